@@ -86,6 +86,8 @@ const char kPrefsUpdateOverCellularTargetSize[] =
 const char kPrefsUpdateServerCertificate[] = "update-server-cert";
 const char kPrefsUpdateStateNextDataLength[] = "update-state-next-data-length";
 const char kPrefsUpdateStateNextDataOffset[] = "update-state-next-data-offset";
+const char kPrefsUpdateStateNextDownloadOffset[] =
+    "update-state-next-download-offset";
 const char kPrefsUpdateStateNextOperation[] = "update-state-next-operation";
 const char kPrefsUpdateStatePayloadIndex[] = "update-state-payload-index";
 const char kPrefsUpdateStateSHA256Context[] = "update-state-sha-256-context";
@@ -123,5 +125,13 @@ const char kPayloadPropertySwitchSlotOnReboot[] = "SWITCH_SLOT_ON_REBOOT";
 // honored if we're resuming an update and post install has already succeeded.
 // The default is 1 (always run post install).
 const char kPayloadPropertyRunPostInstall[] = "RUN_POST_INSTALL";
+// Set "DOWNLOAD_CONNECTIONS=N" to download the payload over up to N HTTP
+// connections at the same time, capped to kDownloadMaxParallelConnections.
+// The default is 1 (a single connection).
+const char kPayloadPropertyDownloadConnections[] = "DOWNLOAD_CONNECTIONS";
+// The maximum number of bytes received ahead of the data being applied when
+// downloading over several connections, capped to
+// kDownloadMaxParallelBufferBytes.
+const char kPayloadPropertyDownloadBufferSize[] = "DOWNLOAD_BUFFER_SIZE";
 
 }  // namespace chromeos_update_engine
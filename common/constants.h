@@ -84,6 +84,7 @@ extern const char kPrefsUpdateOverCellularTargetSize[];
 extern const char kPrefsUpdateServerCertificate[];
 extern const char kPrefsUpdateStateNextDataLength[];
 extern const char kPrefsUpdateStateNextDataOffset[];
+extern const char kPrefsUpdateStateNextDownloadOffset[];
 extern const char kPrefsUpdateStateNextOperation[];
 extern const char kPrefsUpdateStatePayloadIndex[];
 extern const char kPrefsUpdateStateSHA256Context[];
@@ -107,6 +108,8 @@ extern const char kPayloadPropertyPowerwash[];
 extern const char kPayloadPropertyNetworkId[];
 extern const char kPayloadPropertySwitchSlotOnReboot[];
 extern const char kPayloadPropertyRunPostInstall[];
+extern const char kPayloadPropertyDownloadConnections[];
+extern const char kPayloadPropertyDownloadBufferSize[];
 
 // A download source is any combination of protocol and server (that's of
 // interest to us when looking at UMA metrics) using which we may download
@@ -197,6 +200,18 @@ const int kDownloadP2PMaxRetryCount = 5;
 const int kDownloadConnectTimeoutSeconds = 30;
 const int kDownloadP2PConnectTimeoutSeconds = 5;
 
+// The maximum amount of payload data received ahead of the data being applied
+// when downloading over several connections at the same time.
+const int kDownloadParallelBufferBytes = 32 * kNumBytesInOneMiB;
+
+// The maximum amount of payload data received ahead, whatever the amount
+// requested.
+const int kDownloadMaxParallelBufferBytes = 256 * kNumBytesInOneMiB;
+
+// The maximum number of connections used at the same time to download the
+// payload, whatever the number requested.
+const int kDownloadMaxParallelConnections = 8;
+
 // Size in bytes of SHA256 hash.
 const int kSHA256Size = 32;
 
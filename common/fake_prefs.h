@@ -49,6 +49,11 @@ class FakePrefs : public PrefsInterface {
   bool Exists(const std::string& key) const override;
   bool Delete(const std::string& key) override;
 
+  // The fake store doesn't support transactions.
+  bool StartTransaction() override { return false; }
+  bool SubmitTransaction() override { return false; }
+  void CancelTransaction() override {}
+
   void AddObserver(const std::string& key,
                    ObserverInterface* observer) override;
   void RemoveObserver(const std::string& key,
@@ -0,0 +1,128 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/hash_calculator_pool.h"
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Handing a piece over to another thread costs about as much as hashing a few
+// KiB, so smaller updates are hashed right away when possible.
+const size_t kMinQueuedLength = 16 * 1024;
+
+}  // namespace
+
+HashCalculatorPool::HashCalculatorPool(size_t num_threads) {
+  if (num_threads > 0) {
+    thread_pool_.reset(
+        new base::DelegateSimpleThreadPool("hash-pool", num_threads));
+    thread_pool_->Start();
+    // Each worker thread runs updates until |quit_| is set.
+    thread_pool_->AddWork(this, num_threads);
+  }
+}
+
+HashCalculatorPool::~HashCalculatorPool() {
+  Wait();
+  if (thread_pool_) {
+    {
+      base::AutoLock auto_lock(lock_);
+      quit_ = true;
+      changed_.Broadcast();
+    }
+    thread_pool_->JoinAll();
+  }
+}
+
+void HashCalculatorPool::Update(HashCalculator* calculator,
+                                const void* data,
+                                size_t length) {
+  base::AutoLock auto_lock(lock_);
+  Stream* stream = nullptr;
+  for (Stream& existing_stream : streams_) {
+    if (existing_stream.calculator == calculator)
+      stream = &existing_stream;
+  }
+  if (!stream) {
+    streams_.push_back({calculator, {}, false});
+    stream = &streams_.back();
+  }
+  if (length < kMinQueuedLength && !stream->busy && stream->pieces.empty()) {
+    // Nothing else can touch |calculator|, so it's safe to hash without the
+    // lock but the stream must be marked as busy in the meantime.
+    stream->busy = true;
+    bool result;
+    {
+      base::AutoUnlock auto_unlock(lock_);
+      result = calculator->Update(data, length);
+    }
+    // Only this thread adds to |streams_|, so |stream| is still valid.
+    stream->busy = false;
+    failed_ |= !result;
+    return;
+  }
+  stream->pieces.push_back({data, length});
+  pending_pieces_++;
+  changed_.Signal();
+}
+
+bool HashCalculatorPool::Wait() {
+  base::AutoLock auto_lock(lock_);
+  while (pending_pieces_ > 0) {
+    if (!RunNextPieceLocked())
+      changed_.Wait();
+  }
+  streams_.clear();
+  bool result = !failed_;
+  failed_ = false;
+  return result;
+}
+
+void HashCalculatorPool::Run() {
+  base::AutoLock auto_lock(lock_);
+  while (!quit_) {
+    if (!RunNextPieceLocked())
+      changed_.Wait();
+  }
+}
+
+bool HashCalculatorPool::RunNextPieceLocked() {
+  for (size_t i = 0; i < streams_.size(); i++) {
+    if (streams_[i].busy || streams_[i].pieces.empty())
+      continue;
+    HashCalculator* calculator = streams_[i].calculator;
+    Piece piece = streams_[i].pieces.front();
+    streams_[i].pieces.pop_front();
+    streams_[i].busy = true;
+    bool result;
+    {
+      base::AutoUnlock auto_unlock(lock_);
+      result = calculator->Update(piece.data, piece.length);
+    }
+    // Only Wait() removes streams, and not while pieces are pending.
+    streams_[i].busy = false;
+    failed_ |= !result;
+    pending_pieces_--;
+    changed_.Broadcast();
+    return true;
+  }
+  return false;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,105 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_HASH_CALCULATOR_POOL_H_
+#define UPDATE_ENGINE_COMMON_HASH_CALCULATOR_POOL_H_
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/simple_thread.h>
+
+#include "update_engine/common/hash_calculator.h"
+
+namespace chromeos_update_engine {
+
+// A HashCalculatorPool hashes several independent streams of data at the same
+// time. Updates are queued with Update() and run on a pool of worker threads,
+// as well as on the calling thread while it waits for them in Wait(). The
+// updates of a HashCalculator are always applied in the order they were
+// queued, but the updates of different HashCalculators run in parallel.
+//
+// The SHA-256 implementation of OpenSSL already uses the SHA extensions of the
+// CPU when available, so this only spreads the streams across cores.
+//
+// All the methods of this class must be called from the same thread.
+class HashCalculatorPool : public base::DelegateSimpleThread::Delegate {
+ public:
+  // Creates a pool with |num_threads| worker threads besides the calling
+  // thread. If |num_threads| is 0 all the hashing happens in Wait().
+  explicit HashCalculatorPool(size_t num_threads);
+
+  // Waits for all the queued updates to finish.
+  ~HashCalculatorPool() override;
+
+  // Queues the update of |calculator| with |length| bytes of |data|. Both
+  // |calculator| and |data| must remain valid until Wait() returns. Small
+  // updates of a HashCalculator with nothing queued run immediately.
+  void Update(HashCalculator* calculator, const void* data, size_t length);
+
+  // Runs the queued updates, on the calling thread too, until all of them are
+  // done. Returns whether all the updates since the last Wait() succeeded.
+  bool Wait();
+
+  // DelegateSimpleThread::Delegate overrides. Runs updates on a worker thread
+  // until the pool is destroyed.
+  void Run() override;
+
+ private:
+  struct Piece {
+    const void* data;
+    size_t length;
+  };
+
+  // The queued updates of a HashCalculator.
+  struct Stream {
+    HashCalculator* calculator;
+    std::deque<Piece> pieces;
+    // Whether one of the pieces is being hashed, in which case no other piece
+    // of this stream can start.
+    bool busy;
+  };
+
+  // Runs the oldest queued piece of a stream not busy, if any. Returns false
+  // if there was nothing to run. Must be called with |lock_| held, but the
+  // lock is released while hashing.
+  bool RunNextPieceLocked();
+
+  // Protects all the members below.
+  base::Lock lock_;
+  // Signaled when a piece is queued, a piece is done or the pool is being
+  // destroyed.
+  base::ConditionVariable changed_{&lock_};
+
+  std::vector<Stream> streams_;
+  // The number of pieces queued or being hashed.
+  size_t pending_pieces_{0};
+  bool failed_{false};
+  bool quit_{false};
+
+  // The worker threads, or nullptr if there are none.
+  std::unique_ptr<base::DelegateSimpleThreadPool> thread_pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(HashCalculatorPool);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_HASH_CALCULATOR_POOL_H_
@@ -0,0 +1,91 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Benchmark of hashing two independent streams with a HashCalculatorPool,
+// compared with calling HashCalculator::Update() on each of them in turn.
+
+#include <stdlib.h>
+
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/hash_calculator_pool.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const size_t kNumStreams = 2;
+
+// Returns the random data hashed by the benchmarks.
+const brillo::Blob& BenchmarkData() {
+  static const brillo::Blob* data = [] {
+    brillo::Blob* blob = new brillo::Blob(4 * 1024 * 1024);
+    unsigned int seed = 42;
+    for (uint8_t& byte : *blob)
+      byte = rand_r(&seed) & 0xff;
+    return blob;
+  }();
+  return *data;
+}
+
+// Hashes each buffer of the streams one after the other.
+void BM_HashSerial(benchmark::State& state) {
+  const brillo::Blob& data = BenchmarkData();
+  const size_t buffer_size = state.range(0);
+  HashCalculator calculators[kNumStreams];
+  size_t offset = 0;
+  for (auto _ : state) {
+    for (HashCalculator& calculator : calculators) {
+      if (!calculator.Update(data.data() + offset, buffer_size)) {
+        state.SkipWithError("Hashing failed.");
+        return;
+      }
+    }
+    offset = (offset + buffer_size) % data.size();
+  }
+  state.SetBytesProcessed(state.iterations() * kNumStreams * buffer_size);
+}
+
+// Hashes the buffers of the streams in parallel on a pool of one worker
+// thread and the calling thread.
+void BM_HashPool(benchmark::State& state) {
+  const brillo::Blob& data = BenchmarkData();
+  const size_t buffer_size = state.range(0);
+  HashCalculatorPool pool(kNumStreams - 1);
+  HashCalculator calculators[kNumStreams];
+  size_t offset = 0;
+  for (auto _ : state) {
+    for (HashCalculator& calculator : calculators)
+      pool.Update(&calculator, data.data() + offset, buffer_size);
+    if (!pool.Wait()) {
+      state.SkipWithError("Hashing failed.");
+      return;
+    }
+    offset = (offset + buffer_size) % data.size();
+  }
+  state.SetBytesProcessed(state.iterations() * kNumStreams * buffer_size);
+}
+
+BENCHMARK(BM_HashSerial)->Arg(4 * 1024)->Arg(1024 * 1024)->UseRealTime();
+BENCHMARK(BM_HashPool)->Arg(4 * 1024)->Arg(1024 * 1024)->UseRealTime();
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+BENCHMARK_MAIN();
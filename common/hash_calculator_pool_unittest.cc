@@ -0,0 +1,97 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/hash_calculator_pool.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+
+namespace chromeos_update_engine {
+
+class HashCalculatorPoolTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    unsigned int seed = 42;
+    data_.resize(4 * 1024 * 1024);
+    for (uint8_t& byte : data_)
+      byte = rand_r(&seed) & 0xff;
+  }
+
+  // Hashes |data_| in |kNumStreams| streams with |pool|, each stream split in
+  // pieces of a different size, some of which are hashed right away. Checks
+  // the hashes match the ones of the whole data.
+  void HashStreams(HashCalculatorPool* pool) {
+    const size_t kNumStreams = 3;
+    const size_t kPieceSizes[kNumStreams] = {1000, 100 * 1024, 1024 * 1024};
+    HashCalculator calculators[kNumStreams];
+    size_t offsets[kNumStreams] = {0, 0, 0};
+    bool pending = true;
+    while (pending) {
+      pending = false;
+      // Queue up to 16 pieces of each stream, interleaved, before waiting.
+      for (size_t n = 0; n < 16; n++) {
+        for (size_t i = 0; i < kNumStreams; i++) {
+          size_t length = std::min(kPieceSizes[i], data_.size() - offsets[i]);
+          if (length == 0)
+            continue;
+          pool->Update(&calculators[i], data_.data() + offsets[i], length);
+          offsets[i] += length;
+          pending = true;
+        }
+      }
+      EXPECT_TRUE(pool->Wait());
+    }
+
+    brillo::Blob expected_hash;
+    ASSERT_TRUE(HashCalculator::RawHashOfData(data_, &expected_hash));
+    for (HashCalculator& calculator : calculators) {
+      ASSERT_TRUE(calculator.Finalize());
+      EXPECT_EQ(expected_hash, calculator.raw_hash());
+    }
+  }
+
+  brillo::Blob data_;
+};
+
+TEST_F(HashCalculatorPoolTest, NoThreadsTest) {
+  HashCalculatorPool pool(0);
+  HashStreams(&pool);
+}
+
+TEST_F(HashCalculatorPoolTest, ThreadsTest) {
+  HashCalculatorPool pool(2);
+  HashStreams(&pool);
+}
+
+TEST_F(HashCalculatorPoolTest, FailedUpdateTest) {
+  HashCalculatorPool pool(1);
+  HashCalculator calculator;
+  ASSERT_TRUE(calculator.Finalize());
+  // Updates after Finalize() fail.
+  pool.Update(&calculator, data_.data(), data_.size());
+  EXPECT_FALSE(pool.Wait());
+  // The failure is only reported once.
+  EXPECT_TRUE(pool.Wait());
+}
+
+}  // namespace chromeos_update_engine
@@ -109,9 +109,7 @@ class HttpFetcher {
   // Unpause() returns
   virtual void Unpause() = 0;
 
-  // These two function are overloaded in LibcurlHttp fetcher to speed
-  // testing.
-  virtual void set_idle_seconds(int seconds) {}
+  // This function is overloaded in LibcurlHttp fetcher to speed testing.
   virtual void set_retry_seconds(int seconds) {}
 
   // Sets the values used to time out the connection if the transfer
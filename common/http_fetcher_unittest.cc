@@ -253,7 +253,6 @@ class LibcurlHttpFetcherTest : public AnyHttpFetcherTest {
     LibcurlHttpFetcher* ret =
         new LibcurlHttpFetcher(proxy_resolver, &fake_hardware_);
     // Speed up test execution.
-    ret->set_idle_seconds(1);
     ret->set_retry_seconds(1);
     fake_hardware_.SetIsOfficialBuild(false);
     return ret;
@@ -298,7 +297,6 @@ class MultiRangeHttpFetcherTest : public LibcurlHttpFetcherTest {
     ret->ClearRanges();
     ret->AddRange(0);
     // Speed up test execution.
-    ret->set_idle_seconds(1);
     ret->set_retry_seconds(1);
     fake_hardware_.SetIsOfficialBuild(false);
     return ret;
@@ -313,6 +311,29 @@ class MultiRangeHttpFetcherTest : public LibcurlHttpFetcherTest {
   bool IsMulti() const override { return true; }
 };
 
+class ParallelMultiRangeHttpFetcherTest : public MultiRangeHttpFetcherTest {
+ public:
+  // Necessary to unhide the definition in the base class.
+  using AnyHttpFetcherTest::NewLargeFetcher;
+  HttpFetcher* NewLargeFetcher(ProxyResolver* proxy_resolver) override {
+    MultiRangeHttpFetcher* ret = static_cast<MultiRangeHttpFetcher*>(
+        MultiRangeHttpFetcherTest::NewLargeFetcher(proxy_resolver));
+    // Small enough to split the big file in several segments.
+    ret->SetParallelTransfers(
+        base::Bind(&ParallelMultiRangeHttpFetcherTest::NewWorkerFetcher,
+                   base::Unretained(this),
+                   proxy_resolver),
+        3,
+        128 * 1024);
+    return ret;
+  }
+
+ private:
+  HttpFetcher* NewWorkerFetcher(ProxyResolver* proxy_resolver) {
+    return new LibcurlHttpFetcher(proxy_resolver, &fake_hardware_);
+  }
+};
+
 class FileFetcherTest : public AnyHttpFetcherTest {
  public:
   // Necessary to unhide the definition in the base class.
@@ -372,7 +393,6 @@ class MultiRangeHttpFetcherOverFileFetcherTest : public FileFetcherTest {
     // FileFetcher doesn't support range with unspecified length.
     ret->AddRange(0, 1);
     // Speed up test execution.
-    ret->set_idle_seconds(1);
     ret->set_retry_seconds(1);
     fake_hardware_.SetIsOfficialBuild(false);
     return ret;
@@ -422,6 +442,7 @@ class HttpFetcherTest : public ::testing::Test {
 typedef ::testing::Types<LibcurlHttpFetcherTest,
                          MockHttpFetcherTest,
                          MultiRangeHttpFetcherTest,
+                         ParallelMultiRangeHttpFetcherTest,
                          FileFetcherTest,
                          MultiRangeHttpFetcherOverFileFetcherTest>
     HttpFetcherTestTypes;
@@ -506,6 +527,45 @@ TYPED_TEST(HttpFetcherTest, SimpleBigTest) {
   EXPECT_EQ(0, delegate.times_transfer_terminated_called_);
 }
 
+TYPED_TEST(HttpFetcherTest, ConnectionPoolTest) {
+  if (this->test_.IsMock() || this->test_.IsMulti() ||
+      this->test_.IsFileFetcher())
+    return;
+  unique_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  LibcurlConnectionPool pool;
+  pool.Init();
+
+  // The server keeps the connection open after each transfer, so the second
+  // transfer reuses the connection of the first one from the pool.
+  for (int i = 0; i < 2; i++) {
+    HttpFetcherTestDelegate delegate;
+    unique_ptr<HttpFetcher> fetcher(this->test_.NewSmallFetcher());
+    fetcher->set_delegate(&delegate);
+    this->loop_.PostTask(FROM_HERE,
+                         base::Bind(StartTransfer,
+                                    fetcher.get(),
+                                    LocalServerUrlForPath(server->GetPort(),
+                                                          "/keep-alive/100")));
+    this->loop_.Run();
+    EXPECT_EQ(1, delegate.times_transfer_complete_called_);
+  }
+  LibcurlConnectionPool::Stats stats = pool.TakeStats();
+#if LIBCURL_VERSION_NUM >= 0x073900
+  EXPECT_EQ(1, stats.new_connections);
+  EXPECT_EQ(1, stats.reused_connections);
+#else
+  // The connections themselves are only shared since libcurl 7.57.0.
+  EXPECT_EQ(2, stats.new_connections);
+  EXPECT_EQ(0, stats.reused_connections);
+#endif  // LIBCURL_VERSION_NUM >= 0x073900
+
+  // The stats are reset once taken.
+  stats = pool.TakeStats();
+  EXPECT_EQ(0, stats.new_connections + stats.reused_connections);
+}
+
 // Issue #9648: when server returns an error HTTP response, the fetcher needs to
 // terminate transfer prematurely, rather than try to process the error payload.
 TYPED_TEST(HttpFetcherTest, ErrorTest) {
@@ -1237,6 +1297,28 @@ TYPED_TEST(HttpFetcherTest, MultiHttpFetcherMultiEndTest) {
             kHttpResponsePartialContent);
 }
 
+TYPED_TEST(HttpFetcherTest, MultiHttpFetcherWholeFileTest) {
+  if (!this->test_.IsMulti() || this->test_.IsFileFetcher())
+    return;
+
+  unique_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  // Check all the data, which is received out of order by parallel transfers.
+  string expected_data;
+  for (int i = 0; i < kBigLength; i++)
+    expected_data += 'a' + i % 10;
+  vector<pair<off_t, off_t>> ranges;
+  ranges.push_back(make_pair(0, kBigLength));
+  MultiTest(this->test_.NewLargeFetcher(),
+            this->test_.fake_hardware(),
+            this->test_.BigUrl(server->GetPort()),
+            ranges,
+            expected_data,
+            kBigLength,
+            kHttpResponsePartialContent);
+}
+
 TYPED_TEST(HttpFetcherTest, MultiHttpFetcherInsufficientTest) {
   if (!this->test_.IsMulti())
     return;
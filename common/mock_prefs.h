@@ -41,6 +41,10 @@ class MockPrefs : public PrefsInterface {
   MOCK_CONST_METHOD1(Exists, bool(const std::string& key));
   MOCK_METHOD1(Delete, bool(const std::string& key));
 
+  MOCK_METHOD0(StartTransaction, bool());
+  MOCK_METHOD0(SubmitTransaction, bool());
+  MOCK_METHOD0(CancelTransaction, void());
+
   MOCK_METHOD2(AddObserver, void(const std::string& key, ObserverInterface*));
   MOCK_METHOD2(RemoveObserver,
                void(const std::string& key, ObserverInterface*));
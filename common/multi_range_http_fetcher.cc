@@ -16,6 +16,7 @@
 
 #include "update_engine/common/multi_range_http_fetcher.h"
 
+#include <base/bind.h>
 #include <base/strings/stringprintf.h>
 
 #include <algorithm>
@@ -23,8 +24,59 @@
 
 #include "update_engine/common/utils.h"
 
+using brillo::MessageLoop;
+
 namespace chromeos_update_engine {
 
+namespace {
+
+// The size of the segments fetched by the parallel transfers, unless less can
+// be buffered for each connection.
+const size_t kSegmentSize = 4 * 1024 * 1024;
+const size_t kMinSegmentSize = 64 * 1024;
+
+// The number of times the transfer of a segment is started again after it
+// ended early.
+const int kMaxSegmentRetries = 3;
+
+}  // namespace
+
+MultiRangeHttpFetcher::Worker::Worker(MultiRangeHttpFetcher* owner,
+                                      HttpFetcher* fetcher)
+    : owner(owner), fetcher(fetcher) {
+  fetcher->set_delegate(this);
+}
+
+bool MultiRangeHttpFetcher::Worker::ReceivedBytes(HttpFetcher* fetcher,
+                                                  const void* bytes,
+                                                  size_t length) {
+  return owner->WorkerReceivedBytes(this, bytes, length);
+}
+
+void MultiRangeHttpFetcher::Worker::TransferComplete(HttpFetcher* fetcher,
+                                                     bool successful) {
+  owner->WorkerTransferEnded(this);
+}
+
+void MultiRangeHttpFetcher::Worker::TransferTerminated(HttpFetcher* fetcher) {
+  owner->WorkerTransferEnded(this);
+}
+
+MultiRangeHttpFetcher::~MultiRangeHttpFetcher() {
+  if (schedule_task_id_ != MessageLoop::kTaskIdNull)
+    MessageLoop::current()->CancelTask(schedule_task_id_);
+  if (finish_task_id_ != MessageLoop::kTaskIdNull)
+    MessageLoop::current()->CancelTask(finish_task_id_);
+}
+
+void MultiRangeHttpFetcher::SetParallelTransfers(const FetcherFactory& factory,
+                                                 size_t connections,
+                                                 size_t max_buffered_bytes) {
+  fetcher_factory_ = factory;
+  max_connections_ = std::max(connections, static_cast<size_t>(1));
+  max_buffered_bytes_ = max_buffered_bytes;
+}
+
 // Begins the transfer to the specified URL.
 // State change: Stopped -> Downloading
 // (corner case: Stopped -> Stopped for an empty request)
@@ -42,6 +94,16 @@ void MultiRangeHttpFetcher::BeginTransfer(const std::string& url) {
   url_ = url;
   current_index_ = 0;
   bytes_received_this_range_ = 0;
+  if (SplitRangesInSegments()) {
+    LOG(INFO) << "starting parallel transfers of " << segments_.size()
+              << " segments over up to " << max_connections_
+              << " connections";
+    parallel_active_ = true;
+    if (delegate_)
+      delegate_->SeekToOffset(segments_[0].offset);
+    ScheduleWorkers();
+    return;
+  }
   LOG(INFO) << "starting first transfer";
   base_fetcher_->set_delegate(this);
   StartTransfer();
@@ -49,6 +111,11 @@ void MultiRangeHttpFetcher::BeginTransfer(const std::string& url) {
 
 // State change: Downloading -> Pending transfer ended
 void MultiRangeHttpFetcher::TerminateTransfer() {
+  if (parallel_active_) {
+    terminating_ = true;
+    EndParallelTransfers();
+    return;
+  }
   if (!base_fetcher_active_) {
     LOG(INFO) << "Called TerminateTransfer but not active.";
     // Note that after the callback returns this object may be destroyed.
@@ -182,6 +249,293 @@ void MultiRangeHttpFetcher::Reset() {
   base_fetcher_active_ = pending_transfer_ended_ = terminating_ = false;
   current_index_ = 0;
   bytes_received_this_range_ = 0;
+
+  parallel_active_ = parallel_failed_ = delivery_stopped_ = false;
+  segments_.clear();
+  segment_data_.clear();
+  buffered_bytes_ = 0;
+  head_segment_ = next_segment_ = 0;
+  if (schedule_task_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(schedule_task_id_);
+    schedule_task_id_ = MessageLoop::kTaskIdNull;
+  }
+  // The workers terminated while paused can't be reused.
+  workers_.erase(std::remove_if(workers_.begin(),
+                                workers_.end(),
+                                [](const std::unique_ptr<Worker>& worker) {
+                                  return worker->paused;
+                                }),
+                 workers_.end());
+}
+
+void MultiRangeHttpFetcher::Pause() {
+  paused_ = true;
+  if (parallel_active_)
+    ScheduleWorkers();
+  else
+    base_fetcher_->Pause();
+}
+
+void MultiRangeHttpFetcher::Unpause() {
+  paused_ = false;
+  if (parallel_active_)
+    PostScheduleWorkers();
+  else
+    base_fetcher_->Unpause();
+}
+
+bool MultiRangeHttpFetcher::SplitRangesInSegments() {
+  segments_.clear();
+  if (fetcher_factory_.is_null() || max_connections_ < 2)
+    return false;
+  for (const Range& range : ranges_) {
+    if (!range.HasLength())
+      return false;
+  }
+
+  size_t segment_size =
+      std::max(kMinSegmentSize,
+               std::min(kSegmentSize, max_buffered_bytes_ / max_connections_));
+  for (const Range& range : ranges_) {
+    for (size_t offset = 0; offset < range.length(); offset += segment_size) {
+      segments_.push_back({range.offset() + static_cast<off_t>(offset),
+                           std::min(segment_size, range.length() - offset),
+                           offset == 0,
+                           false});
+    }
+  }
+  return segments_.size() > 1;
+}
+
+void MultiRangeHttpFetcher::ScheduleWorkers() {
+  if (!parallel_active_ || terminating_ || parallel_failed_ ||
+      delivery_stopped_) {
+    return;
+  }
+
+  // Start the next segments while there is room to buffer them. The segment
+  // passed to the delegate is always started.
+  while (!paused_ && next_segment_ < segments_.size() &&
+         (next_segment_ == head_segment_ ||
+          buffered_bytes_ < max_buffered_bytes_)) {
+    Worker* idle_worker = nullptr;
+    for (const auto& worker : workers_) {
+      if (!worker->active) {
+        idle_worker = worker.get();
+        break;
+      }
+    }
+    if (!idle_worker) {
+      if (workers_.size() >= max_connections_)
+        break;
+      workers_.emplace_back(new Worker(this, fetcher_factory_.Run()));
+      idle_worker = workers_.back().get();
+      ApplySettings(idle_worker->fetcher.get());
+    }
+    idle_worker->segment = next_segment_++;
+    idle_worker->received = 0;
+    idle_worker->retries = 0;
+    StartWorker(idle_worker);
+  }
+
+  // Pause the transfers ahead of the delegate while the buffer is full. Only
+  // one transfer is unpaused per call since its fetcher may call back before
+  // Unpause() returns.
+  Worker* unpause_worker = nullptr;
+  bool more_to_unpause = false;
+  for (const auto& worker : workers_) {
+    if (!worker->active || worker->ending)
+      continue;
+    bool pause = paused_ || (worker->segment != head_segment_ &&
+                             buffered_bytes_ >= max_buffered_bytes_);
+    if (pause && !worker->paused) {
+      worker->paused = true;
+      worker->fetcher->Pause();
+    } else if (!pause && worker->paused) {
+      if (unpause_worker)
+        more_to_unpause = true;
+      else
+        unpause_worker = worker.get();
+    }
+  }
+  if (unpause_worker) {
+    if (more_to_unpause)
+      PostScheduleWorkers();
+    unpause_worker->paused = false;
+    unpause_worker->fetcher->Unpause();
+  }
+}
+
+void MultiRangeHttpFetcher::PostScheduleWorkers() {
+  if (schedule_task_id_ != MessageLoop::kTaskIdNull)
+    return;
+  schedule_task_id_ = MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(&MultiRangeHttpFetcher::OnScheduleWorkersTask,
+                 base::Unretained(this)));
+}
+
+void MultiRangeHttpFetcher::OnScheduleWorkersTask() {
+  schedule_task_id_ = MessageLoop::kTaskIdNull;
+  ScheduleWorkers();
+}
+
+void MultiRangeHttpFetcher::StartWorker(Worker* worker) {
+  const Segment& segment = segments_[worker->segment];
+  worker->active = true;
+  worker->ending = false;
+  worker->fetcher->SetOffset(segment.offset + worker->received);
+  worker->fetcher->SetLength(segment.length - worker->received);
+  worker->fetcher->BeginTransfer(url_);
+}
+
+bool MultiRangeHttpFetcher::WorkerReceivedBytes(Worker* worker,
+                                                const void* bytes,
+                                                size_t length) {
+  if (terminating_ || parallel_failed_ || delivery_stopped_ || worker->ending)
+    return false;
+  const Segment& segment = segments_[worker->segment];
+  length = std::min(length, segment.length - worker->received);
+  worker->received += length;
+  parallel_bytes_downloaded_ += length;
+
+  if (worker->segment == head_segment_) {
+    if (!DeliverBytes(bytes, length)) {
+      EndParallelTransfers();
+      return false;
+    }
+  } else {
+    brillo::Blob& data = segment_data_[worker->segment];
+    const uint8_t* begin = static_cast<const uint8_t*>(bytes);
+    data.insert(data.end(), begin, begin + length);
+    buffered_bytes_ += length;
+  }
+
+  if (worker->received >= segment.length) {
+    // Like in ReceivedBytes(), wait for the transfer to end before moving on.
+    worker->ending = true;
+    worker->fetcher->TerminateTransfer();
+    return false;
+  }
+  if (worker->segment != head_segment_ &&
+      buffered_bytes_ >= max_buffered_bytes_ && !worker->paused) {
+    worker->paused = true;
+    worker->fetcher->Pause();
+  }
+  return true;
+}
+
+void MultiRangeHttpFetcher::WorkerTransferEnded(Worker* worker) {
+  worker->active = false;
+  http_response_code_ = worker->fetcher->http_response_code();
+  if (terminating_ || parallel_failed_ || delivery_stopped_) {
+    EndParallelTransfers();
+    return;
+  }
+
+  Segment& segment = segments_[worker->segment];
+  if (worker->received < segment.length) {
+    if (worker->retries < kMaxSegmentRetries) {
+      worker->retries++;
+      LOG(WARNING) << "Transfer of segment " << worker->segment
+                   << " ended after " << worker->received << " of "
+                   << segment.length << " bytes, fetching the rest again.";
+      StartWorker(worker);
+      return;
+    }
+    LOG(INFO) << "Didn't get enough bytes. Ending w/ failure.";
+    parallel_failed_ = true;
+    EndParallelTransfers();
+    return;
+  }
+
+  segment.done = true;
+  if (!AdvanceHeadSegment()) {
+    EndParallelTransfers();
+    return;
+  }
+  PostScheduleWorkers();
+}
+
+bool MultiRangeHttpFetcher::AdvanceHeadSegment() {
+  while (segments_[head_segment_].done) {
+    head_segment_++;
+    if (head_segment_ == segments_.size())
+      return false;
+
+    const Segment& segment = segments_[head_segment_];
+    if (segment.range_start && delegate_)
+      delegate_->SeekToOffset(segment.offset);
+    auto data = segment_data_.find(head_segment_);
+    if (data != segment_data_.end()) {
+      brillo::Blob bytes = std::move(data->second);
+      segment_data_.erase(data);
+      buffered_bytes_ -= bytes.size();
+      if (!DeliverBytes(bytes.data(), bytes.size()))
+        return false;
+    }
+  }
+  return true;
+}
+
+bool MultiRangeHttpFetcher::DeliverBytes(const void* bytes, size_t length) {
+  if (delegate_ && !delegate_->ReceivedBytes(this, bytes, length)) {
+    delivery_stopped_ = true;
+    return false;
+  }
+  return true;
+}
+
+void MultiRangeHttpFetcher::EndParallelTransfers() {
+  bool active = false;
+  for (const auto& worker : workers_) {
+    if (!worker->active)
+      continue;
+    active = true;
+    if (!worker->ending) {
+      worker->ending = true;
+      worker->fetcher->TerminateTransfer();
+    }
+  }
+  // The delegate is notified from the message loop, since it may destroy this
+  // object and the workers are still in their callbacks.
+  if (!active && finish_task_id_ == MessageLoop::kTaskIdNull) {
+    finish_task_id_ = MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&MultiRangeHttpFetcher::FinishParallelTransfers,
+                   base::Unretained(this)));
+  }
+}
+
+void MultiRangeHttpFetcher::FinishParallelTransfers() {
+  finish_task_id_ = MessageLoop::kTaskIdNull;
+  bool terminated = terminating_;
+  bool successful = !parallel_failed_ && !delivery_stopped_ &&
+                    head_segment_ == segments_.size();
+  LOG(INFO) << "Done w/ all parallel transfers"
+            << (terminated ? ", terminated" : "")
+            << (successful ? "" : ", failed");
+  Reset();
+  // Note that after the callback returns this object may be destroyed.
+  if (!delegate_)
+    return;
+  if (terminated)
+    delegate_->TransferTerminated(this);
+  else
+    delegate_->TransferComplete(this, successful);
+}
+
+void MultiRangeHttpFetcher::ApplySettings(HttpFetcher* fetcher) {
+  for (const auto& header : headers_)
+    fetcher->SetHeader(header.first, header.second);
+  if (retry_seconds_ >= 0)
+    fetcher->set_retry_seconds(retry_seconds_);
+  if (low_speed_bps_ >= 0)
+    fetcher->set_low_speed_limit(low_speed_bps_, low_speed_sec_);
+  if (connect_timeout_seconds_ >= 0)
+    fetcher->set_connect_timeout(connect_timeout_seconds_);
+  if (max_retry_count_ >= 0)
+    fetcher->set_max_retry_count(max_retry_count_);
 }
 
 std::string MultiRangeHttpFetcher::Range::ToString() const {
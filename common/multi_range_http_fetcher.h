@@ -18,11 +18,16 @@
 #define UPDATE_ENGINE_COMMON_MULTI_RANGE_HTTP_FETCHER_H_
 
 #include <deque>
+#include <map>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <base/callback.h>
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/secure_blob.h>
+
 #include "update_engine/common/http_fetcher.h"
 
 // This class is a simple wrapper around an HttpFetcher. The client
@@ -32,6 +37,9 @@
 // as a length to specify unlimited length. It really only would make sense
 // for the last range specified to have unlimited length, tho it is legal for
 // other entries to have unlimited length.
+//
+// Optionally, the ranges can be fetched in parallel over several fetchers, see
+// SetParallelTransfers().
 
 // There are three states a MultiRangeHttpFetcher object will be in:
 // - Stopped (start state)
@@ -53,7 +61,21 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
         terminating_(false),
         current_index_(0),
         bytes_received_this_range_(0) {}
-  ~MultiRangeHttpFetcher() override {}
+  ~MultiRangeHttpFetcher() override;
+
+  // Creates a fetcher for the parallel transfers.
+  using FetcherFactory = base::Callback<HttpFetcher*()>;
+
+  // Splits the ranges in segments fetched over up to |connections| fetchers
+  // created by |factory| at the same time. The bytes are still passed to the
+  // delegate in order: the segments received ahead are buffered, and their
+  // transfers paused while |max_buffered_bytes| are buffered. A segment whose
+  // transfer fails is fetched again from where it stopped a few times before
+  // failing the whole transfer. The base fetcher is used as before when there
+  // is a single connection or a range without length.
+  void SetParallelTransfers(const FetcherFactory& factory,
+                            size_t connections,
+                            size_t max_buffered_bytes);
 
   void ClearRanges() { ranges_.clear(); }
 
@@ -81,18 +103,17 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
   void SetHeader(const std::string& header_name,
                  const std::string& header_value) override {
     base_fetcher_->SetHeader(header_name, header_value);
+    headers_[header_name] = header_value;
   }
 
-  void Pause() override { base_fetcher_->Pause(); }
+  void Pause() override;
 
-  void Unpause() override { base_fetcher_->Unpause(); }
+  void Unpause() override;
 
-  // These functions are overloaded in LibcurlHttp fetcher for testing purposes.
-  void set_idle_seconds(int seconds) override {
-    base_fetcher_->set_idle_seconds(seconds);
-  }
+  // This function is overloaded in LibcurlHttp fetcher for testing purposes.
   void set_retry_seconds(int seconds) override {
     base_fetcher_->set_retry_seconds(seconds);
+    retry_seconds_ = seconds;
   }
   // TODO(deymo): Determine if this method should be virtual in HttpFetcher so
   // this call is sent to the base_fetcher_.
@@ -101,19 +122,23 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
   }
 
   inline size_t GetBytesDownloaded() override {
-    return base_fetcher_->GetBytesDownloaded();
+    return base_fetcher_->GetBytesDownloaded() + parallel_bytes_downloaded_;
   }
 
   void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override {
     base_fetcher_->set_low_speed_limit(low_speed_bps, low_speed_sec);
+    low_speed_bps_ = low_speed_bps;
+    low_speed_sec_ = low_speed_sec;
   }
 
   void set_connect_timeout(int connect_timeout_seconds) override {
     base_fetcher_->set_connect_timeout(connect_timeout_seconds);
+    connect_timeout_seconds_ = connect_timeout_seconds;
   }
 
   void set_max_retry_count(int max_retry_count) override {
     base_fetcher_->set_max_retry_count(max_retry_count);
+    max_retry_count_ = max_retry_count;
   }
 
  private:
@@ -139,6 +164,44 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
 
   typedef std::vector<Range> RangesVect;
 
+  // A part of a range fetched by one of the parallel transfers.
+  struct Segment {
+    off_t offset;
+    size_t length;
+    // Whether the segment starts its range.
+    bool range_start;
+    // Whether all the bytes of the segment were received.
+    bool done;
+  };
+
+  // A fetcher of the parallel transfers, fetching one segment at a time.
+  struct Worker : public HttpFetcherDelegate {
+    Worker(MultiRangeHttpFetcher* owner, HttpFetcher* fetcher);
+
+    // HttpFetcherDelegate overrides.
+    bool ReceivedBytes(HttpFetcher* fetcher,
+                       const void* bytes,
+                       size_t length) override;
+    void TransferComplete(HttpFetcher* fetcher, bool successful) override;
+    void TransferTerminated(HttpFetcher* fetcher) override;
+
+    MultiRangeHttpFetcher* owner;
+    std::unique_ptr<HttpFetcher> fetcher;
+
+    // Whether a transfer is in progress, and if it was asked to end.
+    bool active{false};
+    bool ending{false};
+    bool paused{false};
+
+    // The index of the segment in |segments_|, the number of its bytes
+    // received and the number of times its transfer was started again.
+    size_t segment{0};
+    size_t received{0};
+    int retries{0};
+
+    DISALLOW_COPY_AND_ASSIGN(Worker);
+  };
+
   // State change: Stopped or Downloading -> Downloading
   void StartTransfer();
 
@@ -156,6 +219,38 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
 
   void Reset();
 
+  // Returns whether the ranges are fetched by parallel transfers, splitting
+  // them in |segments_| if so.
+  bool SplitRangesInSegments();
+
+  // Starts the transfers of the segments on idle workers, and pauses or
+  // unpauses them according to the buffered bytes.
+  void ScheduleWorkers();
+  // Posts a task calling ScheduleWorkers(), unless one is already pending.
+  void PostScheduleWorkers();
+  void OnScheduleWorkersTask();
+
+  // Starts the transfer of the rest of the worker's segment.
+  void StartWorker(Worker* worker);
+
+  bool WorkerReceivedBytes(Worker* worker, const void* bytes, size_t length);
+  void WorkerTransferEnded(Worker* worker);
+
+  // Passes the bytes of the segments completed in order after the current one
+  // to the delegate. Returns false if the delegate stopped the transfer.
+  bool AdvanceHeadSegment();
+
+  // Passes |length| bytes of the current segment to the delegate.
+  bool DeliverBytes(const void* bytes, size_t length);
+
+  // Ends the transfers of all the workers, and notifies the delegate once they
+  // all ended.
+  void EndParallelTransfers();
+  void FinishParallelTransfers();
+
+  // Applies the settings of this fetcher to a worker's |fetcher|.
+  void ApplySettings(HttpFetcher* fetcher);
+
   std::unique_ptr<HttpFetcher> base_fetcher_;
 
   // If true, do not send any more data or TransferComplete to the delegate.
@@ -174,6 +269,46 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
   RangesVect::size_type current_index_;  // index into ranges_
   size_t bytes_received_this_range_;
 
+  // The settings of the parallel transfers, see SetParallelTransfers().
+  FetcherFactory fetcher_factory_;
+  size_t max_connections_{1};
+  size_t max_buffered_bytes_{0};
+
+  // The settings applied to the workers' fetchers.
+  std::map<std::string, std::string> headers_;
+  int retry_seconds_{-1};
+  int low_speed_bps_{-1};
+  int low_speed_sec_{-1};
+  int connect_timeout_seconds_{-1};
+  int max_retry_count_{-1};
+
+  // Whether the current transfer is made of parallel transfers.
+  bool parallel_active_{false};
+  std::vector<Segment> segments_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+
+  // The segment whose bytes are passed to the delegate, and the next one to
+  // start fetching.
+  size_t head_segment_{0};
+  size_t next_segment_{0};
+
+  // The bytes received for the segments after |head_segment_|.
+  std::map<size_t, brillo::Blob> segment_data_;
+  size_t buffered_bytes_{0};
+
+  // Whether Pause() was called.
+  bool paused_{false};
+
+  // Whether a transfer failed for good or the delegate stopped the transfer.
+  bool parallel_failed_{false};
+  bool delivery_stopped_{false};
+
+  size_t parallel_bytes_downloaded_{0};
+
+  brillo::MessageLoop::TaskId schedule_task_id_{
+      brillo::MessageLoop::kTaskIdNull};
+  brillo::MessageLoop::TaskId finish_task_id_{brillo::MessageLoop::kTaskIdNull};
+
   DISALLOW_COPY_AND_ASSIGN(MultiRangeHttpFetcher);
 };
 
@@ -16,31 +16,178 @@
 
 #include "update_engine/common/prefs.h"
 
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <algorithm>
 
+#include <base/files/file_enumerator.h>
 #include <base/files/file_util.h>
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_util.h>
 
+#include "update_engine/common/constants.h"
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 
+using std::map;
+using std::set;
 using std::string;
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// The name of the journal file of JournaledPrefs, which can't be a key name.
+const char kJournalFileName[] = "prefs.journal";
+
+// The name of the file a version using Prefs creates once it changed the key
+// files, so they replace the journal instead of being rewritten from it.
+const char kKeyFilesNewerFileName[] = "prefs.journal.stale";
+
+// The journal file starts with this magic and version, followed by the
+// records. Each record is the size of its entries, the entries and their
+// SHA-256 hash. Each entry is its type, the key and, for kEntrySet, the value,
+// the key and the value being prefixed with their size.
+const char kJournalMagic[] = "UEPJ";
+const uint32_t kJournalVersion = 1;
+const uint8_t kEntrySet = 1;
+const uint8_t kEntryDelete = 2;
+
+// The journal is compacted once this many bytes were appended to it.
+const off_t kJournalMaxAppendedBytes = 64 * 1024;
+
+// Allows only non-empty keys containing [A-Za-z0-9_-].
+bool IsValidKey(const string& key) {
+  if (key.empty())
+    return false;
+  for (size_t i = 0; i < key.size(); ++i) {
+    char c = key.at(i);
+    if (!base::IsAsciiAlpha(c) && !base::IsAsciiDigit(c) && c != '_' &&
+        c != '-')
+      return false;
+  }
+  return true;
+}
+
+void AppendUint32(uint32_t value, string* data) {
+  data->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void AppendString(const string& str, string* data) {
+  AppendUint32(str.size(), data);
+  data->append(str);
+}
+
+bool ReadUint32(const string& data, size_t* offset, uint32_t* value) {
+  if (data.size() - *offset < sizeof(*value))
+    return false;
+  memcpy(value, data.data() + *offset, sizeof(*value));
+  *offset += sizeof(*value);
+  return true;
+}
+
+bool ReadString(const string& data, size_t* offset, string* str) {
+  uint32_t size;
+  if (!ReadUint32(data, offset, &size) || data.size() - *offset < size)
+    return false;
+  str->assign(data, *offset, size);
+  *offset += size;
+  return true;
+}
+
+// Returns the journal record setting the keys in |values| and deleting the
+// keys in |deleted_keys|.
+string MakeJournalRecord(const map<string, string>& values,
+                         const set<string>& deleted_keys) {
+  string entries;
+  for (const auto& key_value : values) {
+    entries.push_back(kEntrySet);
+    AppendString(key_value.first, &entries);
+    AppendString(key_value.second, &entries);
+  }
+  for (const string& key : deleted_keys) {
+    entries.push_back(kEntryDelete);
+    AppendString(key, &entries);
+  }
+  brillo::Blob hash;
+  CHECK(HashCalculator::RawHashOfBytes(entries.data(), entries.size(), &hash));
+
+  string record;
+  AppendString(entries, &record);
+  record.append(hash.begin(), hash.end());
+  return record;
+}
+
+// Applies to |values| the journal record at |offset| in |journal| and moves
+// |offset| past it. Returns false without changing anything if the record is
+// incomplete or corrupted.
+bool ApplyJournalRecord(const string& journal,
+                        size_t* offset,
+                        map<string, string>* values) {
+  size_t record_offset = *offset;
+  string entries;
+  if (!ReadString(journal, &record_offset, &entries) ||
+      journal.size() - record_offset < static_cast<size_t>(kSHA256Size))
+    return false;
+  brillo::Blob hash;
+  if (!HashCalculator::RawHashOfBytes(entries.data(), entries.size(), &hash) ||
+      memcmp(hash.data(), journal.data() + record_offset, kSHA256Size) != 0)
+    return false;
+  record_offset += kSHA256Size;
+
+  map<string, string> set_values;
+  set<string> deleted_keys;
+  size_t entry_offset = 0;
+  while (entry_offset < entries.size()) {
+    uint8_t type = entries[entry_offset++];
+    string key;
+    if (!ReadString(entries, &entry_offset, &key))
+      return false;
+    if (type == kEntrySet) {
+      if (!ReadString(entries, &entry_offset, &set_values[key]))
+        return false;
+    } else if (type == kEntryDelete) {
+      deleted_keys.insert(key);
+    } else {
+      return false;
+    }
+  }
+
+  for (const string& key : deleted_keys)
+    values->erase(key);
+  for (auto& key_value : set_values)
+    (*values)[key_value.first].swap(key_value.second);
+  *offset = record_offset;
+  return true;
+}
+
+}  // namespace
+
 bool PrefsBase::GetString(const string& key, string* value) const {
+  if (in_transaction_) {
+    if (transaction_deleted_keys_.count(key))
+      return false;
+    const auto value_it = transaction_values_.find(key);
+    if (value_it != transaction_values_.end()) {
+      *value = value_it->second;
+      return true;
+    }
+  }
   return storage_->GetKey(key, value);
 }
 
 bool PrefsBase::SetString(const string& key, const string& value) {
-  TEST_AND_RETURN_FALSE(storage_->SetKey(key, value));
-  const auto observers_for_key = observers_.find(key);
-  if (observers_for_key != observers_.end()) {
-    std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
-    for (ObserverInterface* observer : copy_observers)
-      observer->OnPrefSet(key);
+  if (in_transaction_) {
+    transaction_deleted_keys_.erase(key);
+    transaction_values_[key] = value;
+    return true;
   }
+  TEST_AND_RETURN_FALSE(storage_->SetKey(key, value));
+  NotifyKeySet(key);
   return true;
 }
 
@@ -78,20 +225,55 @@ bool PrefsBase::SetBoolean(const string& key, const bool value) {
 }
 
 bool PrefsBase::Exists(const string& key) const {
+  if (in_transaction_) {
+    if (transaction_deleted_keys_.count(key))
+      return false;
+    if (transaction_values_.count(key))
+      return true;
+  }
   return storage_->KeyExists(key);
 }
 
 bool PrefsBase::Delete(const string& key) {
-  TEST_AND_RETURN_FALSE(storage_->DeleteKey(key));
-  const auto observers_for_key = observers_.find(key);
-  if (observers_for_key != observers_.end()) {
-    std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
-    for (ObserverInterface* observer : copy_observers)
-      observer->OnPrefDeleted(key);
+  if (in_transaction_) {
+    transaction_values_.erase(key);
+    transaction_deleted_keys_.insert(key);
+    return true;
   }
+  TEST_AND_RETURN_FALSE(storage_->DeleteKey(key));
+  NotifyKeyDeleted(key);
+  return true;
+}
+
+bool PrefsBase::StartTransaction() {
+  if (in_transaction_ || !storage_->SupportsTransactions())
+    return false;
+  in_transaction_ = true;
+  return true;
+}
+
+bool PrefsBase::SubmitTransaction() {
+  TEST_AND_RETURN_FALSE(in_transaction_);
+  map<string, string> values;
+  set<string> deleted_keys;
+  values.swap(transaction_values_);
+  deleted_keys.swap(transaction_deleted_keys_);
+  in_transaction_ = false;
+
+  TEST_AND_RETURN_FALSE(storage_->CommitKeys(values, deleted_keys));
+  for (const auto& key_value : values)
+    NotifyKeySet(key_value.first);
+  for (const string& key : deleted_keys)
+    NotifyKeyDeleted(key);
   return true;
 }
 
+void PrefsBase::CancelTransaction() {
+  transaction_values_.clear();
+  transaction_deleted_keys_.clear();
+  in_transaction_ = false;
+}
+
 void PrefsBase::AddObserver(const string& key, ObserverInterface* observer) {
   observers_[key].push_back(observer);
 }
@@ -104,6 +286,24 @@ void PrefsBase::RemoveObserver(const string& key, ObserverInterface* observer) {
     observers_for_key.erase(observer_it);
 }
 
+void PrefsBase::NotifyKeySet(const string& key) {
+  const auto observers_for_key = observers_.find(key);
+  if (observers_for_key != observers_.end()) {
+    std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
+    for (ObserverInterface* observer : copy_observers)
+      observer->OnPrefSet(key);
+  }
+}
+
+void PrefsBase::NotifyKeyDeleted(const string& key) {
+  const auto observers_for_key = observers_.find(key);
+  if (observers_for_key != observers_.end()) {
+    std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
+    for (ObserverInterface* observer : copy_observers)
+      observer->OnPrefDeleted(key);
+  }
+}
+
 // Prefs
 
 bool Prefs::Init(const base::FilePath& prefs_dir) {
@@ -153,13 +353,7 @@ bool Prefs::FileStorage::DeleteKey(const string& key) {
 
 bool Prefs::FileStorage::GetFileNameForKey(const string& key,
                                            base::FilePath* filename) const {
-  // Allows only non-empty keys containing [A-Za-z0-9_-].
-  TEST_AND_RETURN_FALSE(!key.empty());
-  for (size_t i = 0; i < key.size(); ++i) {
-    char c = key.at(i);
-    TEST_AND_RETURN_FALSE(base::IsAsciiAlpha(c) || base::IsAsciiDigit(c) ||
-                          c == '_' || c == '-');
-  }
+  TEST_AND_RETURN_FALSE(IsValidKey(key));
   *filename = prefs_dir_.Append(key);
   return true;
 }
@@ -193,4 +387,309 @@ bool MemoryPrefs::MemoryStorage::DeleteKey(const string& key) {
   return true;
 }
 
+bool MemoryPrefs::MemoryStorage::CommitKeys(const map<string, string>& values,
+                                            const set<string>& deleted_keys) {
+  for (const string& key : deleted_keys)
+    values_.erase(key);
+  for (const auto& key_value : values)
+    values_[key_value.first] = key_value.second;
+  return true;
+}
+
+// JournaledPrefs
+
+bool JournaledPrefs::Init(const base::FilePath& prefs_dir) {
+  return journal_storage_.Init(prefs_dir);
+}
+
+JournaledPrefs::JournalStorage::~JournalStorage() {
+  if (journal_fd_ >= 0) {
+    SyncJournal();
+    ExportKeyFiles();
+    IGNORE_EINTR(close(journal_fd_));
+  }
+}
+
+bool JournaledPrefs::JournalStorage::Init(const base::FilePath& prefs_dir) {
+  if (journal_fd_ >= 0) {
+    SyncJournal();
+    ExportKeyFiles();
+    IGNORE_EINTR(close(journal_fd_));
+    journal_fd_ = -1;
+  }
+  prefs_dir_ = prefs_dir;
+  values_.clear();
+  unexported_keys_.clear();
+  if (!base::DirectoryExists(prefs_dir_))
+    TEST_AND_RETURN_FALSE(base::CreateDirectory(prefs_dir_));
+
+  base::FilePath marker_path = prefs_dir_.Append(kKeyFilesNewerFileName);
+  if (base::PathExists(GetJournalPath()) && !base::PathExists(marker_path)) {
+    TEST_AND_RETURN_FALSE(LoadJournal());
+    TEST_AND_RETURN_FALSE(UpdateKeyFiles());
+  } else {
+    // Copy the keys stored by Prefs, or marked by it as newer than the journal,
+    // into a new journal. The key files are kept
+    // and rewritten when the journal is compacted and on shutdown, so a
+    // rollback to a version using Prefs still finds them.
+    TEST_AND_RETURN_FALSE(LoadKeyFiles(&values_));
+    if (!values_.empty()) {
+      LOG(INFO) << "Copying " << values_.size() << " keys from "
+                << prefs_dir_.value() << " into the journal.";
+    }
+    TEST_AND_RETURN_FALSE(CompactJournal());
+    // Only dropped once the new journal is synced, so a power loss before
+    // copies the key files again.
+    if (base::PathExists(marker_path))
+      TEST_AND_RETURN_FALSE(base::DeleteFile(marker_path, false));
+  }
+  return true;
+}
+
+bool JournaledPrefs::JournalStorage::GetKey(const string& key,
+                                            string* value) const {
+  TEST_AND_RETURN_FALSE(IsValidKey(key));
+  const auto value_it = values_.find(key);
+  if (value_it == values_.end()) {
+    LOG(INFO) << key << " not present in " << prefs_dir_.value();
+    return false;
+  }
+  *value = value_it->second;
+  return true;
+}
+
+bool JournaledPrefs::JournalStorage::SetKey(const string& key,
+                                            const string& value) {
+  return StoreKeys({{key, value}}, {}, false);
+}
+
+bool JournaledPrefs::JournalStorage::KeyExists(const string& key) const {
+  TEST_AND_RETURN_FALSE(IsValidKey(key));
+  return values_.find(key) != values_.end();
+}
+
+bool JournaledPrefs::JournalStorage::DeleteKey(const string& key) {
+  return StoreKeys({}, {key}, false);
+}
+
+bool JournaledPrefs::JournalStorage::CommitKeys(
+    const map<string, string>& values, const set<string>& deleted_keys) {
+  return StoreKeys(values, deleted_keys, true);
+}
+
+bool JournaledPrefs::JournalStorage::StoreKeys(
+    const map<string, string>& values,
+    const set<string>& deleted_keys,
+    bool sync) {
+  // Only the keys actually changed are written to the journal.
+  map<string, string> changed_values;
+  set<string> changed_deleted_keys;
+  for (const auto& key_value : values) {
+    TEST_AND_RETURN_FALSE(IsValidKey(key_value.first));
+    const auto value_it = values_.find(key_value.first);
+    if (value_it == values_.end() || value_it->second != key_value.second)
+      changed_values.insert(key_value);
+  }
+  for (const string& key : deleted_keys) {
+    TEST_AND_RETURN_FALSE(IsValidKey(key));
+    if (values_.find(key) != values_.end())
+      changed_deleted_keys.insert(key);
+  }
+  if (changed_values.empty() && changed_deleted_keys.empty())
+    return !sync || SyncJournal();
+
+  TEST_AND_RETURN_FALSE(AppendRecord(
+      MakeJournalRecord(changed_values, changed_deleted_keys), sync));
+  for (const string& key : changed_deleted_keys) {
+    values_.erase(key);
+    unexported_keys_.insert(key);
+  }
+  for (const auto& key_value : changed_values) {
+    values_[key_value.first] = key_value.second;
+    unexported_keys_.insert(key_value.first);
+  }
+
+  if (journal_size_ - compacted_journal_size_ > kJournalMaxAppendedBytes &&
+      !CompactJournal()) {
+    // The changes are stored anyway, the next commit compacts it again.
+    LOG(WARNING) << "Unable to compact " << GetJournalPath().value();
+  }
+  return true;
+}
+
+bool JournaledPrefs::JournalStorage::LoadJournal() {
+  base::FilePath journal_path = GetJournalPath();
+  string journal;
+  TEST_AND_RETURN_FALSE(base::ReadFileToString(journal_path, &journal));
+
+  const size_t magic_size = strlen(kJournalMagic);
+  size_t offset = magic_size;
+  uint32_t version = 0;
+  if (journal.compare(0, magic_size, kJournalMagic) != 0 ||
+      !ReadUint32(journal, &offset, &version) || version != kJournalVersion) {
+    // The journal is only ever created complete, by CompactJournal().
+    LOG(ERROR) << "Invalid journal header in " << journal_path.value();
+    return false;
+  }
+  while (offset < journal.size() &&
+         ApplyJournalRecord(journal, &offset, &values_)) {
+  }
+  if (offset < journal.size()) {
+    // Only the last record can be partially written, any other bad record
+    // means the journal is corrupted and the keys after it can't be trusted.
+    size_t record_offset = offset;
+    uint32_t entries_size;
+    if (ReadUint32(journal, &record_offset, &entries_size) &&
+        journal.size() - record_offset >
+            static_cast<size_t>(entries_size) + kSHA256Size) {
+      LOG(ERROR) << "Corrupted record at offset " << offset << " of "
+                 << journal_path.value() << ", not the last one.";
+      return false;
+    }
+  }
+
+  journal_fd_ = HANDLE_EINTR(
+      open(journal_path.value().c_str(), O_WRONLY | O_APPEND | O_CLOEXEC));
+  TEST_AND_RETURN_FALSE_ERRNO(journal_fd_ >= 0);
+  if (offset < journal.size()) {
+    // The last record was being written when the device lost power. It must
+    // be dropped so the records appended next can be read back.
+    LOG(WARNING) << "Dropping a partially written last record of "
+                 << journal.size() - offset << " bytes from "
+                 << journal_path.value();
+    TEST_AND_RETURN_FALSE_ERRNO(ftruncate(journal_fd_, offset) == 0);
+    TEST_AND_RETURN_FALSE_ERRNO(fdatasync(journal_fd_) == 0);
+  }
+  journal_size_ = offset;
+  compacted_journal_size_ = offset;
+  journal_synced_ = true;
+  return true;
+}
+
+bool JournaledPrefs::JournalStorage::LoadKeyFiles(
+    map<string, string>* values) const {
+  base::FileEnumerator files(prefs_dir_, false, base::FileEnumerator::FILES);
+  for (base::FilePath path = files.Next(); !path.empty(); path = files.Next()) {
+    string key = path.BaseName().value();
+    if (IsValidKey(key))
+      TEST_AND_RETURN_FALSE(base::ReadFileToString(path, &(*values)[key]));
+  }
+  return true;
+}
+
+bool JournaledPrefs::JournalStorage::UpdateKeyFiles() {
+  map<string, string> key_file_values;
+  TEST_AND_RETURN_FALSE(LoadKeyFiles(&key_file_values));
+
+  // The key files are written without syncing them, so their timestamps
+  // don't tell whether they hold newer values than the journal.
+  unexported_keys_.clear();
+  for (const auto& key_value : key_file_values) {
+    if (values_.find(key_value.first) == values_.end())
+      unexported_keys_.insert(key_value.first);
+  }
+  for (const auto& key_value : values_) {
+    const auto value_it = key_file_values.find(key_value.first);
+    if (value_it == key_file_values.end() ||
+        value_it->second != key_value.second) {
+      unexported_keys_.insert(key_value.first);
+    }
+  }
+  ExportKeyFiles();
+  return true;
+}
+
+void JournaledPrefs::JournalStorage::ExportKeyFiles() {
+  // The journal holds the changes already, so these are not synced.
+  for (const string& key : unexported_keys_) {
+    base::FilePath path = prefs_dir_.Append(key);
+    const auto value_it = values_.find(key);
+    if (value_it == values_.end()) {
+      if (!base::DeleteFile(path, false))
+        LOG(WARNING) << "Unable to delete " << path.value();
+    } else if (base::WriteFile(path,
+                               value_it->second.data(),
+                               value_it->second.size()) !=
+               static_cast<int>(value_it->second.size())) {
+      LOG(WARNING) << "Unable to write " << path.value();
+    }
+  }
+  unexported_keys_.clear();
+}
+
+bool JournaledPrefs::JournalStorage::AppendRecord(const string& record,
+                                                  bool sync) {
+  journal_synced_ = false;
+  // Syncing also stores the records appended before without syncing them.
+  if (!utils::WriteAll(journal_fd_, record.data(), record.size()) ||
+      (sync && !SyncJournal())) {
+    PLOG(ERROR) << "Unable to append a record to "
+                << GetJournalPath().value();
+    // Drop what was written of the record, so the next records follow the
+    // last complete one.
+    if (ftruncate(journal_fd_, journal_size_) != 0)
+      PLOG(ERROR) << "Unable to truncate " << GetJournalPath().value();
+    return false;
+  }
+  journal_size_ += record.size();
+  return true;
+}
+
+bool JournaledPrefs::JournalStorage::SyncJournal() {
+  if (journal_synced_)
+    return true;
+  if (fdatasync(journal_fd_) != 0) {
+    PLOG(ERROR) << "Unable to sync " << GetJournalPath().value();
+    return false;
+  }
+  journal_synced_ = true;
+  return true;
+}
+
+bool JournaledPrefs::JournalStorage::CompactJournal() {
+  base::FilePath journal_path = GetJournalPath();
+  base::FilePath temp_path = journal_path.AddExtension("tmp");
+  string journal(kJournalMagic);
+  AppendUint32(kJournalVersion, &journal);
+  journal.append(MakeJournalRecord(values_, {}));
+
+  // The new journal replaces the old one only once it is fully written, so
+  // one of them is always complete.
+  int fd = HANDLE_EINTR(open(temp_path.value().c_str(),
+                             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                             0644));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  bool written =
+      utils::WriteAll(fd, journal.data(), journal.size()) && fsync(fd) == 0;
+  written = IGNORE_EINTR(close(fd)) == 0 && written;
+  if (!written || !base::ReplaceFile(temp_path, journal_path, nullptr)) {
+    PLOG(ERROR) << "Unable to write " << journal_path.value();
+    base::DeleteFile(temp_path, false);
+    return false;
+  }
+  // Sync the directory too, otherwise the records appended next may be lost
+  // along with the rename.
+  int dir_fd = HANDLE_EINTR(
+      open(prefs_dir_.value().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  TEST_AND_RETURN_FALSE_ERRNO(dir_fd >= 0);
+  written = fsync(dir_fd) == 0;
+  IGNORE_EINTR(close(dir_fd));
+  TEST_AND_RETURN_FALSE_ERRNO(written);
+
+  if (journal_fd_ >= 0)
+    IGNORE_EINTR(close(journal_fd_));
+  journal_fd_ = HANDLE_EINTR(
+      open(journal_path.value().c_str(), O_WRONLY | O_APPEND | O_CLOEXEC));
+  TEST_AND_RETURN_FALSE_ERRNO(journal_fd_ >= 0);
+  journal_size_ = journal.size();
+  compacted_journal_size_ = journal.size();
+  journal_synced_ = true;
+  ExportKeyFiles();
+  return true;
+}
+
+base::FilePath JournaledPrefs::JournalStorage::GetJournalPath() const {
+  return prefs_dir_.Append(kJournalFileName);
+}
+
 }  // namespace chromeos_update_engine
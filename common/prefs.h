@@ -17,7 +17,10 @@
 #ifndef UPDATE_ENGINE_COMMON_PREFS_H_
 #define UPDATE_ENGINE_COMMON_PREFS_H_
 
+#include <sys/types.h>
+
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -53,6 +56,18 @@ class PrefsBase : public PrefsInterface {
     // key was deleted.
     virtual bool DeleteKey(const std::string& key) = 0;
 
+    // Returns whether the storage can store several changes at once with
+    // CommitKeys().
+    virtual bool SupportsTransactions() const { return false; }
+
+    // Sets the keys in |values| to their value and deletes the keys in
+    // |deleted_keys| all at once. Returns whether the changes were stored; none
+    // of them is stored otherwise.
+    virtual bool CommitKeys(const std::map<std::string, std::string>& values,
+                            const std::set<std::string>& deleted_keys) {
+      return false;
+    }
+
    private:
     DISALLOW_COPY_AND_ASSIGN(StorageInterface);
   };
@@ -70,15 +85,30 @@ class PrefsBase : public PrefsInterface {
   bool Exists(const std::string& key) const override;
   bool Delete(const std::string& key) override;
 
+  bool StartTransaction() override;
+  bool SubmitTransaction() override;
+  void CancelTransaction() override;
+
   void AddObserver(const std::string& key,
                    ObserverInterface* observer) override;
   void RemoveObserver(const std::string& key,
                       ObserverInterface* observer) override;
 
  private:
+  // Calls the observers of |key| after it was set or deleted.
+  void NotifyKeySet(const std::string& key);
+  void NotifyKeyDeleted(const std::string& key);
+
   // The registered observers watching for changes.
   std::map<std::string, std::vector<ObserverInterface*>> observers_;
 
+  // Whether a transaction is started.
+  bool in_transaction_{false};
+
+  // The values set and the keys deleted since the transaction started.
+  std::map<std::string, std::string> transaction_values_;
+  std::set<std::string> transaction_deleted_keys_;
+
   // The concrete implementation of the storage used for the keys.
   StorageInterface* storage_;
 
@@ -152,6 +182,9 @@ class MemoryPrefs : public PrefsBase {
     bool SetKey(const std::string& key, const std::string& value) override;
     bool KeyExists(const std::string& key) const override;
     bool DeleteKey(const std::string& key) override;
+    bool SupportsTransactions() const override { return true; }
+    bool CommitKeys(const std::map<std::string, std::string>& values,
+                    const std::set<std::string>& deleted_keys) override;
 
    private:
     // The std::map holding the values in memory.
@@ -163,6 +196,110 @@ class MemoryPrefs : public PrefsBase {
 
   DISALLOW_COPY_AND_ASSIGN(MemoryPrefs);
 };
+
+// Implements a preference store by appending every change to a journal file
+// under a preference store directory, so several keys can be stored at once
+// with a single write and fsync(). Only a submitted transaction syncs the
+// journal, the other changes are synced along with the next one. A change
+// partially written when the device lost power is dropped when the journal is
+// loaded. The journal is compacted into a single record of all the values when
+// it grows. The files stored by Prefs in the same directory are copied into it
+// on the first Init() and then rewritten when the journal is compacted and on
+// shutdown, so a version using Prefs still reads the keys after a rollback.
+// The journal always wins over the key files, unless a version using Prefs
+// marked them as newer by creating the "prefs.journal.stale" file.
+
+class JournaledPrefs : public PrefsBase {
+ public:
+  JournaledPrefs() : PrefsBase(&journal_storage_) {}
+
+  // Initializes the store by associating this object with |prefs_dir|
+  // as the preference store directory and loading the journal in it. Returns
+  // true on success, false otherwise.
+  bool Init(const base::FilePath& prefs_dir);
+
+ private:
+  class JournalStorage : public PrefsBase::StorageInterface {
+   public:
+    JournalStorage() = default;
+    ~JournalStorage() override;
+
+    bool Init(const base::FilePath& prefs_dir);
+
+    // PrefsBase::StorageInterface overrides.
+    bool GetKey(const std::string& key, std::string* value) const override;
+    bool SetKey(const std::string& key, const std::string& value) override;
+    bool KeyExists(const std::string& key) const override;
+    bool DeleteKey(const std::string& key) override;
+    bool SupportsTransactions() const override { return true; }
+    bool CommitKeys(const std::map<std::string, std::string>& values,
+                    const std::set<std::string>& deleted_keys) override;
+
+   private:
+    // Stores the changes like CommitKeys(), syncing the journal file only if
+    // |sync| is true.
+    bool StoreKeys(const std::map<std::string, std::string>& values,
+                   const std::set<std::string>& deleted_keys,
+                   bool sync);
+
+    // Loads the values from the records of the journal file. A partially
+    // written last record is dropped from the file, while any other bad record
+    // fails the load.
+    bool LoadJournal();
+
+    // Loads into |values| the files named after their key in the preference
+    // store directory, as stored by Prefs.
+    bool LoadKeyFiles(std::map<std::string, std::string>* values) const;
+
+    // Rewrites the key files differing from the loaded journal.
+    bool UpdateKeyFiles();
+
+    // Writes or deletes the files of the keys in |unexported_keys_| to match
+    // |values_|, without syncing them.
+    void ExportKeyFiles();
+
+    // Appends a record of the changes to the journal file, and syncs it if
+    // |sync| is true.
+    bool AppendRecord(const std::string& record, bool sync);
+
+    // Syncs the records appended to the journal file since the last sync.
+    bool SyncJournal();
+
+    // Replaces the journal file with one holding a single record of all the
+    // values.
+    bool CompactJournal();
+
+    // Returns the path of the journal file.
+    base::FilePath GetJournalPath() const;
+
+    // Preference store directory.
+    base::FilePath prefs_dir_;
+
+    // The values of all the keys, as stored in the journal.
+    std::map<std::string, std::string> values_;
+
+    // The journal file open for appending, or -1.
+    int journal_fd_{-1};
+
+    // The size of the journal file, and its size when it was last compacted.
+    off_t journal_size_{0};
+    off_t compacted_journal_size_{0};
+
+    // Whether all the records of the journal file are synced.
+    bool journal_synced_{true};
+
+    // The keys changed since their key files were last written.
+    std::set<std::string> unexported_keys_;
+
+    DISALLOW_COPY_AND_ASSIGN(JournalStorage);
+  };
+
+  // The concrete journal storage implementation.
+  JournalStorage journal_storage_;
+
+  DISALLOW_COPY_AND_ASSIGN(JournaledPrefs);
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_COMMON_PREFS_H_
@@ -79,6 +79,21 @@ class PrefsInterface {
   // this key. Calling with non-existent keys does nothing.
   virtual bool Delete(const std::string& key) = 0;
 
+  // Starts a transaction: the values set and the keys deleted until the
+  // transaction is submitted are stored all at once, so a crash or a power loss
+  // never leaves only some of them stored. The Get*() and Exists() methods see
+  // them right away, while the observers are only called once they are stored.
+  // Returns false if a transaction is already started or if the store doesn't
+  // support transactions, in which case every change is stored right away.
+  virtual bool StartTransaction() = 0;
+
+  // Stores the changes made since StartTransaction() and ends the transaction.
+  // Returns true on success; none of the changes is stored otherwise.
+  virtual bool SubmitTransaction() = 0;
+
+  // Drops the changes made since StartTransaction() and ends the transaction.
+  virtual void CancelTransaction() = 0;
+
   // Add an observer to watch whenever the given |key| is modified. The
   // OnPrefSet() and OnPrefDelete() methods will be called whenever any of the
   // Set*() methods or the Delete() method are called on the given key,
@@ -17,6 +17,7 @@
 #include "update_engine/common/prefs.h"
 
 #include <inttypes.h>
+#include <string.h>
 
 #include <limits>
 #include <string>
@@ -24,8 +25,10 @@
 #include <base/files/file_util.h>
 #include <base/files/scoped_temp_dir.h>
 #include <base/macros.h>
+#include <base/strings/string_number_conversions.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
+#include <base/time/time.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
@@ -279,6 +282,13 @@ TEST_F(PrefsTest, DeleteWorks) {
   EXPECT_FALSE(prefs_.Exists(kKey));
 }
 
+TEST_F(PrefsTest, TransactionsNotSupported) {
+  EXPECT_FALSE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "value"));
+  EXPECT_TRUE(base::PathExists(prefs_dir_.Append(kKey)));
+  EXPECT_FALSE(prefs_.SubmitTransaction());
+}
+
 class MockPrefsObserver : public PrefsInterface::ObserverInterface {
  public:
   MOCK_METHOD1(OnPrefSet, void(const string&));
@@ -361,4 +371,263 @@ TEST_F(MemoryPrefsTest, BasicTest) {
   EXPECT_FALSE(prefs_.Delete(kKey));
 }
 
+TEST_F(MemoryPrefsTest, TransactionTest) {
+  EXPECT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 1234));
+  EXPECT_TRUE(prefs_.Exists(kKey));
+  prefs_.CancelTransaction();
+  EXPECT_FALSE(prefs_.Exists(kKey));
+
+  EXPECT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 1234));
+  EXPECT_TRUE(prefs_.SubmitTransaction());
+  int64_t value = 0;
+  EXPECT_TRUE(prefs_.GetInt64(kKey, &value));
+  EXPECT_EQ(1234, value);
+}
+
+class JournaledPrefsTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    prefs_dir_ = temp_dir_.GetPath();
+    journal_path_ = prefs_dir_.Append("prefs.journal");
+    ASSERT_TRUE(prefs_.Init(prefs_dir_));
+  }
+
+  base::ScopedTempDir temp_dir_;
+  base::FilePath prefs_dir_;
+  base::FilePath journal_path_;
+  JournaledPrefs prefs_;
+};
+
+TEST_F(JournaledPrefsTest, KeysStoredInJournal) {
+  const char kOtherKey[] = "other-key";
+  EXPECT_TRUE(prefs_.SetString(kKey, "value"));
+  EXPECT_TRUE(prefs_.SetInt64(kOtherKey, 42));
+  EXPECT_TRUE(prefs_.Delete(kKey));
+  EXPECT_TRUE(prefs_.SetBoolean(kKey, true));
+  EXPECT_TRUE(prefs_.Delete(kOtherKey));
+  EXPECT_TRUE(base::PathExists(journal_path_));
+
+  JournaledPrefs prefs;
+  EXPECT_TRUE(prefs.Init(prefs_dir_));
+  bool value = false;
+  EXPECT_TRUE(prefs.GetBoolean(kKey, &value));
+  EXPECT_TRUE(value);
+  EXPECT_FALSE(prefs.Exists(kOtherKey));
+}
+
+TEST_F(JournaledPrefsTest, BadKeys) {
+  const char kBadKey[] = "prefs.journal";
+  string value;
+  EXPECT_FALSE(prefs_.SetString(kBadKey, "value"));
+  EXPECT_FALSE(prefs_.GetString(kBadKey, &value));
+  EXPECT_FALSE(prefs_.Exists(kBadKey));
+  EXPECT_FALSE(prefs_.Delete(kBadKey));
+}
+
+TEST_F(JournaledPrefsTest, KeyFilesCopiedToJournal) {
+  base::FilePath subdir = prefs_dir_.Append("subdir");
+  ASSERT_TRUE(base::CreateDirectory(subdir));
+  const char kValue[] = "some test value\non 2 lines";
+  ASSERT_EQ(static_cast<int>(strlen(kValue)),
+            base::WriteFile(subdir.Append(kKey), kValue, strlen(kValue)));
+
+  EXPECT_TRUE(prefs_.Init(subdir));
+  EXPECT_TRUE(base::PathExists(subdir.Append(kKey)));
+  string value;
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ(kValue, value);
+
+  JournaledPrefs prefs;
+  EXPECT_TRUE(prefs.Init(subdir));
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ(kValue, value);
+}
+
+TEST_F(JournaledPrefsTest, KeyFilesUpdated) {
+  const char kOtherKey[] = "other-key";
+  {
+    JournaledPrefs journaled_prefs;
+    EXPECT_TRUE(journaled_prefs.Init(prefs_dir_));
+    EXPECT_TRUE(journaled_prefs.SetInt64(kKey, 5));
+    EXPECT_TRUE(journaled_prefs.SetInt64(kOtherKey, 6));
+    EXPECT_TRUE(journaled_prefs.StartTransaction());
+    EXPECT_TRUE(journaled_prefs.SetInt64(kKey, 7));
+    EXPECT_TRUE(journaled_prefs.Delete(kOtherKey));
+    EXPECT_TRUE(journaled_prefs.SubmitTransaction());
+    // The key files are only written on shutdown.
+    EXPECT_FALSE(base::PathExists(prefs_dir_.Append(kKey)));
+  }
+
+  // A version using Prefs reads the same keys.
+  Prefs prefs;
+  EXPECT_TRUE(prefs.Init(prefs_dir_));
+  int64_t value = 0;
+  EXPECT_TRUE(prefs.GetInt64(kKey, &value));
+  EXPECT_EQ(7, value);
+  EXPECT_FALSE(prefs.Exists(kOtherKey));
+}
+
+TEST_F(JournaledPrefsTest, KeyFilesRewrittenFromJournal) {
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 5));
+  // A key file not written yet when the device lost power.
+  base::FilePath key_path = prefs_dir_.Append(kKey);
+  ASSERT_EQ(1, base::WriteFile(key_path, "4", 1));
+  base::Time old_time = base::Time::Now() - base::TimeDelta::FromHours(1);
+  ASSERT_TRUE(base::TouchFile(key_path, old_time, old_time));
+
+  JournaledPrefs prefs;
+  EXPECT_TRUE(prefs.Init(prefs_dir_));
+  int64_t value = 0;
+  EXPECT_TRUE(prefs.GetInt64(kKey, &value));
+  EXPECT_EQ(5, value);
+  string key_file_value;
+  EXPECT_TRUE(base::ReadFileToString(key_path, &key_file_value));
+  EXPECT_EQ("5", key_file_value);
+}
+
+TEST_F(JournaledPrefsTest, KeyFilesNewerThanJournalIgnored) {
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 5));
+  // A key file timestamp alone doesn't make it newer than the journal.
+  base::FilePath key_path = prefs_dir_.Append(kKey);
+  ASSERT_EQ(1, base::WriteFile(key_path, "8", 1));
+  base::Time new_time = base::Time::Now() + base::TimeDelta::FromHours(1);
+  ASSERT_TRUE(base::TouchFile(key_path, new_time, new_time));
+
+  JournaledPrefs prefs;
+  EXPECT_TRUE(prefs.Init(prefs_dir_));
+  int64_t value = 0;
+  EXPECT_TRUE(prefs.GetInt64(kKey, &value));
+  EXPECT_EQ(5, value);
+  string key_file_value;
+  EXPECT_TRUE(base::ReadFileToString(key_path, &key_file_value));
+  EXPECT_EQ("5", key_file_value);
+}
+
+TEST_F(JournaledPrefsTest, KeyFilesMarkedNewerThanJournal) {
+  const char kOtherKey[] = "other-key";
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 5));
+  EXPECT_TRUE(prefs_.SetInt64(kOtherKey, 6));
+  // Keys changed by a version using Prefs after a rollback, which marked the
+  // key files as newer.
+  ASSERT_EQ(1, base::WriteFile(prefs_dir_.Append(kKey), "8", 1));
+  base::FilePath marker_path = prefs_dir_.Append("prefs.journal.stale");
+  ASSERT_EQ(0, base::WriteFile(marker_path, "", 0));
+
+  JournaledPrefs prefs;
+  EXPECT_TRUE(prefs.Init(prefs_dir_));
+  int64_t value = 0;
+  EXPECT_TRUE(prefs.GetInt64(kKey, &value));
+  EXPECT_EQ(8, value);
+  EXPECT_FALSE(prefs.Exists(kOtherKey));
+  EXPECT_FALSE(base::PathExists(marker_path));
+}
+
+TEST_F(JournaledPrefsTest, PartiallyWrittenRecordDropped) {
+  const char kOtherKey[] = "other-key";
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 5));
+  // A record cut before its end by a power loss.
+  const char kPartialRecord[] = "\x40\0\0\0\x01";
+  ASSERT_TRUE(base::AppendToFile(
+      journal_path_, kPartialRecord, sizeof(kPartialRecord) - 1));
+
+  JournaledPrefs prefs;
+  EXPECT_TRUE(prefs.Init(prefs_dir_));
+  int64_t value = 0;
+  EXPECT_TRUE(prefs.GetInt64(kKey, &value));
+  EXPECT_EQ(5, value);
+  EXPECT_TRUE(prefs.SetInt64(kOtherKey, 6));
+
+  EXPECT_TRUE(prefs_.Init(prefs_dir_));
+  EXPECT_TRUE(prefs_.GetInt64(kKey, &value));
+  EXPECT_EQ(5, value);
+  EXPECT_TRUE(prefs_.GetInt64(kOtherKey, &value));
+  EXPECT_EQ(6, value);
+}
+
+TEST_F(JournaledPrefsTest, CorruptedRecordFails) {
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 5));
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 6));
+  // Corrupt the value of the first record, which is followed by the second
+  // one.
+  string journal;
+  ASSERT_TRUE(base::ReadFileToString(journal_path_, &journal));
+  size_t key_offset = journal.find(kKey);
+  ASSERT_NE(string::npos, key_offset);
+  size_t value_offset = key_offset + strlen(kKey) + sizeof(uint32_t);
+  ASSERT_EQ('5', journal[value_offset]);
+  journal[value_offset] = '4';
+  ASSERT_EQ(static_cast<int>(journal.size()),
+            base::WriteFile(journal_path_, journal.data(), journal.size()));
+
+  JournaledPrefs prefs;
+  EXPECT_FALSE(prefs.Init(prefs_dir_));
+}
+
+TEST_F(JournaledPrefsTest, JournalCompacted) {
+  const string kValue(1024, 'x');
+  for (int i = 0; i < 200; i++)
+    EXPECT_TRUE(prefs_.SetString(kKey, kValue + base::IntToString(i)));
+  int64_t journal_size = 0;
+  EXPECT_TRUE(base::GetFileSize(journal_path_, &journal_size));
+  EXPECT_LT(journal_size, 100 * 1024);
+  // The key files are written along with the compacted journal.
+  EXPECT_TRUE(base::PathExists(prefs_dir_.Append(kKey)));
+
+  JournaledPrefs prefs;
+  EXPECT_TRUE(prefs.Init(prefs_dir_));
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ(kValue + "199", value);
+}
+
+TEST_F(JournaledPrefsTest, TransactionSubmitted) {
+  const char kOtherKey[] = "other-key";
+  EXPECT_TRUE(prefs_.SetString(kOtherKey, "value"));
+  MockPrefsObserver mock_obserser;
+  prefs_.AddObserver(kKey, &mock_obserser);
+  prefs_.AddObserver(kOtherKey, &mock_obserser);
+
+  EXPECT_TRUE(prefs_.StartTransaction());
+  EXPECT_FALSE(prefs_.StartTransaction());
+  EXPECT_CALL(mock_obserser, OnPrefSet(_)).Times(0);
+  EXPECT_CALL(mock_obserser, OnPrefDeleted(_)).Times(0);
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 7));
+  EXPECT_TRUE(prefs_.Delete(kOtherKey));
+  int64_t value = 0;
+  EXPECT_TRUE(prefs_.GetInt64(kKey, &value));
+  EXPECT_EQ(7, value);
+  EXPECT_FALSE(prefs_.Exists(kOtherKey));
+  testing::Mock::VerifyAndClearExpectations(&mock_obserser);
+
+  EXPECT_CALL(mock_obserser, OnPrefSet(Eq(kKey)));
+  EXPECT_CALL(mock_obserser, OnPrefDeleted(Eq(kOtherKey)));
+  EXPECT_TRUE(prefs_.SubmitTransaction());
+  testing::Mock::VerifyAndClearExpectations(&mock_obserser);
+  prefs_.RemoveObserver(kKey, &mock_obserser);
+  prefs_.RemoveObserver(kOtherKey, &mock_obserser);
+
+  JournaledPrefs prefs;
+  EXPECT_TRUE(prefs.Init(prefs_dir_));
+  EXPECT_TRUE(prefs.GetInt64(kKey, &value));
+  EXPECT_EQ(7, value);
+  EXPECT_FALSE(prefs.Exists(kOtherKey));
+}
+
+TEST_F(JournaledPrefsTest, TransactionCanceled) {
+  EXPECT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 7));
+  prefs_.CancelTransaction();
+  EXPECT_FALSE(prefs_.Exists(kKey));
+
+  // None of the changes is stored if one of them is invalid.
+  EXPECT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 7));
+  EXPECT_TRUE(prefs_.SetInt64("no spaces", 8));
+  EXPECT_FALSE(prefs_.SubmitTransaction());
+  EXPECT_FALSE(prefs_.Exists(kKey));
+}
+
 }  // namespace chromeos_update_engine
@@ -51,7 +51,7 @@ bool DaemonStateAndroid::Initialize() {
     LOG(ERROR) << "Failed to get a non-volatile directory.";
     return false;
   }
-  Prefs* prefs = new Prefs();
+  JournaledPrefs* prefs = new JournaledPrefs();
   prefs_.reset(prefs);
   if (!prefs->Init(non_volatile_path.Append(kPrefsSubDirectory))) {
     LOG(ERROR) << "Failed to initialize preferences.";
@@ -63,6 +63,10 @@ bool DaemonStateAndroid::Initialize() {
       new CertificateChecker(prefs_.get(), &openssl_wrapper_));
   certificate_checker_->Init();
 
+  // The LibcurlConnectionPool singleton is used by the HTTP fetchers.
+  connection_pool_.reset(new LibcurlConnectionPool());
+  connection_pool_->Init();
+
   // Initialize the UpdateAttempter before the UpdateManager.
   update_attempter_.reset(new UpdateAttempterAndroid(
       this, prefs_.get(), boot_control_.get(), hardware_.get()));
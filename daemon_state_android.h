@@ -25,6 +25,7 @@
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/daemon_state_interface.h"
+#include "update_engine/libcurl_connection_pool.h"
 #include "update_engine/service_delegate_android_interface.h"
 #include "update_engine/service_observer_interface.h"
 #include "update_engine/update_attempter_android.h"
@@ -62,6 +63,10 @@ class DaemonStateAndroid : public DaemonStateInterface {
   // Interface for persisted store.
   std::unique_ptr<PrefsInterface> prefs_;
 
+  // The connections shared by the HTTP transfers. It must outlive their
+  // fetchers.
+  std::unique_ptr<LibcurlConnectionPool> connection_pool_;
+
   // The main class handling the updates.
   std::unique_ptr<UpdateAttempterAndroid> update_attempter_;
 
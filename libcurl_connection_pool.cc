@@ -0,0 +1,79 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/libcurl_connection_pool.h"
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+// static
+LibcurlConnectionPool* LibcurlConnectionPool::connection_pool_singleton_ =
+    nullptr;
+
+LibcurlConnectionPool::LibcurlConnectionPool() {
+  share_handle_ = curl_share_init();
+  CHECK(share_handle_);
+  CHECK_EQ(
+      curl_share_setopt(share_handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS),
+      CURLSHE_OK);
+  CHECK_EQ(curl_share_setopt(
+               share_handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION),
+           CURLSHE_OK);
+#if LIBCURL_VERSION_NUM >= 0x073900
+  // Sharing the connections is only supported since libcurl 7.57.0.
+  CHECK_EQ(
+      curl_share_setopt(share_handle_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT),
+      CURLSHE_OK);
+#endif  // LIBCURL_VERSION_NUM >= 0x073900
+}
+
+LibcurlConnectionPool::~LibcurlConnectionPool() {
+  if (connection_pool_singleton_ == this)
+    connection_pool_singleton_ = nullptr;
+  // This closes the pooled connections.
+  CURLSHcode code = curl_share_cleanup(share_handle_);
+  if (code != CURLSHE_OK) {
+    LOG(ERROR) << "Unable to clean up the connection pool: "
+               << curl_share_strerror(code);
+  }
+}
+
+void LibcurlConnectionPool::Init() {
+  CHECK(connection_pool_singleton_ == nullptr);
+  connection_pool_singleton_ = this;
+}
+
+void LibcurlConnectionPool::AddConnectionSetUp(bool reused,
+                                               base::TimeDelta setup_time) {
+  if (reused) {
+    VLOG(1) << "Reused a pooled connection.";
+    stats_.reused_connections++;
+  } else {
+    VLOG(1) << "Set up a new connection in " << setup_time.InMilliseconds()
+            << " ms.";
+    stats_.new_connections++;
+    stats_.setup_time += setup_time;
+  }
+}
+
+LibcurlConnectionPool::Stats LibcurlConnectionPool::TakeStats() {
+  Stats stats = stats_;
+  stats_ = Stats();
+  return stats;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,91 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_LIBCURL_CONNECTION_POOL_H_
+#define UPDATE_ENGINE_LIBCURL_CONNECTION_POOL_H_
+
+#include <set>
+
+#include <curl/curl.h>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+class LibcurlHttpFetcher;
+
+// Shares the DNS cache, the TLS sessions and the open connections between the
+// transfers of all the LibcurlHttpFetcher instances, so a transfer to a server
+// connected to before, like a retry or the next range of a payload, doesn't
+// need a new TCP and TLS handshake. All the transfers run on the same message
+// loop, so the shared data doesn't need to be locked.
+class LibcurlConnectionPool {
+ public:
+  // The connections used by the transfers which got a response from their
+  // server.
+  struct Stats {
+    int new_connections{0};
+    int reused_connections{0};
+    // The total time taken to establish the new connections, including the
+    // name resolution and the TCP and TLS handshakes.
+    base::TimeDelta setup_time;
+  };
+
+  LibcurlConnectionPool();
+  ~LibcurlConnectionPool();
+
+  // Initialize this class as the singleton instance used by the fetchers. Only
+  // one instance can be initialized at a time. The fetchers don't share their
+  // connections while there is none.
+  void Init();
+
+  // Returns the initialized instance, if any.
+  static LibcurlConnectionPool* Get() { return connection_pool_singleton_; }
+
+  // The handle passed to libcurl with CURLOPT_SHARE.
+  CURLSH* share_handle() const { return share_handle_; }
+
+  // The fetchers with a transfer in progress. The socket of a pooled
+  // connection may be closed by another fetcher than the one watching it.
+  void AddFetcher(LibcurlHttpFetcher* fetcher) { fetchers_.insert(fetcher); }
+  void RemoveFetcher(LibcurlHttpFetcher* fetcher) { fetchers_.erase(fetcher); }
+  const std::set<LibcurlHttpFetcher*>& fetchers() const { return fetchers_; }
+
+  // Records that a transfer got a response over either a |reused| connection
+  // or a new one which took |setup_time| to establish.
+  void AddConnectionSetUp(bool reused, base::TimeDelta setup_time);
+
+  // Returns the connections recorded since the last call, so they are reported
+  // once per update attempt instead of once per transfer.
+  Stats TakeStats();
+
+ private:
+  // The LibcurlConnectionPool singleton instance.
+  static LibcurlConnectionPool* connection_pool_singleton_;
+
+  CURLSH* share_handle_{nullptr};
+
+  std::set<LibcurlHttpFetcher*> fetchers_;
+
+  Stats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(LibcurlConnectionPool);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_LIBCURL_CONNECTION_POOL_H_
@@ -72,27 +72,45 @@ int LibcurlSockoptCallback(void* /* clientp */,
 // static
 int LibcurlHttpFetcher::LibcurlCloseSocketCallback(void* clientp,
                                                    curl_socket_t item) {
+  LibcurlHttpFetcher* fetcher = static_cast<LibcurlHttpFetcher*>(clientp);
+  fetcher->StopWatchingSocket(item);
+  return CloseSocket(item);
+}
+
+// static
+int LibcurlHttpFetcher::LibcurlPooledCloseSocketCallback(void* clientp,
+                                                         curl_socket_t item) {
+  // The connection may outlive the fetcher which opened it, so look for the
+  // fetcher watching the socket in the pool.
+  LibcurlConnectionPool* pool = static_cast<LibcurlConnectionPool*>(clientp);
+  for (LibcurlHttpFetcher* fetcher : pool->fetchers())
+    fetcher->StopWatchingSocket(item);
+  return CloseSocket(item);
+}
+
+// static
+int LibcurlHttpFetcher::CloseSocket(curl_socket_t item) {
 #ifdef __ANDROID__
   qtaguid_untagSocket(item);
 #endif  // __ANDROID__
-  LibcurlHttpFetcher* fetcher = static_cast<LibcurlHttpFetcher*>(clientp);
-  // Stop watching the socket before closing it.
-  for (size_t t = 0; t < arraysize(fetcher->fd_task_maps_); ++t) {
-    const auto fd_task_pair = fetcher->fd_task_maps_[t].find(item);
-    if (fd_task_pair != fetcher->fd_task_maps_[t].end()) {
+  // Documentation for this callback says to return 0 on success or 1 on error.
+  if (!IGNORE_EINTR(close(item)))
+    return 0;
+  return 1;
+}
+
+void LibcurlHttpFetcher::StopWatchingSocket(curl_socket_t item) {
+  for (size_t t = 0; t < arraysize(fd_task_maps_); ++t) {
+    const auto fd_task_pair = fd_task_maps_[t].find(item);
+    if (fd_task_pair != fd_task_maps_[t].end()) {
       if (!MessageLoop::current()->CancelTask(fd_task_pair->second)) {
         LOG(WARNING) << "Error canceling the watch task "
                      << fd_task_pair->second << " for "
                      << (t ? "writing" : "reading") << " the fd " << item;
       }
-      fetcher->fd_task_maps_[t].erase(item);
+      fd_task_maps_[t].erase(item);
     }
   }
-
-  // Documentation for this callback says to return 0 on success or 1 on error.
-  if (!IGNORE_EINTR(close(item)))
-    return 0;
-  return 1;
 }
 
 LibcurlHttpFetcher::LibcurlHttpFetcher(ProxyResolver* proxy_resolver,
@@ -148,6 +166,20 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
   url_ = url;
   curl_multi_handle_ = curl_multi_init();
   CHECK(curl_multi_handle_);
+  // libcurl tells which sockets to watch and when to call it back, so it is
+  // only called when there is something to do.
+  CHECK_EQ(curl_multi_setopt(curl_multi_handle_,
+                             CURLMOPT_SOCKETFUNCTION,
+                             LibcurlSocketCallback),
+           CURLM_OK);
+  CHECK_EQ(curl_multi_setopt(curl_multi_handle_, CURLMOPT_SOCKETDATA, this),
+           CURLM_OK);
+  CHECK_EQ(curl_multi_setopt(curl_multi_handle_,
+                             CURLMOPT_TIMERFUNCTION,
+                             LibcurlTimerCallback),
+           CURLM_OK);
+  CHECK_EQ(curl_multi_setopt(curl_multi_handle_, CURLMOPT_TIMERDATA, this),
+           CURLM_OK);
 
   curl_handle_ = curl_easy_init();
   CHECK(curl_handle_);
@@ -156,9 +188,21 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
   // Tag and untag the socket for network usage stats.
   curl_easy_setopt(
       curl_handle_, CURLOPT_SOCKOPTFUNCTION, LibcurlSockoptCallback);
-  curl_easy_setopt(
-      curl_handle_, CURLOPT_CLOSESOCKETFUNCTION, LibcurlCloseSocketCallback);
-  curl_easy_setopt(curl_handle_, CURLOPT_CLOSESOCKETDATA, this);
+  connection_pool_ = LibcurlConnectionPool::Get();
+  if (connection_pool_) {
+    connection_pool_->AddFetcher(this);
+    CHECK_EQ(curl_easy_setopt(
+                 curl_handle_, CURLOPT_SHARE, connection_pool_->share_handle()),
+             CURLE_OK);
+    curl_easy_setopt(curl_handle_,
+                     CURLOPT_CLOSESOCKETFUNCTION,
+                     LibcurlPooledCloseSocketCallback);
+    curl_easy_setopt(curl_handle_, CURLOPT_CLOSESOCKETDATA, connection_pool_);
+  } else {
+    curl_easy_setopt(
+        curl_handle_, CURLOPT_CLOSESOCKETFUNCTION, LibcurlCloseSocketCallback);
+    curl_easy_setopt(curl_handle_, CURLOPT_CLOSESOCKETDATA, this);
+  }
 
   CHECK(HasProxy());
   bool is_direct = (GetCurrentProxy() == kNoProxy);
@@ -392,14 +436,19 @@ void LibcurlHttpFetcher::SetHeader(const string& header_name,
 }
 
 void LibcurlHttpFetcher::CurlPerformOnce() {
+  CurlSocketAction(CURL_SOCKET_TIMEOUT, 0);
+}
+
+void LibcurlHttpFetcher::CurlSocketAction(curl_socket_t fd, int ev_bitmask) {
   CHECK(transfer_in_progress_);
   int running_handles = 0;
   CURLMcode retcode = CURLM_CALL_MULTI_PERFORM;
 
-  // libcurl may request that we immediately call curl_multi_perform after it
-  // returns, so we do. libcurl promises that curl_multi_perform will not block.
+  // libcurl may request that we immediately call it again after it returns, so
+  // we do. libcurl promises that curl_multi_socket_action will not block.
   while (CURLM_CALL_MULTI_PERFORM == retcode) {
-    retcode = curl_multi_perform(curl_multi_handle_, &running_handles);
+    retcode = curl_multi_socket_action(
+        curl_multi_handle_, fd, ev_bitmask, &running_handles);
     if (terminate_requested_) {
       ForceTransferTermination();
       return;
@@ -414,10 +463,9 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
   }
 
   if (running_handles != 0 || transfer_paused_) {
-    // There's either more work to do or we are paused, so we just keep the
-    // file descriptors to watch up to date and exit, until we are done with the
-    // work and we are not paused.
-    SetupMessageLoopSources();
+    // There's either more work to do or we are paused. libcurl already updated
+    // the sockets to watch and its timer through the callbacks, so we wait
+    // until we are done with the work and we are not paused.
     return;
   }
 
@@ -428,6 +476,7 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
   if (http_response_code_) {
     LOG(INFO) << "HTTP response code: " << http_response_code_;
     no_network_retry_count_ = 0;
+    ReportConnectionSetUp();
   } else {
     LOG(ERROR) << "Unable to get http response code.";
   }
@@ -591,97 +640,81 @@ void LibcurlHttpFetcher::Unpause() {
   CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_CONT), CURLE_OK);
   // Since the transfer is in progress, we need to dispatch a CurlPerformOnce()
   // now to let the connection continue, otherwise it would be called by the
-  // TimeoutCallback but with a delay.
+  // libcurl timer but with a delay.
   CurlPerformOnce();
 }
 
-// This method sets up callbacks with the MessageLoop.
-void LibcurlHttpFetcher::SetupMessageLoopSources() {
-  fd_set fd_read;
-  fd_set fd_write;
-  fd_set fd_exc;
-
-  FD_ZERO(&fd_read);
-  FD_ZERO(&fd_write);
-  FD_ZERO(&fd_exc);
+// static
+int LibcurlHttpFetcher::LibcurlSocketCallback(CURL* /* easy */,
+                                              curl_socket_t s,
+                                              int what,
+                                              void* userp,
+                                              void* /* socketp */) {
+  static_cast<LibcurlHttpFetcher*>(userp)->WatchSocket(s, what);
+  return 0;
+}
 
-  int fd_max = 0;
+// static
+int LibcurlHttpFetcher::LibcurlTimerCallback(CURLM* /* multi */,
+                                             long timeout_ms,  // NOLINT
+                                             void* userp) {
+  static_cast<LibcurlHttpFetcher*>(userp)->SetTimeout(timeout_ms);
+  return 0;
+}
 
-  // Ask libcurl for the set of file descriptors we should track on its
-  // behalf.
-  CHECK_EQ(curl_multi_fdset(
-               curl_multi_handle_, &fd_read, &fd_write, &fd_exc, &fd_max),
-           CURLM_OK);
+void LibcurlHttpFetcher::WatchSocket(curl_socket_t fd, int what) {
+  bool must_track[2] = {
+      what == CURL_POLL_IN || what == CURL_POLL_INOUT,   // track 0 -- read
+      what == CURL_POLL_OUT || what == CURL_POLL_INOUT,  // track 1 -- write
+  };
+  MessageLoop::WatchMode watch_modes[2] = {
+      MessageLoop::WatchMode::kWatchRead,
+      MessageLoop::WatchMode::kWatchWrite,
+  };
+  int ev_bitmasks[2] = {CURL_CSELECT_IN, CURL_CSELECT_OUT};
 
-  // We should iterate through all file descriptors up to libcurl's fd_max or
-  // the highest one we're tracking, whichever is larger.
   for (size_t t = 0; t < arraysize(fd_task_maps_); ++t) {
-    if (!fd_task_maps_[t].empty())
-      fd_max = max(fd_max, fd_task_maps_[t].rbegin()->first);
-  }
-
-  // For each fd, if we're not tracking it, track it. If we are tracking it, but
-  // libcurl doesn't care about it anymore, stop tracking it. After this loop,
-  // there should be exactly as many tasks scheduled in fd_task_maps_[0|1] as
-  // there are read/write fds that we're tracking.
-  for (int fd = 0; fd <= fd_max; ++fd) {
-    // Note that fd_exc is unused in the current version of libcurl so is_exc
-    // should always be false.
-    bool is_exc = FD_ISSET(fd, &fd_exc) != 0;
-    bool must_track[2] = {
-        is_exc || (FD_ISSET(fd, &fd_read) != 0),  // track 0 -- read
-        is_exc || (FD_ISSET(fd, &fd_write) != 0)  // track 1 -- write
-    };
-    MessageLoop::WatchMode watch_modes[2] = {
-        MessageLoop::WatchMode::kWatchRead,
-        MessageLoop::WatchMode::kWatchWrite,
-    };
-
-    for (size_t t = 0; t < arraysize(fd_task_maps_); ++t) {
-      auto fd_task_it = fd_task_maps_[t].find(fd);
-      bool tracked = fd_task_it != fd_task_maps_[t].end();
-
-      if (!must_track[t]) {
-        // If we have an outstanding io_channel, remove it.
-        if (tracked) {
-          MessageLoop::current()->CancelTask(fd_task_it->second);
-          fd_task_maps_[t].erase(fd_task_it);
-        }
-        continue;
-      }
-
-      // If we are already tracking this fd, continue -- nothing to do.
-      if (tracked)
-        continue;
-
-      // Track a new fd.
-      fd_task_maps_[t][fd] = MessageLoop::current()->WatchFileDescriptor(
-          FROM_HERE,
-          fd,
-          watch_modes[t],
-          true,  // persistent
-          base::Bind(&LibcurlHttpFetcher::CurlPerformOnce,
-                     base::Unretained(this)));
-
-      static int io_counter = 0;
-      io_counter++;
-      if (io_counter % 50 == 0) {
-        LOG(INFO) << "io_counter = " << io_counter;
+    auto fd_task_it = fd_task_maps_[t].find(fd);
+    bool tracked = fd_task_it != fd_task_maps_[t].end();
+
+    if (!must_track[t]) {
+      // If we have an outstanding watch, remove it.
+      if (tracked) {
+        MessageLoop::current()->CancelTask(fd_task_it->second);
+        fd_task_maps_[t].erase(fd_task_it);
       }
+      continue;
     }
-  }
 
-  // Set up a timeout callback for libcurl.
-  if (timeout_id_ == MessageLoop::kTaskIdNull) {
-    VLOG(1) << "Setting up timeout source: " << idle_seconds_ << " seconds.";
-    timeout_id_ = MessageLoop::current()->PostDelayedTask(
+    // If we are already tracking this fd, continue -- nothing to do.
+    if (tracked)
+      continue;
+
+    // Track a new fd.
+    fd_task_maps_[t][fd] = MessageLoop::current()->WatchFileDescriptor(
         FROM_HERE,
-        base::Bind(&LibcurlHttpFetcher::TimeoutCallback,
-                   base::Unretained(this)),
-        TimeDelta::FromSeconds(idle_seconds_));
+        fd,
+        watch_modes[t],
+        true,  // persistent
+        base::Bind(&LibcurlHttpFetcher::CurlSocketAction,
+                   base::Unretained(this),
+                   fd,
+                   ev_bitmasks[t]));
   }
 }
 
+void LibcurlHttpFetcher::SetTimeout(long timeout_ms) {  // NOLINT
+  MessageLoop::current()->CancelTask(timeout_id_);
+  timeout_id_ = MessageLoop::kTaskIdNull;
+  // A negative timeout means that libcurl doesn't need to be called back.
+  if (timeout_ms < 0)
+    return;
+  timeout_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&LibcurlHttpFetcher::TimeoutCallback, base::Unretained(this)),
+      TimeDelta::FromMilliseconds(timeout_ms));
+}
+
 void LibcurlHttpFetcher::RetryTimeoutCallback() {
   retry_task_id_ = MessageLoop::kTaskIdNull;
   if (transfer_paused_) {
@@ -693,38 +726,15 @@ void LibcurlHttpFetcher::RetryTimeoutCallback() {
 }
 
 void LibcurlHttpFetcher::TimeoutCallback() {
-  // We always re-schedule the callback, even if we don't want to be called
-  // anymore. We will remove the event source separately if we don't want to
-  // be called back.
-  timeout_id_ = MessageLoop::current()->PostDelayedTask(
-      FROM_HERE,
-      base::Bind(&LibcurlHttpFetcher::TimeoutCallback, base::Unretained(this)),
-      TimeDelta::FromSeconds(idle_seconds_));
-
-  // CurlPerformOnce() may call CleanUp(), so we need to schedule our callback
-  // first, since it could be canceled by this call.
+  timeout_id_ = MessageLoop::kTaskIdNull;
   if (transfer_in_progress_)
-    CurlPerformOnce();
+    CurlSocketAction(CURL_SOCKET_TIMEOUT, 0);
 }
 
 void LibcurlHttpFetcher::CleanUp() {
   MessageLoop::current()->CancelTask(retry_task_id_);
   retry_task_id_ = MessageLoop::kTaskIdNull;
 
-  MessageLoop::current()->CancelTask(timeout_id_);
-  timeout_id_ = MessageLoop::kTaskIdNull;
-
-  for (size_t t = 0; t < arraysize(fd_task_maps_); ++t) {
-    for (const auto& fd_taks_pair : fd_task_maps_[t]) {
-      if (!MessageLoop::current()->CancelTask(fd_taks_pair.second)) {
-        LOG(WARNING) << "Error canceling the watch task " << fd_taks_pair.second
-                     << " for " << (t ? "writing" : "reading") << " the fd "
-                     << fd_taks_pair.first;
-      }
-    }
-    fd_task_maps_[t].clear();
-  }
-
   if (curl_http_headers_) {
     curl_slist_free_all(curl_http_headers_);
     curl_http_headers_ = nullptr;
@@ -737,10 +747,29 @@ void LibcurlHttpFetcher::CleanUp() {
     curl_easy_cleanup(curl_handle_);
     curl_handle_ = nullptr;
   }
+  if (connection_pool_) {
+    connection_pool_->RemoveFetcher(this);
+    connection_pool_ = nullptr;
+  }
   if (curl_multi_handle_) {
     CHECK_EQ(curl_multi_cleanup(curl_multi_handle_), CURLM_OK);
     curl_multi_handle_ = nullptr;
   }
+
+  // libcurl may update its timer and sockets while cleaning up the handles.
+  MessageLoop::current()->CancelTask(timeout_id_);
+  timeout_id_ = MessageLoop::kTaskIdNull;
+
+  for (size_t t = 0; t < arraysize(fd_task_maps_); ++t) {
+    for (const auto& fd_taks_pair : fd_task_maps_[t]) {
+      if (!MessageLoop::current()->CancelTask(fd_taks_pair.second)) {
+        LOG(WARNING) << "Error canceling the watch task " << fd_taks_pair.second
+                     << " for " << (t ? "writing" : "reading") << " the fd "
+                     << fd_taks_pair.first;
+      }
+    }
+    fd_task_maps_[t].clear();
+  }
   transfer_in_progress_ = false;
   transfer_paused_ = false;
   restart_transfer_on_unpause_ = false;
@@ -758,4 +787,27 @@ void LibcurlHttpFetcher::GetHttpResponseCode() {
   }
 }
 
+void LibcurlHttpFetcher::ReportConnectionSetUp() {
+  if (!connection_pool_ ||
+      base::StartsWith(url_, "file://", base::CompareCase::INSENSITIVE_ASCII)) {
+    return;
+  }
+  long num_connects = 0;  // NOLINT(runtime/int) - curl needs long.
+  double connect_time = 0;
+  double app_connect_time = 0;
+  if (curl_easy_getinfo(curl_handle_, CURLINFO_NUM_CONNECTS, &num_connects) !=
+          CURLE_OK ||
+      curl_easy_getinfo(curl_handle_, CURLINFO_CONNECT_TIME, &connect_time) !=
+          CURLE_OK ||
+      curl_easy_getinfo(
+          curl_handle_, CURLINFO_APPCONNECT_TIME, &app_connect_time) !=
+          CURLE_OK) {
+    return;
+  }
+  // The TLS handshake time is zero for plain HTTP connections.
+  connection_pool_->AddConnectionSetUp(
+      num_connects == 0,
+      TimeDelta::FromSecondsD(max(connect_time, app_connect_time)));
+}
+
 }  // namespace chromeos_update_engine
@@ -31,6 +31,7 @@
 #include "update_engine/certificate_checker.h"
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/http_fetcher.h"
+#include "update_engine/libcurl_connection_pool.h"
 
 // This is a concrete implementation of HttpFetcher that uses libcurl to do the
 // http work.
@@ -67,17 +68,6 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // Resume the transfer by calling curl_easy_pause(CURLPAUSE_CONT).
   void Unpause() override;
 
-  // Libcurl sometimes asks to be called back after some time while
-  // leaving that time unspecified. In that case, we pick a reasonable
-  // default of one second, but it can be overridden here. This is
-  // primarily useful for testing.
-  // From http://curl.haxx.se/libcurl/c/curl_multi_timeout.html:
-  //     if libcurl returns a -1 timeout here, it just means that libcurl
-  //     currently has no stored timeout value. You must not wait too long
-  //     (more than a few seconds perhaps) before you call
-  //     curl_multi_perform() again.
-  void set_idle_seconds(int seconds) override { idle_seconds_ = seconds; }
-
   // Sets the retry timeout. Useful for testing.
   void set_retry_seconds(int seconds) override { retry_seconds_ = seconds; }
 
@@ -111,6 +101,18 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // closing a socket created with the CURLOPT_OPENSOCKETFUNCTION callback.
   static int LibcurlCloseSocketCallback(void* clientp, curl_socket_t item);
 
+  // The CURLOPT_CLOSESOCKETFUNCTION callback function used when the connection
+  // is pooled in the LibcurlConnectionPool |clientp|.
+  static int LibcurlPooledCloseSocketCallback(void* clientp,
+                                              curl_socket_t item);
+
+  // Closes the socket |item| on behalf of libcurl.
+  static int CloseSocket(curl_socket_t item);
+
+  // Stops watching the socket |item| from the message loop, before it is
+  // closed.
+  void StopWatchingSocket(curl_socket_t item);
+
   // Callback for when proxy resolution has completed. This begins the
   // transfer.
   void ProxiesResolved();
@@ -118,6 +120,10 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // Asks libcurl for the http response code and stores it in the object.
   void GetHttpResponseCode();
 
+  // Asks libcurl how the transfer connected to the server and records it in
+  // the connection pool, if any.
+  void ReportConnectionSetUp();
+
   // Checks whether stored HTTP response is within the success range.
   inline bool IsHttpResponseSuccess() {
     return (http_response_code_ >= 200 && http_response_code_ < 300);
@@ -137,18 +143,34 @@ class LibcurlHttpFetcher : public HttpFetcher {
   void TimeoutCallback();
   void RetryTimeoutCallback();
 
-  // Calls into curl_multi_perform to let libcurl do its work. Returns after
-  // curl_multi_perform is finished, which may actually be after more than
-  // one call to curl_multi_perform. This method will set up the message
-  // loop with sources for future work that libcurl will do, if any, or complete
-  // the transfer and finish the action if no work left to do.
-  // This method will not block.
+  // Lets libcurl do the work that is due, like starting or resuming the
+  // transfer. This method will not block.
   void CurlPerformOnce();
 
-  // Sets up message loop sources as needed by libcurl. This is generally
-  // the file descriptor of the socket and a timer in case nothing happens
-  // on the fds.
-  void SetupMessageLoopSources();
+  // Calls into curl_multi_socket_action to let libcurl handle the events
+  // |ev_bitmask| of the socket |fd|, or its timeout when |fd| is
+  // CURL_SOCKET_TIMEOUT. libcurl updates the sockets to watch and its timer
+  // through the callbacks below while working, or the transfer is completed
+  // and the action finished if no work is left to do. This method will not
+  // block.
+  void CurlSocketAction(curl_socket_t fd, int ev_bitmask);
+
+  // libcurl's CURLMOPT_SOCKETFUNCTION and CURLMOPT_TIMERFUNCTION callback
+  // functions, called when the events to watch on a socket or the time until
+  // libcurl must be called back change.
+  static int LibcurlSocketCallback(
+      CURL* easy, curl_socket_t s, int what, void* userp, void* socketp);
+  static int LibcurlTimerCallback(CURLM* multi,
+                                  long timeout_ms,  // NOLINT(runtime/int)
+                                  void* userp);
+
+  // Watches the socket |fd| from the message loop for the CURL_POLL_* events
+  // |what|, or stops watching it for CURL_POLL_REMOVE.
+  void WatchSocket(curl_socket_t fd, int what);
+
+  // Calls libcurl back after |timeout_ms|, replacing the previous timeout. A
+  // negative |timeout_ms| only removes it.
+  void SetTimeout(long timeout_ms);  // NOLINT(runtime/int)
 
   // Callback called by libcurl when new data has arrived on the transfer
   size_t LibcurlWrite(void* ptr, size_t size, size_t nmemb);
@@ -191,6 +213,9 @@ class LibcurlHttpFetcher : public HttpFetcher {
   CURL* curl_handle_{nullptr};
   struct curl_slist* curl_http_headers_{nullptr};
 
+  // The pool sharing the connections of the current transfer, if any.
+  LibcurlConnectionPool* connection_pool_{nullptr};
+
   // The extra headers that will be sent on each request.
   std::map<std::string, std::string> extra_headers_;
 
@@ -200,8 +225,8 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // set appropriately.
   std::map<int, brillo::MessageLoop::TaskId> fd_task_maps_[2];
 
-  // The TaskId of the timer we're waiting on. kTaskIdNull if we are not waiting
-  // on it.
+  // The TaskId of the libcurl timer we're waiting on. kTaskIdNull if we are not
+  // waiting on it.
   brillo::MessageLoop::TaskId timeout_id_{brillo::MessageLoop::kTaskIdNull};
 
   bool transfer_in_progress_{false};
@@ -246,9 +271,6 @@ class LibcurlHttpFetcher : public HttpFetcher {
   int no_network_retry_count_{0};
   int no_network_max_retries_{0};
 
-  // Seconds to wait before asking libcurl to "perform".
-  int idle_seconds_{1};
-
   // If true, we are currently performing a write callback on the delegate.
   bool in_write_callback_{false};
 
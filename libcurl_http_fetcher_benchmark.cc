@@ -0,0 +1,316 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Benchmark of the downloads of LibcurlHttpFetcher from the test_http_server,
+// which must be next to the benchmark binary, compared with the
+// curl_multi_perform() polling loop used before. Besides the throughput, it
+// reports the wakeups of the process, counted as the times it blocked waiting
+// for events.
+
+#include <inttypes.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <base/bind.h>
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/message_loop/message_loop.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/stringprintf.h>
+#include <benchmark/benchmark.h>
+#include <brillo/message_loops/base_message_loop.h>
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/process.h>
+#include <curl/curl.h>
+
+#include "update_engine/common/fake_hardware.h"
+#include "update_engine/common/http_fetcher.h"
+#include "update_engine/common/proxy_resolver.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/libcurl_http_fetcher.h"
+
+using base::TimeDelta;
+using brillo::MessageLoop;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const char kListeningMsgPrefix[] = "listening on port ";
+
+// Runs the test_http_server in the background.
+class TestHttpServer {
+ public:
+  bool Start() {
+    base::FilePath exe_path;
+    TEST_AND_RETURN_FALSE(
+        base::ReadSymbolicLink(base::FilePath("/proc/self/exe"), &exe_path));
+    server_.AddArg(exe_path.DirName().Append("test_http_server").value());
+    server_.RedirectUsingPipe(STDOUT_FILENO, false);
+    TEST_AND_RETURN_FALSE(server_.Start());
+
+    // Wait for the server to print the port it is listening on.
+    int fd = server_.GetPipe(STDOUT_FILENO);
+    string line;
+    char c;
+    while (read(fd, &c, 1) == 1 && c != '\n')
+      line.push_back(c);
+    TEST_AND_RETURN_FALSE(line.compare(0,
+                                       strlen(kListeningMsgPrefix),
+                                       kListeningMsgPrefix) == 0);
+    return base::StringToUint(line.substr(strlen(kListeningMsgPrefix)),
+                              &port_);
+  }
+
+  string DownloadUrl(int64_t size) const {
+    return base::StringPrintf(
+        "http://127.0.0.1:%u/download/%" PRId64, port_, size);
+  }
+
+ private:
+  brillo::ProcessImpl server_;
+  unsigned int port_{0};
+};
+
+// The message loop and the server shared by all the benchmarks.
+class BenchmarkEnvironment {
+ public:
+  BenchmarkEnvironment() {
+    loop_.SetAsCurrent();
+    CHECK(server_.Start());
+  }
+
+  const TestHttpServer& server() const { return server_; }
+
+ private:
+  base::MessageLoopForIO base_loop_;
+  brillo::BaseMessageLoop loop_{&base_loop_};
+  TestHttpServer server_;
+};
+
+BenchmarkEnvironment* GetEnvironment() {
+  static BenchmarkEnvironment* environment = new BenchmarkEnvironment();
+  return environment;
+}
+
+// Returns the number of times the process blocked waiting for an event.
+int64_t VoluntaryContextSwitches() {
+  struct rusage usage;
+  CHECK_EQ(getrusage(RUSAGE_SELF, &usage), 0);
+  return usage.ru_nvcsw;
+}
+
+// A download with LibcurlHttpFetcher. Breaks the message loop when done.
+class FetcherDownload : public HttpFetcherDelegate {
+ public:
+  explicit FetcherDownload(const string& url) : url_(url) {
+    hardware_.SetIsOfficialBuild(false);
+    fetcher_.reset(new LibcurlHttpFetcher(&proxy_resolver_, &hardware_));
+    fetcher_->set_delegate(this);
+  }
+
+  void Start() { fetcher_->BeginTransfer(url_); }
+
+  int64_t bytes_received() const { return bytes_received_; }
+
+  // HttpFetcherDelegate overrides.
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    bytes_received_ += length;
+    return true;
+  }
+
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    MessageLoop::current()->BreakLoop();
+  }
+
+  void TransferTerminated(HttpFetcher* fetcher) override {
+    MessageLoop::current()->BreakLoop();
+  }
+
+ private:
+  string url_;
+  FakeHardware hardware_;
+  DirectProxyResolver proxy_resolver_;
+  std::unique_ptr<LibcurlHttpFetcher> fetcher_;
+  int64_t bytes_received_{0};
+};
+
+// The previous way LibcurlHttpFetcher drove libcurl, reduced to a plain
+// download: curl_multi_perform() is called whenever one of the sockets returned
+// by curl_multi_fdset() is ready, and every second otherwise. Breaks the
+// message loop when done.
+class PollingDownload {
+ public:
+  explicit PollingDownload(const string& url) {
+    curl_multi_handle_ = curl_multi_init();
+    curl_handle_ = curl_easy_init();
+    curl_easy_setopt(curl_handle_, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl_handle_, CURLOPT_WRITEFUNCTION, StaticLibcurlWrite);
+    curl_easy_setopt(curl_handle_, CURLOPT_WRITEDATA, this);
+    curl_multi_add_handle(curl_multi_handle_, curl_handle_);
+  }
+
+  ~PollingDownload() {
+    CancelSources();
+    curl_multi_remove_handle(curl_multi_handle_, curl_handle_);
+    curl_easy_cleanup(curl_handle_);
+    curl_multi_cleanup(curl_multi_handle_);
+  }
+
+  void Start() { CurlPerformOnce(); }
+
+  int64_t bytes_received() const { return bytes_received_; }
+
+ private:
+  static size_t StaticLibcurlWrite(void* ptr,
+                                   size_t size,
+                                   size_t nmemb,
+                                   void* stream) {
+    static_cast<PollingDownload*>(stream)->bytes_received_ += size * nmemb;
+    return size * nmemb;
+  }
+
+  void CurlPerformOnce() {
+    int running_handles = 0;
+    while (curl_multi_perform(curl_multi_handle_, &running_handles) ==
+           CURLM_CALL_MULTI_PERFORM) {
+    }
+    if (running_handles == 0) {
+      CancelSources();
+      MessageLoop::current()->BreakLoop();
+      return;
+    }
+    SetupMessageLoopSources();
+  }
+
+  void SetupMessageLoopSources() {
+    fd_set fd_read;
+    fd_set fd_write;
+    fd_set fd_exc;
+    FD_ZERO(&fd_read);
+    FD_ZERO(&fd_write);
+    FD_ZERO(&fd_exc);
+    int fd_max = 0;
+    curl_multi_fdset(curl_multi_handle_, &fd_read, &fd_write, &fd_exc, &fd_max);
+    for (const auto& fd_task_map : fd_task_maps_) {
+      if (!fd_task_map.empty())
+        fd_max = std::max(fd_max, fd_task_map.rbegin()->first);
+    }
+
+    MessageLoop::WatchMode watch_modes[2] = {
+        MessageLoop::WatchMode::kWatchRead,
+        MessageLoop::WatchMode::kWatchWrite,
+    };
+    for (int fd = 0; fd <= fd_max; ++fd) {
+      bool must_track[2] = {FD_ISSET(fd, &fd_read) != 0,
+                            FD_ISSET(fd, &fd_write) != 0};
+      for (size_t t = 0; t < arraysize(fd_task_maps_); ++t) {
+        auto fd_task_it = fd_task_maps_[t].find(fd);
+        bool tracked = fd_task_it != fd_task_maps_[t].end();
+        if (!must_track[t] && tracked) {
+          MessageLoop::current()->CancelTask(fd_task_it->second);
+          fd_task_maps_[t].erase(fd_task_it);
+        } else if (must_track[t] && !tracked) {
+          fd_task_maps_[t][fd] = MessageLoop::current()->WatchFileDescriptor(
+              FROM_HERE,
+              fd,
+              watch_modes[t],
+              true,  // persistent
+              base::Bind(&PollingDownload::CurlPerformOnce,
+                         base::Unretained(this)));
+        }
+      }
+    }
+
+    if (timeout_id_ == MessageLoop::kTaskIdNull) {
+      timeout_id_ = MessageLoop::current()->PostDelayedTask(
+          FROM_HERE,
+          base::Bind(&PollingDownload::TimeoutCallback, base::Unretained(this)),
+          TimeDelta::FromSeconds(1));
+    }
+  }
+
+  void TimeoutCallback() {
+    timeout_id_ = MessageLoop::kTaskIdNull;
+    CurlPerformOnce();
+  }
+
+  void CancelSources() {
+    MessageLoop::current()->CancelTask(timeout_id_);
+    timeout_id_ = MessageLoop::kTaskIdNull;
+    for (auto& fd_task_map : fd_task_maps_) {
+      for (const auto& fd_task_pair : fd_task_map)
+        MessageLoop::current()->CancelTask(fd_task_pair.second);
+      fd_task_map.clear();
+    }
+  }
+
+  CURLM* curl_multi_handle_{nullptr};
+  CURL* curl_handle_{nullptr};
+  std::map<int, MessageLoop::TaskId> fd_task_maps_[2];
+  MessageLoop::TaskId timeout_id_{MessageLoop::kTaskIdNull};
+  int64_t bytes_received_{0};
+};
+
+template <typename Download>
+void BM_Download(benchmark::State& state) {
+  BenchmarkEnvironment* environment = GetEnvironment();
+  string url = environment->server().DownloadUrl(state.range(0));
+  int64_t wakeups = 0;
+  for (auto _ : state) {
+    int64_t context_switches = VoluntaryContextSwitches();
+    Download download(url);
+    MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&Download::Start, base::Unretained(&download)));
+    MessageLoop::current()->Run();
+    wakeups += VoluntaryContextSwitches() - context_switches;
+    if (download.bytes_received() != state.range(0)) {
+      state.SkipWithError("The download failed.");
+      return;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+  state.counters["wakeups"] =
+      benchmark::Counter(wakeups, benchmark::Counter::kIsRate);
+  state.counters["wakeups_per_mib"] = benchmark::Counter(
+      static_cast<double>(wakeups) * 1024 * 1024 /
+      (state.iterations() * state.range(0)));
+}
+
+BENCHMARK_TEMPLATE(BM_Download, FetcherDownload)
+    ->Range(64 * 1024, 64 * 1024 * 1024)
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Download, PollingDownload)
+    ->Range(64 * 1024, 64 * 1024 * 1024)
+    ->UseRealTime();
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+BENCHMARK_MAIN();
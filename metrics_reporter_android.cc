@@ -69,6 +69,13 @@ constexpr char
     kMetricsUpdateEngineSuccessfulUpdateDownloadOverheadPercentage[] =
         "ota_update_engine_successful_update_download_overhead_percentage";
 
+constexpr char kMetricsUpdateEngineConnectionNewConnections[] =
+    "ota_update_engine_connection_new_connections";
+constexpr char kMetricsUpdateEngineConnectionReusedPercentage[] =
+    "ota_update_engine_connection_reused_percentage";
+constexpr char kMetricsUpdateEngineConnectionSetupTimeMs[] =
+    "ota_update_engine_connection_setup_time_ms";
+
 std::unique_ptr<MetricsReporterInterface> CreateMetricsReporter() {
   return std::make_unique<MetricsReporterAndroid>();
 }
@@ -150,6 +157,23 @@ void MetricsReporterAndroid::ReportSuccessfulUpdateMetrics(
                reboot_count);
 }
 
+void MetricsReporterAndroid::ReportConnectionSetupMetrics(
+    int new_connections,
+    int reused_connections,
+    base::TimeDelta average_setup_time) {
+  LogHistogram(metrics::kMetricsUpdateEngineConnectionNewConnections,
+               new_connections);
+  int total_connections = new_connections + reused_connections;
+  if (total_connections > 0) {
+    LogHistogram(metrics::kMetricsUpdateEngineConnectionReusedPercentage,
+                 reused_connections * 100 / total_connections);
+  }
+  if (new_connections > 0) {
+    LogHistogram(metrics::kMetricsUpdateEngineConnectionSetupTimeMs,
+                 average_setup_time.InMilliseconds());
+  }
+}
+
 void MetricsReporterAndroid::ReportAbnormallyTerminatedUpdateAttemptMetrics() {
   int attempt_result =
       static_cast<int>(metrics::AttemptResult::kAbnormalTermination);
@@ -79,6 +79,11 @@ class MetricsReporterAndroid : public MetricsReporterInterface {
   void ReportCertificateCheckMetrics(ServerToCheck server_to_check,
                                      CertificateCheckResult result) override {}
 
+  void ReportConnectionSetupMetrics(
+      int new_connections,
+      int reused_connections,
+      base::TimeDelta average_setup_time) override;
+
   void ReportFailedUpdateCount(int target_attempt) override {}
 
   void ReportTimeToReboot(int time_to_reboot_minutes) override {}
@@ -192,6 +192,19 @@ class MetricsReporterInterface {
   virtual void ReportCertificateCheckMetrics(ServerToCheck server_to_check,
                                              CertificateCheckResult result) = 0;
 
+  // Helper function to report how the transfers of an update attempt
+  // connected to their servers: the number of |new_connections|, the number of
+  // |reused_connections| and the |average_setup_time| of the new ones. The
+  // following metrics are reported:
+  //
+  //  |kMetricConnectionNewConnections|
+  //  |kMetricConnectionReusedPercentage|
+  //  |kMetricConnectionSetupTimeMs| (only if there are new connections)
+  virtual void ReportConnectionSetupMetrics(
+      int new_connections,
+      int reused_connections,
+      base::TimeDelta average_setup_time) = 0;
+
   // Helper function to report the number failed update attempts. The following
   // metrics are reported:
   //
@@ -122,6 +122,14 @@ const char kMetricCertificateCheckUpdateCheck[] =
 const char kMetricCertificateCheckDownload[] =
     "UpdateEngine.CertificateCheck.Download";
 
+// UpdateEngine.Connection.* metrics.
+const char kMetricConnectionNewConnections[] =
+    "UpdateEngine.Connection.NewConnections";
+const char kMetricConnectionReusedPercentage[] =
+    "UpdateEngine.Connection.ReusedPercentage";
+const char kMetricConnectionSetupTimeMs[] =
+    "UpdateEngine.Connection.SetupTimeMs";
+
 // UpdateEngine.KernelKey.* metrics.
 const char kMetricKernelMinVersion[] = "UpdateEngine.KernelKey.MinVersion";
 const char kMetricKernelMaxRollforwardVersion[] =
@@ -559,6 +567,42 @@ void MetricsReporterOmaha::ReportCertificateCheckMetrics(
       static_cast<int>(CertificateCheckResult::kNumConstants));
 }
 
+void MetricsReporterOmaha::ReportConnectionSetupMetrics(
+    int new_connections,
+    int reused_connections,
+    base::TimeDelta average_setup_time) {
+  string metric = metrics::kMetricConnectionNewConnections;
+  LOG(INFO) << "Uploading " << new_connections << " for metric " << metric;
+  metrics_lib_->SendToUMA(metric,
+                          new_connections,
+                          0,     // min: 0 connections
+                          1000,  // max: 1000 connections
+                          50);   // num_buckets
+
+  int total_connections = new_connections + reused_connections;
+  if (total_connections > 0) {
+    metric = metrics::kMetricConnectionReusedPercentage;
+    int value = reused_connections * 100 / total_connections;
+    LOG(INFO) << "Uploading " << value << "% for metric " << metric;
+    metrics_lib_->SendToUMA(metric,
+                            value,
+                            0,    // min: 0%
+                            100,  // max: 100%
+                            50);  // num_buckets
+  }
+
+  if (new_connections == 0)
+    return;
+  metric = metrics::kMetricConnectionSetupTimeMs;
+  metrics_lib_->SendToUMA(metric,
+                          average_setup_time.InMilliseconds(),
+                          0,          // min: 0 ms
+                          30 * 1000,  // max: 30 seconds
+                          kNumDefaultUmaBuckets);
+  LOG(INFO) << "Uploading " << utils::FormatTimeDelta(average_setup_time)
+            << " for metric " << metric;
+}
+
 void MetricsReporterOmaha::ReportFailedUpdateCount(int target_attempt) {
   string metric = metrics::kMetricFailedUpdateCount;
   metrics_lib_->SendToUMA(metric,
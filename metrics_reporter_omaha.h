@@ -90,6 +90,11 @@ extern const char kMetricEnterpriseRollbackSuccess[];
 extern const char kMetricCertificateCheckUpdateCheck[];
 extern const char kMetricCertificateCheckDownload[];
 
+// UpdateEngine.Connection.* metrics.
+extern const char kMetricConnectionNewConnections[];
+extern const char kMetricConnectionReusedPercentage[];
+extern const char kMetricConnectionSetupTimeMs[];
+
 // UpdateEngine.KernelKey.* metrics.
 extern const char kMetricKernelMinVersion[];
 extern const char kMetricKernelMaxRollforwardVersion[];
@@ -156,6 +161,11 @@ class MetricsReporterOmaha : public MetricsReporterInterface {
   void ReportCertificateCheckMetrics(ServerToCheck server_to_check,
                                      CertificateCheckResult result) override;
 
+  void ReportConnectionSetupMetrics(
+      int new_connections,
+      int reused_connections,
+      base::TimeDelta average_setup_time) override;
+
   void ReportFailedUpdateCount(int target_attempt) override;
 
   void ReportTimeToReboot(int time_to_reboot_minutes) override;
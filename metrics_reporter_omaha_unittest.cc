@@ -445,6 +445,35 @@ TEST_F(MetricsReporterOmahaTest, ReportCertificateCheckMetrics) {
   reporter_.ReportCertificateCheckMetrics(server_to_check, result);
 }
 
+TEST_F(MetricsReporterOmahaTest, ReportConnectionSetupMetrics) {
+  EXPECT_CALL(*mock_metrics_lib_,
+              SendToUMA(metrics::kMetricConnectionNewConnections, 2, _, _, _))
+      .Times(1);
+  EXPECT_CALL(
+      *mock_metrics_lib_,
+      SendToUMA(metrics::kMetricConnectionReusedPercentage, 75, _, _, _))
+      .Times(1);
+  EXPECT_CALL(*mock_metrics_lib_,
+              SendToUMA(metrics::kMetricConnectionSetupTimeMs, 250, _, _, _))
+      .Times(1);
+  reporter_.ReportConnectionSetupMetrics(
+      2, 6, base::TimeDelta::FromMilliseconds(250));
+}
+
+TEST_F(MetricsReporterOmahaTest, ReportConnectionSetupMetricsAllReused) {
+  EXPECT_CALL(*mock_metrics_lib_,
+              SendToUMA(metrics::kMetricConnectionNewConnections, 0, _, _, _))
+      .Times(1);
+  EXPECT_CALL(
+      *mock_metrics_lib_,
+      SendToUMA(metrics::kMetricConnectionReusedPercentage, 100, _, _, _))
+      .Times(1);
+  EXPECT_CALL(*mock_metrics_lib_,
+              SendToUMA(metrics::kMetricConnectionSetupTimeMs, _, _, _, _))
+      .Times(0);
+  reporter_.ReportConnectionSetupMetrics(0, 3, base::TimeDelta());
+}
+
 TEST_F(MetricsReporterOmahaTest, ReportFailedUpdateCount) {
   int target_attempt = 3;
   EXPECT_CALL(
@@ -77,6 +77,11 @@ class MockMetricsReporter : public MetricsReporterInterface {
                void(ServerToCheck server_to_check,
                     CertificateCheckResult result));
 
+  MOCK_METHOD3(ReportConnectionSetupMetrics,
+               void(int new_connections,
+                    int reused_connections,
+                    base::TimeDelta average_setup_time));
+
   MOCK_METHOD1(ReportFailedUpdateCount, void(int target_attempt));
 
   MOCK_METHOD1(ReportTimeToReboot, void(int time_to_reboot_minutes));
@@ -0,0 +1,77 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/apply_pipeline.h"
+
+#include <utility>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+void ApplyPipeline::Entry::Run() {
+  bool result = job_->Run();
+  // The owner thread may destroy this Entry as soon as |done_| is set, so no
+  // member can be accessed after the lock is released.
+  base::AutoLock auto_lock(pipeline_->lock_);
+  result_ = result;
+  done_ = true;
+  pipeline_->job_done_.Broadcast();
+}
+
+ApplyPipeline::ApplyPipeline(size_t num_threads) {
+  if (num_threads > 0) {
+    thread_pool_.reset(
+        new base::DelegateSimpleThreadPool("apply-pipeline", num_threads));
+    thread_pool_->Start();
+  }
+}
+
+ApplyPipeline::~ApplyPipeline() {
+  // JoinAll() runs all the pending work before stopping the threads.
+  if (thread_pool_)
+    thread_pool_->JoinAll();
+}
+
+void ApplyPipeline::Submit(std::unique_ptr<Job> job) {
+  entries_.emplace_back(new Entry(this, std::move(job)));
+  if (thread_pool_)
+    thread_pool_->AddWork(entries_.back().get());
+  else
+    entries_.back()->Run();
+}
+
+bool ApplyPipeline::IsFrontDone() {
+  if (entries_.empty())
+    return false;
+  base::AutoLock auto_lock(lock_);
+  return entries_.front()->done_;
+}
+
+std::unique_ptr<ApplyPipeline::Job> ApplyPipeline::PopFront(bool* result) {
+  CHECK(!entries_.empty());
+  std::unique_ptr<Entry> entry = std::move(entries_.front());
+  entries_.pop_front();
+  {
+    base::AutoLock auto_lock(lock_);
+    while (!entry->done_)
+      job_done_.Wait();
+    *result = entry->result_;
+  }
+  return std::move(entry->job_);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,111 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_APPLY_PIPELINE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_APPLY_PIPELINE_H_
+
+#include <deque>
+#include <memory>
+#include <utility>
+
+#include <base/macros.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+#include <base/threading/simple_thread.h>
+
+namespace chromeos_update_engine {
+
+// An ApplyPipeline runs jobs on a pool of worker threads while handing them
+// back to the owner thread in the same order they were submitted. This allows
+// the CPU-bound part of several install operations to run concurrently while
+// the results are still committed to disk in manifest order.
+//
+// All the methods of this class must be called from the same thread.
+class ApplyPipeline {
+ public:
+  class Job {
+   public:
+    virtual ~Job() = default;
+
+    // Runs the job on a worker thread. Implementations must only access their
+    // own data since several jobs run at the same time. Returns whether the
+    // job succeeded.
+    virtual bool Run() = 0;
+  };
+
+  // Creates a pipeline with |num_threads| worker threads. If |num_threads| is
+  // 0 no thread is created and the jobs run synchronously in Submit().
+  explicit ApplyPipeline(size_t num_threads);
+
+  // Waits for all the submitted jobs to finish running.
+  ~ApplyPipeline();
+
+  // Queues |job| to run on the next available worker thread.
+  void Submit(std::unique_ptr<Job> job);
+
+  // Returns whether the oldest job in the pipeline finished running. Returns
+  // false if the pipeline is empty.
+  bool IsFrontDone();
+
+  // Removes the oldest job from the pipeline, waiting for it to finish running
+  // if needed. Stores the value returned by the job's Run() in |result|. The
+  // pipeline must not be empty.
+  std::unique_ptr<Job> PopFront(bool* result);
+
+  // The number of jobs submitted and not yet removed with PopFront().
+  size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+
+ private:
+  // A submitted job and its completion state. The |done| and |result| members
+  // are protected by the pipeline's |lock_|.
+  class Entry : public base::DelegateSimpleThread::Delegate {
+   public:
+    Entry(ApplyPipeline* pipeline, std::unique_ptr<Job> job)
+        : pipeline_(pipeline), job_(std::move(job)) {}
+    ~Entry() override = default;
+
+    // Overrides DelegateSimpleThread::Delegate.
+    void Run() override;
+
+   private:
+    friend class ApplyPipeline;
+
+    ApplyPipeline* pipeline_;
+    std::unique_ptr<Job> job_;
+    bool done_{false};
+    bool result_{false};
+
+    DISALLOW_COPY_AND_ASSIGN(Entry);
+  };
+
+  // Protects the completion state of all the |entries_|.
+  base::Lock lock_;
+  // Signaled every time a job finishes running.
+  base::ConditionVariable job_done_{&lock_};
+
+  // The submitted jobs in submission order.
+  std::deque<std::unique_ptr<Entry>> entries_;
+
+  // The worker threads, or nullptr when running the jobs synchronously.
+  std::unique_ptr<base::DelegateSimpleThreadPool> thread_pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(ApplyPipeline);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_APPLY_PIPELINE_H_
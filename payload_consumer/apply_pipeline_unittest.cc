@@ -0,0 +1,106 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/apply_pipeline.h"
+
+#include <unistd.h>
+
+#include <memory>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// A job that sleeps for a while and returns a fixed result. The sleep is
+// shorter for the jobs submitted later, so they tend to finish out of order.
+class FakeJob : public ApplyPipeline::Job {
+ public:
+  FakeJob(size_t index, useconds_t sleep_us, bool result)
+      : index_(index), sleep_us_(sleep_us), result_(result) {}
+
+  bool Run() override {
+    usleep(sleep_us_);
+    ran_ = true;
+    return result_;
+  }
+
+  size_t index() const { return index_; }
+  bool ran() const { return ran_; }
+
+ private:
+  size_t index_;
+  useconds_t sleep_us_;
+  bool result_;
+  bool ran_{false};
+};
+
+const size_t kNumJobs = 20;
+
+}  // namespace
+
+class ApplyPipelineTest : public ::testing::Test {
+ protected:
+  // Submits |kNumJobs| jobs to |pipeline|. The jobs at an index multiple of 3
+  // fail.
+  void SubmitJobs(ApplyPipeline* pipeline) {
+    for (size_t i = 0; i < kNumJobs; i++) {
+      pipeline->Submit(
+          std::make_unique<FakeJob>(i, (kNumJobs - i) * 500, i % 3 != 0));
+    }
+  }
+
+  // Pops all the jobs from |pipeline| and checks they come in order with the
+  // right result.
+  void ExpectJobsInOrder(ApplyPipeline* pipeline) {
+    for (size_t i = 0; i < kNumJobs; i++) {
+      ASSERT_FALSE(pipeline->empty());
+      bool result;
+      std::unique_ptr<ApplyPipeline::Job> job = pipeline->PopFront(&result);
+      FakeJob* fake_job = static_cast<FakeJob*>(job.get());
+      EXPECT_EQ(i, fake_job->index());
+      EXPECT_TRUE(fake_job->ran());
+      EXPECT_EQ(i % 3 != 0, result);
+    }
+    EXPECT_TRUE(pipeline->empty());
+  }
+};
+
+TEST_F(ApplyPipelineTest, SynchronousTest) {
+  ApplyPipeline pipeline(0);
+  EXPECT_FALSE(pipeline.IsFrontDone());
+  SubmitJobs(&pipeline);
+  EXPECT_EQ(kNumJobs, pipeline.size());
+  // Without worker threads the jobs run while being submitted.
+  EXPECT_TRUE(pipeline.IsFrontDone());
+  ExpectJobsInOrder(&pipeline);
+}
+
+TEST_F(ApplyPipelineTest, ThreadedInOrderTest) {
+  ApplyPipeline pipeline(4);
+  SubmitJobs(&pipeline);
+  EXPECT_EQ(kNumJobs, pipeline.size());
+  ExpectJobsInOrder(&pipeline);
+}
+
+TEST_F(ApplyPipelineTest, DestroyWithPendingJobsTest) {
+  // Destroying the pipeline must wait for the jobs still running.
+  ApplyPipeline pipeline(2);
+  SubmitJobs(&pipeline);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,375 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/block_cache_file_descriptor.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The maximum number of bytes read from the underlying file descriptor at once
+// on a cache miss.
+const size_t kMaxReadSize = 1024 * 1024;  // 1 MiB
+
+}  // namespace
+
+const uint32_t BlockCacheFileDescriptor::kNoUse =
+    std::numeric_limits<uint32_t>::max();
+
+ssize_t BlockCacheFileDescriptor::Read(void* buf, size_t count) {
+  if (!schedule_finalized_)
+    FinalizeSchedule();
+  uint8_t* bytes = static_cast<uint8_t*>(buf);
+  size_t bytes_read = 0;
+  while (bytes_read < count) {
+    uint64_t block = offset_ / block_size_;
+    auto it = entries_.find(block);
+    if (it != entries_.end()) {
+      size_t block_offset = offset_ % block_size_;
+      size_t length = std::min(count - bytes_read, block_size_ - block_offset);
+      memcpy(bytes + bytes_read,
+             cache_data_.data() + it->second.slot * block_size_ + block_offset,
+             length);
+      // Each cached block is copied on its own, so this counts one hit per
+      // block as |misses_| does.
+      hits_++;
+      bytes_read += length;
+      offset_ += length;
+      continue;
+    }
+    // Read all the following blocks of the request not cached at once.
+    uint64_t request_end_block =
+        utils::DivRoundUp(offset_ + count - bytes_read, block_size_);
+    uint64_t end_block = block + 1;
+    while (end_block < request_end_block &&
+           (end_block - block) * block_size_ < kMaxReadSize &&
+           entries_.find(end_block) == entries_.end()) {
+      end_block++;
+    }
+    ssize_t rc =
+        ReadBlocks(block, end_block, bytes + bytes_read, count - bytes_read);
+    if (rc <= 0)
+      return bytes_read > 0 ? bytes_read : rc;
+    bytes_read += rc;
+  }
+  return bytes_read;
+}
+
+ssize_t BlockCacheFileDescriptor::ReadBlocks(uint64_t first_block,
+                                             uint64_t end_block,
+                                             uint8_t* buf,
+                                             size_t count) {
+  off64_t start = first_block * block_size_;
+  size_t length = (end_block - first_block) * block_size_;
+  read_buffer_.resize(length);
+  if (fd_->Seek(start, SEEK_SET) != start)
+    return -1;
+  size_t bytes_read = 0;
+  while (bytes_read < length) {
+    ssize_t rc = fd_->Read(read_buffer_.data() + bytes_read,
+                           length - bytes_read);
+    if (rc < 0 && bytes_read == 0)
+      return -1;
+    // Stop at the end of the file, or at an error after reading some data,
+    // which will be reported by the next read.
+    if (rc <= 0)
+      break;
+    bytes_read += rc;
+  }
+  // Only count the blocks actually read, not the ones past the end of the file.
+  misses_ += utils::DivRoundUp(bytes_read, block_size_);
+
+  for (uint64_t block = first_block;
+       (block - first_block + 1) * block_size_ <= bytes_read;
+       block++) {
+    Insert(block, read_buffer_.data() + (block - first_block) * block_size_);
+  }
+
+  size_t skip = offset_ - start;
+  if (bytes_read <= skip)
+    return 0;
+  size_t bytes_copied = std::min(count, bytes_read - skip);
+  memcpy(buf, read_buffer_.data() + skip, bytes_copied);
+  offset_ += bytes_copied;
+  return bytes_copied;
+}
+
+bool BlockCacheFileDescriptor::ReadRanges(const std::vector<Range>& ranges,
+                                          void* buf) {
+  if (!schedule_finalized_)
+    FinalizeSchedule();
+  // The cached blocks are copied right away, and the blocks not cached in all
+  // the |ranges| are read from |fd_| with a single ReadRanges() call so it can
+  // batch them.
+  struct Copy {
+    uint8_t* dest;
+    size_t buffer_offset;
+    size_t length;
+  };
+  std::vector<Range> miss_ranges;
+  std::vector<Copy> copies;
+  size_t miss_bytes = 0;
+  uint8_t* bytes = static_cast<uint8_t*>(buf);
+  for (const Range& range : ranges) {
+    off64_t offset = range.offset;
+    off64_t end = range.offset + range.length;
+    while (offset < end) {
+      uint64_t block = offset / block_size_;
+      size_t block_offset = offset % block_size_;
+      size_t length =
+          std::min<off64_t>(end - offset, block_size_ - block_offset);
+      auto it = entries_.find(block);
+      if (it != entries_.end()) {
+        memcpy(bytes,
+               cache_data_.data() + it->second.slot * block_size_ +
+                   block_offset,
+               length);
+        hits_++;
+      } else {
+        // Whole blocks are read so they can be added to the cache.
+        off64_t block_start = block * block_size_;
+        if (miss_ranges.empty() ||
+            miss_ranges.back().offset +
+                    static_cast<off64_t>(miss_ranges.back().length) !=
+                block_start) {
+          miss_ranges.push_back({block_start, 0});
+        }
+        miss_ranges.back().length += block_size_;
+        size_t buffer_offset = miss_bytes + block_offset;
+        if (!copies.empty() &&
+            copies.back().dest + copies.back().length == bytes &&
+            copies.back().buffer_offset + copies.back().length ==
+                buffer_offset) {
+          copies.back().length += length;
+        } else {
+          copies.push_back({bytes, buffer_offset, length});
+        }
+        miss_bytes += block_size_;
+      }
+      bytes += length;
+      offset += length;
+    }
+  }
+  if (miss_ranges.empty())
+    return true;
+
+  read_buffer_.resize(miss_bytes);
+  if (!fd_->ReadRanges(miss_ranges, read_buffer_.data()))
+    return false;
+  misses_ += miss_bytes / block_size_;
+  const uint8_t* block_data = read_buffer_.data();
+  for (const Range& miss_range : miss_ranges) {
+    for (uint64_t block = miss_range.offset / block_size_;
+         block < (miss_range.offset + miss_range.length) / block_size_;
+         block++) {
+      Insert(block, block_data);
+      block_data += block_size_;
+    }
+  }
+  for (const Copy& copy : copies)
+    memcpy(copy.dest, read_buffer_.data() + copy.buffer_offset, copy.length);
+  return true;
+}
+
+bool BlockCacheFileDescriptor::WriteRanges(const std::vector<Range>& ranges,
+                                           const void* buf) {
+  for (const Range& range : ranges)
+    Invalidate(range.offset, range.length);
+  return fd_->WriteRanges(ranges, buf);
+}
+
+ssize_t BlockCacheFileDescriptor::Write(const void* buf, size_t count) {
+  Invalidate(offset_, count);
+  if (fd_->Seek(offset_, SEEK_SET) != offset_)
+    return -1;
+  ssize_t rc = fd_->Write(buf, count);
+  if (rc > 0)
+    offset_ += rc;
+  return rc;
+}
+
+off64_t BlockCacheFileDescriptor::Seek(off64_t offset, int whence) {
+  off64_t next_offset;
+  switch (whence) {
+    case SEEK_SET:
+      next_offset = offset;
+      break;
+    case SEEK_CUR:
+      next_offset = offset_ + offset;
+      break;
+    default:
+      next_offset = fd_->Seek(offset, whence);
+      break;
+  }
+  if (next_offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  offset_ = next_offset;
+  return offset_;
+}
+
+bool BlockCacheFileDescriptor::BlkIoctl(int request,
+                                        uint64_t start,
+                                        uint64_t length,
+                                        int* result) {
+  Invalidate(start, length);
+  return fd_->BlkIoctl(request, start, length, result);
+}
+
+bool BlockCacheFileDescriptor::Close() {
+  entries_.clear();
+  entries_by_next_use_.clear();
+  free_slots_.clear();
+  brillo::Blob().swap(cache_data_);
+  brillo::Blob().swap(read_buffer_);
+  offset_ = 0;
+  return fd_->Close();
+}
+
+void BlockCacheFileDescriptor::AddOperation(
+    const google::protobuf::RepeatedPtrField<Extent>& extents,
+    bool read_twice) {
+  DCHECK(!schedule_finalized_);
+  uint32_t operation = read_twice_.size();
+  for (const Extent& extent : extents) {
+    for (uint64_t block = extent.start_block();
+         block < extent.start_block() + extent.num_blocks();
+         block++) {
+      uses_.emplace_back(block, operation);
+    }
+  }
+  read_twice_.push_back(read_twice);
+}
+
+void BlockCacheFileDescriptor::SetOperation(size_t index) {
+  if (!schedule_finalized_)
+    FinalizeSchedule();
+  current_operation_ = index;
+  // Update the next use of the cached blocks read by the previous operations.
+  while (!entries_by_next_use_.empty() &&
+         entries_by_next_use_.begin()->first < current_operation_) {
+    uint64_t block = entries_by_next_use_.begin()->second;
+    entries_by_next_use_.erase(entries_by_next_use_.begin());
+    auto it = entries_.find(block);
+    uint32_t next_use = NextUse(block, current_operation_);
+    if (next_use == kNoUse) {
+      free_slots_.push_back(it->second.slot);
+      entries_.erase(it);
+    } else {
+      it->second.next_use = next_use;
+      entries_by_next_use_.emplace(next_use, block);
+    }
+  }
+}
+
+void BlockCacheFileDescriptor::FinalizeSchedule() {
+  std::sort(uses_.begin(), uses_.end());
+  uses_.erase(std::unique(uses_.begin(), uses_.end()), uses_.end());
+  // Only keep the blocks read more than once, since the others are never in
+  // the cache.
+  size_t kept = 0;
+  for (size_t i = 0; i < uses_.size();) {
+    size_t end = i + 1;
+    while (end < uses_.size() && uses_[end].first == uses_[i].first)
+      end++;
+    if (end - i > 1 || read_twice_[uses_[i].second]) {
+      std::copy(uses_.begin() + i, uses_.begin() + end, uses_.begin() + kept);
+      kept += end - i;
+    }
+    i = end;
+  }
+  uses_.resize(kept);
+  uses_.shrink_to_fit();
+  schedule_finalized_ = true;
+}
+
+uint32_t BlockCacheFileDescriptor::NextUse(uint64_t block,
+                                           uint32_t operation) const {
+  auto it = std::lower_bound(
+      uses_.begin(), uses_.end(), std::make_pair(block, operation));
+  if (it == uses_.end() || it->first != block)
+    return kNoUse;
+  return it->second;
+}
+
+void BlockCacheFileDescriptor::Insert(uint64_t block, const uint8_t* data) {
+  if (max_cached_blocks_ == 0 || current_operation_ >= read_twice_.size() ||
+      entries_.find(block) != entries_.end()) {
+    return;
+  }
+  // The block is read now, so it is only needed again if this operation reads
+  // it twice or a later operation reads it.
+  uint32_t next_use = NextUse(block,
+                              read_twice_[current_operation_]
+                                  ? current_operation_
+                                  : current_operation_ + 1);
+  if (next_use == kNoUse)
+    return;
+  if (entries_.size() >= max_cached_blocks_) {
+    // Evict the block read again the furthest in the future, unless it is this
+    // one.
+    auto last = std::prev(entries_by_next_use_.end());
+    if (last->first <= next_use)
+      return;
+    Remove(entries_.find(last->second));
+  }
+
+  size_t slot;
+  if (free_slots_.empty()) {
+    // All the slots allocated are in use.
+    slot = entries_.size();
+    cache_data_.resize((slot + 1) * block_size_);
+  } else {
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+  }
+  memcpy(cache_data_.data() + slot * block_size_, data, block_size_);
+  entries_[block] = {slot, next_use};
+  entries_by_next_use_.emplace(next_use, block);
+}
+
+void BlockCacheFileDescriptor::Remove(
+    std::unordered_map<uint64_t, Entry>::iterator it) {
+  entries_by_next_use_.erase(std::make_pair(it->second.next_use, it->first));
+  free_slots_.push_back(it->second.slot);
+  entries_.erase(it);
+}
+
+void BlockCacheFileDescriptor::Invalidate(uint64_t offset, uint64_t length) {
+  for (uint64_t block = offset / block_size_;
+       block < utils::DivRoundUp(offset + length, block_size_) &&
+       !entries_.empty();
+       block++) {
+    auto it = entries_.find(block);
+    if (it != entries_.end())
+      Remove(it);
+  }
+}
+
+}  // namespace chromeos_update_engine
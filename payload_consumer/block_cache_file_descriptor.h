@@ -0,0 +1,159 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_BLOCK_CACHE_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_BLOCK_CACHE_FILE_DESCRIPTOR_H_
+
+#include <sys/types.h>
+
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A FileDescriptor that keeps the blocks read from |fd| which will be read
+// again later, so they are only read from |fd| once. The blocks each operation
+// reads are known from the manifest in advance, so when the cache is full the
+// block evicted is the one read again the furthest in the future, which is
+// optimal. Reads of blocks not read again are passed through to |fd|, and
+// writes invalidate the cached blocks they overlap.
+class BlockCacheFileDescriptor : public FileDescriptor {
+ public:
+  BlockCacheFileDescriptor(FileDescriptorPtr fd,
+                           size_t block_size,
+                           size_t max_cached_blocks)
+      : fd_(fd),
+        block_size_(block_size),
+        max_cached_blocks_(max_cached_blocks) {}
+  ~BlockCacheFileDescriptor() override = default;
+
+  bool Open(const char* path, int flags, mode_t mode) override {
+    return fd_->Open(path, flags, mode);
+  }
+  bool Open(const char* path, int flags) override {
+    return fd_->Open(path, flags);
+  }
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  bool ReadRanges(const std::vector<Range>& ranges, void* buf) override;
+  bool WriteRanges(const std::vector<Range>& ranges, const void* buf) override;
+  bool ReadAhead(off64_t offset, uint64_t length) override {
+    return fd_->ReadAhead(offset, length);
+  }
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override;
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+  // Appends an operation reading the blocks in |extents| to the schedule of
+  // reads, reading them twice if |read_twice|. The operations must be added in
+  // the order they are performed and before the first SetOperation().
+  void AddOperation(
+      const google::protobuf::RepeatedPtrField<Extent>& extents,
+      bool read_twice);
+
+  // Tells that the operation at |index| in the schedule is being performed.
+  // The blocks not read by this operation or the following ones are dropped.
+  void SetOperation(size_t index);
+
+  // The number of blocks read from the cache and from |fd| since the cache was
+  // created. A block is counted once per Read() call or range of ReadRanges()
+  // using any of its bytes.
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+
+ private:
+  struct Entry {
+    // The index of the block data in |cache_data_|.
+    size_t slot;
+    // The index of the next operation reading the block.
+    uint32_t next_use;
+  };
+
+  // Sorts |uses_| and drops the blocks which are never read again after the
+  // first time.
+  void FinalizeSchedule();
+
+  // Returns the first operation at or after |operation| reading |block|, or
+  // kNoUse if none.
+  uint32_t NextUse(uint64_t block, uint32_t operation) const;
+
+  // Adds the |block| just read from |fd_| with the given |data| to the cache
+  // if it is read again before the blocks already cached.
+  void Insert(uint64_t block, const uint8_t* data);
+
+  // Removes the cached |block| pointed by |it|.
+  void Remove(std::unordered_map<uint64_t, Entry>::iterator it);
+
+  // Removes the cached blocks overlapping the |length| bytes at |offset|.
+  void Invalidate(uint64_t offset, uint64_t length);
+
+  // Reads the blocks [first_block, end_block) from |fd_|, adds them to the
+  // cache and copies up to |count| bytes of them starting at |offset_| into
+  // |buf|. Returns the number of bytes copied, or -1 on error.
+  ssize_t ReadBlocks(uint64_t first_block,
+                     uint64_t end_block,
+                     uint8_t* buf,
+                     size_t count);
+
+  static const uint32_t kNoUse;
+
+  FileDescriptorPtr fd_;
+  const size_t block_size_;
+  const size_t max_cached_blocks_;
+  off64_t offset_{0};
+
+  // The reads of the schedule as (block, operation) pairs, sorted once the
+  // schedule is finalized, and whether each operation reads its blocks twice.
+  std::vector<std::pair<uint64_t, uint32_t>> uses_;
+  std::vector<bool> read_twice_;
+  bool schedule_finalized_{false};
+  uint32_t current_operation_{0};
+
+  // The cached blocks and their data, and the cached blocks ordered by their
+  // next use to find the one to evict.
+  std::unordered_map<uint64_t, Entry> entries_;
+  std::set<std::pair<uint32_t, uint64_t>> entries_by_next_use_;
+  brillo::Blob cache_data_;
+  std::vector<size_t> free_slots_;
+
+  // Buffer for the blocks read from |fd_|.
+  brillo::Blob read_buffer_;
+
+  uint64_t hits_{0};
+  uint64_t misses_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(BlockCacheFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_BLOCK_CACHE_FILE_DESCRIPTOR_H_
@@ -0,0 +1,249 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/block_cache_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/fake_file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kBlockSize = 16;
+const size_t kNumBlocks = 32;
+}  // namespace
+
+class BlockCacheFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    fake_fd_ = new FakeFileDescriptor();
+    fake_fd_->SetFileSize(kNumBlocks * kBlockSize);
+    EXPECT_TRUE(fake_fd_->Open("fake", O_RDONLY));
+    data_ = FakeFileDescriptorData(kNumBlocks * kBlockSize);
+  }
+
+  void CreateCache(size_t max_cached_blocks) {
+    cache_fd_.reset(new BlockCacheFileDescriptor(
+        FileDescriptorPtr(fake_fd_), kBlockSize, max_cached_blocks));
+  }
+
+  void AddOperation(const vector<Extent>& extents, bool read_twice) {
+    RepeatedPtrField<Extent> extents_field(extents.begin(), extents.end());
+    cache_fd_->AddOperation(extents_field, read_twice);
+  }
+
+  // Reads |num_blocks| blocks starting at |start_block| from the cache and
+  // checks the data read.
+  void ExpectReadBlocks(uint64_t start_block, uint64_t num_blocks) {
+    ExpectRead(start_block * kBlockSize, num_blocks * kBlockSize);
+  }
+
+  void ExpectRead(off64_t offset, size_t count) {
+    brillo::Blob buf(count);
+    EXPECT_EQ(offset, cache_fd_->Seek(offset, SEEK_SET));
+    EXPECT_EQ(static_cast<ssize_t>(count),
+              cache_fd_->Read(buf.data(), buf.size()));
+    EXPECT_EQ(brillo::Blob(data_.begin() + offset,
+                           data_.begin() + offset + count),
+              buf);
+  }
+
+  // Owned by |cache_fd_|.
+  FakeFileDescriptor* fake_fd_;
+  std::unique_ptr<BlockCacheFileDescriptor> cache_fd_;
+  brillo::Blob data_;
+};
+
+TEST_F(BlockCacheFileDescriptorTest, CachesBlocksReadAgainTest) {
+  CreateCache(kNumBlocks);
+  AddOperation({ExtentForRange(0, 4)}, false);
+  AddOperation({ExtentForRange(2, 4)}, false);
+  AddOperation({ExtentForRange(0, 1), ExtentForRange(10, 2)}, false);
+
+  cache_fd_->SetOperation(0);
+  ExpectReadBlocks(0, 4);
+  EXPECT_EQ(0U, cache_fd_->hits());
+  EXPECT_EQ(4U, cache_fd_->misses());
+
+  cache_fd_->SetOperation(1);
+  ExpectReadBlocks(2, 4);
+  EXPECT_EQ(2U, cache_fd_->hits());
+  EXPECT_EQ(6U, cache_fd_->misses());
+
+  cache_fd_->SetOperation(2);
+  ExpectReadBlocks(0, 1);
+  ExpectReadBlocks(10, 2);
+  EXPECT_EQ(3U, cache_fd_->hits());
+  EXPECT_EQ(8U, cache_fd_->misses());
+  EXPECT_EQ(3U, fake_fd_->GetReadOps().size());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, EvictsBlockReadLastTest) {
+  // With room for a single block, the block kept is the one read again first.
+  CreateCache(1);
+  AddOperation({ExtentForRange(0, 2)}, false);
+  AddOperation({ExtentForRange(1, 1)}, false);
+  AddOperation({ExtentForRange(0, 1)}, false);
+
+  cache_fd_->SetOperation(0);
+  ExpectReadBlocks(0, 2);
+  cache_fd_->SetOperation(1);
+  ExpectReadBlocks(1, 1);
+  EXPECT_EQ(1U, cache_fd_->hits());
+  cache_fd_->SetOperation(2);
+  ExpectReadBlocks(0, 1);
+  EXPECT_EQ(1U, cache_fd_->hits());
+  EXPECT_EQ(3U, cache_fd_->misses());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, ReadTwiceTest) {
+  CreateCache(kNumBlocks);
+  AddOperation({ExtentForRange(4, 8)}, true);
+  AddOperation({ExtentForRange(4, 8)}, false);
+
+  cache_fd_->SetOperation(0);
+  ExpectReadBlocks(4, 8);
+  ExpectReadBlocks(4, 8);
+  EXPECT_EQ(8U, cache_fd_->hits());
+  cache_fd_->SetOperation(1);
+  ExpectReadBlocks(4, 8);
+  EXPECT_EQ(16U, cache_fd_->hits());
+  EXPECT_EQ(8U, cache_fd_->misses());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, UnalignedReadTest) {
+  CreateCache(kNumBlocks);
+  AddOperation({ExtentForRange(0, 4)}, true);
+
+  cache_fd_->SetOperation(0);
+  ExpectRead(5, 3 * kBlockSize);
+  ExpectRead(1, kBlockSize);
+  ExpectRead(kBlockSize + 3, 2 * kBlockSize + 1);
+  // Blocks 0 and 1, then blocks 1 to 3, are read from the cache.
+  EXPECT_EQ(5U, cache_fd_->hits());
+  EXPECT_EQ(4U, cache_fd_->misses());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, BlocksNotReadAgainAreNotCachedTest) {
+  CreateCache(kNumBlocks);
+  AddOperation({ExtentForRange(0, 4)}, false);
+  AddOperation({ExtentForRange(8, 4)}, false);
+
+  cache_fd_->SetOperation(0);
+  ExpectReadBlocks(0, 4);
+  ExpectReadBlocks(0, 4);
+  EXPECT_EQ(0U, cache_fd_->hits());
+  EXPECT_EQ(8U, cache_fd_->misses());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, ReadPastEndOfFileTest) {
+  CreateCache(kNumBlocks);
+  AddOperation({ExtentForRange(kNumBlocks - 2, 2)}, true);
+
+  cache_fd_->SetOperation(0);
+  brillo::Blob buf(4 * kBlockSize);
+  EXPECT_EQ((kNumBlocks - 2) * kBlockSize,
+            cache_fd_->Seek((kNumBlocks - 2) * kBlockSize, SEEK_SET));
+  EXPECT_EQ(static_cast<ssize_t>(2 * kBlockSize),
+            cache_fd_->Read(buf.data(), buf.size()));
+  EXPECT_EQ(0, cache_fd_->Read(buf.data(), buf.size()));
+  // The blocks past the end of the file are not counted.
+  EXPECT_EQ(0U, cache_fd_->hits());
+  EXPECT_EQ(2U, cache_fd_->misses());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, ReadRangesReadsMissesAtOnceTest) {
+  CreateCache(kNumBlocks);
+  AddOperation({ExtentForRange(2, 2)}, false);
+  AddOperation({ExtentForRange(0, 6), ExtentForRange(10, 2)}, false);
+
+  cache_fd_->SetOperation(0);
+  ExpectReadBlocks(2, 2);
+  EXPECT_EQ(1U, fake_fd_->GetReadOps().size());
+
+  cache_fd_->SetOperation(1);
+  vector<FileDescriptor::Range> ranges = {
+      {0, 6 * kBlockSize}, {10 * kBlockSize, 2 * kBlockSize}};
+  brillo::Blob buf(8 * kBlockSize);
+  EXPECT_TRUE(cache_fd_->ReadRanges(ranges, buf.data()));
+  brillo::Blob expected(data_.begin(), data_.begin() + 6 * kBlockSize);
+  expected.insert(expected.end(),
+                  data_.begin() + 10 * kBlockSize,
+                  data_.begin() + 12 * kBlockSize);
+  EXPECT_EQ(expected, buf);
+  EXPECT_EQ(2U, cache_fd_->hits());
+  EXPECT_EQ(8U, cache_fd_->misses());
+  // Only the blocks 0-1, 4-5 and 10-11 are read from the file.
+  vector<std::pair<uint64_t, uint64_t>> expected_read_ops = {
+      {2 * kBlockSize, 2 * kBlockSize},
+      {0, 2 * kBlockSize},
+      {4 * kBlockSize, 2 * kBlockSize},
+      {10 * kBlockSize, 2 * kBlockSize}};
+  EXPECT_EQ(expected_read_ops, fake_fd_->GetReadOps());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, WriteInvalidatesCachedBlocksTest) {
+  test_utils::ScopedTempFile temp_file("BlockCacheFileDescriptor-file.XXXXXX");
+  brillo::Blob zero_blob(kNumBlocks * kBlockSize, 0);
+  EXPECT_TRUE(utils::WriteFile(
+      temp_file.path().c_str(), zero_blob.data(), zero_blob.size()));
+  FileDescriptorPtr fd(new EintrSafeFileDescriptor());
+  BlockCacheFileDescriptor cache_fd(fd, kBlockSize, kNumBlocks);
+  EXPECT_TRUE(cache_fd.Open(temp_file.path().c_str(), O_RDWR, 0600));
+  RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(0, 2);
+  cache_fd.AddOperation(extents, true);
+  cache_fd.SetOperation(0);
+
+  brillo::Blob buf(2 * kBlockSize);
+  EXPECT_EQ(static_cast<ssize_t>(buf.size()),
+            cache_fd.Read(buf.data(), buf.size()));
+  brillo::Blob new_data(4, 0xaa);
+  EXPECT_EQ(static_cast<off64_t>(kBlockSize + 2),
+            cache_fd.Seek(kBlockSize + 2, SEEK_SET));
+  EXPECT_EQ(static_cast<ssize_t>(new_data.size()),
+            cache_fd.Write(new_data.data(), new_data.size()));
+
+  EXPECT_EQ(0, cache_fd.Seek(0, SEEK_SET));
+  EXPECT_EQ(static_cast<ssize_t>(buf.size()),
+            cache_fd.Read(buf.data(), buf.size()));
+  brillo::Blob expected(2 * kBlockSize, 0);
+  std::fill(expected.begin() + kBlockSize + 2,
+            expected.begin() + kBlockSize + 6,
+            0xaa);
+  EXPECT_EQ(expected, buf);
+  // The first block is still cached, the second one is read again.
+  EXPECT_EQ(1U, cache_fd.hits());
+  EXPECT_EQ(3U, cache_fd.misses());
+  EXPECT_TRUE(cache_fd.Close());
+}
+
+}  // namespace chromeos_update_engine
@@ -72,6 +72,24 @@ ssize_t CachedFileDescriptor::Write(const void* buf, size_t count) {
   return total_bytes_wrote;
 }
 
+bool CachedFileDescriptor::ReadRanges(const std::vector<Range>& ranges,
+                                      void* buf) {
+  // The ranges may overlap the cached data and leave |fd_| at any offset, so
+  // flush the cache first and restore the offset afterwards.
+  if (!FlushCache() || !fd_->ReadRanges(ranges, buf))
+    return false;
+  return fd_->Seek(offset_, SEEK_SET) >= 0;
+}
+
+bool CachedFileDescriptor::WriteRanges(const std::vector<Range>& ranges,
+                                       const void* buf) {
+  // The ranges are usually scattered, so they are passed through to |fd_|
+  // instead of being cached.
+  if (!FlushCache() || !fd_->WriteRanges(ranges, buf))
+    return false;
+  return fd_->Seek(offset_, SEEK_SET) >= 0;
+}
+
 bool CachedFileDescriptor::Flush() {
   return FlushCache() && fd_->Flush();
 }
@@ -47,6 +47,11 @@ class CachedFileDescriptor : public FileDescriptor {
   }
   ssize_t Write(const void* buf, size_t count) override;
   off64_t Seek(off64_t offset, int whence) override;
+  bool ReadRanges(const std::vector<Range>& ranges, void* buf) override;
+  bool WriteRanges(const std::vector<Range>& ranges, const void* buf) override;
+  bool ReadAhead(off64_t offset, uint64_t length) override {
+    return fd_->ReadAhead(offset, length);
+  }
   uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
   bool BlkIoctl(int request,
                 uint64_t start,
@@ -127,6 +127,33 @@ TEST_F(CachedFileDescriptorTest, RandomWriteTest) {
   EXPECT_EQ(blob_in, blob_out);
 }
 
+TEST_F(CachedFileDescriptorTest, WriteRangesTest) {
+  EXPECT_EQ(cfd_->Seek(0, SEEK_SET), 0);
+  brillo::Blob blob_in(kFileSize, 0);
+  // Leave some data in the cache before writing the ranges.
+  std::fill_n(&blob_in[0], 10, 1);
+  Write(&blob_in[0], 10);
+
+  brillo::Blob ranges_data(30, 2);
+  vector<FileDescriptor::Range> ranges = {{500, 20}, {200, 10}};
+  EXPECT_TRUE(cfd_->WriteRanges(ranges, ranges_data.data()));
+  std::fill_n(&blob_in[500], 20, 2);
+  std::fill_n(&blob_in[200], 10, 2);
+
+  // The next write continues after the cached data.
+  std::fill_n(&blob_in[10], 10, 3);
+  Write(&blob_in[10], 10);
+  EXPECT_TRUE(cfd_->Flush());
+
+  brillo::Blob blob_out;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  EXPECT_EQ(blob_in, blob_out);
+
+  brillo::Blob ranges_out(30);
+  EXPECT_TRUE(cfd_->ReadRanges(ranges, ranges_out.data()));
+  EXPECT_EQ(ranges_data, ranges_out);
+}
+
 TEST_F(CachedFileDescriptorTest, SeekTest) {
   EXPECT_EQ(cfd_->Seek(0, SEEK_SET), 0);
   EXPECT_EQ(cfd_->Seek(1, SEEK_SET), 1);
@@ -33,6 +33,7 @@
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
+#include <base/sys_info.h>
 #include <base/time/time.h>
 #include <brillo/data_encoding.h>
 #include <bsdiff/bspatch.h>
@@ -44,6 +45,7 @@
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/terminator.h"
+#include "update_engine/payload_consumer/block_cache_file_descriptor.h"
 #include "update_engine/payload_consumer/bzip_extent_writer.h"
 #include "update_engine/payload_consumer/cached_file_descriptor.h"
 #include "update_engine/payload_consumer/download_action.h"
@@ -53,6 +55,9 @@
 #include "update_engine/payload_consumer/fec_file_descriptor.h"
 #endif  // USE_FEC
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#if USE_IO_URING
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+#endif  // USE_IO_URING
 #include "update_engine/payload_consumer/mount_history.h"
 #if USE_MTD
 #include "update_engine/payload_consumer/mtd_file_descriptor.h"
@@ -62,6 +67,7 @@
 #include "update_engine/payload_consumer/xz_extent_writer.h"
 
 using google::protobuf::RepeatedPtrField;
+using std::max;
 using std::min;
 using std::string;
 using std::vector;
@@ -72,6 +78,8 @@ const unsigned DeltaPerformer::kProgressLogTimeoutSeconds = 30;
 const unsigned DeltaPerformer::kProgressDownloadWeight = 50;
 const unsigned DeltaPerformer::kProgressOperationsWeight = 50;
 const uint64_t DeltaPerformer::kCheckpointFrequencySeconds = 1;
+const size_t DeltaPerformer::kMaxApplyThreads = 4;
+const size_t DeltaPerformer::kSourcePrefetchOperations = 16;
 
 namespace {
 const int kUpdateStateOperationInvalid = -1;
@@ -82,7 +90,20 @@ const int kUbiVolumeAttachTimeout = 5 * 60;
 
 const uint64_t kCacheSize = 1024 * 1024;  // 1MB
 
-FileDescriptorPtr CreateFileDescriptor(const char* path) {
+// Maximum memory used by the source, data and target buffers of the operations
+// being applied in the worker threads. Larger operations are applied directly.
+const uint64_t kMaxApplyPipelineBytes = 64 * 1024 * 1024;  // 64MB
+
+// Maximum number of operations queued in the apply pipeline per worker thread.
+const size_t kApplyPipelineDepthPerThread = 2;
+
+const size_t kMaxPuffPatchCacheSize = 5 * 1024 * 1024;  // Total 5MB cache.
+
+// The maximum size of the cache of the source blocks read by more than one
+// operation of a partition.
+const uint64_t kMaxSourceBlockCacheBytes = 16 * 1024 * 1024;  // 16MB
+
+FileDescriptorPtr CreateFileDescriptor(const char* path, bool use_io_uring) {
   FileDescriptorPtr ret;
 #if USE_MTD
   if (strstr(path, "/dev/ubi") == path) {
@@ -103,7 +124,15 @@ FileDescriptorPtr CreateFileDescriptor(const char* path) {
   } else {
     LOG(INFO) << path << " is not an MTD nor a UBI device.";
 #endif
+#if USE_IO_URING
+    // Fall back to the blocking system calls on kernels without io_uring.
+    if (use_io_uring && IoUringFileDescriptor::IsSupported())
+      ret.reset(new IoUringFileDescriptor);
+    else
+      ret.reset(new EintrSafeFileDescriptor);
+#else
     ret.reset(new EintrSafeFileDescriptor);
+#endif  // USE_IO_URING
 #if USE_MTD
   }
 #endif
@@ -115,13 +144,14 @@ FileDescriptorPtr CreateFileDescriptor(const char* path) {
 FileDescriptorPtr OpenFile(const char* path,
                            int mode,
                            bool cache_writes,
+                           bool use_io_uring,
                            int* err) {
   // Try to mark the block device read-only based on the mode. Ignore any
   // failure since this won't work when passing regular files.
   bool read_only = (mode & O_ACCMODE) == O_RDONLY;
   utils::SetBlockDeviceReadOnly(path, read_only);
 
-  FileDescriptorPtr fd = CreateFileDescriptor(path);
+  FileDescriptorPtr fd = CreateFileDescriptor(path, use_io_uring);
   if (cache_writes && !read_only) {
     fd = FileDescriptorPtr(new CachedFileDescriptor(fd, kCacheSize));
     LOG(INFO) << "Caching writes.";
@@ -269,22 +299,6 @@ void DeltaPerformer::UpdateOverallProgress(bool force_log,
   last_progress_chunk_ = curr_progress_chunk;
 }
 
-size_t DeltaPerformer::CopyDataToBuffer(const char** bytes_p,
-                                        size_t* count_p,
-                                        size_t max) {
-  const size_t count = *count_p;
-  if (!count)
-    return 0;  // Special case shortcut.
-  size_t read_len = min(count, max - buffer_.size());
-  const char* bytes_start = *bytes_p;
-  const char* bytes_end = bytes_start + read_len;
-  buffer_.reserve(max);
-  buffer_.insert(buffer_.end(), bytes_start, bytes_end);
-  *bytes_p = bytes_end;
-  *count_p = count - read_len;
-  return read_len;
-}
-
 bool DeltaPerformer::HandleOpResult(bool op_result,
                                     const char* op_type_name,
                                     ErrorCode* error) {
@@ -304,6 +318,15 @@ bool DeltaPerformer::HandleOpResult(bool op_result,
 }
 
 int DeltaPerformer::Close() {
+  // Wait for the operations still in the worker threads. These were not
+  // committed, so they will be applied again if the update is resumed.
+  if (apply_pipeline_ && !apply_pipeline_->empty()) {
+    LOG(INFO) << "Discarding " << apply_pipeline_->size()
+              << " uncommitted operations";
+  }
+  apply_pipeline_.reset();
+  apply_pipeline_bytes_ = 0;
+
   int err = -CloseCurrentPartition();
   LOG_IF(ERROR,
          !payload_hash_calculator_.Finalize() ||
@@ -314,11 +337,21 @@ int DeltaPerformer::Close() {
     if (err >= 0)
       err = 1;
   }
+  buffer_.Reset();
   return -err;
 }
 
 int DeltaPerformer::CloseCurrentPartition() {
   int err = 0;
+  if (source_cache_fd_) {
+    uint64_t reads = source_cache_fd_->hits() + source_cache_fd_->misses();
+    if (reads > 0) {
+      LOG(INFO) << "Source block cache hits: " << source_cache_fd_->hits()
+                << "/" << reads << " blocks read ("
+                << source_cache_fd_->hits() * 100 / reads << "%).";
+    }
+    source_cache_fd_.reset();
+  }
   if (source_fd_ && !source_fd_->Close()) {
     err = errno;
     PLOG(ERROR) << "Error closing source partition";
@@ -364,7 +397,8 @@ bool DeltaPerformer::OpenCurrentPartition() {
       install_part.source_size > 0) {
     source_path_ = install_part.source_path;
     int err;
-    source_fd_ = OpenFile(source_path_.c_str(), O_RDONLY, false, &err);
+    source_fd_ =
+        OpenFile(source_path_.c_str(), O_RDONLY, false, use_io_uring_, &err);
     if (!source_fd_) {
       LOG(ERROR) << "Unable to open source partition "
                  << partition.partition_name() << " on slot "
@@ -372,7 +406,9 @@ bool DeltaPerformer::OpenCurrentPartition() {
                  << ", file " << source_path_;
       return false;
     }
+    SetupSourceBlockCache(partition);
   }
+  next_prefetch_operation_num_ = 0;
 
   target_path_ = install_part.target_path;
   int err;
@@ -384,7 +420,8 @@ bool DeltaPerformer::OpenCurrentPartition() {
   LOG(INFO) << "Opening " << target_path_ << " partition with"
             << (interactive_ ? "out" : "") << " O_DSYNC";
 
-  target_fd_ = OpenFile(target_path_.c_str(), flags, true, &err);
+  target_fd_ =
+      OpenFile(target_path_.c_str(), flags, true, use_io_uring_, &err);
   if (!target_fd_) {
     LOG(ERROR) << "Unable to open target partition "
                << partition.partition_name() << " on slot "
@@ -403,6 +440,57 @@ bool DeltaPerformer::OpenCurrentPartition() {
   return true;
 }
 
+void DeltaPerformer::SetupSourceBlockCache(const PartitionUpdate& partition) {
+  source_cache_fd_ = std::make_shared<BlockCacheFileDescriptor>(
+      source_fd_, block_size_, kMaxSourceBlockCacheBytes / block_size_);
+  for (const InstallOperation& op : partition.operations()) {
+    switch (op.type()) {
+      case InstallOperation::SOURCE_COPY:
+      case InstallOperation::SOURCE_BSDIFF:
+      case InstallOperation::BROTLI_BSDIFF:
+      case InstallOperation::PUFFDIFF:
+        // The diff operations applied in place read the source once to check
+        // its hash and once more to patch it. The pipelined ones and
+        // SOURCE_COPY read it only once.
+        source_cache_fd_->AddOperation(
+            op.src_extents(),
+            op.type() != InstallOperation::SOURCE_COPY &&
+                op.has_src_sha256_hash() && !CanPipelineOperation(op));
+        break;
+      default:
+        // Keep the schedule indexes the same as the operation indexes.
+        source_cache_fd_->AddOperation({}, false);
+        break;
+    }
+  }
+  source_fd_ = source_cache_fd_;
+}
+
+void DeltaPerformer::PrefetchSourceBlocks(size_t partition_operation_num) {
+  if (!source_fd_)
+    return;
+  const PartitionUpdate& partition = partitions_[current_partition_];
+  size_t end_operation_num =
+      min(static_cast<size_t>(partition.operations_size()),
+          partition_operation_num + source_prefetch_operations_);
+  next_prefetch_operation_num_ =
+      max(next_prefetch_operation_num_, partition_operation_num);
+  for (; next_prefetch_operation_num_ < end_operation_num;
+       next_prefetch_operation_num_++) {
+    const InstallOperation& op =
+        partition.operations(next_prefetch_operation_num_);
+    for (const Extent& extent : op.src_extents()) {
+      if (extent.start_block() == kSparseHole)
+        continue;
+      off64_t offset = extent.start_block() * block_size_;
+      uint64_t length = extent.num_blocks() * block_size_;
+      source_fd_->ReadAhead(offset, length);
+      if (source_ecc_fd_)
+        source_ecc_fd_->ReadAhead(offset, length);
+    }
+  }
+}
+
 bool DeltaPerformer::OpenCurrentECCPartition() {
   if (source_ecc_fd_)
     return true;
@@ -584,13 +672,13 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     // Read data up to the needed limit; this is either maximium payload header
     // size, or the full metadata size (once it becomes known).
     const bool do_read_header = !IsHeaderParsed();
-    CopyDataToBuffer(
+    buffer_.Append(
         &c_bytes,
         &count,
         (do_read_header ? kMaxPayloadHeaderSize
                         : metadata_size_ + metadata_signature_size_));
 
-    MetadataParseResult result = ParsePayloadMetadata(buffer_, error);
+    MetadataParseResult result = ParsePayloadMetadata(buffer_.blob(), error);
     if (result == MetadataParseResult::kError)
       return false;
     if (result == MetadataParseResult::kInsufficientData) {
@@ -606,6 +694,15 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
       return false;
     manifest_valid_ = true;
 
+    if (manifest_.has_payload_hash_tree()) {
+      hash_tree_verifier_.reset(new PayloadHashTreeVerifier());
+      if (!hash_tree_verifier_->Init(manifest_.payload_hash_tree())) {
+        LOG(ERROR) << "Invalid payload hash tree in the manifest.";
+        *error = ErrorCode::kDownloadManifestParseError;
+        return false;
+      }
+    }
+
     // Clear the download buffer.
     DiscardBuffer(false, metadata_size_);
 
@@ -654,7 +751,51 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     LOG(INFO) << "Starting to apply update payload operations";
   }
 
+  // With a payload hash tree, the operations only see the data of the chunks
+  // already verified, so no operation is applied before its data is verified.
+  if (!hash_tree_verifier_)
+    return WritePayloadData(c_bytes, count, error);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(c_bytes);
+  do {
+    const uint8_t* verified_data;
+    size_t verified_size;
+    if (!hash_tree_verifier_->Update(
+            &data, &count, &verified_data, &verified_size)) {
+      LOG(ERROR) << "The payload data doesn't match the payload hash tree.";
+      *error = ErrorCode::kPayloadHashMismatchError;
+      return false;
+    }
+    if (!WritePayloadData(reinterpret_cast<const char*>(verified_data),
+                          verified_size,
+                          error)) {
+      return false;
+    }
+  } while (count > 0);
+  return true;
+}
+
+bool DeltaPerformer::WritePayloadData(const char* c_bytes,
+                                      size_t count,
+                                      ErrorCode* error) {
   while (next_operation_num_ < num_total_operations_) {
+    // Commit the operations already applied by the worker threads. Wait for
+    // all of them if a checkpoint is due, since the progress can't be saved
+    // while there are operations in the pipeline.
+    if (!CommitPipelinedOperations(
+            base::TimeTicks::Now() > update_checkpoint_time_, error)) {
+      return false;
+    }
+
+    // The next operation to process comes after the ones in the pipeline.
+    const size_t operation_num =
+        next_operation_num_ + (apply_pipeline_ ? apply_pipeline_->size() : 0);
+    if (operation_num >= num_total_operations_) {
+      // All the remaining operations are in the pipeline.
+      if (!CommitPipelinedOperations(true, error))
+        return false;
+      continue;
+    }
+
     // Check if we should cancel the current attempt for any reason.
     // In this case, *error will have already been populated with the reason
     // why we're canceling.
@@ -663,7 +804,10 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
 
     // We know there are more operations to perform because we didn't reach the
     // |num_total_operations_| limit yet.
-    if (next_operation_num_ >= acc_num_operations_[current_partition_]) {
+    if (operation_num >= acc_num_operations_[current_partition_]) {
+      // The pipelined operations must be written before closing the partition.
+      if (!CommitPipelinedOperations(true, error))
+        return false;
       CloseCurrentPartition();
       // Skip until there are operations for current_partition_.
       while (next_operation_num_ >= acc_num_operations_[current_partition_]) {
@@ -675,13 +819,18 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
       }
     }
     const size_t partition_operation_num =
-        next_operation_num_ -
+        operation_num -
         (current_partition_ ? acc_num_operations_[current_partition_ - 1] : 0);
 
     const InstallOperation& op =
         partitions_[current_partition_].operations(partition_operation_num);
+    if (source_cache_fd_)
+      source_cache_fd_->SetOperation(partition_operation_num);
+    PrefetchSourceBlocks(partition_operation_num);
 
-    CopyDataToBuffer(&c_bytes, &count, op.data_length());
+    // The operation data is used in place if it was received in one piece.
+    // Either way it is consumed before returning from this method.
+    buffer_.AppendOrReference(&c_bytes, &count, op.data_length());
 
     // Check whether we received all of the next operation's data payload.
     if (!CanPerformInstallOperation(op))
@@ -710,6 +859,22 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
       }
     }
 
+    if (CanPipelineOperation(op)) {
+      if (!PipelineOperation(op, error)) {
+        // Commit the previous operations so the failure is reported for the
+        // right operation number.
+        if (CommitPipelinedOperations(true, error))
+          HandleOpResult(false, InstallOperationTypeName(op.type()), error);
+        return false;
+      }
+      continue;
+    }
+
+    // The rest of the operations are applied in place, after all the previous
+    // operations are written.
+    if (!CommitPipelinedOperations(true, error))
+      return false;
+
     // Makes sure we unblock exit when this operation completes.
     ScopedTerminatorExitUnblocker exit_unblocker =
         ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
@@ -777,7 +942,7 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
       *error = ErrorCode::kDownloadPayloadVerificationError;
       return false;
     }
-    CopyDataToBuffer(&c_bytes, &count, manifest_.signatures_size());
+    buffer_.Append(&c_bytes, &count, manifest_.signatures_size());
     // Needs more data to cover entire signature.
     if (buffer_.size() < manifest_.signatures_size())
       return true;
@@ -1186,7 +1351,8 @@ bool DeltaPerformer::PerformSourceCopyOperation(
                                                 target_fd_,
                                                 operation.dst_extents(),
                                                 block_size_,
-                                                &source_hash);
+                                                &source_hash,
+                                                &hash_pool_);
     if (read_ok && expected_source_hash == source_hash)
       return true;
 
@@ -1208,7 +1374,8 @@ bool DeltaPerformer::PerformSourceCopyOperation(
                                                        target_fd_,
                                                        operation.dst_extents(),
                                                        block_size_,
-                                                       &source_hash));
+                                                       &source_hash,
+                                                       &hash_pool_));
     TEST_AND_RETURN_FALSE(
         ValidateSourceHash(source_hash, operation, source_ecc_fd_, error));
     // At this point reading from the the error corrected device worked, but
@@ -1226,6 +1393,7 @@ bool DeltaPerformer::PerformSourceCopyOperation(
                                      target_fd_,
                                      operation.dst_extents(),
                                      block_size_,
+                                     nullptr,
                                      nullptr)) {
       return true;
     }
@@ -1234,13 +1402,36 @@ bool DeltaPerformer::PerformSourceCopyOperation(
                                                        target_fd_,
                                                        operation.dst_extents(),
                                                        block_size_,
+                                                       nullptr,
                                                        nullptr));
   }
   return true;
 }
 
+namespace {
+
+// Reads the |extents| from |fd| and stores their hash in |hash_out| if not
+// null. The data read is stored in |data_out| if not null.
+bool ReadSourceExtents(FileDescriptorPtr fd,
+                       const RepeatedPtrField<Extent>& extents,
+                       uint64_t block_size,
+                       brillo::Blob* data_out,
+                       brillo::Blob* hash_out,
+                       HashCalculatorPool* hash_pool) {
+  if (data_out) {
+    return fd_utils::ReadAndHashExtentsToBlob(
+        fd, extents, block_size, data_out, hash_out, hash_pool);
+  }
+  return fd_utils::ReadAndHashExtents(
+      fd, extents, block_size, hash_out, hash_pool);
+}
+
+}  // namespace
+
 FileDescriptorPtr DeltaPerformer::ChooseSourceFD(
-    const InstallOperation& operation, ErrorCode* error) {
+    const InstallOperation& operation,
+    ErrorCode* error,
+    brillo::Blob* source_data) {
   if (source_fd_ == nullptr) {
     LOG(ERROR) << "ChooseSourceFD fail: source_fd_ == nullptr";
     return nullptr;
@@ -1252,18 +1443,35 @@ FileDescriptorPtr DeltaPerformer::ChooseSourceFD(
     // at this point, but we first need to make sure all extents are readable
     // since the error corrected device can be shorter or not available.
     if (OpenCurrentECCPartition() &&
-        fd_utils::ReadAndHashExtents(
-            source_ecc_fd_, operation.src_extents(), block_size_, nullptr)) {
+        ReadSourceExtents(source_ecc_fd_,
+                          operation.src_extents(),
+                          block_size_,
+                          source_data,
+                          nullptr,
+                          nullptr)) {
       return source_ecc_fd_;
     }
+    if (source_data &&
+        !ReadSourceExtents(source_fd_,
+                           operation.src_extents(),
+                           block_size_,
+                           source_data,
+                           nullptr,
+                           nullptr)) {
+      return nullptr;
+    }
     return source_fd_;
   }
 
   brillo::Blob source_hash;
   brillo::Blob expected_source_hash(operation.src_sha256_hash().begin(),
                                     operation.src_sha256_hash().end());
-  if (fd_utils::ReadAndHashExtents(
-          source_fd_, operation.src_extents(), block_size_, &source_hash) &&
+  if (ReadSourceExtents(source_fd_,
+                        operation.src_extents(),
+                        block_size_,
+                        source_data,
+                        &source_hash,
+                        &hash_pool_) &&
       source_hash == expected_source_hash) {
     return source_fd_;
   }
@@ -1282,8 +1490,12 @@ FileDescriptorPtr DeltaPerformer::ChooseSourceFD(
                << base::HexEncode(expected_source_hash.data(),
                                   expected_source_hash.size());
 
-  if (fd_utils::ReadAndHashExtents(
-          source_ecc_fd_, operation.src_extents(), block_size_, &source_hash) &&
+  if (ReadSourceExtents(source_ecc_fd_,
+                        operation.src_extents(),
+                        block_size_,
+                        source_data,
+                        &source_hash,
+                        &hash_pool_) &&
       ValidateSourceHash(source_hash, operation, source_ecc_fd_, error)) {
     // At this point reading from the the error corrected device worked, but
     // reading from the raw device failed, so this is considered a recovered
@@ -1431,7 +1643,7 @@ bool DeltaPerformer::PerformSourceBsdiffOperation(
   if (operation.has_dst_length())
     TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
 
-  FileDescriptorPtr source_fd = ChooseSourceFD(operation, error);
+  FileDescriptorPtr source_fd = ChooseSourceFD(operation, error, nullptr);
   TEST_AND_RETURN_FALSE(source_fd != nullptr);
 
   auto reader = std::make_unique<DirectExtentReader>();
@@ -1538,7 +1750,7 @@ bool DeltaPerformer::PerformPuffDiffOperation(const InstallOperation& operation,
   TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
   TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
 
-  FileDescriptorPtr source_fd = ChooseSourceFD(operation, error);
+  FileDescriptorPtr source_fd = ChooseSourceFD(operation, error, nullptr);
   TEST_AND_RETURN_FALSE(source_fd != nullptr);
 
   auto reader = std::make_unique<DirectExtentReader>();
@@ -1555,16 +1767,276 @@ bool DeltaPerformer::PerformPuffDiffOperation(const InstallOperation& operation,
       std::move(writer),
       utils::BlocksInExtents(operation.dst_extents()) * block_size_));
 
-  const size_t kMaxCacheSize = 5 * 1024 * 1024;  // Total 5MB cache.
   TEST_AND_RETURN_FALSE(puffin::PuffPatch(std::move(src_stream),
                                           std::move(dst_stream),
                                           buffer_.data(),
                                           buffer_.size(),
-                                          kMaxCacheSize));
+                                          kMaxPuffPatchCacheSize));
   DiscardBuffer(true, buffer_.size());
   return true;
 }
 
+namespace {
+
+// The part of an install operation that runs in the worker threads of the
+// apply pipeline. The job only uses its own buffers: the source data is read
+// before submitting the job and the target data is written to the target
+// partition when the job is committed.
+class InstallOperationJob : public ApplyPipeline::Job {
+ public:
+  InstallOperationJob(const InstallOperation& operation,
+                      uint32_t block_size,
+                      brillo::Blob data,
+                      brillo::Blob source_data)
+      : operation_(operation),
+        block_size_(block_size),
+        data_(std::move(data)),
+        source_data_(std::move(source_data)),
+        memory_size_(data_.size() + source_data_.size() +
+                     utils::BlocksInExtents(operation.dst_extents()) *
+                         block_size) {}
+  ~InstallOperationJob() override = default;
+
+  // ApplyPipeline::Job overrides.
+  bool Run() override;
+
+  const InstallOperation& operation() const { return operation_; }
+  const brillo::Blob& target_data() const { return target_data_; }
+
+  // The memory used by the job buffers.
+  uint64_t memory_size() const { return memory_size_; }
+
+ private:
+  bool ApplyOperation();
+
+  const InstallOperation& operation_;
+  uint32_t block_size_;
+
+  // The operation data blob and the data read from the source extents.
+  brillo::Blob data_;
+  brillo::Blob source_data_;
+
+  // The data to be written to the destination extents.
+  brillo::Blob target_data_;
+
+  uint64_t memory_size_;
+
+  DISALLOW_COPY_AND_ASSIGN(InstallOperationJob);
+};
+
+bool InstallOperationJob::Run() {
+  base::TimeTicks op_start_time = base::TimeTicks::Now();
+  bool result = ApplyOperation();
+  OP_DURATION_HISTOGRAM("Pipelined", op_start_time);
+  // Release the input buffers as soon as possible.
+  brillo::Blob().swap(data_);
+  brillo::Blob().swap(source_data_);
+  return result;
+}
+
+bool InstallOperationJob::ApplyOperation() {
+  switch (operation_.type()) {
+    case InstallOperation::REPLACE:
+      target_data_.swap(data_);
+      return true;
+    case InstallOperation::SOURCE_COPY:
+      target_data_.swap(source_data_);
+      return true;
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ: {
+      std::unique_ptr<ExtentWriter> writer =
+          std::make_unique<BlobExtentWriter>(&target_data_);
+      if (operation_.type() == InstallOperation::REPLACE_BZ)
+        writer.reset(new BzipExtentWriter(std::move(writer)));
+      else
+        writer.reset(new XzExtentWriter(std::move(writer)));
+      TEST_AND_RETURN_FALSE(
+          writer->Init(nullptr, operation_.dst_extents(), block_size_));
+      TEST_AND_RETURN_FALSE(writer->Write(data_.data(), data_.size()));
+      return true;
+    }
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF: {
+      auto reader = std::make_unique<BlobExtentReader>(&source_data_);
+      TEST_AND_RETURN_FALSE(
+          reader->Init(nullptr, operation_.src_extents(), block_size_));
+      auto src_file = std::make_unique<BsdiffExtentFile>(std::move(reader),
+                                                         source_data_.size());
+
+      auto writer = std::make_unique<BlobExtentWriter>(&target_data_);
+      TEST_AND_RETURN_FALSE(
+          writer->Init(nullptr, operation_.dst_extents(), block_size_));
+      auto dst_file = std::make_unique<BsdiffExtentFile>(
+          std::move(writer),
+          utils::BlocksInExtents(operation_.dst_extents()) * block_size_);
+
+      TEST_AND_RETURN_FALSE(bsdiff::bspatch(std::move(src_file),
+                                            std::move(dst_file),
+                                            data_.data(),
+                                            data_.size()) == 0);
+      return true;
+    }
+    case InstallOperation::PUFFDIFF: {
+      auto reader = std::make_unique<BlobExtentReader>(&source_data_);
+      TEST_AND_RETURN_FALSE(
+          reader->Init(nullptr, operation_.src_extents(), block_size_));
+      puffin::UniqueStreamPtr src_stream(
+          new PuffinExtentStream(std::move(reader), source_data_.size()));
+
+      auto writer = std::make_unique<BlobExtentWriter>(&target_data_);
+      TEST_AND_RETURN_FALSE(
+          writer->Init(nullptr, operation_.dst_extents(), block_size_));
+      puffin::UniqueStreamPtr dst_stream(new PuffinExtentStream(
+          std::move(writer),
+          utils::BlocksInExtents(operation_.dst_extents()) * block_size_));
+
+      TEST_AND_RETURN_FALSE(puffin::PuffPatch(std::move(src_stream),
+                                              std::move(dst_stream),
+                                              data_.data(),
+                                              data_.size(),
+                                              kMaxPuffPatchCacheSize));
+      return true;
+    }
+    default:
+      LOG(ERROR) << "Operation type "
+                 << InstallOperationTypeName(operation_.type())
+                 << " can't be pipelined.";
+      return false;
+  }
+}
+
+// Returns the memory needed to pipeline |operation| with the |block_size|.
+uint64_t OperationMemorySize(const InstallOperation& operation,
+                             uint32_t block_size) {
+  return operation.data_length() +
+         (utils::BlocksInExtents(operation.src_extents()) +
+          utils::BlocksInExtents(operation.dst_extents())) *
+             block_size;
+}
+
+}  // namespace
+
+bool DeltaPerformer::CanPipelineOperation(const InstallOperation& operation) {
+  if (max_apply_threads_ == 0 ||
+      OperationMemorySize(operation, block_size_) > kMaxApplyPipelineBytes) {
+    return false;
+  }
+
+  switch (operation.type()) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+      // The payload signature is extracted synchronously from its dummy
+      // REPLACE operation in major version 1 payloads.
+      return !manifest_.has_signatures_offset() ||
+             manifest_.signatures_offset() != operation.data_offset();
+    case InstallOperation::SOURCE_COPY:
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::PUFFDIFF:
+      return true;
+    default:
+      // MOVE and BSDIFF read the target partition and ZERO and DISCARD are
+      // just an ioctl() on it.
+      return false;
+  }
+}
+
+bool DeltaPerformer::PipelineOperation(const InstallOperation& operation,
+                                       ErrorCode* error) {
+  if (operation.has_src_length())
+    TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
+  if (operation.has_dst_length())
+    TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
+  if (operation.has_data_offset()) {
+    // Since we delete data off the beginning of the buffer as we use it,
+    // the data we need should be exactly at the beginning of the buffer.
+    TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
+    TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  }
+
+  if (!apply_pipeline_) {
+    apply_threads_ =
+        min(max_apply_threads_,
+            static_cast<size_t>(base::SysInfo::NumberOfProcessors()));
+    LOG(INFO) << "Applying operations with " << apply_threads_
+              << " worker threads.";
+    apply_pipeline_.reset(new ApplyPipeline(apply_threads_));
+  }
+
+  // Make room for this operation. This has to happen before consuming its data
+  // from |buffer_| since committing an operation may checkpoint the progress.
+  const uint64_t memory_size = OperationMemorySize(operation, block_size_);
+  while (!apply_pipeline_->empty() &&
+         (apply_pipeline_->size() >=
+              apply_threads_ * kApplyPipelineDepthPerThread ||
+          apply_pipeline_bytes_ + memory_size > kMaxApplyPipelineBytes)) {
+    TEST_AND_RETURN_FALSE(CommitFrontOperation(error));
+  }
+
+  brillo::Blob source_data;
+  if (operation.src_extents_size() > 0) {
+    TEST_AND_RETURN_FALSE(ChooseSourceFD(operation, error, &source_data) !=
+                          nullptr);
+  }
+
+  // Hand the data blob over to the job. Like DiscardBuffer(), this hashes the
+  // data in payload order and advances the buffer offset.
+  buffer_offset_ += buffer_.size();
+  UpdatePayloadHashes(buffer_.size());
+  brillo::Blob data = buffer_.Release();
+
+  auto job = std::make_unique<InstallOperationJob>(
+      operation, block_size_, std::move(data), std::move(source_data));
+  apply_pipeline_bytes_ += job->memory_size();
+  apply_pipeline_->Submit(std::move(job));
+  return true;
+}
+
+bool DeltaPerformer::CommitPipelinedOperations(bool wait, ErrorCode* error) {
+  while (apply_pipeline_ && !apply_pipeline_->empty() &&
+         (wait || apply_pipeline_->IsFrontDone())) {
+    if (!CommitFrontOperation(error))
+      return false;
+  }
+  return true;
+}
+
+bool DeltaPerformer::CommitFrontOperation(ErrorCode* error) {
+  bool op_result;
+  std::unique_ptr<ApplyPipeline::Job> job =
+      apply_pipeline_->PopFront(&op_result);
+  const InstallOperationJob* op_job =
+      static_cast<const InstallOperationJob*>(job.get());
+  apply_pipeline_bytes_ -= op_job->memory_size();
+  const InstallOperation& op = op_job->operation();
+
+  // Makes sure we unblock exit when this operation completes.
+  ScopedTerminatorExitUnblocker exit_unblocker =
+      ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
+
+  if (op_result) {
+    const brillo::Blob& target_data = op_job->target_data();
+    DirectExtentWriter writer;
+    op_result = writer.Init(target_fd_, op.dst_extents(), block_size_) &&
+                writer.Write(target_data.data(), target_data.size());
+  }
+  if (!HandleOpResult(op_result, InstallOperationTypeName(op.type()), error))
+    return false;
+
+  if (!target_fd_->Flush()) {
+    return false;
+  }
+
+  next_operation_num_++;
+  UpdateOverallProgress(false, "Completed ");
+  // The operations still in the pipeline are already included in the payload
+  // hash and |buffer_offset_|, so the progress can't be saved yet.
+  if (apply_pipeline_->empty())
+    CheckpointUpdateProgress(false);
+  return true;
+}
+
 bool DeltaPerformer::ExtractSignatureMessageFromOperation(
     const InstallOperation& operation) {
   if (operation.type() != InstallOperation::REPLACE ||
@@ -1583,7 +2055,7 @@ bool DeltaPerformer::ExtractSignatureMessage() {
   TEST_AND_RETURN_FALSE(buffer_offset_ == manifest_.signatures_offset());
   TEST_AND_RETURN_FALSE(buffer_.size() >= manifest_.signatures_size());
   signatures_message_data_.assign(
-      buffer_.begin(), buffer_.begin() + manifest_.signatures_size());
+      buffer_.data(), buffer_.data() + manifest_.signatures_size());
 
   // Save the signature blob because if the update is interrupted after the
   // download phase we don't go through this path anymore. Some alternatives to
@@ -1837,11 +2309,19 @@ void DeltaPerformer::DiscardBuffer(bool do_advance_offset,
     buffer_offset_ += buffer_.size();
 
   // Hash the content.
-  payload_hash_calculator_.Update(buffer_.data(), buffer_.size());
-  signed_hash_calculator_.Update(buffer_.data(), signed_hash_buffer_size);
+  UpdatePayloadHashes(signed_hash_buffer_size);
 
-  // Swap content with an empty vector to ensure that all memory is released.
-  brillo::Blob().swap(buffer_);
+  // Keep the allocated memory around for the next operation.
+  buffer_.Clear();
+}
+
+void DeltaPerformer::UpdatePayloadHashes(size_t signed_hash_buffer_size) {
+  hash_pool_.Update(&payload_hash_calculator_, buffer_.data(), buffer_.size());
+  hash_pool_.Update(
+      &signed_hash_calculator_, buffer_.data(), signed_hash_buffer_size);
+  // Like the single updates before, a failure only shows up as a hash
+  // mismatch later.
+  hash_pool_.Wait();
 }
 
 bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
@@ -1870,6 +2350,8 @@ bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
         next_data_offset >= 0))
     return false;
 
+  // Needed to verify the hash of the whole payload, even with a payload hash
+  // tree. See PrimeUpdateState().
   string sha256_context;
   if (!(prefs->GetString(kPrefsUpdateStateSHA256Context, &sha256_context) &&
         !sha256_context.empty()))
@@ -1889,11 +2371,26 @@ bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
   return true;
 }
 
+int64_t DeltaPerformer::GetNextDownloadOffset(PrefsInterface* prefs) {
+  // The update progress stored without a download offset resumes from the
+  // data of the next operation.
+  int64_t next_download_offset = -1;
+  if (prefs->GetInt64(kPrefsUpdateStateNextDownloadOffset,
+                      &next_download_offset) &&
+      next_download_offset >= 0) {
+    return next_download_offset;
+  }
+  int64_t next_data_offset = 0;
+  prefs->GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset);
+  return next_data_offset;
+}
+
 bool DeltaPerformer::ResetUpdateProgress(PrefsInterface* prefs, bool quick) {
   TEST_AND_RETURN_FALSE(prefs->SetInt64(kPrefsUpdateStateNextOperation,
                                         kUpdateStateOperationInvalid));
   if (!quick) {
     prefs->SetInt64(kPrefsUpdateStateNextDataOffset, -1);
+    prefs->SetInt64(kPrefsUpdateStateNextDownloadOffset, -1);
     prefs->SetInt64(kPrefsUpdateStateNextDataLength, 0);
     prefs->SetString(kPrefsUpdateStateSHA256Context, "");
     prefs->SetString(kPrefsUpdateStateSignedSHA256Context, "");
@@ -1917,6 +2414,22 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
   }
 
   Terminator::set_exit_blocked(true);
+  // Store the whole checkpoint at once when the prefs support transactions, so
+  // a power loss never leaves a mix of two checkpoints.
+  if (!prefs_->StartTransaction())
+    return StoreUpdateProgress();
+  if (!StoreUpdateProgress()) {
+    prefs_->CancelTransaction();
+  } else if (prefs_->SubmitTransaction()) {
+    return true;
+  }
+  // Nothing was stored, so the next checkpoint must store everything again.
+  LOG(ERROR) << "Unable to store the update progress.";
+  last_updated_buffer_offset_ = std::numeric_limits<uint64_t>::max();
+  return false;
+}
+
+bool DeltaPerformer::StoreUpdateProgress() {
   if (last_updated_buffer_offset_ != buffer_offset_) {
     // Resets the progress in case we die in the middle of the state update.
     ResetUpdateProgress(prefs_, true);
@@ -1927,6 +2440,12 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
                           signed_hash_calculator_.GetContext()));
     TEST_AND_RETURN_FALSE(
         prefs_->SetInt64(kPrefsUpdateStateNextDataOffset, buffer_offset_));
+    // With a payload hash tree, the download resumes from the start of the
+    // chunk of |buffer_offset_|, so the whole chunk is verified again.
+    TEST_AND_RETURN_FALSE(prefs_->SetInt64(
+        kPrefsUpdateStateNextDownloadOffset,
+        hash_tree_verifier_ ? hash_tree_verifier_->GetChunkStart(buffer_offset_)
+                            : buffer_offset_));
     last_updated_buffer_offset_ = buffer_offset_;
 
     if (next_operation_num_ < num_total_operations_) {
@@ -1967,6 +2486,16 @@ bool DeltaPerformer::PrimeUpdateState() {
       prefs_->GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset) &&
       next_data_offset >= 0);
   buffer_offset_ = next_data_offset;
+  // The download resumes from |next_download_offset|. The data received
+  // before |buffer_offset_| is only verified, since its operations were
+  // already applied.
+  int64_t next_download_offset = GetNextDownloadOffset(prefs_);
+  if (hash_tree_verifier_) {
+    TEST_AND_RETURN_FALSE(
+        hash_tree_verifier_->SetOffset(next_download_offset, buffer_offset_));
+  } else {
+    TEST_AND_RETURN_FALSE(next_download_offset == next_data_offset);
+  }
 
   // The signed hash context and the signature blob may be empty if the
   // interrupted update didn't reach the signature.
@@ -1979,6 +2508,11 @@ bool DeltaPerformer::PrimeUpdateState() {
 
   prefs_->GetString(kPrefsUpdateStateSignatureBlob, &signatures_message_data_);
 
+  // The payload hash tree doesn't replace the hash of the whole payload,
+  // which VerifyPayload() checks against the update check response. Only that
+  // hash covers the header, the metadata signature and the signatures blob.
+  // It also authenticates the manifest, and so the tree, when the metadata
+  // isn't signed. So an update can only resume with its hash context.
   string hash_context;
   TEST_AND_RETURN_FALSE(
       prefs_->GetString(kPrefsUpdateStateSHA256Context, &hash_context) &&
@@ -1998,7 +2532,7 @@ bool DeltaPerformer::PrimeUpdateState() {
 
   // Advance the download progress to reflect what doesn't need to be
   // re-downloaded.
-  total_bytes_received_ += buffer_offset_;
+  total_bytes_received_ += next_download_offset;
 
   // Speculatively count the resume as a failure.
   int64_t resumed_update_failures;
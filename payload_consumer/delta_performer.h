@@ -20,6 +20,7 @@
 #include <inttypes.h>
 
 #include <limits>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -29,10 +30,15 @@
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/hash_calculator_pool.h"
 #include "update_engine/common/platform_constants.h"
+#include "update_engine/payload_consumer/apply_pipeline.h"
+#include "update_engine/payload_consumer/block_cache_file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_writer.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/payload_data_buffer.h"
+#include "update_engine/payload_consumer/payload_hash_tree.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -61,6 +67,12 @@ class DeltaPerformer : public FileWriter {
   static const unsigned kProgressDownloadWeight;
   static const unsigned kProgressOperationsWeight;
   static const uint64_t kCheckpointFrequencySeconds;
+  // The default maximum number of worker threads used to apply the install
+  // operations. The actual number is also limited by the number of CPUs.
+  static const size_t kMaxApplyThreads;
+  // The default number of operations ahead of the current one whose source
+  // blocks are prefetched.
+  static const size_t kSourcePrefetchOperations;
 
   DeltaPerformer(PrefsInterface* prefs,
                  BootControlInterface* boot_control,
@@ -138,6 +150,10 @@ class DeltaPerformer : public FileWriter {
   static bool CanResumeUpdate(PrefsInterface* prefs,
                               const std::string& update_check_response_hash);
 
+  // Returns the offset in the payload data blobs from which to download the
+  // rest of an interrupted update, based on the persistent preferences.
+  static int64_t GetNextDownloadOffset(PrefsInterface* prefs);
+
   // Resets the persistent update progress state to indicate that an update
   // can't be resumed. Performs a quick update-in-progress reset if |quick| is
   // true, otherwise resets all progress-related update state. Returns true on
@@ -156,6 +172,23 @@ class DeltaPerformer : public FileWriter {
     public_key_path_ = public_key_path;
   }
 
+  // Sets the maximum number of worker threads used to apply the install
+  // operations. When set to 0 all the operations are applied synchronously
+  // from Write().
+  void set_max_apply_threads(size_t max_apply_threads) {
+    max_apply_threads_ = max_apply_threads;
+  }
+
+  // Sets the number of operations ahead of the current one whose source blocks
+  // are prefetched while their data is downloaded. 0 disables the prefetch.
+  void set_source_prefetch_operations(size_t source_prefetch_operations) {
+    source_prefetch_operations_ = source_prefetch_operations;
+  }
+
+  // Sets whether the partitions are read and written with io_uring when the
+  // kernel supports it, instead of the blocking system calls.
+  void set_use_io_uring(bool use_io_uring) { use_io_uring_ = use_io_uring; }
+
   // Return true if header parsing is finished and no errors occurred.
   bool IsHeaderParsed() const;
 
@@ -179,17 +212,16 @@ class DeltaPerformer : public FileWriter {
   FRIEND_TEST(DeltaPerformerTest, ChooseSourceFDTest);
   FRIEND_TEST(DeltaPerformerTest, UsePublicKeyFromResponse);
 
+  // Applies the operations and extracts the signature from the next |count|
+  // bytes of the payload data blobs at |c_bytes|, received after the manifest.
+  // Returns false and stores the error in |error| on failure.
+  bool WritePayloadData(const char* c_bytes, size_t count, ErrorCode* error);
+
   // Parse and move the update instructions of all partitions into our local
   // |partitions_| variable based on the version of the payload. Requires the
   // manifest to be parsed and valid.
   bool ParseManifestPartitions(ErrorCode* error);
 
-  // Appends up to |*count_p| bytes from |*bytes_p| to |buffer_|, but only to
-  // the extent that the size of |buffer_| does not exceed |max|. Advances
-  // |*cbytes_p| and decreases |*count_p| by the actual number of bytes copied,
-  // and returns this number.
-  size_t CopyDataToBuffer(const char** bytes_p, size_t* count_p, size_t max);
-
   // If |op_result| is false, emits an error message using |op_type_name| and
   // sets |*error| accordingly. Otherwise does nothing. Returns |op_result|.
   bool HandleOpResult(bool op_result,
@@ -235,9 +267,41 @@ class DeltaPerformer : public FileWriter {
   // For a given operation, choose the source fd to be used (raw device or error
   // correction device) based on the source operation hash.
   // Returns nullptr if the source hash mismatch cannot be corrected, and set
-  // the |error| accordingly.
+  // the |error| accordingly. If |source_data| is not null, the source data read
+  // from the returned fd is stored in it.
   FileDescriptorPtr ChooseSourceFD(const InstallOperation& operation,
-                                   ErrorCode* error);
+                                   ErrorCode* error,
+                                   brillo::Blob* source_data);
+
+  // Returns whether |operation| can be applied through the |apply_pipeline_|.
+  // Only the operations that don't read the target partition and whose data
+  // fits in the pipeline memory budget are pipelined.
+  bool CanPipelineOperation(const InstallOperation& operation);
+
+  // Wraps |source_fd_| in a |source_cache_fd_| keeping the source blocks read
+  // by more than one of the |partition| operations.
+  void SetupSourceBlockCache(const PartitionUpdate& partition);
+
+  // Hints the source partition to read the source blocks of the operations of
+  // the current partition up to |source_prefetch_operations_| after
+  // |partition_operation_num|, skipping the ones already prefetched.
+  void PrefetchSourceBlocks(size_t partition_operation_num);
+
+  // Reads the source data of |operation|, takes its data blob from |buffer_|
+  // and submits it to the |apply_pipeline_|. The operation is only written to
+  // the target partition once committed by CommitPipelinedOperations().
+  // Returns whether the operation was submitted and sets |error| on source
+  // hash mismatch.
+  bool PipelineOperation(const InstallOperation& operation, ErrorCode* error);
+
+  // Writes the result of the pipelined operations to the target partition in
+  // manifest order. If |wait| is true, waits for all the pipelined operations
+  // to finish, otherwise only commits those already finished. Returns false
+  // and sets |error| if an operation failed.
+  bool CommitPipelinedOperations(bool wait, ErrorCode* error);
+
+  // Waits for the oldest operation in the |apply_pipeline_| and commits it.
+  bool CommitFrontOperation(ErrorCode* error);
 
   // Extracts the payload signature message from the blob on the |operation| if
   // the offset matches the one specified by the manifest. Returns whether the
@@ -251,16 +315,24 @@ class DeltaPerformer : public FileWriter {
 
   // Updates the payload hash calculator with the bytes in |buffer_|, also
   // updates the signed hash calculator with the first |signed_hash_buffer_size|
-  // bytes in |buffer_|. Then discard the content, ensuring that memory is being
-  // deallocated. If |do_advance_offset|, advances the internal offset counter
-  // accordingly.
+  // bytes in |buffer_|. Then discard the content, keeping the memory for the
+  // next operation. If |do_advance_offset|, advances the internal offset
+  // counter accordingly.
   void DiscardBuffer(bool do_advance_offset, size_t signed_hash_buffer_size);
 
+  // Updates the payload hash calculator with the bytes in |buffer_| and the
+  // signed hash calculator with the first |signed_hash_buffer_size| bytes in
+  // |buffer_|, hashing both at the same time.
+  void UpdatePayloadHashes(size_t signed_hash_buffer_size);
+
   // Checkpoints the update progress into persistent storage to allow this
   // update attempt to be resumed after reboot.
   // If |force| is false, checkpoint may be throttled.
   bool CheckpointUpdateProgress(bool force);
 
+  // Stores the update progress of a checkpoint into the prefs.
+  bool StoreUpdateProgress();
+
   // Primes the required update state. Returns true if the update state was
   // successfully initialized to a saved resume state or if the update is a new
   // update. Returns false otherwise.
@@ -298,6 +370,10 @@ class DeltaPerformer : public FileWriter {
   // partition when using a delta payload.
   FileDescriptorPtr source_fd_{nullptr};
 
+  // The cache of the source blocks read by several operations |source_fd_|
+  // reads through, if any.
+  std::shared_ptr<BlockCacheFileDescriptor> source_cache_fd_;
+
   // File descriptor of the error corrected source partition. Only set while
   // updating partition using a delta payload for a partition where error
   // correction is available. The size of the error corrected device is smaller
@@ -358,7 +434,7 @@ class DeltaPerformer : public FileWriter {
   // A buffer used for accumulating downloaded data. Initially, it stores the
   // payload metadata; once that's downloaded and parsed, it stores data for the
   // next update operation.
-  brillo::Blob buffer_;
+  PayloadDataBuffer buffer_;
   // Offset of buffer_ in the binary blobs section of the update.
   uint64_t buffer_offset_{0};
 
@@ -368,6 +444,31 @@ class DeltaPerformer : public FileWriter {
   // The block size (parsed from the manifest).
   uint32_t block_size_{0};
 
+  // The maximum number of worker threads used to apply the operations.
+  size_t max_apply_threads_{kMaxApplyThreads};
+
+  // The number of operations ahead whose source blocks are prefetched, and the
+  // index in the current partition of the next operation to prefetch.
+  size_t source_prefetch_operations_{kSourcePrefetchOperations};
+  size_t next_prefetch_operation_num_{0};
+
+  // Whether the partitions are opened with an IoUringFileDescriptor.
+  bool use_io_uring_{true};
+
+  // The pipeline applying the operations in the worker threads, created when
+  // the first operation is pipelined. The operations in the pipeline were
+  // already consumed from the payload (their data is included in
+  // |buffer_offset_| and the hash calculators) but are not yet counted in
+  // |next_operation_num_| until committed, so the update progress can only be
+  // checkpointed while the pipeline is empty.
+  std::unique_ptr<ApplyPipeline> apply_pipeline_;
+
+  // The number of worker threads of |apply_pipeline_|.
+  size_t apply_threads_{0};
+
+  // Memory used by the operations in |apply_pipeline_|.
+  uint64_t apply_pipeline_bytes_{0};
+
   // Calculates the whole payload file hash, including headers and signatures.
   HashCalculator payload_hash_calculator_;
 
@@ -376,6 +477,16 @@ class DeltaPerformer : public FileWriter {
   // the metadata and doesn't include the payload signature itself.
   HashCalculator signed_hash_calculator_;
 
+  // Hashes the payload and the signed hash in parallel, the second one on its
+  // worker thread.
+  HashCalculatorPool hash_pool_{1};
+
+  // Verifies the chunks of the data blobs as they are received, if the
+  // manifest has a payload hash tree, and holds the data of each chunk until it
+  // is verified. Unlike the whole payload hash, this catches corrupted data
+  // before it is applied.
+  std::unique_ptr<PayloadHashTreeVerifier> hash_tree_verifier_;
+
   // Signatures message blob extracted directly from the payload.
   std::string signatures_message_data_;
 
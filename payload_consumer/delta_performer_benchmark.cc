@@ -0,0 +1,170 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Benchmark of the DeltaPerformer::Write() throughput for a payload of one
+// block REPLACE operations received in chunks of several sizes. The operations
+// received within one chunk are used in place by the PayloadDataBuffer, the
+// ones split across chunks are copied into it.
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <base/logging.h>
+#include <benchmark/benchmark.h>
+
+#include "update_engine/common/fake_boot_control.h"
+#include "update_engine/common/fake_hardware.h"
+#include "update_engine/common/prefs.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/delta_performer.h"
+#include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/payload_file.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const size_t kBlockSize = 4096;
+const size_t kNumOperations = 4096;
+
+// The payload and the partitions shared by all the benchmarks.
+class BenchmarkEnvironment {
+ public:
+  BenchmarkEnvironment() {
+    CHECK(temp_dir_.CreateUniqueTempDir());
+    CHECK(GeneratePayload());
+    target_path_ = temp_dir_.GetPath().Append("target").value();
+    CHECK(utils::WriteFile(target_path_.c_str(), nullptr, 0));
+    boot_control_.SetPartitionDevice(kPartitionNameRoot, 1, target_path_);
+    boot_control_.SetPartitionDevice(kPartitionNameRoot, 0, "/dev/null");
+    boot_control_.SetPartitionDevice(kPartitionNameKernel, 1, "/dev/null");
+    boot_control_.SetPartitionDevice(kPartitionNameKernel, 0, "/dev/null");
+  }
+
+  // Writes the payload to a new DeltaPerformer in chunks of |chunk_size|
+  // bytes. Returns whether the payload was applied.
+  bool ApplyPayload(size_t chunk_size) {
+    InstallPlan install_plan;
+    install_plan.source_slot = 0;
+    install_plan.target_slot = 1;
+    InstallPlan::Payload payload = payload_;
+    MemoryPrefs prefs;
+    DeltaPerformer performer(&prefs,
+                             &boot_control_,
+                             &hardware_,
+                             nullptr,
+                             &install_plan,
+                             &payload,
+                             false /* interactive */);
+    for (size_t offset = 0; offset < payload_data_.size();
+         offset += chunk_size) {
+      size_t count = std::min(chunk_size, payload_data_.size() - offset);
+      if (!performer.Write(payload_data_.data() + offset, count))
+        return false;
+    }
+    return performer.Close() == 0;
+  }
+
+  size_t payload_size() const { return payload_data_.size(); }
+
+ private:
+  // Generates a payload with |kNumOperations| one block REPLACE operations.
+  bool GeneratePayload() {
+    brillo::Blob blob_data;
+    vector<AnnotatedOperation> aops;
+    for (size_t i = 0; i < kNumOperations; i++) {
+      AnnotatedOperation aop;
+      *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+      aop.op.set_data_offset(blob_data.size());
+      aop.op.set_data_length(kBlockSize);
+      aop.op.set_type(InstallOperation::REPLACE);
+      aops.push_back(aop);
+      blob_data.insert(blob_data.end(), kBlockSize, static_cast<uint8_t>(i));
+    }
+    string blob_path = temp_dir_.GetPath().Append("blob").value();
+    TEST_AND_RETURN_FALSE(utils::WriteFile(
+        blob_path.c_str(), blob_data.data(), blob_data.size()));
+
+    PayloadGenerationConfig config;
+    config.version.major = kMaxSupportedMajorPayloadVersion;
+    config.version.minor = kMaxSupportedMinorPayloadVersion;
+    PayloadFile payload_file;
+    TEST_AND_RETURN_FALSE(payload_file.Init(config));
+    PartitionConfig old_part(kPartitionNameRoot);
+    old_part.path = "/dev/null";
+    PartitionConfig new_part(kPartitionNameRoot);
+    new_part.path = "/dev/zero";
+    new_part.size = blob_data.size();
+    TEST_AND_RETURN_FALSE(payload_file.AddPartition(old_part, new_part, aops));
+    old_part.name = kPartitionNameKernel;
+    new_part.name = kPartitionNameKernel;
+    new_part.size = 0;
+    TEST_AND_RETURN_FALSE(payload_file.AddPartition(old_part, new_part, {}));
+
+    string payload_path = temp_dir_.GetPath().Append("payload").value();
+    TEST_AND_RETURN_FALSE(payload_file.WritePayload(
+        payload_path, blob_path, "", &payload_.metadata_size));
+    TEST_AND_RETURN_FALSE(utils::ReadFile(payload_path, &payload_data_));
+    return true;
+  }
+
+  base::ScopedTempDir temp_dir_;
+  string target_path_;
+  brillo::Blob payload_data_;
+  InstallPlan::Payload payload_;
+  FakeBootControl boot_control_;
+  FakeHardware hardware_;
+};
+
+BenchmarkEnvironment* GetEnvironment() {
+  static BenchmarkEnvironment* environment = new BenchmarkEnvironment();
+  return environment;
+}
+
+// Chunks smaller than the operations force a copy of every operation, while
+// the operations are used in place from the 16KiB chunks the fetchers deliver
+// or from bigger ones.
+void BM_Write(benchmark::State& state) {
+  BenchmarkEnvironment* environment = GetEnvironment();
+  for (auto _ : state) {
+    if (!environment->ApplyPayload(state.range(0))) {
+      state.SkipWithError("The payload failed to apply.");
+      return;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * environment->payload_size());
+}
+
+BENCHMARK(BM_Write)
+    ->Arg(1024)
+    ->Arg(16 * 1024)
+    ->Arg(1024 * 1024)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+BENCHMARK_MAIN();
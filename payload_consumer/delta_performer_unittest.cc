@@ -20,6 +20,7 @@
 #include <inttypes.h>
 #include <time.h>
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <vector>
@@ -240,6 +241,27 @@ class DeltaPerformerTest : public ::testing::Test {
     return payload_data;
   }
 
+  // Generates a payload with |num_operations| one block REPLACE operations,
+  // each one filling its block with a different byte. The expected partition
+  // data is stored in |expected_data|.
+  brillo::Blob GenerateReplacePayload(size_t num_operations,
+                                      brillo::Blob* expected_data) {
+    const size_t kBlockSize = 4096;
+    expected_data->clear();
+    vector<AnnotatedOperation> aops;
+    for (size_t i = 0; i < num_operations; i++) {
+      AnnotatedOperation aop;
+      *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+      aop.op.set_data_offset(expected_data->size());
+      aop.op.set_data_length(kBlockSize);
+      aop.op.set_type(InstallOperation::REPLACE);
+      aops.push_back(aop);
+      expected_data->insert(
+          expected_data->end(), kBlockSize, static_cast<uint8_t>('a' + i));
+    }
+    return GeneratePayload(*expected_data, aops, false);
+  }
+
   brillo::Blob GenerateSourceCopyPayload(const brillo::Blob& copied_data,
                                          bool add_hash,
                                          PartitionConfig* old_part = nullptr) {
@@ -546,6 +568,74 @@ TEST_F(DeltaPerformerTest, ReplaceXzOperationTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
 }
 
+TEST_F(DeltaPerformerTest, MultipleReplaceOperationsTest) {
+  // Enough operations to fill the apply pipeline of all the worker threads.
+  brillo::Blob expected_data;
+  brillo::Blob payload_data = GenerateReplacePayload(
+      DeltaPerformer::kMaxApplyThreads * 4, &expected_data);
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, MultipleReplaceOperationsSynchronousTest) {
+  brillo::Blob expected_data;
+  brillo::Blob payload_data = GenerateReplacePayload(8, &expected_data);
+
+  performer_.set_max_apply_threads(0);
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, ReplaceOperationsWithoutIoUringTest) {
+  brillo::Blob expected_data;
+  brillo::Blob payload_data = GenerateReplacePayload(8, &expected_data);
+
+  performer_.set_use_io_uring(false);
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, WriteChunkSizesTest) {
+  // The operation data may be split across any number of Write() calls, or
+  // several operations may be received in one of them.
+  const size_t kBlockSize = 4096;
+  const size_t kNumOperations = 8;
+  brillo::Blob expected_data;
+  brillo::Blob payload_data =
+      GenerateReplacePayload(kNumOperations, &expected_data);
+
+  for (size_t chunk_size : {static_cast<size_t>(1),
+                            static_cast<size_t>(kBlockSize - 1),
+                            static_cast<size_t>(16 * 1024),
+                            payload_data.size()}) {
+    test_utils::ScopedTempFile new_part("Partition-XXXXXX");
+    fake_boot_control_.SetPartitionDevice(
+        kPartitionNameRoot, install_plan_.target_slot, new_part.path());
+    fake_boot_control_.SetPartitionDevice(
+        kPartitionNameRoot, install_plan_.source_slot, "/dev/null");
+    fake_boot_control_.SetPartitionDevice(
+        kPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+    fake_boot_control_.SetPartitionDevice(
+        kPartitionNameKernel, install_plan_.source_slot, "/dev/null");
+
+    DeltaPerformer performer(&prefs_,
+                             &fake_boot_control_,
+                             &fake_hardware_,
+                             &mock_delegate_,
+                             &install_plan_,
+                             &payload_,
+                             false /* interactive*/);
+    for (size_t offset = 0; offset < payload_data.size();
+         offset += chunk_size) {
+      size_t count = std::min(chunk_size, payload_data.size() - offset);
+      ASSERT_TRUE(performer.Write(payload_data.data() + offset, count));
+    }
+    EXPECT_EQ(0, performer.Close());
+
+    brillo::Blob partition_data;
+    EXPECT_TRUE(utils::ReadFile(new_part.path(), &partition_data));
+    EXPECT_EQ(expected_data, partition_data) << "chunk_size=" << chunk_size;
+  }
+}
+
 TEST_F(DeltaPerformerTest, ZeroOperationTest) {
   brillo::Blob existing_data = brillo::Blob(4096 * 10, 'a');
   brillo::Blob expected_data = existing_data;
@@ -731,7 +821,8 @@ TEST_F(DeltaPerformerTest, ChooseSourceFDTest) {
   op.set_src_sha256_hash(src_hash.data(), src_hash.size());
 
   ErrorCode error = ErrorCode::kSuccess;
-  EXPECT_EQ(performer_.source_ecc_fd_, performer_.ChooseSourceFD(op, &error));
+  EXPECT_EQ(performer_.source_ecc_fd_,
+            performer_.ChooseSourceFD(op, &error, nullptr));
   EXPECT_EQ(ErrorCode::kSuccess, error);
   // Verify that the fake_fec was actually used.
   EXPECT_EQ(1U, fake_fec->GetReadOps().size());
@@ -221,10 +221,8 @@ void DownloadAction::StartDownloading() {
     // If there're remaining unprocessed data blobs, fetch them. Be careful not
     // to request data beyond the end of the payload to avoid 416 HTTP response
     // error codes.
-    int64_t next_data_offset = 0;
-    prefs_->GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset);
-    uint64_t resume_offset =
-        manifest_metadata_size + manifest_signature_size + next_data_offset;
+    uint64_t resume_offset = manifest_metadata_size + manifest_signature_size +
+                             DeltaPerformer::GetNextDownloadOffset(prefs_);
     if (!payload_->size) {
       http_fetcher_->AddRange(base_offset_ + resume_offset);
     } else if (resume_offset < payload_->size) {
@@ -106,6 +106,16 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
 
   void set_base_offset(int64_t base_offset) { base_offset_ = base_offset; }
 
+  // Downloads the payload over up to |connections| fetchers created by
+  // |factory| at the same time, buffering up to |max_buffered_bytes| received
+  // ahead of the DeltaPerformer.
+  void SetParallelDownload(const MultiRangeHttpFetcher::FetcherFactory& factory,
+                           size_t connections,
+                           size_t max_buffered_bytes) {
+    http_fetcher_->SetParallelTransfers(
+        factory, connections, max_buffered_bytes);
+  }
+
   HttpFetcher* http_fetcher() { return http_fetcher_.get(); }
 
   // Returns the p2p file id for the file being written or the empty
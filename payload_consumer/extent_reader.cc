@@ -17,6 +17,7 @@
 #include "update_engine/payload_consumer/extent_reader.h"
 
 #include <algorithm>
+#include <vector>
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -65,26 +66,20 @@ bool DirectExtentReader::Seek(uint64_t offset) {
 }
 
 bool DirectExtentReader::Read(void* buffer, size_t count) {
-  auto bytes = reinterpret_cast<uint8_t*>(buffer);
+  // Collect the ranges of the extents covered by this read and read them all
+  // at once, so the file descriptor can issue them concurrently.
+  std::vector<FileDescriptor::Range> ranges;
   uint64_t bytes_read = 0;
   while (bytes_read < count) {
-    if (cur_extent_ == extents_.end()) {
-      TEST_AND_RETURN_FALSE(bytes_read == count);
-    }
+    TEST_AND_RETURN_FALSE(cur_extent_ != extents_.end());
     uint64_t cur_extent_bytes_left =
         cur_extent_->num_blocks() * block_size_ - cur_extent_bytes_read_;
     uint64_t bytes_to_read =
         std::min(count - bytes_read, cur_extent_bytes_left);
 
-    ssize_t out_bytes_read;
-    TEST_AND_RETURN_FALSE(utils::PReadAll(
-        fd_,
-        bytes + bytes_read,
-        bytes_to_read,
-        cur_extent_->start_block() * block_size_ + cur_extent_bytes_read_,
-        &out_bytes_read));
-    TEST_AND_RETURN_FALSE(out_bytes_read ==
-                          static_cast<ssize_t>(bytes_to_read));
+    const off64_t offset =
+        cur_extent_->start_block() * block_size_ + cur_extent_bytes_read_;
+    ranges.push_back({offset, static_cast<size_t>(bytes_to_read)});
 
     bytes_read += bytes_to_read;
     cur_extent_bytes_read_ += bytes_to_read;
@@ -95,6 +90,30 @@ bool DirectExtentReader::Read(void* buffer, size_t count) {
       cur_extent_bytes_read_ = 0;
     }
   }
+  return fd_->ReadRanges(ranges, buffer);
+}
+
+bool BlobExtentReader::Init(FileDescriptorPtr fd,
+                            const RepeatedPtrField<Extent>& extents,
+                            uint32_t block_size) {
+  TEST_AND_RETURN_FALSE(blob_->size() ==
+                        utils::BlocksInExtents(extents) * block_size);
+  offset_ = 0;
+  return true;
+}
+
+bool BlobExtentReader::Seek(uint64_t offset) {
+  TEST_AND_RETURN_FALSE(offset <= blob_->size());
+  offset_ = offset;
+  return true;
+}
+
+bool BlobExtentReader::Read(void* buffer, size_t count) {
+  TEST_AND_RETURN_FALSE(offset_ + count <= blob_->size());
+  std::copy(blob_->begin() + offset_,
+            blob_->begin() + offset_ + count,
+            reinterpret_cast<uint8_t*>(buffer));
+  offset_ += count;
   return true;
 }
 
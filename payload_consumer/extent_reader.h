@@ -19,6 +19,8 @@
 
 #include <vector>
 
+#include <brillo/secure_blob.h>
+
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -77,6 +79,29 @@ class DirectExtentReader : public ExtentReader {
   DISALLOW_COPY_AND_ASSIGN(DirectExtentReader);
 };
 
+// BlobExtentReader reads the data of the extents from a memory buffer that
+// already holds all of them concatenated together, for example as read with a
+// DirectExtentReader.
+class BlobExtentReader : public ExtentReader {
+ public:
+  explicit BlobExtentReader(const brillo::Blob* blob) : blob_(blob) {}
+  ~BlobExtentReader() override = default;
+
+  bool Init(FileDescriptorPtr fd,
+            const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Seek(uint64_t offset) override;
+  bool Read(void* bytes, size_t count) override;
+
+ private:
+  const brillo::Blob* blob_;
+
+  // Offset assuming all extents are concatenated.
+  uint64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(BlobExtentReader);
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_READER_H_
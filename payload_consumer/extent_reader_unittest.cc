@@ -167,4 +167,34 @@ TEST_F(ExtentReaderTest, RandomReadTest) {
   }
 }
 
+TEST_F(ExtentReaderTest, BlobReaderTest) {
+  vector<Extent> extents = {ExtentForRange(1, 1), ExtentForRange(4, 2)};
+  brillo::Blob data;
+  ReadExtents(extents, &data);
+
+  BlobExtentReader reader(&data);
+  EXPECT_TRUE(
+      reader.Init(nullptr, {extents.begin(), extents.end()}, kBlockSize));
+
+  brillo::Blob blob(kBlockSize);
+  EXPECT_TRUE(reader.Seek(kBlockSize + 3));
+  EXPECT_TRUE(reader.Read(blob.data(), blob.size()));
+  ExpectVectorsEq(
+      brillo::Blob(data.begin() + kBlockSize + 3,
+                   data.begin() + 2 * kBlockSize + 3),
+      blob);
+
+  // Reading past the end of the extents fails.
+  EXPECT_FALSE(reader.Read(blob.data(), 2 * kBlockSize));
+  EXPECT_FALSE(reader.Seek(data.size() + 1));
+}
+
+TEST_F(ExtentReaderTest, BlobReaderSizeMismatchTest) {
+  vector<Extent> extents = {ExtentForRange(1, 2)};
+  brillo::Blob data(kBlockSize);
+  BlobExtentReader reader(&data);
+  EXPECT_FALSE(
+      reader.Init(nullptr, {extents.begin(), extents.end()}, kBlockSize));
+}
+
 }  // namespace chromeos_update_engine
@@ -21,6 +21,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <vector>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
@@ -32,7 +33,12 @@ namespace chromeos_update_engine {
 bool DirectExtentWriter::Write(const void* bytes, size_t count) {
   if (count == 0)
     return true;
+  // Collect the ranges of the extents covered by this write and write them all
+  // at once, so the file descriptor can issue them concurrently. Sparse holes
+  // split the data into several batches.
   const char* c_bytes = reinterpret_cast<const char*>(bytes);
+  std::vector<FileDescriptor::Range> ranges;
+  size_t batch_start = 0;
   size_t bytes_written = 0;
   while (bytes_written < count) {
     TEST_AND_RETURN_FALSE(cur_extent_ != extents_.end());
@@ -47,10 +53,11 @@ bool DirectExtentWriter::Write(const void* bytes, size_t count) {
     if (cur_extent_->start_block() != kSparseHole) {
       const off64_t offset =
           cur_extent_->start_block() * block_size_ + extent_bytes_written_;
-      TEST_AND_RETURN_FALSE_ERRNO(fd_->Seek(offset, SEEK_SET) !=
-                                  static_cast<off64_t>(-1));
-      TEST_AND_RETURN_FALSE(
-          utils::WriteAll(fd_, c_bytes + bytes_written, bytes_to_write));
+      ranges.push_back({offset, bytes_to_write});
+    } else {
+      TEST_AND_RETURN_FALSE(fd_->WriteRanges(ranges, c_bytes + batch_start));
+      ranges.clear();
+      batch_start = bytes_written + bytes_to_write;
     }
     bytes_written += bytes_to_write;
     extent_bytes_written_ += bytes_to_write;
@@ -62,6 +69,13 @@ bool DirectExtentWriter::Write(const void* bytes, size_t count) {
       cur_extent_++;
     }
   }
+  return fd_->WriteRanges(ranges, c_bytes + batch_start);
+}
+
+bool BlobExtentWriter::Write(const void* bytes, size_t count) {
+  TEST_AND_RETURN_FALSE(blob_->size() + count <= capacity_);
+  const uint8_t* c_bytes = reinterpret_cast<const uint8_t*>(bytes);
+  blob_->insert(blob_->end(), c_bytes, c_bytes + count);
   return true;
 }
 
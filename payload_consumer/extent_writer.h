@@ -76,6 +76,33 @@ class DirectExtentWriter : public ExtentWriter {
   google::protobuf::RepeatedPtrField<Extent>::iterator cur_extent_;
 };
 
+// An ExtentWriter that appends the data to a memory buffer instead of writing
+// it to the extents. The data written is limited to the size of the extents
+// passed to Init(), so it can later be written to them with a
+// DirectExtentWriter.
+class BlobExtentWriter : public ExtentWriter {
+ public:
+  explicit BlobExtentWriter(brillo::Blob* blob) : blob_(blob) {}
+  ~BlobExtentWriter() override = default;
+
+  bool Init(FileDescriptorPtr fd,
+            const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override {
+    capacity_ = utils::BlocksInExtents(extents) * block_size;
+    blob_->clear();
+    blob_->reserve(capacity_);
+    return true;
+  }
+  bool Write(const void* bytes, size_t count) override;
+
+ private:
+  brillo::Blob* blob_;
+  // The total size of the extents passed to Init().
+  uint64_t capacity_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(BlobExtentWriter);
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_WRITER_H_
@@ -180,4 +180,20 @@ TEST_F(ExtentWriterTest, SparseFileTest) {
   ExpectVectorsEq(expected_data, resultant_data);
 }
 
+TEST_F(ExtentWriterTest, BlobWriterTest) {
+  vector<Extent> extents = {ExtentForRange(1, 1), ExtentForRange(5, 1)};
+  brillo::Blob blob;
+  BlobExtentWriter writer(&blob);
+  EXPECT_TRUE(
+      writer.Init(nullptr, {extents.begin(), extents.end()}, kBlockSize));
+
+  brillo::Blob data(kBlockSize + 10, 'a');
+  EXPECT_TRUE(writer.Write(data.data(), data.size()));
+  EXPECT_EQ(data, blob);
+  // Writing more data than the extents can hold fails.
+  EXPECT_FALSE(writer.Write(data.data(), data.size()));
+  EXPECT_TRUE(writer.Write(data.data(), kBlockSize - 10));
+  EXPECT_EQ(2 * kBlockSize, blob.size());
+}
+
 }  // namespace chromeos_update_engine
@@ -28,6 +28,42 @@
 
 namespace chromeos_update_engine {
 
+bool FileDescriptor::ReadRanges(const std::vector<Range>& ranges, void* buf) {
+  uint8_t* bytes = static_cast<uint8_t*>(buf);
+  for (const Range& range : ranges) {
+    TEST_AND_RETURN_FALSE_ERRNO(Seek(range.offset, SEEK_SET) ==
+                                range.offset);
+    size_t bytes_read = 0;
+    while (bytes_read < range.length) {
+      ssize_t rc = Read(bytes + bytes_read, range.length - bytes_read);
+      TEST_AND_RETURN_FALSE_ERRNO(rc >= 0);
+      // Reading past the end of the file is an error.
+      TEST_AND_RETURN_FALSE(rc > 0);
+      bytes_read += rc;
+    }
+    bytes += range.length;
+  }
+  return true;
+}
+
+bool FileDescriptor::WriteRanges(const std::vector<Range>& ranges,
+                                 const void* buf) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(buf);
+  for (const Range& range : ranges) {
+    TEST_AND_RETURN_FALSE_ERRNO(Seek(range.offset, SEEK_SET) ==
+                                range.offset);
+    size_t bytes_written = 0;
+    while (bytes_written < range.length) {
+      ssize_t rc = Write(bytes + bytes_written, range.length - bytes_written);
+      TEST_AND_RETURN_FALSE_ERRNO(rc >= 0);
+      TEST_AND_RETURN_FALSE(rc > 0);
+      bytes_written += rc;
+    }
+    bytes += range.length;
+  }
+  return true;
+}
+
 bool EintrSafeFileDescriptor::Open(const char* path, int flags, mode_t mode) {
   CHECK_EQ(fd_, -1);
   return ((fd_ = HANDLE_EINTR(open(path, flags, mode))) >= 0);
@@ -67,6 +103,11 @@ off64_t EintrSafeFileDescriptor::Seek(off64_t offset, int whence) {
   return lseek64(fd_, offset, whence);
 }
 
+bool EintrSafeFileDescriptor::ReadAhead(off64_t offset, uint64_t length) {
+  CHECK_GE(fd_, 0);
+  return posix_fadvise(fd_, offset, length, POSIX_FADV_WILLNEED) == 0;
+}
+
 uint64_t EintrSafeFileDescriptor::BlockDevSize() {
   if (fd_ < 0)
     return 0;
@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <memory>
+#include <vector>
 
 #include <base/logging.h>
 
@@ -48,6 +49,12 @@ using FileDescriptorPtr = std::shared_ptr<FileDescriptor>;
 // An abstract class defining the file descriptor API.
 class FileDescriptor {
  public:
+  // A range of |length| bytes starting at |offset| in the file.
+  struct Range {
+    off64_t offset;
+    size_t length;
+  };
+
   FileDescriptor() {}
   virtual ~FileDescriptor() {}
 
@@ -72,6 +79,22 @@ class FileDescriptor {
   // may set errno accordingly.
   virtual off64_t Seek(off64_t offset, int whence) = 0;
 
+  // Reads all the |ranges| into |buf|, one after the other. The descriptor
+  // must be open prior to this call. Implementations may read several ranges
+  // at the same time and leave the file offset anywhere. The default
+  // implementation uses Seek() and Read(). Returns whether all the data was
+  // read.
+  virtual bool ReadRanges(const std::vector<Range>& ranges, void* buf);
+
+  // Writes |buf| to the |ranges|, one after the other. Same as ReadRanges()
+  // otherwise.
+  virtual bool WriteRanges(const std::vector<Range>& ranges, const void* buf);
+
+  // Hints that the |length| bytes starting at |offset| will be read soon, so
+  // the implementation can start reading them in the background. Returns
+  // whether the hint is supported. The default implementation does nothing.
+  virtual bool ReadAhead(off64_t offset, uint64_t length) { return false; }
+
   // Return the size of the block device in bytes, or 0 if the device is not a
   // block device or an error occurred.
   virtual uint64_t BlockDevSize() = 0;
@@ -118,6 +141,7 @@ class EintrSafeFileDescriptor : public FileDescriptor {
   ssize_t Read(void* buf, size_t count) override;
   ssize_t Write(const void* buf, size_t count) override;
   off64_t Seek(off64_t offset, int whence) override;
+  bool ReadAhead(off64_t offset, uint64_t length) override;
   uint64_t BlockDevSize() override;
   bool BlkIoctl(int request,
                 uint64_t start,
@@ -21,6 +21,7 @@
 #include <base/logging.h>
 
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/hash_calculator_pool.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/extent_reader.h"
 #include "update_engine/payload_consumer/extent_writer.h"
@@ -37,33 +38,48 @@ const uint64_t kMaxCopyBufferSize = 1024 * 1024;
 
 bool CommonHashExtents(FileDescriptorPtr source,
                        const RepeatedPtrField<Extent>& src_extents,
-                       DirectExtentWriter* writer,
+                       ExtentWriter* writer,
                        uint64_t block_size,
-                       brillo::Blob* hash_out) {
+                       brillo::Blob* hash_out,
+                       HashCalculatorPool* hash_pool) {
   auto total_blocks = utils::BlocksInExtents(src_extents);
   auto buffer_blocks = kMaxCopyBufferSize / block_size;
   // Ensure we copy at least one block at a time.
   if (buffer_blocks < 1)
     buffer_blocks = 1;
-  brillo::Blob buf(buffer_blocks * block_size);
+  // With a |hash_pool| a buffer is hashed while the next one is read into the
+  // other buffer.
+  const bool use_hash_pool = hash_pool && hash_out;
+  brillo::Blob bufs[2];
+  for (size_t i = 0; i < (use_hash_pool ? 2 : 1); i++)
+    bufs[i].resize(std::min(total_blocks, buffer_blocks) * block_size);
 
   DirectExtentReader reader;
   TEST_AND_RETURN_FALSE(reader.Init(source, src_extents, block_size));
 
   HashCalculator source_hasher;
-  while (total_blocks > 0) {
+  bool success = true;
+  for (size_t i = 0; success && total_blocks > 0; i++) {
+    brillo::Blob& buf = bufs[use_hash_pool ? i % 2 : 0];
     auto read_blocks = std::min(total_blocks, buffer_blocks);
-    TEST_AND_RETURN_FALSE(reader.Read(buf.data(), read_blocks * block_size));
-    if (hash_out != nullptr) {
-      TEST_AND_RETURN_FALSE(
-          source_hasher.Update(buf.data(), read_blocks * block_size));
-    }
-    if (writer) {
-      TEST_AND_RETURN_FALSE(
-          writer->Write(buf.data(), read_blocks * block_size));
+    size_t read_size = read_blocks * block_size;
+    success = reader.Read(buf.data(), read_size);
+    if (success && use_hash_pool) {
+      // The hash of the previous buffer must be done before the next read
+      // reuses it.
+      success = hash_pool->Wait();
+      hash_pool->Update(&source_hasher, buf.data(), read_size);
+    } else if (success && hash_out != nullptr) {
+      success = source_hasher.Update(buf.data(), read_size);
     }
+    if (success && writer)
+      success = writer->Write(buf.data(), read_size);
     total_blocks -= read_blocks;
   }
+  // The buffers can't be released while they are being hashed.
+  if (use_hash_pool)
+    success = hash_pool->Wait() && success;
+  TEST_AND_RETURN_FALSE(success);
 
   if (hash_out != nullptr) {
     TEST_AND_RETURN_FALSE(source_hasher.Finalize());
@@ -81,21 +97,36 @@ bool CopyAndHashExtents(FileDescriptorPtr source,
                         FileDescriptorPtr target,
                         const RepeatedPtrField<Extent>& tgt_extents,
                         uint64_t block_size,
-                        brillo::Blob* hash_out) {
+                        brillo::Blob* hash_out,
+                        HashCalculatorPool* hash_pool) {
   DirectExtentWriter writer;
   TEST_AND_RETURN_FALSE(writer.Init(target, tgt_extents, block_size));
   TEST_AND_RETURN_FALSE(utils::BlocksInExtents(src_extents) ==
                         utils::BlocksInExtents(tgt_extents));
-  TEST_AND_RETURN_FALSE(
-      CommonHashExtents(source, src_extents, &writer, block_size, hash_out));
+  TEST_AND_RETURN_FALSE(CommonHashExtents(
+      source, src_extents, &writer, block_size, hash_out, hash_pool));
   return true;
 }
 
 bool ReadAndHashExtents(FileDescriptorPtr source,
                         const RepeatedPtrField<Extent>& extents,
                         uint64_t block_size,
-                        brillo::Blob* hash_out) {
-  return CommonHashExtents(source, extents, nullptr, block_size, hash_out);
+                        brillo::Blob* hash_out,
+                        HashCalculatorPool* hash_pool) {
+  return CommonHashExtents(
+      source, extents, nullptr, block_size, hash_out, hash_pool);
+}
+
+bool ReadAndHashExtentsToBlob(FileDescriptorPtr source,
+                              const RepeatedPtrField<Extent>& extents,
+                              uint64_t block_size,
+                              brillo::Blob* data_out,
+                              brillo::Blob* hash_out,
+                              HashCalculatorPool* hash_pool) {
+  BlobExtentWriter writer(data_out);
+  TEST_AND_RETURN_FALSE(writer.Init(nullptr, extents, block_size));
+  return CommonHashExtents(
+      source, extents, &writer, block_size, hash_out, hash_pool);
 }
 
 }  // namespace fd_utils
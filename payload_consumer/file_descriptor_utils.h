@@ -19,6 +19,7 @@
 
 #include <brillo/secure_blob.h>
 
+#include "update_engine/common/hash_calculator_pool.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -34,23 +35,38 @@ namespace fd_utils {
 // false and the value pointed by |hash_out| is undefined.
 // The |source| and |target| files must be different, or otherwise |src_extents|
 // and |tgt_extents| must not overlap.
+// If |hash_pool| is not null, the blocks are hashed on it while the next ones
+// are read. Nothing else may be queued on |hash_pool| during the call.
 bool CopyAndHashExtents(
     FileDescriptorPtr source,
     const google::protobuf::RepeatedPtrField<Extent>& src_extents,
     FileDescriptorPtr target,
     const google::protobuf::RepeatedPtrField<Extent>& tgt_extents,
     uint64_t block_size,
-    brillo::Blob* hash_out);
+    brillo::Blob* hash_out,
+    HashCalculatorPool* hash_pool);
 
 // Reads blocks from |source| and calculates the hash. The blocks to read are
 // specified by |extents|. Stores the hash in |hash_out| if it is not null. The
 // block sizes are passed as |block_size|. In case of error reading, it returns
-// false and the value pointed by |hash_out| is undefined.
+// false and the value pointed by |hash_out| is undefined. The |hash_pool| is
+// used as in CopyAndHashExtents().
 bool ReadAndHashExtents(
     FileDescriptorPtr source,
     const google::protobuf::RepeatedPtrField<Extent>& extents,
     uint64_t block_size,
-    brillo::Blob* hash_out);
+    brillo::Blob* hash_out,
+    HashCalculatorPool* hash_pool);
+
+// Same as ReadAndHashExtents() but also stores the data read from the |extents|
+// in |data_out|, concatenated together.
+bool ReadAndHashExtentsToBlob(
+    FileDescriptorPtr source,
+    const google::protobuf::RepeatedPtrField<Extent>& extents,
+    uint64_t block_size,
+    brillo::Blob* data_out,
+    brillo::Blob* hash_out,
+    HashCalculatorPool* hash_pool);
 
 }  // namespace fd_utils
 }  // namespace chromeos_update_engine
@@ -26,6 +26,7 @@
 #include <gtest/gtest.h>
 
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/hash_calculator_pool.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/fake_file_descriptor.h"
@@ -85,7 +86,7 @@ TEST_F(FileDescriptorUtilsTest, CopyAndHashExtentsMismatchBlocksTest) {
   auto tgt_extents = CreateExtentList({{0, 5}});
 
   EXPECT_FALSE(fd_utils::CopyAndHashExtents(
-      source_, src_extents, target_, tgt_extents, 4, nullptr));
+      source_, src_extents, target_, tgt_extents, 4, nullptr, nullptr));
 }
 
 // Failing to read from the source should fail the copy.
@@ -94,7 +95,7 @@ TEST_F(FileDescriptorUtilsTest, CopyAndHashExtentsReadFailureTest) {
   fake_source_->AddFailureRange(10, 5);
 
   EXPECT_FALSE(fd_utils::CopyAndHashExtents(
-      source_, extents, target_, extents, 4, nullptr));
+      source_, extents, target_, extents, 4, nullptr, nullptr));
 }
 
 // Failing to write to the target should fail the copy.
@@ -106,7 +107,7 @@ TEST_F(FileDescriptorUtilsTest, CopyAndHashExtentsWriteFailureTest) {
   // Note that we pass |source_| as the target as well, which should fail to
   // write.
   EXPECT_FALSE(fd_utils::CopyAndHashExtents(
-      source_, src_extents, source_, tgt_extents, 4, nullptr));
+      source_, src_extents, source_, tgt_extents, 4, nullptr, nullptr));
 }
 
 // Test that we can copy extents without hashing them, allowing a nullptr
@@ -115,7 +116,7 @@ TEST_F(FileDescriptorUtilsTest, CopyAndHashExtentsWithoutHashingTest) {
   auto extents = CreateExtentList({{0, 5}});
 
   EXPECT_TRUE(fd_utils::CopyAndHashExtents(
-      source_, extents, target_, extents, 4, nullptr));
+      source_, extents, target_, extents, 4, nullptr, nullptr));
   ExpectTarget("00000001000200030004");
 }
 
@@ -129,7 +130,7 @@ TEST_F(FileDescriptorUtilsTest, CopyAndHashExtentsManyToOneTest) {
   auto tgt_extents = CreateExtentList({{0, 5}});
 
   EXPECT_TRUE(fd_utils::CopyAndHashExtents(
-      source_, src_extents, target_, tgt_extents, 4, &hash_out));
+      source_, src_extents, target_, tgt_extents, 4, &hash_out, nullptr));
   const char kExpectedResult[] = "00010004000200030000";
   ExpectTarget(kExpectedResult);
 
@@ -145,7 +146,7 @@ TEST_F(FileDescriptorUtilsTest, CopyAndHashExtentsManyToManyTest) {
   auto tgt_extents = CreateExtentList({{2, 3}, {0, 2}});
 
   EXPECT_TRUE(fd_utils::CopyAndHashExtents(
-      source_, src_extents, target_, tgt_extents, 4, &hash_out));
+      source_, src_extents, target_, tgt_extents, 4, &hash_out, nullptr));
   // The reads always match the source extent list of blocks (up to the
   // internal buffer size).
   std::vector<std::pair<uint64_t, uint64_t>> kExpectedOps = {
@@ -172,13 +173,15 @@ TEST_F(FileDescriptorUtilsTest, ReadAndHashExtentsReadFailureTest) {
   auto extents = CreateExtentList({{0, 5}});
   fake_source_->AddFailureRange(10, 5);
   brillo::Blob hash_out;
-  EXPECT_FALSE(fd_utils::ReadAndHashExtents(source_, extents, 4, &hash_out));
+  EXPECT_FALSE(
+      fd_utils::ReadAndHashExtents(source_, extents, 4, &hash_out, nullptr));
 }
 
 // Test that if hash_out is null, it still works.
 TEST_F(FileDescriptorUtilsTest, ReadAndHashExtentsWithoutHashingTest) {
   auto extents = CreateExtentList({{0, 5}});
-  EXPECT_TRUE(fd_utils::ReadAndHashExtents(source_, extents, 4, nullptr));
+  EXPECT_TRUE(
+      fd_utils::ReadAndHashExtents(source_, extents, 4, nullptr, nullptr));
 }
 
 // Tests that it can calculate the hash properly.
@@ -186,7 +189,8 @@ TEST_F(FileDescriptorUtilsTest, ReadAndHashExtentsTest) {
   // Reorder the input as 1 4 2 3 0.
   auto extents = CreateExtentList({{1, 1}, {4, 1}, {2, 2}, {0, 1}});
   brillo::Blob hash_out;
-  EXPECT_TRUE(fd_utils::ReadAndHashExtents(source_, extents, 4, &hash_out));
+  EXPECT_TRUE(
+      fd_utils::ReadAndHashExtents(source_, extents, 4, &hash_out, nullptr));
 
   const char kExpectedResult[] = "00010004000200030000";
   brillo::Blob expected_hash;
@@ -195,4 +199,80 @@ TEST_F(FileDescriptorUtilsTest, ReadAndHashExtentsTest) {
   EXPECT_EQ(expected_hash, hash_out);
 }
 
+// Tests that the data read is returned together with its hash.
+TEST_F(FileDescriptorUtilsTest, ReadAndHashExtentsToBlobTest) {
+  // Reorder the input as 1 4 2 3 0.
+  auto extents = CreateExtentList({{1, 1}, {4, 1}, {2, 2}, {0, 1}});
+  brillo::Blob data_out;
+  brillo::Blob hash_out;
+  EXPECT_TRUE(fd_utils::ReadAndHashExtentsToBlob(
+      source_, extents, 4, &data_out, &hash_out, nullptr));
+
+  const char kExpectedResult[] = "00010004000200030000";
+  EXPECT_EQ(brillo::Blob(kExpectedResult,
+                         kExpectedResult + strlen(kExpectedResult)),
+            data_out);
+  brillo::Blob expected_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(data_out, &expected_hash));
+  EXPECT_EQ(expected_hash, hash_out);
+}
+
+// Tests that extents larger than the copy buffer are read and hashed in several
+// pieces, in the order of the extents.
+TEST_F(FileDescriptorUtilsTest, ReadAndHashExtentsToBlobMultipleBuffersTest) {
+  const uint64_t kBlockSize = 4096;
+  // 300 blocks don't fit in the 1 MiB copy buffer.
+  auto extents = CreateExtentList({{300, 100}, {0, 200}});
+  brillo::Blob data_out;
+  brillo::Blob hash_out;
+  EXPECT_TRUE(fd_utils::ReadAndHashExtentsToBlob(
+      source_, extents, kBlockSize, &data_out, &hash_out, nullptr));
+
+  brillo::Blob source_data = FakeFileDescriptorData(400 * kBlockSize);
+  brillo::Blob expected_data(source_data.begin() + 300 * kBlockSize,
+                             source_data.end());
+  expected_data.insert(expected_data.end(),
+                       source_data.begin(),
+                       source_data.begin() + 200 * kBlockSize);
+  EXPECT_EQ(expected_data, data_out);
+  brillo::Blob expected_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(expected_data, &expected_hash));
+  EXPECT_EQ(expected_hash, hash_out);
+}
+
+// Tests that hashing on a HashCalculatorPool while the next blocks are read
+// gives the same data and hash, over several copy buffers.
+TEST_F(FileDescriptorUtilsTest, CopyAndHashExtentsHashPoolTest) {
+  const uint64_t kBlockSize = 4096;
+  // 600 blocks don't fit in two 1 MiB copy buffers.
+  auto src_extents = CreateExtentList({{300, 300}, {0, 300}});
+  auto tgt_extents = CreateExtentList({{0, 600}});
+  brillo::Blob expected_hash;
+  EXPECT_TRUE(fd_utils::ReadAndHashExtents(
+      source_, src_extents, kBlockSize, &expected_hash, nullptr));
+
+  HashCalculatorPool hash_pool(1);
+  brillo::Blob hash_out;
+  EXPECT_TRUE(fd_utils::CopyAndHashExtents(source_,
+                                           src_extents,
+                                           target_,
+                                           tgt_extents,
+                                           kBlockSize,
+                                           &hash_out,
+                                           &hash_pool));
+  EXPECT_EQ(expected_hash, hash_out);
+  brillo::Blob source_data = FakeFileDescriptorData(600 * kBlockSize);
+  std::string expected_data(source_data.begin() + 300 * kBlockSize,
+                            source_data.end());
+  expected_data.append(source_data.begin(),
+                       source_data.begin() + 300 * kBlockSize);
+  ExpectTarget(expected_data);
+
+  // A read failure is reported once the pending hashes are done.
+  fake_source_->AddFailureRange(100 * kBlockSize, 1);
+  EXPECT_FALSE(fd_utils::ReadAndHashExtents(
+      source_, src_extents, kBlockSize, &hash_out, &hash_pool));
+  EXPECT_TRUE(hash_pool.Wait());
+}
+
 }  // namespace chromeos_update_engine
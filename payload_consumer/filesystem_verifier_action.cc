@@ -23,9 +23,12 @@
 
 #include <algorithm>
 #include <cstdlib>
+#include <memory>
 #include <string>
+#include <utility>
 
 #include <base/bind.h>
+#include <base/posix/eintr_wrapper.h>
 #include <brillo/data_encoding.h>
 #include <brillo/streams/file_stream.h>
 
@@ -37,9 +40,22 @@ using std::string;
 namespace chromeos_update_engine {
 
 namespace {
-const off_t kReadFileBufferSize = 128 * 1024;
+const off_t kReadFileBufferSize = 1024 * 1024;
+
+// The number of partitions hashed at the same time. Hashing is mostly bound by
+// the latency of the reads, so hashing several partitions keeps the storage
+// busy.
+const size_t kMaxParallelPartitions = 4;
+
+// The number of buffers the kernel is asked to read ahead of the current read
+// in each partition.
+const size_t kReadAheadBuffers = 4;
 }  // namespace
 
+FilesystemVerifierAction::FilesystemVerifierAction()
+    : max_parallel_partitions_(kMaxParallelPartitions),
+      read_ahead_buffers_(kReadAheadBuffers) {}
+
 void FilesystemVerifierAction::PerformAction() {
   // Will tell the ActionProcessor we've failed if we return.
   ScopedActionCompleter abort_action_completer(processor_, this);
@@ -58,6 +74,9 @@ void FilesystemVerifierAction::PerformAction() {
     return;
   }
 
+  for (const InstallPlan::Partition& partition : install_plan_.partitions)
+    total_bytes_ += partition.target_size;
+
   StartPartitionHashing();
   abort_action_completer.set_should_complete(false);
 }
@@ -68,9 +87,8 @@ void FilesystemVerifierAction::TerminateProcessing() {
 }
 
 void FilesystemVerifierAction::Cleanup(ErrorCode code) {
-  src_stream_.reset();
-  // This memory is not used anymore.
-  buffer_.clear();
+  // This also releases the buffers, their memory is not used anymore.
+  hashers_.clear();
 
   if (cancelled_)
     return;
@@ -79,185 +97,246 @@ void FilesystemVerifierAction::Cleanup(ErrorCode code) {
   processor_->ActionComplete(this, code);
 }
 
-void FilesystemVerifierAction::StartPartitionHashing() {
-  if (partition_index_ == install_plan_.partitions.size()) {
+bool FilesystemVerifierAction::StartPartitionHashing() {
+  // The source partition is only hashed for the partition which target hash
+  // didn't match, so only the target partitions are hashed in parallel.
+  while (verifier_step_ == VerifierStep::kVerifyTargetHash &&
+         hashers_.size() < std::max(max_parallel_partitions_, size_t{1}) &&
+         next_partition_index_ < install_plan_.partitions.size()) {
+    if (!StartHashingPartition(next_partition_index_++))
+      return false;
+  }
+  if (hashers_.empty()) {
     Cleanup(ErrorCode::kSuccess);
-    return;
+    return false;
   }
+  return true;
+}
+
+bool FilesystemVerifierAction::StartHashingPartition(size_t partition_index) {
   const InstallPlan::Partition& partition =
-      install_plan_.partitions[partition_index_];
+      install_plan_.partitions[partition_index];
 
+  auto hasher = std::make_unique<PartitionHasher>();
+  hasher->partition_index = partition_index;
   string part_path;
   switch (verifier_step_) {
     case VerifierStep::kVerifySourceHash:
       part_path = partition.source_path;
-      partition_size_ = partition.source_size;
+      hasher->size = partition.source_size;
       break;
     case VerifierStep::kVerifyTargetHash:
       part_path = partition.target_path;
-      partition_size_ = partition.target_size;
+      hasher->size = partition.target_size;
       break;
   }
 
   if (part_path.empty()) {
-    if (partition_size_ == 0) {
-      LOG(INFO) << "Skip hashing partition " << partition_index_ << " ("
+    if (hasher->size == 0) {
+      LOG(INFO) << "Skip hashing partition " << partition_index << " ("
                 << partition.name << ") because size is 0.";
-      partition_index_++;
-      StartPartitionHashing();
-      return;
+      return true;
     }
-    LOG(ERROR) << "Cannot hash partition " << partition_index_ << " ("
+    LOG(ERROR) << "Cannot hash partition " << partition_index << " ("
                << partition.name
                << ") because its device path cannot be determined.";
     Cleanup(ErrorCode::kFilesystemVerifierError);
-    return;
+    return false;
   }
 
-  LOG(INFO) << "Hashing partition " << partition_index_ << " ("
+  LOG(INFO) << "Hashing partition " << partition_index << " ("
             << partition.name << ") on device " << part_path;
 
+  // Open the file descriptor ourselves to also use it for the read ahead.
+  hasher->fd = HANDLE_EINTR(open(part_path.c_str(), O_RDONLY));
   brillo::ErrorPtr error;
-  src_stream_ =
-      brillo::FileStream::Open(base::FilePath(part_path),
-                               brillo::Stream::AccessMode::READ,
-                               brillo::FileStream::Disposition::OPEN_EXISTING,
-                               &error);
+  if (hasher->fd >= 0) {
+    hasher->stream = brillo::FileStream::FromFileDescriptor(
+        hasher->fd, true /* own_descriptor */, &error);
+    if (!hasher->stream)
+      IGNORE_EINTR(close(hasher->fd));
+  }
 
-  if (!src_stream_) {
+  if (!hasher->stream) {
     LOG(ERROR) << "Unable to open " << part_path << " for reading";
     Cleanup(ErrorCode::kFilesystemVerifierError);
-    return;
+    return false;
   }
 
-  buffer_.resize(kReadFileBufferSize);
-  hasher_ = std::make_unique<HashCalculator>();
-
-  offset_ = 0;
+  hasher->buffer.resize(kReadFileBufferSize);
+  hasher->hasher = std::make_unique<HashCalculator>();
   if (verifier_step_ == VerifierStep::kVerifyTargetHash &&
       install_plan_.write_verity) {
-    if (!verity_writer_->Init(partition)) {
+    hasher->verity_writer = verity_writer::CreateVerityWriter();
+    if (!hasher->verity_writer->Init(partition)) {
       Cleanup(ErrorCode::kVerityCalculationError);
-      return;
+      return false;
     }
   }
 
   // Start the first read.
-  ScheduleRead();
+  hashers_.push_back(std::move(hasher));
+  return ScheduleRead(hashers_.back().get());
 }
 
-void FilesystemVerifierAction::ScheduleRead() {
+bool FilesystemVerifierAction::ScheduleRead(PartitionHasher* hasher) {
   const InstallPlan::Partition& partition =
-      install_plan_.partitions[partition_index_];
+      install_plan_.partitions[hasher->partition_index];
 
   // We can only start reading anything past |hash_tree_offset| after we have
   // already read all the data blocks that the hash tree covers. The same
   // applies to FEC.
-  uint64_t read_end = partition_size_;
+  uint64_t read_end = hasher->size;
   if (partition.hash_tree_size != 0 &&
-      offset_ < partition.hash_tree_data_offset + partition.hash_tree_data_size)
+      hasher->offset <
+          partition.hash_tree_data_offset + partition.hash_tree_data_size)
     read_end = std::min(read_end, partition.hash_tree_offset);
   if (partition.fec_size != 0 &&
-      offset_ < partition.fec_data_offset + partition.fec_data_size)
+      hasher->offset < partition.fec_data_offset + partition.fec_data_size)
     read_end = std::min(read_end, partition.fec_offset);
-  size_t bytes_to_read =
-      std::min(static_cast<uint64_t>(buffer_.size()), read_end - offset_);
-  if (!bytes_to_read) {
-    FinishPartitionHashing();
-    return;
+  size_t bytes_to_read = std::min(static_cast<uint64_t>(hasher->buffer.size()),
+                                  read_end - hasher->offset);
+  if (!bytes_to_read)
+    return FinishPartitionHashing(hasher);
+
+  // Let the kernel read the next buffers while this one is being hashed. This
+  // is only a hint, so errors are ignored.
+  uint64_t read_ahead_end = std::min(
+      read_end,
+      hasher->offset + hasher->buffer.size() * (read_ahead_buffers_ + 1));
+  if (read_ahead_buffers_ > 0 && read_ahead_end > hasher->read_ahead_end) {
+    uint64_t read_ahead_start =
+        std::max(hasher->offset, hasher->read_ahead_end);
+    posix_fadvise(hasher->fd,
+                  read_ahead_start,
+                  read_ahead_end - read_ahead_start,
+                  POSIX_FADV_WILLNEED);
+    hasher->read_ahead_end = read_ahead_end;
   }
 
-  bool read_async_ok = src_stream_->ReadAsync(
-      buffer_.data(),
+  bool read_async_ok = hasher->stream->ReadAsync(
+      hasher->buffer.data(),
       bytes_to_read,
       base::Bind(&FilesystemVerifierAction::OnReadDoneCallback,
-                 base::Unretained(this)),
+                 base::Unretained(this),
+                 base::Unretained(hasher)),
       base::Bind(&FilesystemVerifierAction::OnReadErrorCallback,
-                 base::Unretained(this)),
+                 base::Unretained(this),
+                 base::Unretained(hasher)),
       nullptr);
 
   if (!read_async_ok) {
     LOG(ERROR) << "Unable to schedule an asynchronous read from the stream.";
     Cleanup(ErrorCode::kError);
+    return false;
   }
+  return true;
 }
 
-void FilesystemVerifierAction::OnReadDoneCallback(size_t bytes_read) {
+void FilesystemVerifierAction::OnReadDoneCallback(PartitionHasher* hasher,
+                                                  size_t bytes_read) {
   if (cancelled_) {
     Cleanup(ErrorCode::kError);
     return;
   }
 
   if (bytes_read == 0) {
-    LOG(ERROR) << "Failed to read the remaining " << partition_size_ - offset_
-               << " bytes from partition "
-               << install_plan_.partitions[partition_index_].name;
+    LOG(ERROR) << "Failed to read the remaining "
+               << hasher->size - hasher->offset << " bytes from partition "
+               << install_plan_.partitions[hasher->partition_index].name;
     Cleanup(ErrorCode::kFilesystemVerifierError);
     return;
   }
 
-  if (!hasher_->Update(buffer_.data(), bytes_read)) {
+  hash_pool_.Update(hasher->hasher.get(), hasher->buffer.data(), bytes_read);
+  bool verity_updated = true;
+  if (hasher->verity_writer) {
+    verity_updated = hasher->verity_writer->Update(
+        hasher->offset, hasher->buffer.data(), bytes_read);
+  }
+  if (!hash_pool_.Wait()) {
     LOG(ERROR) << "Unable to update the hash.";
     Cleanup(ErrorCode::kError);
     return;
   }
+  if (!verity_updated) {
+    Cleanup(ErrorCode::kVerityCalculationError);
+    return;
+  }
 
-  if (verifier_step_ == VerifierStep::kVerifyTargetHash &&
-      install_plan_.write_verity) {
-    if (!verity_writer_->Update(offset_, buffer_.data(), bytes_read)) {
-      Cleanup(ErrorCode::kVerityCalculationError);
-      return;
+  hasher->offset += bytes_read;
+
+  if (verifier_step_ == VerifierStep::kVerifyTargetHash && total_bytes_ > 0) {
+    // Log the progress of all the partitions every 10%.
+    uint64_t old_percent = hashed_bytes_ * 100 / total_bytes_;
+    hashed_bytes_ += bytes_read;
+    uint64_t percent = hashed_bytes_ * 100 / total_bytes_;
+    if (percent / 10 != old_percent / 10) {
+      LOG(INFO) << "Verified " << percent << "% of the "
+                << install_plan_.partitions.size() << " partitions.";
     }
   }
 
-  offset_ += bytes_read;
-
-  if (offset_ == partition_size_) {
-    FinishPartitionHashing();
+  if (hasher->offset == hasher->size) {
+    FinishPartitionHashing(hasher);
     return;
   }
 
-  ScheduleRead();
+  ScheduleRead(hasher);
 }
 
-void FilesystemVerifierAction::OnReadErrorCallback(const brillo::Error* error) {
+void FilesystemVerifierAction::OnReadErrorCallback(
+    PartitionHasher* hasher, const brillo::Error* error) {
   // TODO(deymo): Transform the read-error into an specific ErrorCode.
   LOG(ERROR) << "Asynchronous read failed.";
   Cleanup(ErrorCode::kError);
 }
 
-void FilesystemVerifierAction::FinishPartitionHashing() {
-  if (!hasher_->Finalize()) {
+bool FilesystemVerifierAction::FinishPartitionHashing(
+    PartitionHasher* hasher) {
+  if (!hasher->hasher->Finalize()) {
     LOG(ERROR) << "Unable to finalize the hash.";
     Cleanup(ErrorCode::kError);
-    return;
+    return false;
+  }
+  if (hasher->verity_writer && !hasher->verity_writer->Finalize()) {
+    Cleanup(ErrorCode::kVerityCalculationError);
+    return false;
   }
-  InstallPlan::Partition& partition =
-      install_plan_.partitions[partition_index_];
+  size_t partition_index = hasher->partition_index;
+  InstallPlan::Partition& partition = install_plan_.partitions[partition_index];
   LOG(INFO) << "Hash of " << partition.name << ": "
-            << Base64Encode(hasher_->raw_hash());
+            << Base64Encode(hasher->hasher->raw_hash());
 
   switch (verifier_step_) {
     case VerifierStep::kVerifyTargetHash:
-      if (partition.target_hash != hasher_->raw_hash()) {
+      if (partition.target_hash != hasher->hasher->raw_hash()) {
         LOG(ERROR) << "New '" << partition.name
                    << "' partition verification failed.";
         if (partition.source_hash.empty()) {
           // No need to verify source if it is a full payload.
           Cleanup(ErrorCode::kNewRootfsVerificationError);
-          return;
+          return false;
         }
         // If we have not verified source partition yet, now that the target
         // partition does not match, and it's not a full payload, we need to
         // switch to kVerifySourceHash step to check if it's because the source
-        // partition does not match either.
+        // partition does not match either. The other partitions don't matter
+        // anymore, so stop hashing them.
         verifier_step_ = VerifierStep::kVerifySourceHash;
-      } else {
-        partition_index_++;
+        hashers_.clear();
+        if (!StartHashingPartition(partition_index))
+          return false;
+        if (hashers_.empty()) {
+          // The source partition was skipped.
+          Cleanup(ErrorCode::kNewRootfsVerificationError);
+          return false;
+        }
+        return true;
       }
       break;
     case VerifierStep::kVerifySourceHash:
-      if (partition.source_hash != hasher_->raw_hash()) {
+      if (partition.source_hash != hasher->hasher->raw_hash()) {
         LOG(ERROR) << "Old '" << partition.name
                    << "' partition verification failed.";
         LOG(ERROR) << "This is a server-side error due to mismatched delta"
@@ -270,7 +349,7 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
                       " means that the delta I've been given doesn't match my"
                       " existing system. The "
                    << partition.name << " partition I have has hash: "
-                   << Base64Encode(hasher_->raw_hash())
+                   << Base64Encode(hasher->hasher->raw_hash())
                    << " but the update expected me to have "
                    << Base64Encode(partition.source_hash) << " .";
         LOG(INFO) << "To get the checksum of the " << partition.name
@@ -282,7 +361,7 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
         LOG(INFO) << "To get the checksum of partitions in a bin file, "
                   << "run: .../src/scripts/sha256_partitions.sh .../file.bin";
         Cleanup(ErrorCode::kDownloadStateInitializationError);
-        return;
+        return false;
       }
       // The action will skip kVerifySourceHash step if target partition hash
       // matches, if we are in this step, it means target hash does not match,
@@ -291,13 +370,21 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
       // We only need to verify the source partition which the target hash does
       // not match, the rest of the partitions don't matter.
       Cleanup(ErrorCode::kNewRootfsVerificationError);
-      return;
+      return false;
   }
   // Start hashing the next partition, if any.
-  hasher_.reset();
-  buffer_.clear();
-  src_stream_->CloseBlocking(nullptr);
-  StartPartitionHashing();
+  RemoveHasher(hasher);
+  return StartPartitionHashing();
+}
+
+void FilesystemVerifierAction::RemoveHasher(PartitionHasher* hasher) {
+  hasher->stream->CloseBlocking(nullptr);
+  hashers_.erase(
+      std::find_if(hashers_.begin(),
+                   hashers_.end(),
+                   [hasher](const std::unique_ptr<PartitionHasher>& item) {
+                     return item.get() == hasher;
+                   }));
 }
 
 }  // namespace chromeos_update_engine
@@ -28,6 +28,7 @@
 
 #include "update_engine/common/action.h"
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/hash_calculator_pool.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/verity_writer_interface.h"
 
@@ -51,34 +52,88 @@ enum class VerifierStep {
 
 class FilesystemVerifierAction : public InstallPlanAction {
  public:
-  FilesystemVerifierAction()
-      : verity_writer_(verity_writer::CreateVerityWriter()) {}
+  FilesystemVerifierAction();
   ~FilesystemVerifierAction() override = default;
 
   void PerformAction() override;
   void TerminateProcessing() override;
 
+  // Sets the maximum number of partitions hashed at the same time.
+  void set_max_parallel_partitions(size_t max_parallel_partitions) {
+    max_parallel_partitions_ = max_parallel_partitions;
+  }
+
+  // Sets the number of buffers the kernel is asked to read ahead of the
+  // current read in each partition.
+  void set_read_ahead_buffers(size_t read_ahead_buffers) {
+    read_ahead_buffers_ = read_ahead_buffers;
+  }
+
   // Debugging/logging
   static std::string StaticType() { return "FilesystemVerifierAction"; }
   std::string Type() const override { return StaticType(); }
 
  private:
   friend class FilesystemVerifierActionTestDelegate;
-  // Starts the hashing of the current partition. If there aren't any partitions
-  // remaining to be hashed, it finishes the action.
-  void StartPartitionHashing();
 
-  // Schedules the asynchronous read of the filesystem.
-  void ScheduleRead();
+  // The state of a partition being hashed.
+  struct PartitionHasher {
+    // The index in the install_plan_.partitions vector of the partition.
+    size_t partition_index{0};
+
+    // The FileStream used to read from the device, and its file descriptor.
+    brillo::StreamPtr stream;
+    int fd{-1};
+
+    // Buffer for storing data we read.
+    brillo::Blob buffer;
+
+    // Calculates the hash of the data.
+    std::unique_ptr<HashCalculator> hasher;
+
+    // Write verity data of the partition.
+    std::unique_ptr<VerityWriterInterface> verity_writer;
+
+    // Reads and hashes this many bytes from the head of the input stream. This
+    // is initialized from the corresponding InstallPlan::Partition size which
+    // is the total size update_engine is expected to write, and may be smaller
+    // than the size of the partition in gpt.
+    uint64_t size{0};
+
+    // The byte offset that we are reading in the partition.
+    uint64_t offset{0};
 
-  // Called from the main loop when a single read from |src_stream_| succeeds or
-  // fails, calling OnReadDoneCallback() and OnReadErrorCallback() respectively.
-  void OnReadDoneCallback(size_t bytes_read);
-  void OnReadErrorCallback(const brillo::Error* error);
+    // The end of the data the kernel was already asked to read ahead.
+    uint64_t read_ahead_end{0};
+  };
 
-  // When the read is done, finalize the hash checking of the current partition
-  // and continue checking the next one.
-  void FinishPartitionHashing();
+  // Starts hashing the next partitions until |max_parallel_partitions_| are
+  // being hashed at the same time. If there aren't any partitions remaining to
+  // be hashed, it finishes the action.
+  // This and the methods below returning a bool return false if they finished
+  // the action, in which case the action may have been destroyed already.
+  bool StartPartitionHashing();
+
+  // Starts hashing the partition at |partition_index| in the current
+  // |verifier_step_|.
+  bool StartHashingPartition(size_t partition_index);
+
+  // Schedules the asynchronous read of the filesystem of |hasher|.
+  bool ScheduleRead(PartitionHasher* hasher);
+
+  // Called from the main loop when a single read from the stream of |hasher|
+  // succeeds or fails, calling OnReadDoneCallback() and OnReadErrorCallback()
+  // respectively.
+  void OnReadDoneCallback(PartitionHasher* hasher, size_t bytes_read);
+  void OnReadErrorCallback(PartitionHasher* hasher,
+                           const brillo::Error* error);
+
+  // When all the reads of |hasher| are done, finalize the hash checking of its
+  // partition and continue checking the next one.
+  bool FinishPartitionHashing(PartitionHasher* hasher);
+
+  // Removes |hasher| from |hashers_|, closing its stream.
+  void RemoveHasher(PartitionHasher* hasher);
 
   // Cleans up all the variables we use for async operations and tells the
   // ActionProcessor we're done w/ |code| as passed in. |cancelled_| should be
@@ -88,36 +143,28 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // The type of the partition that we are verifying.
   VerifierStep verifier_step_ = VerifierStep::kVerifyTargetHash;
 
-  // The index in the install_plan_.partitions vector of the partition currently
-  // being hashed.
-  size_t partition_index_{0};
-
-  // If not null, the FileStream used to read from the device.
-  brillo::StreamPtr src_stream_;
+  // The index in the install_plan_.partitions vector of the next partition to
+  // start hashing.
+  size_t next_partition_index_{0};
 
-  // Buffer for storing data we read.
-  brillo::Blob buffer_;
+  // The partitions being hashed.
+  std::vector<std::unique_ptr<PartitionHasher>> hashers_;
 
   bool cancelled_{false};  // true if the action has been cancelled.
 
   // The install plan we're passed in via the input pipe.
   InstallPlan install_plan_;
 
-  // Calculates the hash of the data.
-  std::unique_ptr<HashCalculator> hasher_;
-
-  // Write verity data of the current partition.
-  std::unique_ptr<VerityWriterInterface> verity_writer_;
+  // Hashes the data on a worker thread while the verity data is computed.
+  HashCalculatorPool hash_pool_{1};
 
-  // Reads and hashes this many bytes from the head of the input stream. When
-  // the partition starts to be hashed, this field is initialized from the
-  // corresponding InstallPlan::Partition size which is the total size
-  // update_engine is expected to write, and may be smaller than the size of the
-  // partition in gpt.
-  uint64_t partition_size_{0};
+  size_t max_parallel_partitions_;
+  size_t read_ahead_buffers_;
 
-  // The byte offset that we are reading in the current partition.
-  uint64_t offset_{0};
+  // The total number of bytes of the target partitions to hash and the number
+  // of them hashed so far, used to log the progress of all the partitions.
+  uint64_t total_bytes_{0};
+  uint64_t hashed_bytes_{0};
 
   DISALLOW_COPY_AND_ASSIGN(FilesystemVerifierAction);
 };
@@ -19,6 +19,7 @@
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <base/bind.h>
 #include <base/posix/eintr_wrapper.h>
@@ -70,7 +71,8 @@ class FilesystemVerifierActionTestDelegate : public ActionProcessorDelegate {
     if (action->Type() == FilesystemVerifierAction::StaticType()) {
       ran_ = true;
       code_ = code;
-      EXPECT_FALSE(static_cast<FilesystemVerifierAction*>(action)->src_stream_);
+      EXPECT_TRUE(
+          static_cast<FilesystemVerifierAction*>(action)->hashers_.empty());
     } else if (action->Type() ==
                ObjectCollectorAction<InstallPlan>::StaticType()) {
       auto collector_action =
@@ -254,6 +256,57 @@ TEST_F(FilesystemVerifierActionTest, NonExistentDriveTest) {
   EXPECT_EQ(ErrorCode::kFilesystemVerifierError, delegate.code_);
 }
 
+TEST_F(FilesystemVerifierActionTest, MultiplePartitionsTest) {
+  // More partitions than the ones hashed in parallel, of different sizes.
+  const size_t kNumPartitions = 6;
+  std::vector<std::unique_ptr<test_utils::ScopedTempFile>> part_files;
+  InstallPlan install_plan;
+  for (size_t i = 0; i < kNumPartitions; i++) {
+    part_files.push_back(
+        std::make_unique<test_utils::ScopedTempFile>("part_file.XXXXXX"));
+    brillo::Blob part_data((i + 1) * 512 * 1024 + i);
+    test_utils::FillWithData(&part_data);
+    ASSERT_TRUE(
+        test_utils::WriteFileVector(part_files.back()->path(), part_data));
+    InstallPlan::Partition part;
+    part.name = "part" + std::to_string(i);
+    part.target_path = part_files.back()->path();
+    part.target_size = part_data.size();
+    ASSERT_TRUE(HashCalculator::RawHashOfData(part_data, &part.target_hash));
+    install_plan.partitions.push_back(part);
+  }
+  // A skipped partition.
+  InstallPlan::Partition empty_part;
+  empty_part.name = "empty";
+  install_plan.partitions.push_back(empty_part);
+
+  for (bool hash_fail : {false, true}) {
+    if (hash_fail)
+      install_plan.partitions[3].target_hash[0] ^= 0xff;
+    BuildActions(install_plan);
+
+    FilesystemVerifierActionTestDelegate delegate;
+    processor_.set_delegate(&delegate);
+
+    loop_.PostTask(
+        FROM_HERE,
+        base::Bind(
+            [](ActionProcessor* processor) { processor->StartProcessing(); },
+            base::Unretained(&processor_)));
+    loop_.Run();
+
+    EXPECT_FALSE(processor_.IsRunning());
+    EXPECT_TRUE(delegate.ran());
+    EXPECT_EQ(hash_fail ? ErrorCode::kNewRootfsVerificationError
+                        : ErrorCode::kSuccess,
+              delegate.code());
+  }
+  // The streams of the partitions still being hashed when the hash of another
+  // one failed may leak some null callbacks.
+  while (loop_.RunOnce(false)) {
+  }
+}
+
 TEST_F(FilesystemVerifierActionTest, RunAsRootVerifyHashTest) {
   ASSERT_EQ(0U, getuid());
   EXPECT_TRUE(DoTest(false, false));
@@ -0,0 +1,359 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <deque>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const unsigned IoUringFileDescriptor::kQueueDepth = 32;
+
+namespace {
+
+// There is no libc wrapper for the io_uring system calls.
+int IoUringSetup(unsigned entries, struct io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int IoUringEnter(int ring_fd,
+                 unsigned to_submit,
+                 unsigned min_complete,
+                 unsigned flags) {
+  return syscall(
+      __NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+// Maps the |size| bytes of the io_uring region at |offset|. Returns nullptr on
+// failure.
+void* MapRing(int ring_fd, size_t size, off_t offset) {
+  void* ptr = mmap(nullptr,
+                   size,
+                   PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE,
+                   ring_fd,
+                   offset);
+  return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+template <typename T>
+T* RingPointer(void* ring, uint32_t offset) {
+  return reinterpret_cast<T*>(static_cast<uint8_t*>(ring) + offset);
+}
+
+// The part of a range still to be read or written.
+struct Request {
+  off64_t offset;
+  struct iovec iov;
+};
+
+}  // namespace
+
+IoUringFileDescriptor::~IoUringFileDescriptor() {
+  TearDown();
+}
+
+bool IoUringFileDescriptor::IsSupported() {
+  static bool supported = [] {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = IoUringSetup(1, &params);
+    if (ring_fd < 0) {
+      PLOG(INFO) << "io_uring is not supported";
+      return false;
+    }
+    IGNORE_EINTR(close(ring_fd));
+    return true;
+  }();
+  return supported;
+}
+
+bool IoUringFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  if (!EintrSafeFileDescriptor::Open(path, flags, mode))
+    return false;
+  SetUp(path, flags);
+  return true;
+}
+
+bool IoUringFileDescriptor::Open(const char* path, int flags) {
+  if (!EintrSafeFileDescriptor::Open(path, flags))
+    return false;
+  SetUp(path, flags);
+  return true;
+}
+
+ssize_t IoUringFileDescriptor::Write(const void* buf, size_t count) {
+  if (!sync_writes_)
+    unsynced_buffered_writes_ = true;
+  return EintrSafeFileDescriptor::Write(buf, count);
+}
+
+bool IoUringFileDescriptor::ReadRanges(const vector<Range>& ranges,
+                                       void* buf) {
+  if (ring_fd_ < 0)
+    return EintrSafeFileDescriptor::ReadRanges(ranges, buf);
+  return TransferRanges(false, ranges, static_cast<uint8_t*>(buf));
+}
+
+bool IoUringFileDescriptor::WriteRanges(const vector<Range>& ranges,
+                                        const void* buf) {
+  if (ring_fd_ < 0)
+    return EintrSafeFileDescriptor::WriteRanges(ranges, buf);
+  // The buffer is only read by the kernel for write requests.
+  return TransferRanges(
+      true, ranges, const_cast<uint8_t*>(static_cast<const uint8_t*>(buf)));
+}
+
+bool IoUringFileDescriptor::ReadAhead(off64_t offset, uint64_t length) {
+  // The block aligned reads bypass the page cache with O_DIRECT, so the data
+  // read ahead into it would never be used.
+  if (direct_fd_ >= 0)
+    return false;
+  return EintrSafeFileDescriptor::ReadAhead(offset, length);
+}
+
+bool IoUringFileDescriptor::Close() {
+  TearDown();
+  return EintrSafeFileDescriptor::Close();
+}
+
+void IoUringFileDescriptor::SetUp(const char* path, int flags) {
+  sync_writes_ = (flags & (O_DSYNC | O_SYNC)) != 0;
+  unsynced_buffered_writes_ = false;
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd_ = IoUringSetup(kQueueDepth, &params);
+  if (ring_fd_ < 0) {
+    PLOG(WARNING) << "Unable to set up io_uring for " << path
+                  << ", using blocking I/O.";
+    return;
+  }
+  sq_entries_ = params.sq_entries;
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sq_ring_ = MapRing(ring_fd_, sq_ring_size_, IORING_OFF_SQ_RING);
+  cq_ring_ = MapRing(ring_fd_, cq_ring_size_, IORING_OFF_CQ_RING);
+  sqes_ = static_cast<struct io_uring_sqe*>(
+      MapRing(ring_fd_, sqes_size_, IORING_OFF_SQES));
+  if (!sq_ring_ || !cq_ring_ || !sqes_) {
+    PLOG(WARNING) << "Unable to map the io_uring queues for " << path
+                  << ", using blocking I/O.";
+    TearDown();
+    return;
+  }
+  sq_tail_ = RingPointer<unsigned>(sq_ring_, params.sq_off.tail);
+  sq_mask_ = RingPointer<unsigned>(sq_ring_, params.sq_off.ring_mask);
+  sq_array_ = RingPointer<unsigned>(sq_ring_, params.sq_off.array);
+  cq_head_ = RingPointer<unsigned>(cq_ring_, params.cq_off.head);
+  cq_tail_ = RingPointer<unsigned>(cq_ring_, params.cq_off.tail);
+  cq_mask_ = RingPointer<unsigned>(cq_ring_, params.cq_off.ring_mask);
+  cqes_ = RingPointer<struct io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+
+  // Bypassing the page cache only makes sense on block devices, where
+  // otherwise the whole partition would go through it.
+  struct stat stbuf;
+  if (fstat(fd_, &stbuf) != 0 || !S_ISBLK(stbuf.st_mode))
+    return;
+  int logical_block_size = 0;
+  if (ioctl(fd_, BLKSSZGET, &logical_block_size) != 0 ||
+      logical_block_size <= 0) {
+    return;
+  }
+  // The data written with O_DIRECT must be as durable as the data written
+  // through |fd_|.
+  direct_fd_ = HANDLE_EINTR(
+      open(path, (flags & (O_ACCMODE | O_DSYNC | O_SYNC)) | O_DIRECT));
+  if (direct_fd_ < 0) {
+    PLOG(INFO) << "Unable to open " << path << " with O_DIRECT.";
+    return;
+  }
+  direct_alignment_ = logical_block_size;
+}
+
+void IoUringFileDescriptor::TearDown() {
+  if (sqes_)
+    munmap(sqes_, sqes_size_);
+  if (cq_ring_)
+    munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_)
+    munmap(sq_ring_, sq_ring_size_);
+  sqes_ = nullptr;
+  cq_ring_ = nullptr;
+  sq_ring_ = nullptr;
+  sq_entries_ = 0;
+  if (ring_fd_ >= 0)
+    IGNORE_EINTR(close(ring_fd_));
+  ring_fd_ = -1;
+  if (direct_fd_ >= 0)
+    IGNORE_EINTR(close(direct_fd_));
+  direct_fd_ = -1;
+  direct_alignment_ = 0;
+  unsynced_buffered_writes_ = false;
+}
+
+bool IoUringFileDescriptor::SyncBufferedWrites() {
+  if (!unsynced_buffered_writes_)
+    return true;
+  if (HANDLE_EINTR(fdatasync(fd_)) != 0) {
+    PLOG(ERROR) << "Unable to write back the buffered data";
+    return false;
+  }
+  unsynced_buffered_writes_ = false;
+  return true;
+}
+
+bool IoUringFileDescriptor::TransferRanges(bool write,
+                                           const vector<Range>& ranges,
+                                           uint8_t* buf) {
+  vector<Request> requests;
+  requests.reserve(ranges.size());
+  std::deque<size_t> pending;
+  for (const Range& range : ranges) {
+    if (range.length > 0) {
+      pending.push_back(requests.size());
+      requests.push_back({range.offset, {buf, range.length}});
+    }
+    buf += range.length;
+  }
+
+  // Requests with the offset, size and memory aligned can use O_DIRECT.
+  auto is_direct = [this](const Request& request) {
+    return direct_fd_ >= 0 && request.offset % direct_alignment_ == 0 &&
+           request.iov.iov_len % direct_alignment_ == 0 &&
+           reinterpret_cast<uintptr_t>(request.iov.iov_base) %
+                   direct_alignment_ ==
+               0;
+  };
+
+  // Dirty pages of the page cache could be written back over the data written
+  // with O_DIRECT, or be missed by the reads with O_DIRECT.
+  for (const Request& request : requests) {
+    if (is_direct(request)) {
+      if (!SyncBufferedWrites())
+        return false;
+      break;
+    }
+  }
+
+  size_t in_flight = 0;
+  unsigned unsubmitted = 0;
+  bool success = true;
+  bool ring_failed = false;
+  // After a failure no new requests are queued, but the ones in flight must
+  // complete before returning since they use |buf|.
+  while (in_flight > 0 || (success && !pending.empty())) {
+    unsigned sq_tail = *sq_tail_;
+    while (success && !pending.empty() && in_flight < sq_entries_) {
+      size_t index = pending.front();
+      pending.pop_front();
+      const Request& request = requests[index];
+      unsigned sq_index = sq_tail & *sq_mask_;
+      struct io_uring_sqe* sqe = &sqes_[sq_index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+      bool direct = is_direct(request);
+      sqe->fd = direct ? direct_fd_ : fd_;
+      if (write && !direct && !sync_writes_)
+        unsynced_buffered_writes_ = true;
+      sqe->off = request.offset;
+      sqe->addr = reinterpret_cast<uintptr_t>(&request.iov);
+      sqe->len = 1;
+      sqe->user_data = index;
+      sq_array_[sq_index] = sq_index;
+      sq_tail++;
+      in_flight++;
+      unsubmitted++;
+    }
+    // Publish the new entries to the kernel.
+    __atomic_store_n(sq_tail_, sq_tail, __ATOMIC_RELEASE);
+
+    int submitted =
+        IoUringEnter(ring_fd_, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+    if (submitted < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      // Returning while the kernel may still access |buf| isn't an option.
+      PCHECK(!ring_failed) << "Unable to wait for the io_uring requests";
+      PLOG(ERROR) << "io_uring_enter() failed";
+      // Take back the entries the kernel didn't consume, and only wait for the
+      // requests already in flight.
+      __atomic_store_n(sq_tail_, sq_tail - unsubmitted, __ATOMIC_RELEASE);
+      in_flight -= unsubmitted;
+      unsubmitted = 0;
+      success = false;
+      ring_failed = true;
+      continue;
+    }
+    unsubmitted -= submitted;
+
+    unsigned cq_head = *cq_head_;
+    unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; cq_head != cq_tail; cq_head++) {
+      const struct io_uring_cqe* cqe = &cqes_[cq_head & *cq_mask_];
+      Request& request = requests[cqe->user_data];
+      in_flight--;
+      if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+        pending.push_back(cqe->user_data);
+        continue;
+      }
+      if (cqe->res < 0) {
+        errno = -cqe->res;
+        PLOG(ERROR) << "Unable to " << (write ? "write " : "read ")
+                    << request.iov.iov_len << " bytes at offset "
+                    << request.offset;
+        success = false;
+        continue;
+      }
+      if (cqe->res == 0) {
+        LOG(ERROR) << "Unexpected end of file at offset " << request.offset;
+        success = false;
+        continue;
+      }
+      // Queue the rest of a short read or write.
+      request.offset += cqe->res;
+      request.iov.iov_base = static_cast<uint8_t*>(request.iov.iov_base) +
+                             cqe->res;
+      request.iov.iov_len -= cqe->res;
+      if (request.iov.iov_len > 0)
+        pending.push_back(cqe->user_data);
+    }
+    // Release the processed entries to the kernel.
+    __atomic_store_n(cq_head_, cq_head, __ATOMIC_RELEASE);
+  }
+  // The next transfers use blocking I/O.
+  if (ring_failed)
+    TearDown();
+  return success;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,113 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
+
+#include <linux/io_uring.h>
+
+#include <vector>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// A file descriptor that issues the reads and writes of ReadRanges() and
+// WriteRanges() concurrently through an io_uring submission queue, instead of
+// one blocking system call at a time. On block devices the requests aligned to
+// the logical block size bypass the page cache with O_DIRECT, keeping the
+// O_DSYNC or O_SYNC flag the file was opened with.
+//
+// If the kernel doesn't support io_uring this behaves exactly like an
+// EintrSafeFileDescriptor.
+class IoUringFileDescriptor : public EintrSafeFileDescriptor {
+ public:
+  // The maximum number of requests in flight.
+  static const unsigned kQueueDepth;
+
+  IoUringFileDescriptor() = default;
+  ~IoUringFileDescriptor() override;
+
+  // Returns whether the running kernel supports io_uring.
+  static bool IsSupported();
+
+  // FileDescriptor overrides.
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  bool ReadRanges(const std::vector<Range>& ranges, void* buf) override;
+  bool WriteRanges(const std::vector<Range>& ranges, const void* buf) override;
+  bool ReadAhead(off64_t offset, uint64_t length) override;
+  bool Close() override;
+
+ private:
+  // Sets up the submission queue and the O_DIRECT descriptor for the file
+  // just opened at |path| with |flags|. On failure the regular system calls
+  // are used instead.
+  void SetUp(const char* path, int flags);
+
+  // Releases the submission queue and the O_DIRECT descriptor.
+  void TearDown();
+
+  // Writes back the data written through the page cache, so it doesn't
+  // overwrite or hide the data later written or read with O_DIRECT.
+  bool SyncBufferedWrites();
+
+  // Reads (or writes if |write|) the |ranges| from |buf|, keeping up to
+  // |kQueueDepth| requests in flight.
+  bool TransferRanges(bool write,
+                      const std::vector<Range>& ranges,
+                      uint8_t* buf);
+
+  // The io_uring instance, or -1 if not available.
+  int ring_fd_{-1};
+
+  // The descriptor opened with O_DIRECT and the alignment its requests need,
+  // or -1 if not available.
+  int direct_fd_{-1};
+  size_t direct_alignment_{0};
+
+  // Whether the file was opened with O_DSYNC or O_SYNC, and otherwise if some
+  // data written through the page cache may not be written back yet.
+  bool sync_writes_{false};
+  bool unsynced_buffered_writes_{false};
+
+  // The shared memory regions of the submission and completion queues.
+  void* sq_ring_{nullptr};
+  size_t sq_ring_size_{0};
+  void* cq_ring_{nullptr};
+  size_t cq_ring_size_{0};
+  struct io_uring_sqe* sqes_{nullptr};
+  size_t sqes_size_{0};
+
+  // Pointers into the queue regions.
+  unsigned* sq_tail_{nullptr};
+  unsigned* sq_mask_{nullptr};
+  unsigned* sq_array_{nullptr};
+  unsigned* cq_head_{nullptr};
+  unsigned* cq_tail_{nullptr};
+  unsigned* cq_mask_{nullptr};
+  struct io_uring_cqe* cqes_{nullptr};
+
+  // The number of entries in the submission queue.
+  unsigned sq_entries_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(IoUringFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
@@ -0,0 +1,110 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kFileSize = 1024 * 1024;
+}  // namespace
+
+class IoUringFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    file_data_.resize(kFileSize);
+    for (size_t i = 0; i < file_data_.size(); i++)
+      file_data_[i] = i * 7 % 251;
+    EXPECT_TRUE(test_utils::WriteFileVector(temp_file_.path(), file_data_));
+    EXPECT_TRUE(fd_.Open(temp_file_.path().c_str(), O_RDWR));
+  }
+
+  void TearDown() override { EXPECT_TRUE(fd_.Close()); }
+
+  // More ranges than the queue depth, some of them not aligned.
+  vector<FileDescriptor::Range> GetRanges() {
+    vector<FileDescriptor::Range> ranges;
+    for (size_t i = 0; i < IoUringFileDescriptor::kQueueDepth * 3; i++)
+      ranges.push_back({static_cast<off64_t>((i * 37 % 200) * 4096 + i), 1000});
+    return ranges;
+  }
+
+  IoUringFileDescriptor fd_;
+  brillo::Blob file_data_;
+  test_utils::ScopedTempFile temp_file_{"IoUringFileDescriptor-file.XXXXXX"};
+};
+
+TEST_F(IoUringFileDescriptorTest, ReadRangesTest) {
+  vector<FileDescriptor::Range> ranges = GetRanges();
+  brillo::Blob data(ranges.size() * 1000);
+  EXPECT_TRUE(fd_.ReadRanges(ranges, data.data()));
+
+  brillo::Blob expected_data;
+  for (const auto& range : ranges) {
+    expected_data.insert(expected_data.end(),
+                         file_data_.begin() + range.offset,
+                         file_data_.begin() + range.offset + range.length);
+  }
+  EXPECT_EQ(expected_data, data);
+}
+
+TEST_F(IoUringFileDescriptorTest, ReadRangesPastEndTest) {
+  vector<FileDescriptor::Range> ranges = {
+      {static_cast<off64_t>(kFileSize - 1000), 2000}};
+  brillo::Blob data(2000);
+  EXPECT_FALSE(fd_.ReadRanges(ranges, data.data()));
+}
+
+TEST_F(IoUringFileDescriptorTest, ReadAheadRegularFileTest) {
+  // Regular files are always read through the page cache.
+  EXPECT_TRUE(fd_.ReadAhead(0, kFileSize));
+}
+
+TEST_F(IoUringFileDescriptorTest, WriteRangesTest) {
+  // Non-overlapping ranges, so the order of the writes doesn't matter.
+  vector<FileDescriptor::Range> ranges;
+  for (size_t i = 0; i < IoUringFileDescriptor::kQueueDepth * 3; i++)
+    ranges.push_back({static_cast<off64_t>(i * 5000), 3000});
+  brillo::Blob data(ranges.size() * 3000);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = i % 13;
+  EXPECT_TRUE(fd_.WriteRanges(ranges, data.data()));
+  EXPECT_TRUE(fd_.Flush());
+
+  brillo::Blob expected_data = file_data_;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    std::copy(data.begin() + i * 3000,
+              data.begin() + (i + 1) * 3000,
+              expected_data.begin() + ranges[i].offset);
+  }
+  brillo::Blob actual_data;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &actual_data));
+  EXPECT_EQ(expected_data, actual_data);
+}
+
+}  // namespace chromeos_update_engine
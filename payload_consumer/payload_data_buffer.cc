@@ -0,0 +1,90 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/payload_data_buffer.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+const size_t PayloadDataBuffer::kMaxRetainedCapacity = 2 * 1024 * 1024;  // 2MB
+
+size_t PayloadDataBuffer::Append(const char** bytes_p,
+                                 size_t* count_p,
+                                 size_t max) {
+  const size_t count = *count_p;
+  if (!count)
+    return 0;  // Special case shortcut.
+  // New data can only be appended to data we own.
+  if (reference_)
+    blob_ = Release();
+  size_t read_len = std::min(count, max - blob_.size());
+  const char* bytes_start = *bytes_p;
+  const char* bytes_end = bytes_start + read_len;
+  blob_.reserve(max);
+  blob_.insert(blob_.end(), bytes_start, bytes_end);
+  *bytes_p = bytes_end;
+  *count_p = count - read_len;
+  return read_len;
+}
+
+size_t PayloadDataBuffer::AppendOrReference(const char** bytes_p,
+                                            size_t* count_p,
+                                            size_t max) {
+  if (!empty() || *count_p < max || max == 0)
+    return Append(bytes_p, count_p, max);
+  reference_ = reinterpret_cast<const uint8_t*>(*bytes_p);
+  reference_size_ = max;
+  *bytes_p += max;
+  *count_p -= max;
+  return max;
+}
+
+const brillo::Blob& PayloadDataBuffer::blob() const {
+  DCHECK(!reference_);
+  return blob_;
+}
+
+brillo::Blob PayloadDataBuffer::Release() {
+  brillo::Blob result;
+  if (reference_) {
+    result.assign(reference_, reference_ + reference_size_);
+    reference_ = nullptr;
+    reference_size_ = 0;
+  } else {
+    result.swap(blob_);
+  }
+  return result;
+}
+
+void PayloadDataBuffer::Clear() {
+  reference_ = nullptr;
+  reference_size_ = 0;
+  if (blob_.capacity() > kMaxRetainedCapacity)
+    brillo::Blob().swap(blob_);
+  else
+    blob_.clear();
+}
+
+void PayloadDataBuffer::Reset() {
+  reference_ = nullptr;
+  reference_size_ = 0;
+  brillo::Blob().swap(blob_);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,92 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_DATA_BUFFER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_DATA_BUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// A buffer accumulating the payload data received in chunks until a whole
+// piece (the metadata, an operation blob or the signatures) is available.
+//
+// When a piece arrives within a single chunk, AppendOrReference() just points
+// at the chunk instead of copying it. Otherwise the data is copied into a
+// blob whose memory is reused for the next pieces.
+class PayloadDataBuffer {
+ public:
+  // Memory kept allocated by Clear() to be reused for the next pieces.
+  static const size_t kMaxRetainedCapacity;
+
+  PayloadDataBuffer() = default;
+  ~PayloadDataBuffer() = default;
+
+  // Copies up to |*count_p| bytes from |*bytes_p| to the buffer, but only to
+  // the extent that the size of the buffer does not exceed |max|. Advances
+  // |*bytes_p| and decreases |*count_p| by the actual number of bytes copied,
+  // and returns this number.
+  size_t Append(const char** bytes_p, size_t* count_p, size_t max);
+
+  // Same as Append(), but if the buffer is empty and all the |max| bytes are
+  // available in |*bytes_p| they are referenced instead of copied. The caller
+  // must then Clear() or Release() the buffer before the memory pointed by
+  // |*bytes_p| is released.
+  size_t AppendOrReference(const char** bytes_p, size_t* count_p, size_t max);
+
+  // Returns the data in the buffer, which is the referenced memory if any.
+  const uint8_t* data() const {
+    return reference_ ? reference_ : blob_.data();
+  }
+  size_t size() const { return reference_ ? reference_size_ : blob_.size(); }
+  bool empty() const { return size() == 0; }
+
+  // Whether the buffer points to memory passed to AppendOrReference().
+  bool is_reference() const { return reference_ != nullptr; }
+
+  // Returns the buffered data as a blob. Only valid if the data was copied
+  // into the buffer with Append().
+  const brillo::Blob& blob() const;
+
+  // Empties the buffer and returns its data, which is only copied if it was
+  // referenced.
+  brillo::Blob Release();
+
+  // Empties the buffer. Up to |kMaxRetainedCapacity| bytes of allocated memory
+  // are kept for the next pieces.
+  void Clear();
+
+  // Empties the buffer and releases all its memory.
+  void Reset();
+
+ private:
+  // The copied data.
+  brillo::Blob blob_;
+
+  // The referenced data, or nullptr if the data is in |blob_|.
+  const uint8_t* reference_{nullptr};
+  size_t reference_size_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadDataBuffer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_DATA_BUFFER_H_
@@ -0,0 +1,111 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/payload_data_buffer.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class PayloadDataBufferTest : public ::testing::Test {
+ protected:
+  PayloadDataBuffer buffer_;
+};
+
+TEST_F(PayloadDataBufferTest, AppendTest) {
+  const string data = "0123456789";
+  const char* bytes = data.data();
+  size_t count = 4;
+  EXPECT_EQ(4U, buffer_.Append(&bytes, &count, 6));
+  EXPECT_EQ(0U, count);
+  EXPECT_EQ(data.data() + 4, bytes);
+
+  // Only two more bytes fit in the buffer.
+  count = 6;
+  EXPECT_EQ(2U, buffer_.Append(&bytes, &count, 6));
+  EXPECT_EQ(4U, count);
+  EXPECT_EQ(data.data() + 6, bytes);
+  EXPECT_FALSE(buffer_.is_reference());
+  EXPECT_EQ("012345", string(buffer_.blob().begin(), buffer_.blob().end()));
+}
+
+TEST_F(PayloadDataBufferTest, AppendOrReferenceTest) {
+  const string data = "0123456789";
+  const char* bytes = data.data();
+  size_t count = data.size();
+  EXPECT_EQ(6U, buffer_.AppendOrReference(&bytes, &count, 6));
+  EXPECT_EQ(4U, count);
+  EXPECT_TRUE(buffer_.is_reference());
+  EXPECT_EQ(reinterpret_cast<const uint8_t*>(data.data()), buffer_.data());
+  EXPECT_EQ(6U, buffer_.size());
+
+  brillo::Blob released = buffer_.Release();
+  EXPECT_EQ("012345", string(released.begin(), released.end()));
+  EXPECT_TRUE(buffer_.empty());
+  EXPECT_FALSE(buffer_.is_reference());
+}
+
+TEST_F(PayloadDataBufferTest, AppendOrReferenceSplitDataTest) {
+  const string data = "0123456789";
+  const char* bytes = data.data();
+  size_t count = 3;
+  // Not all the data is available, so it has to be copied.
+  EXPECT_EQ(3U, buffer_.AppendOrReference(&bytes, &count, 6));
+  EXPECT_FALSE(buffer_.is_reference());
+  count = 7;
+  EXPECT_EQ(3U, buffer_.AppendOrReference(&bytes, &count, 6));
+  EXPECT_FALSE(buffer_.is_reference());
+  EXPECT_EQ("012345", string(buffer_.blob().begin(), buffer_.blob().end()));
+}
+
+TEST_F(PayloadDataBufferTest, AppendAfterReferenceTest) {
+  const string data = "0123456789";
+  const char* bytes = data.data();
+  size_t count = 4;
+  EXPECT_EQ(4U, buffer_.AppendOrReference(&bytes, &count, 4));
+  EXPECT_TRUE(buffer_.is_reference());
+  // Appending more data copies the referenced data first.
+  count = 6;
+  EXPECT_EQ(2U, buffer_.Append(&bytes, &count, 6));
+  EXPECT_FALSE(buffer_.is_reference());
+  EXPECT_EQ("012345", string(buffer_.blob().begin(), buffer_.blob().end()));
+}
+
+TEST_F(PayloadDataBufferTest, ClearKeepsMemoryTest) {
+  const string data(1024, 'a');
+  const char* bytes = data.data();
+  size_t count = data.size();
+  buffer_.Append(&bytes, &count, data.size());
+  const uint8_t* memory = buffer_.data();
+  buffer_.Clear();
+  EXPECT_TRUE(buffer_.empty());
+
+  // The next data is copied to the same memory.
+  bytes = data.data();
+  count = data.size();
+  buffer_.Append(&bytes, &count, data.size());
+  EXPECT_EQ(memory, buffer_.data());
+
+  buffer_.Reset();
+  EXPECT_TRUE(buffer_.empty());
+  EXPECT_EQ(0U, buffer_.blob().capacity());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,226 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/payload_hash_tree.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const uint32_t kPayloadHashTreeChunkSize = 1024 * 1024;
+
+bool ComputePayloadHashTreeRoot(const vector<brillo::Blob>& chunk_hashes,
+                                brillo::Blob* root) {
+  if (chunk_hashes.empty())
+    return HashCalculator::RawHashOfBytes(nullptr, 0, root);
+
+  vector<brillo::Blob> level = chunk_hashes;
+  while (level.size() > 1) {
+    vector<brillo::Blob> parents;
+    for (size_t i = 0; i < level.size(); i += 2) {
+      if (i + 1 == level.size()) {
+        parents.push_back(level[i]);
+        continue;
+      }
+      HashCalculator hasher;
+      TEST_AND_RETURN_FALSE(hasher.Update(level[i].data(), level[i].size()));
+      TEST_AND_RETURN_FALSE(
+          hasher.Update(level[i + 1].data(), level[i + 1].size()));
+      TEST_AND_RETURN_FALSE(hasher.Finalize());
+      parents.push_back(hasher.raw_hash());
+    }
+    level.swap(parents);
+  }
+  *root = level[0];
+  return true;
+}
+
+PayloadHashTreeBuilder::PayloadHashTreeBuilder(uint32_t chunk_size)
+    : chunk_size_(chunk_size) {
+  CHECK_GT(chunk_size_, 0u);
+}
+
+bool PayloadHashTreeBuilder::Update(const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  while (size > 0) {
+    if (!chunk_hasher_) {
+      chunk_hasher_.reset(new HashCalculator());
+      chunk_hashed_ = 0;
+    }
+    size_t length = std::min(static_cast<uint64_t>(size),
+                             chunk_size_ - chunk_hashed_);
+    TEST_AND_RETURN_FALSE(chunk_hasher_->Update(bytes, length));
+    bytes += length;
+    size -= length;
+    chunk_hashed_ += length;
+    data_size_ += length;
+    if (chunk_hashed_ == chunk_size_)
+      TEST_AND_RETURN_FALSE(FinishChunk());
+  }
+  return true;
+}
+
+bool PayloadHashTreeBuilder::Finalize(PayloadHashTree* tree) {
+  if (chunk_hasher_)
+    TEST_AND_RETURN_FALSE(FinishChunk());
+
+  brillo::Blob root;
+  TEST_AND_RETURN_FALSE(ComputePayloadHashTreeRoot(chunk_hashes_, &root));
+  tree->Clear();
+  tree->set_chunk_size(chunk_size_);
+  tree->set_data_size(data_size_);
+  for (const brillo::Blob& hash : chunk_hashes_)
+    tree->add_chunk_hashes(hash.data(), hash.size());
+  tree->set_root_hash(root.data(), root.size());
+  return true;
+}
+
+bool PayloadHashTreeBuilder::FinishChunk() {
+  TEST_AND_RETURN_FALSE(chunk_hasher_->Finalize());
+  chunk_hashes_.push_back(chunk_hasher_->raw_hash());
+  chunk_hasher_.reset();
+  return true;
+}
+
+bool PayloadHashTreeVerifier::Init(const PayloadHashTree& tree) {
+  TEST_AND_RETURN_FALSE(tree.chunk_size() > 0);
+  uint64_t num_chunks =
+      (tree.data_size() + tree.chunk_size() - 1) / tree.chunk_size();
+  if (static_cast<uint64_t>(tree.chunk_hashes_size()) != num_chunks) {
+    LOG(ERROR) << "The payload hash tree has " << tree.chunk_hashes_size()
+               << " chunk hashes instead of " << num_chunks << ".";
+    return false;
+  }
+
+  chunk_hashes_.clear();
+  for (const std::string& hash : tree.chunk_hashes())
+    chunk_hashes_.emplace_back(hash.begin(), hash.end());
+  brillo::Blob root;
+  TEST_AND_RETURN_FALSE(ComputePayloadHashTreeRoot(chunk_hashes_, &root));
+  if (root != brillo::Blob(tree.root_hash().begin(), tree.root_hash().end())) {
+    LOG(ERROR) << "The payload hash tree doesn't match its root hash.";
+    return false;
+  }
+
+  chunk_size_ = tree.chunk_size();
+  data_size_ = tree.data_size();
+  verified_chunks_ = 0;
+  return SetOffset(0, 0);
+}
+
+bool PayloadHashTreeVerifier::VerifyChunk(uint64_t index,
+                                          const void* data,
+                                          size_t size) const {
+  TEST_AND_RETURN_FALSE(index < chunk_hashes_.size());
+  uint64_t chunk_start = index * chunk_size_;
+  TEST_AND_RETURN_FALSE(
+      size == std::min(static_cast<uint64_t>(chunk_size_),
+                       data_size_ - chunk_start));
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(data, size, &hash));
+  return hash == chunk_hashes_[index];
+}
+
+bool PayloadHashTreeVerifier::Update(const uint8_t** data,
+                                     size_t* size,
+                                     const uint8_t** verified,
+                                     size_t* verified_size) {
+  if (chunk_released_) {
+    chunk_data_.clear();
+    chunk_released_ = false;
+  }
+  const uint8_t* bytes = *data;
+  if (offset_ >= data_size_) {
+    // The data past the end of the tree is released as is.
+    size_t skip = std::min(static_cast<uint64_t>(*size),
+                           std::max(release_offset_, offset_) - offset_);
+    *verified = bytes + skip;
+    *verified_size = *size - skip;
+    offset_ += *size;
+    *data += *size;
+    *size = 0;
+    return true;
+  }
+
+  uint64_t index = offset_ / chunk_size_;
+  uint64_t chunk_end = std::min((index + 1) * chunk_size_, data_size_);
+  size_t length = std::min(static_cast<uint64_t>(*size), chunk_end - offset_);
+  offset_ += length;
+  *data += length;
+  *size -= length;
+  *verified = nullptr;
+  *verified_size = 0;
+  if (chunk_data_.empty() && offset_ == chunk_end) {
+    // The whole chunk was received at once, so it is verified in place.
+    TEST_AND_RETURN_FALSE(
+        ReleaseChunk(index, bytes, length, verified, verified_size));
+  } else {
+    chunk_data_.insert(chunk_data_.end(), bytes, bytes + length);
+    if (offset_ == chunk_end) {
+      TEST_AND_RETURN_FALSE(ReleaseChunk(index,
+                                         chunk_data_.data(),
+                                         chunk_data_.size(),
+                                         verified,
+                                         verified_size));
+      chunk_released_ = true;
+    }
+  }
+  return true;
+}
+
+uint64_t PayloadHashTreeVerifier::GetChunkStart(uint64_t offset) const {
+  if (offset >= data_size_)
+    return offset;
+  return offset - offset % chunk_size_;
+}
+
+bool PayloadHashTreeVerifier::SetOffset(uint64_t offset,
+                                        uint64_t release_offset) {
+  TEST_AND_RETURN_FALSE(GetChunkStart(offset) == offset);
+  TEST_AND_RETURN_FALSE(offset <= release_offset);
+  offset_ = offset;
+  release_offset_ = release_offset;
+  brillo::Blob().swap(chunk_data_);
+  chunk_released_ = false;
+  return true;
+}
+
+bool PayloadHashTreeVerifier::ReleaseChunk(uint64_t index,
+                                           const uint8_t* data,
+                                           size_t size,
+                                           const uint8_t** verified,
+                                           size_t* verified_size) {
+  if (!VerifyChunk(index, data, size)) {
+    LOG(ERROR) << "The payload data chunk " << index
+               << " doesn't match its hash in the manifest.";
+    return false;
+  }
+  uint64_t chunk_start = index * chunk_size_;
+  size_t skip = std::min(static_cast<uint64_t>(size),
+                         std::max(release_offset_, chunk_start) - chunk_start);
+  *verified = data + skip;
+  *verified_size = size - skip;
+  verified_chunks_++;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
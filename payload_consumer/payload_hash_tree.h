@@ -0,0 +1,150 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_HASH_TREE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_HASH_TREE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// The size of the payload data chunks hashed in the PayloadHashTree.
+extern const uint32_t kPayloadHashTreeChunkSize;
+
+// Computes in |root| the root of the PayloadHashTree built over the
+// |chunk_hashes|, which is the hash of no data if there are no chunks.
+bool ComputePayloadHashTreeRoot(const std::vector<brillo::Blob>& chunk_hashes,
+                                brillo::Blob* root);
+
+// Builds the PayloadHashTree of the payload data blobs as they are written.
+class PayloadHashTreeBuilder {
+ public:
+  explicit PayloadHashTreeBuilder(uint32_t chunk_size);
+  ~PayloadHashTreeBuilder() = default;
+
+  // Hashes the next |size| bytes of the data blobs.
+  bool Update(const void* data, size_t size);
+
+  // Hashes the last chunk and fills |tree|. No more data can be added after.
+  bool Finalize(PayloadHashTree* tree);
+
+ private:
+  // Adds the hash of the current chunk.
+  bool FinishChunk();
+
+  const uint32_t chunk_size_;
+
+  // The number of bytes hashed so far.
+  uint64_t data_size_{0};
+
+  std::vector<brillo::Blob> chunk_hashes_;
+
+  // The hash of the current chunk, not complete yet.
+  std::unique_ptr<HashCalculator> chunk_hasher_;
+  uint64_t chunk_hashed_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadHashTreeBuilder);
+};
+
+// Verifies the payload data blobs against the PayloadHashTree of the manifest.
+// The chunks can be verified independently with VerifyChunk(), or as the data
+// is received in order with Update(), which only releases the data of the
+// chunks verified, without copying the chunks received at once.
+class PayloadHashTreeVerifier {
+ public:
+  PayloadHashTreeVerifier() = default;
+  ~PayloadHashTreeVerifier() = default;
+
+  // Loads the |tree|, checking that it is consistent with its root hash.
+  bool Init(const PayloadHashTree& tree);
+
+  // Returns whether the |size| bytes at |data| match the chunk |index|.
+  bool VerifyChunk(uint64_t index, const void* data, size_t size) const;
+
+  // Receives the next data blob bytes from the |*size| bytes at |*data|, up to
+  // the end of the current chunk, and advances |*data| and |*size| past them.
+  // Points |*verified| and |*verified_size| to the data which can be used, if
+  // any: the chunk just completed and verified with VerifyChunk(), or the data
+  // past the end of the tree, like the signature blob. A chunk received at
+  // once is used in place. Otherwise its data is kept until the rest of the
+  // chunk is received, and stays valid until the next call. Returns false if a
+  // chunk doesn't match its hash.
+  bool Update(const uint8_t** data,
+              size_t* size,
+              const uint8_t** verified,
+              size_t* verified_size);
+
+  // Returns where to receive the data from to use the data from |offset|: the
+  // start of its chunk, or |offset| past the end of the tree.
+  uint64_t GetChunkStart(uint64_t offset) const;
+
+  // Continues receiving the data from |offset|, like when resuming an update,
+  // dropping the data kept. |offset| must be the start of a chunk or past the
+  // end of the tree, so every chunk is verified in full. The data before
+  // |release_offset| is verified but not released, since it was already used.
+  // Returns false if |offset| is in the middle of a chunk or past
+  // |release_offset|.
+  bool SetOffset(uint64_t offset, uint64_t release_offset);
+
+  uint32_t chunk_size() const { return chunk_size_; }
+  uint64_t data_size() const { return data_size_; }
+
+  // The number of chunks verified by Update().
+  uint64_t verified_chunks() const { return verified_chunks_; }
+
+ private:
+  // Verifies the chunk |index| received in the |size| bytes at |data| and
+  // points |*verified| and |*verified_size| to them if they match, skipping
+  // the data before |release_offset_|.
+  bool ReleaseChunk(uint64_t index,
+                    const uint8_t* data,
+                    size_t size,
+                    const uint8_t** verified,
+                    size_t* verified_size);
+
+  uint32_t chunk_size_{0};
+  uint64_t data_size_{0};
+  std::vector<brillo::Blob> chunk_hashes_;
+
+  // The offset of the next byte received by Update(), and of the first byte
+  // released.
+  uint64_t offset_{0};
+  uint64_t release_offset_{0};
+
+  // The data of the chunk containing |offset_| received so far when it isn't
+  // received at once. The data of the last chunk completed is kept until the
+  // next Update() if |chunk_released_|.
+  brillo::Blob chunk_data_;
+  bool chunk_released_{false};
+
+  uint64_t verified_chunks_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadHashTreeVerifier);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_HASH_TREE_H_
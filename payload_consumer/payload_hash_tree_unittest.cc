@@ -0,0 +1,198 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/payload_hash_tree.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+const uint32_t kChunkSize = 64;
+}  // namespace
+
+class PayloadHashTreeTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Two full chunks and a partial one.
+    data_.resize(kChunkSize * 2 + 10);
+    test_utils::FillWithData(&data_);
+    PayloadHashTreeBuilder builder(kChunkSize);
+    // Feed the data in pieces not aligned with the chunks.
+    EXPECT_TRUE(builder.Update(data_.data(), 7));
+    EXPECT_TRUE(builder.Update(data_.data() + 7, data_.size() - 7));
+    EXPECT_TRUE(builder.Finalize(&tree_));
+  }
+
+  // Passes the |size| bytes at |data| to the |verifier| and appends the data
+  // it releases to |verified|.
+  bool Update(PayloadHashTreeVerifier* verifier,
+              const uint8_t* data,
+              size_t size,
+              brillo::Blob* verified) {
+    do {
+      const uint8_t* verified_data;
+      size_t verified_size;
+      if (!verifier->Update(&data, &size, &verified_data, &verified_size))
+        return false;
+      verified->insert(
+          verified->end(), verified_data, verified_data + verified_size);
+    } while (size > 0);
+    return true;
+  }
+
+  brillo::Blob data_;
+  PayloadHashTree tree_;
+};
+
+TEST_F(PayloadHashTreeTest, BuildTest) {
+  EXPECT_EQ(kChunkSize, tree_.chunk_size());
+  EXPECT_EQ(data_.size(), tree_.data_size());
+  ASSERT_EQ(3, tree_.chunk_hashes_size());
+
+  brillo::Blob hash;
+  EXPECT_TRUE(
+      HashCalculator::RawHashOfBytes(data_.data() + kChunkSize * 2, 10, &hash));
+  EXPECT_EQ(string(hash.begin(), hash.end()), tree_.chunk_hashes(2));
+
+  // The third hash is carried up to be hashed with the parent of the first two.
+  HashCalculator parent;
+  EXPECT_TRUE(parent.Update(tree_.chunk_hashes(0).data(), hash.size()));
+  EXPECT_TRUE(parent.Update(tree_.chunk_hashes(1).data(), hash.size()));
+  EXPECT_TRUE(parent.Finalize());
+  HashCalculator root;
+  EXPECT_TRUE(root.Update(parent.raw_hash().data(), hash.size()));
+  EXPECT_TRUE(root.Update(hash.data(), hash.size()));
+  EXPECT_TRUE(root.Finalize());
+  EXPECT_EQ(string(root.raw_hash().begin(), root.raw_hash().end()),
+            tree_.root_hash());
+}
+
+TEST_F(PayloadHashTreeTest, InitRejectsBadRootTest) {
+  PayloadHashTreeVerifier verifier;
+  EXPECT_TRUE(verifier.Init(tree_));
+  tree_.mutable_chunk_hashes(1)->at(0) ^= 1;
+  EXPECT_FALSE(verifier.Init(tree_));
+}
+
+TEST_F(PayloadHashTreeTest, VerifyChunkTest) {
+  PayloadHashTreeVerifier verifier;
+  ASSERT_TRUE(verifier.Init(tree_));
+  // In any order.
+  EXPECT_TRUE(verifier.VerifyChunk(2, data_.data() + kChunkSize * 2, 10));
+  EXPECT_TRUE(verifier.VerifyChunk(0, data_.data(), kChunkSize));
+  EXPECT_FALSE(verifier.VerifyChunk(1, data_.data(), kChunkSize));
+  EXPECT_FALSE(verifier.VerifyChunk(2, data_.data() + kChunkSize * 2, 9));
+  EXPECT_FALSE(verifier.VerifyChunk(3, data_.data(), 0));
+}
+
+TEST_F(PayloadHashTreeTest, UpdateTest) {
+  PayloadHashTreeVerifier verifier;
+  ASSERT_TRUE(verifier.Init(tree_));
+  brillo::Blob verified;
+  // The second chunk is held until it is complete.
+  EXPECT_TRUE(Update(&verifier, data_.data(), 100, &verified));
+  EXPECT_EQ(1u, verifier.verified_chunks());
+  EXPECT_EQ(brillo::Blob(data_.begin(), data_.begin() + kChunkSize), verified);
+  // The data past the end of the tree is released as is.
+  brillo::Blob rest(data_.begin() + 100, data_.end());
+  rest.resize(rest.size() + 20, 'x');
+  EXPECT_TRUE(Update(&verifier, rest.data(), rest.size(), &verified));
+  EXPECT_EQ(3u, verifier.verified_chunks());
+  brillo::Blob expected = data_;
+  expected.resize(expected.size() + 20, 'x');
+  EXPECT_EQ(expected, verified);
+}
+
+TEST_F(PayloadHashTreeTest, UpdateInPlaceTest) {
+  PayloadHashTreeVerifier verifier;
+  ASSERT_TRUE(verifier.Init(tree_));
+  const uint8_t* data = data_.data();
+  size_t size = kChunkSize + 10;
+  const uint8_t* verified_data;
+  size_t verified_size;
+  // The first chunk is received at once, so it isn't copied.
+  EXPECT_TRUE(verifier.Update(&data, &size, &verified_data, &verified_size));
+  EXPECT_EQ(data_.data(), verified_data);
+  EXPECT_EQ(kChunkSize, verified_size);
+  EXPECT_EQ(data_.data() + kChunkSize, data);
+  EXPECT_EQ(10u, size);
+  // The start of the second chunk is kept until the rest is received.
+  EXPECT_TRUE(verifier.Update(&data, &size, &verified_data, &verified_size));
+  EXPECT_EQ(0u, verified_size);
+  EXPECT_EQ(0u, size);
+  size = kChunkSize - 10;
+  EXPECT_TRUE(verifier.Update(&data, &size, &verified_data, &verified_size));
+  EXPECT_EQ(brillo::Blob(data_.begin() + kChunkSize,
+                         data_.begin() + 2 * kChunkSize),
+            brillo::Blob(verified_data, verified_data + verified_size));
+  EXPECT_EQ(2u, verifier.verified_chunks());
+}
+
+TEST_F(PayloadHashTreeTest, UpdateMismatchTest) {
+  PayloadHashTreeVerifier verifier;
+  ASSERT_TRUE(verifier.Init(tree_));
+  data_[kChunkSize + 1] ^= 1;
+  brillo::Blob verified;
+  EXPECT_TRUE(Update(&verifier, data_.data(), kChunkSize + 10, &verified));
+  // None of the corrupted chunk is released.
+  EXPECT_EQ(kChunkSize, verified.size());
+  EXPECT_FALSE(Update(&verifier,
+                      data_.data() + kChunkSize + 10,
+                      data_.size() - kChunkSize - 10,
+                      &verified));
+  EXPECT_EQ(kChunkSize, verified.size());
+}
+
+TEST_F(PayloadHashTreeTest, SetOffsetTest) {
+  PayloadHashTreeVerifier verifier;
+  ASSERT_TRUE(verifier.Init(tree_));
+  EXPECT_EQ(kChunkSize, verifier.GetChunkStart(kChunkSize + 5));
+  EXPECT_EQ(data_.size() + 5, verifier.GetChunkStart(data_.size() + 5));
+  // Resuming in the middle of a chunk would use its data unverified.
+  EXPECT_FALSE(verifier.SetOffset(kChunkSize + 5, kChunkSize + 5));
+  EXPECT_FALSE(verifier.SetOffset(kChunkSize, kChunkSize - 1));
+
+  // The chunk is verified in full, but only the data from the release offset
+  // is used.
+  ASSERT_TRUE(verifier.SetOffset(kChunkSize, kChunkSize + 5));
+  brillo::Blob verified;
+  EXPECT_TRUE(Update(&verifier,
+                     data_.data() + kChunkSize,
+                     data_.size() - kChunkSize,
+                     &verified));
+  EXPECT_EQ(2u, verifier.verified_chunks());
+  EXPECT_EQ(brillo::Blob(data_.begin() + kChunkSize + 5, data_.end()),
+            verified);
+
+  // A corrupted chunk is detected after resuming.
+  data_[kChunkSize + 1] ^= 1;
+  ASSERT_TRUE(verifier.SetOffset(kChunkSize, kChunkSize + 5));
+  verified.clear();
+  EXPECT_FALSE(Update(&verifier,
+                      data_.data() + kChunkSize,
+                      data_.size() - kChunkSize,
+                      &verified));
+  EXPECT_TRUE(verified.empty());
+}
+
+}  // namespace chromeos_update_engine
@@ -23,6 +23,9 @@
 
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
+#include <base/synchronization/lock.h>
+#include <base/sys_info.h>
+#include <base/threading/simple_thread.h>
 #include <fec/ecc.h>
 extern "C" {
 #include <fec.h>
@@ -38,8 +41,213 @@ std::unique_ptr<VerityWriterInterface> CreateVerityWriter() {
 }
 }  // namespace verity_writer
 
+namespace {
+
+// The maximum number of threads used to encode the FEC.
+const size_t kMaxFecThreads = 4;
+
+// The number of consecutive rounds encoded together. Each round reads one
+// block from each of |rs_n| areas of the data, and consecutive rounds read
+// consecutive blocks, so a batch of rounds is read with |rs_n| larger reads.
+// Each thread uses about |kFecRoundsPerBatch| + 1 MiB for 4K block size.
+const uint64_t kFecRoundsPerBatch = 4;
+
+// The maximum size of the FEC accumulated in memory while the data passes
+// through Update(). A larger FEC is encoded from disk once all the data has
+// been written.
+const uint64_t kMaxAccumulatedFecSize = 64 * 1024 * 1024;
+
+// The primitive polynomial of the GF(2^8) field used by FEC_PARAMS().
+const uint32_t kFecFieldPolynomial = 0x11d;
+
+// Multiplies |a| and |b| in the GF(2^8) field of the Reed-Solomon code.
+uint8_t FieldMultiply(uint8_t a, uint8_t b) {
+  uint32_t x = a;
+  uint8_t result = 0;
+  for (; b != 0; b >>= 1) {
+    if (b & 1)
+      result ^= x;
+    x <<= 1;
+    if (x & 0x100)
+      x ^= kFecFieldPolynomial;
+  }
+  return result;
+}
+
+// Encodes, or verifies in |verify_mode|, the FEC of the data in |fd|. The
+// rounds are encoded in batches and several threads can call Run() at the same
+// time, each one taking the next batch not yet encoded.
+class FecEncoder : public base::DelegateSimpleThread::Delegate {
+ public:
+  FecEncoder(int fd,
+             uint64_t data_offset,
+             uint64_t data_size,
+             uint64_t fec_offset,
+             uint32_t fec_roots,
+             uint32_t block_size,
+             uint64_t rounds,
+             bool verify_mode)
+      : fd_(fd),
+        data_offset_(data_offset),
+        data_size_(data_size),
+        fec_offset_(fec_offset),
+        fec_roots_(fec_roots),
+        rs_n_(FEC_RSM - fec_roots),
+        block_size_(block_size),
+        rounds_(rounds),
+        verify_mode_(verify_mode) {}
+  ~FecEncoder() override = default;
+
+  // DelegateSimpleThread::Delegate overrides. Encodes batches until all of
+  // them are done or one failed.
+  void Run() override;
+
+  // Whether all the batches were encoded. Only valid once all the threads
+  // finished running.
+  bool succeeded() {
+    base::AutoLock auto_lock(lock_);
+    return !failed_ && next_round_ >= rounds_;
+  }
+
+ private:
+  // Takes the next batch of rounds to encode. Returns false if there are none
+  // left or another batch failed.
+  bool NextBatch(uint64_t* first_round, uint64_t* num_rounds);
+
+  // Encodes the |num_rounds| rounds starting at |first_round| with the
+  // |rs_char| Reed-Solomon encoder.
+  bool EncodeBatch(void* rs_char, uint64_t first_round, uint64_t num_rounds);
+
+  const int fd_;
+  const uint64_t data_offset_;
+  const uint64_t data_size_;
+  const uint64_t fec_offset_;
+  const uint32_t fec_roots_;
+  const size_t rs_n_;
+  const uint32_t block_size_;
+  const uint64_t rounds_;
+  const bool verify_mode_;
+
+  // Protects the members below.
+  base::Lock lock_;
+  uint64_t next_round_{0};
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(FecEncoder);
+};
+
+void FecEncoder::Run() {
+  // The encoder context isn't thread safe, so each thread needs its own.
+  std::unique_ptr<void, decltype(&free_rs_char)> rs_char(
+      init_rs_char(FEC_PARAMS(fec_roots_)), &free_rs_char);
+  bool result = rs_char != nullptr;
+  uint64_t first_round, num_rounds;
+  while (result && NextBatch(&first_round, &num_rounds))
+    result = EncodeBatch(rs_char.get(), first_round, num_rounds);
+  if (!result) {
+    base::AutoLock auto_lock(lock_);
+    failed_ = true;
+  }
+}
+
+bool FecEncoder::NextBatch(uint64_t* first_round, uint64_t* num_rounds) {
+  base::AutoLock auto_lock(lock_);
+  if (failed_ || next_round_ >= rounds_)
+    return false;
+  *first_round = next_round_;
+  *num_rounds = std::min(kFecRoundsPerBatch, rounds_ - next_round_);
+  next_round_ += *num_rounds;
+  return true;
+}
+
+bool FecEncoder::EncodeBatch(void* rs_char,
+                             uint64_t first_round,
+                             uint64_t num_rounds) {
+  // Read the |rs_n_| areas of data for all the rounds. |data| stores the
+  // |num_rounds| blocks of each area one after the other.
+  const size_t area_size = num_rounds * block_size_;
+  brillo::Blob data(rs_n_ * area_size, 0);
+  for (size_t j = 0; j < rs_n_; j++) {
+    uint8_t* area = data.data() + j * area_size;
+    auto block_offset = [&](uint64_t round) {
+      return fec_ecc_interleave(
+          (first_round + round) * rs_n_ * block_size_ + j, rs_n_, rounds_);
+    };
+    uint64_t r = 0;
+    while (r < num_rounds) {
+      uint64_t offset = block_offset(r);
+      // Don't read past |data_size_|, treat them as 0.
+      if (offset >= data_size_) {
+        r++;
+        continue;
+      }
+      // Read all the consecutive blocks at once.
+      uint64_t num_blocks = 1;
+      while (r + num_blocks < num_rounds) {
+        uint64_t next_offset = offset + num_blocks * block_size_;
+        if (next_offset >= data_size_ ||
+            block_offset(r + num_blocks) != next_offset) {
+          break;
+        }
+        num_blocks++;
+      }
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(fd_,
+                                            area + r * block_size_,
+                                            num_blocks * block_size_,
+                                            data_offset_ + offset,
+                                            &bytes_read));
+      TEST_AND_RETURN_FALSE(bytes_read ==
+                            static_cast<ssize_t>(num_blocks * block_size_));
+      r += num_blocks;
+    }
+  }
+
+  brillo::Blob fec(num_rounds * block_size_ * fec_roots_);
+  // Encodes |block_size_| number of rs blocks each round. This uses about
+  // 1 MiB memory for 4K block size.
+  brillo::Blob rs_blocks(block_size_ * rs_n_);
+  for (uint64_t r = 0; r < num_rounds; r++) {
+    for (size_t j = 0; j < rs_n_; j++) {
+      const uint8_t* block = data.data() + j * area_size + r * block_size_;
+      for (size_t k = 0; k < block_size_; k++) {
+        rs_blocks[k * rs_n_ + j] = block[k];
+      }
+    }
+    uint8_t* round_fec = fec.data() + r * block_size_ * fec_roots_;
+    for (size_t j = 0; j < block_size_; j++) {
+      // Encode [j * rs_n : (j + 1) * rs_n) in |rs_blocks| and write
+      // |fec_roots| number of parity bytes to |j * fec_roots| in |round_fec|.
+      encode_rs_char(
+          rs_char, rs_blocks.data() + j * rs_n_, round_fec + j * fec_roots_);
+    }
+  }
+
+  uint64_t fec_offset = fec_offset_ + first_round * block_size_ * fec_roots_;
+  if (verify_mode_) {
+    brillo::Blob fec_read(fec.size());
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        fd_, fec_read.data(), fec_read.size(), fec_offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(fec_read.size()));
+    TEST_AND_RETURN_FALSE(fec == fec_read);
+  } else {
+    TEST_AND_RETURN_FALSE(
+        utils::PWriteAll(fd_, fec.data(), fec.size(), fec_offset));
+  }
+  return true;
+}
+
+}  // namespace
+
 bool VerityWriterAndroid::Init(const InstallPlan::Partition& partition) {
   partition_ = &partition;
+  hash_tree_builder_.reset();
+  fec_.clear();
+  fec_parity_table_.clear();
+  fec_rounds_ = 0;
+  fec_data_accumulated_ = 0;
+  fec_written_ = false;
 
   if (partition_->hash_tree_size != 0 || partition_->fec_size != 0) {
     utils::SetBlockDeviceReadOnly(partition_->target_path, false);
@@ -65,6 +273,99 @@ bool VerityWriterAndroid::Init(const InstallPlan::Partition& partition) {
       return false;
     }
   }
+  if (partition_->fec_size != 0 && !InitFECAccumulation()) {
+    LOG(INFO) << "Verity FEC will be encoded from "
+              << partition_->target_path << " once all the data is written.";
+  }
+  return true;
+}
+
+bool VerityWriterAndroid::InitFECAccumulation() {
+  uint32_t block_size = partition_->block_size;
+  uint32_t fec_roots = partition_->fec_roots;
+  // The rounds of the data blocks are computed like fec_ecc_interleave(),
+  // which only supports FEC_BLOCKSIZE blocks. Invalid parameters are reported
+  // by EncodeFEC().
+  if (block_size != FEC_BLOCKSIZE || fec_roots == 0 || fec_roots >= FEC_RSM ||
+      partition_->fec_data_size % block_size != 0) {
+    return false;
+  }
+  size_t rs_n = FEC_RSM - fec_roots;
+  uint64_t rounds =
+      utils::DivRoundUp(partition_->fec_data_size / block_size, rs_n);
+  if (rounds * fec_roots * block_size != partition_->fec_size ||
+      partition_->fec_size > kMaxAccumulatedFecSize) {
+    return false;
+  }
+
+  // The Reed-Solomon code is linear, so the parity of an rs block is the sum
+  // of the parity of each of its bytes alone at its position. Encode a single 1
+  // at every position, the parity of the other values is a multiple of it.
+  std::unique_ptr<void, decltype(&free_rs_char)> rs_char(
+      init_rs_char(FEC_PARAMS(fec_roots)), &free_rs_char);
+  TEST_AND_RETURN_FALSE(rs_char != nullptr);
+  fec_parity_table_.resize(rs_n * 256 * fec_roots);
+  brillo::Blob rs_block(rs_n, 0);
+  brillo::Blob parity(fec_roots);
+  uint8_t* entry = fec_parity_table_.data();
+  for (size_t j = 0; j < rs_n; j++) {
+    rs_block[j] = 1;
+    encode_rs_char(rs_char.get(), rs_block.data(), parity.data());
+    rs_block[j] = 0;
+    for (uint32_t value = 0; value < 256; value++) {
+      for (uint32_t r = 0; r < fec_roots; r++)
+        *entry++ = FieldMultiply(value, parity[r]);
+    }
+  }
+  fec_.assign(partition_->fec_size, 0);
+  fec_rounds_ = rounds;
+  return true;
+}
+
+void VerityWriterAndroid::AccumulateFEC(uint64_t offset,
+                                        const uint8_t* buffer,
+                                        size_t size) {
+  const uint32_t block_size = partition_->block_size;
+  const uint32_t fec_roots = partition_->fec_roots;
+  while (size > 0) {
+    // The data block |block| is at position |block / fec_rounds_| of the rs
+    // blocks of round |block % fec_rounds_|, see fec_ecc_interleave(). The
+    // byte k of the block belongs to the k-th rs block of the round.
+    uint64_t block = offset / block_size;
+    size_t block_offset = offset % block_size;
+    size_t length =
+        std::min(size, static_cast<size_t>(block_size) - block_offset);
+    const uint8_t* table =
+        fec_parity_table_.data() + (block / fec_rounds_) * 256 * fec_roots;
+    uint8_t* parity =
+        fec_.data() +
+        ((block % fec_rounds_) * block_size + block_offset) * fec_roots;
+    for (size_t k = 0; k < length; k++, parity += fec_roots) {
+      const uint8_t* value_parity = table + buffer[k] * fec_roots;
+      for (uint32_t r = 0; r < fec_roots; r++)
+        parity[r] ^= value_parity[r];
+    }
+    offset += length;
+    buffer += length;
+    size -= length;
+  }
+}
+
+bool VerityWriterAndroid::WriteAccumulatedFEC() {
+  int fd = HANDLE_EINTR(open(partition_->target_path.c_str(), O_WRONLY));
+  if (fd < 0) {
+    PLOG(ERROR) << "Failed to open " << partition_->target_path
+                << " to write FEC.";
+    return false;
+  }
+  ScopedFdCloser fd_closer(&fd);
+
+  LOG(INFO) << "Writing verity FEC to " << partition_->target_path;
+  TEST_AND_RETURN_FALSE(utils::PWriteAll(
+      fd, fec_.data(), fec_.size(), partition_->fec_offset));
+  brillo::Blob().swap(fec_);
+  brillo::Blob().swap(fec_parity_table_);
+  fec_written_ = true;
   return true;
 }
 
@@ -101,7 +402,20 @@ bool VerityWriterAndroid::Update(uint64_t offset,
   if (partition_->fec_size != 0) {
     uint64_t fec_data_end =
         partition_->fec_data_offset + partition_->fec_data_size;
-    if (offset < fec_data_end && offset + size >= fec_data_end) {
+    if (!fec_.empty()) {
+      uint64_t start_offset = std::max(offset, partition_->fec_data_offset);
+      uint64_t end_offset = std::min(offset + size, fec_data_end);
+      if (start_offset < end_offset) {
+        AccumulateFEC(start_offset - partition_->fec_data_offset,
+                      buffer + start_offset - offset,
+                      end_offset - start_offset);
+        fec_data_accumulated_ += end_offset - start_offset;
+        // All FEC data blocks have been accumulated, write the FEC to disk.
+        if (fec_data_accumulated_ == partition_->fec_data_size)
+          TEST_AND_RETURN_FALSE(WriteAccumulatedFEC());
+      }
+    } else if (!fec_written_ && offset < fec_data_end &&
+               offset + size >= fec_data_end) {
       LOG(INFO) << "Writing verity FEC to " << partition_->target_path;
       TEST_AND_RETURN_FALSE(EncodeFEC(partition_->target_path,
                                       partition_->fec_data_offset,
@@ -111,11 +425,27 @@ bool VerityWriterAndroid::Update(uint64_t offset,
                                       partition_->fec_roots,
                                       partition_->block_size,
                                       false /* verify_mode */));
+      fec_written_ = true;
     }
   }
   return true;
 }
 
+bool VerityWriterAndroid::Finalize() {
+  if (hash_tree_builder_) {
+    LOG(ERROR) << "Not all the verity hash tree data of "
+               << partition_->target_path << " was passed.";
+    return false;
+  }
+  if (partition_->fec_size != 0 && !fec_written_) {
+    LOG(ERROR) << "Not all the verity FEC data of " << partition_->target_path
+               << " was passed, got " << fec_data_accumulated_ << " of "
+               << partition_->fec_data_size << " bytes.";
+    return false;
+  }
+  return true;
+}
+
 bool VerityWriterAndroid::EncodeFEC(const std::string& path,
                                     uint64_t data_offset,
                                     uint64_t data_size,
@@ -131,10 +461,6 @@ bool VerityWriterAndroid::EncodeFEC(const std::string& path,
   uint64_t rounds = utils::DivRoundUp(data_size / block_size, rs_n);
   TEST_AND_RETURN_FALSE(rounds * fec_roots * block_size == fec_size);
 
-  std::unique_ptr<void, decltype(&free_rs_char)> rs_char(
-      init_rs_char(FEC_PARAMS(fec_roots)), &free_rs_char);
-  TEST_AND_RETURN_FALSE(rs_char != nullptr);
-
   int fd = HANDLE_EINTR(open(path.c_str(), verify_mode ? O_RDONLY : O_RDWR));
   if (fd < 0) {
     PLOG(ERROR) << "Failed to open " << path << " to write FEC.";
@@ -142,54 +468,28 @@ bool VerityWriterAndroid::EncodeFEC(const std::string& path,
   }
   ScopedFdCloser fd_closer(&fd);
 
-  for (size_t i = 0; i < rounds; i++) {
-    // Encodes |block_size| number of rs blocks each round so that we can read
-    // one block each time instead of 1 byte to increase random read
-    // performance. This uses about 1 MiB memory for 4K block size.
-    brillo::Blob rs_blocks(block_size * rs_n);
-    for (size_t j = 0; j < rs_n; j++) {
-      brillo::Blob buffer(block_size, 0);
-      uint64_t offset =
-          fec_ecc_interleave(i * rs_n * block_size + j, rs_n, rounds);
-      // Don't read past |data_size|, treat them as 0.
-      if (offset < data_size) {
-        ssize_t bytes_read = 0;
-        TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
-                                              buffer.data(),
-                                              buffer.size(),
-                                              data_offset + offset,
-                                              &bytes_read));
-        TEST_AND_RETURN_FALSE(bytes_read ==
-                              static_cast<ssize_t>(buffer.size()));
-      }
-      for (size_t k = 0; k < buffer.size(); k++) {
-        rs_blocks[k * rs_n + j] = buffer[k];
-      }
-    }
-    brillo::Blob fec(block_size * fec_roots);
-    for (size_t j = 0; j < block_size; j++) {
-      // Encode [j * rs_n : (j + 1) * rs_n) in |rs_blocks| and write |fec_roots|
-      // number of parity bytes to |j * fec_roots| in |fec|.
-      encode_rs_char(rs_char.get(),
-                     rs_blocks.data() + j * rs_n,
-                     fec.data() + j * fec_roots);
-    }
-
-    if (verify_mode) {
-      brillo::Blob fec_read(fec.size());
-      ssize_t bytes_read = 0;
-      TEST_AND_RETURN_FALSE(utils::PReadAll(
-          fd, fec_read.data(), fec_read.size(), fec_offset, &bytes_read));
-      TEST_AND_RETURN_FALSE(bytes_read ==
-                            static_cast<ssize_t>(fec_read.size()));
-      TEST_AND_RETURN_FALSE(fec == fec_read);
-    } else {
-      TEST_AND_RETURN_FALSE(
-          utils::PWriteAll(fd, fec.data(), fec.size(), fec_offset));
-    }
-    fec_offset += fec.size();
+  FecEncoder encoder(fd,
+                     data_offset,
+                     data_size,
+                     fec_offset,
+                     fec_roots,
+                     block_size,
+                     rounds,
+                     verify_mode);
+  uint64_t num_batches = utils::DivRoundUp(rounds, kFecRoundsPerBatch);
+  size_t num_threads = std::min(
+      kMaxFecThreads, static_cast<size_t>(base::SysInfo::NumberOfProcessors()));
+  if (num_batches < num_threads)
+    num_threads = num_batches;
+  if (num_threads <= 1) {
+    encoder.Run();
+  } else {
+    base::DelegateSimpleThreadPool thread_pool("fec-encoder", num_threads);
+    thread_pool.Start();
+    // Each thread keeps taking batches from |encoder| until all are done.
+    thread_pool.AddWork(&encoder, num_threads);
+    thread_pool.JoinAll();
   }
-
-  return true;
+  return encoder.succeeded();
 }
 }  // namespace chromeos_update_engine
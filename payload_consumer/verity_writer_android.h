@@ -20,6 +20,7 @@
 #include <memory>
 #include <string>
 
+#include <brillo/secure_blob.h>
 #include <verity/hash_tree_builder.h>
 
 #include "update_engine/payload_consumer/verity_writer_interface.h"
@@ -33,13 +34,13 @@ class VerityWriterAndroid : public VerityWriterInterface {
 
   bool Init(const InstallPlan::Partition& partition) override;
   bool Update(uint64_t offset, const uint8_t* buffer, size_t size) override;
+  bool Finalize() override;
 
   // Read [data_offset : data_offset + data_size) from |path| and encode FEC
   // data, if |verify_mode|, then compare the encoded FEC with the one in
-  // |path|, otherwise write the encoded FEC to |path|. We can't encode as we go
-  // in each Update() like hash tree, because for every rs block, its data are
-  // spreaded across entire |data_size|, unless we can cache all data in
-  // memory, we have to re-read them from disk.
+  // |path|, otherwise write the encoded FEC to |path|. The rounds are encoded
+  // in batches on up to 4 threads. This is only used by Update() when the FEC
+  // is too large to be accumulated in memory.
   static bool EncodeFEC(const std::string& path,
                         uint64_t data_offset,
                         uint64_t data_size,
@@ -50,10 +51,36 @@ class VerityWriterAndroid : public VerityWriterInterface {
                         bool verify_mode);
 
  private:
+  // Sets up the accumulation of the FEC in Update(). Returns false if the FEC
+  // of |partition_| has to be encoded from disk with EncodeFEC() instead.
+  bool InitFECAccumulation();
+
+  // Adds the contribution of the FEC data at [offset : offset + size), relative
+  // to |fec_data_offset|, to the parity in |fec_|.
+  void AccumulateFEC(uint64_t offset, const uint8_t* buffer, size_t size);
+
+  // Writes the accumulated |fec_| to the target partition.
+  bool WriteAccumulatedFEC();
+
   const InstallPlan::Partition* partition_ = nullptr;
 
   std::unique_ptr<HashTreeBuilder> hash_tree_builder_;
 
+  // The parity of all the rounds, laid out like the FEC on disk. Every data
+  // block belongs to a single round, so instead of re-reading the data from
+  // disk after it is all written, the contribution of each data byte to the
+  // parity of its rs block is added here as it passes through Update(). Empty
+  // if the FEC is not being accumulated.
+  brillo::Blob fec_;
+  // The parity contribution of every byte value at every position of an rs
+  // block. The |fec_roots| parity bytes for the value v at position j are at
+  // (j * 256 + v) * fec_roots.
+  brillo::Blob fec_parity_table_;
+  uint64_t fec_rounds_{0};
+  // The number of FEC data bytes accumulated in |fec_| so far.
+  uint64_t fec_data_accumulated_{0};
+  bool fec_written_{false};
+
   DISALLOW_COPY_AND_ASSIGN(VerityWriterAndroid);
 };
 
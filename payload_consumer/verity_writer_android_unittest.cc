@@ -16,8 +16,16 @@
 
 #include "update_engine/payload_consumer/verity_writer_android.h"
 
+#include <stdlib.h>
+
+#include <memory>
+
 #include <brillo/secure_blob.h>
+#include <fec/ecc.h>
 #include <gtest/gtest.h>
+extern "C" {
+#include <fec.h>
+}
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
@@ -117,4 +125,131 @@ TEST_F(VerityWriterAndroidTest, FECTest) {
   EXPECT_EQ(part_data, actual_part);
 }
 
+TEST_F(VerityWriterAndroidTest, MultipleRoundsFECTest) {
+  const uint32_t kBlockSize = 4096;
+  const uint32_t kFecRoots = 2;
+  const size_t kRsN = FEC_RSM - kFecRoots;
+  // Enough blocks for several batches of rounds, the last round not full.
+  const uint64_t kDataBlocks = kRsN * 9 + 100;
+  const uint64_t kRounds = 10;
+  const uint64_t kDataSize = kDataBlocks * kBlockSize;
+  const uint64_t kFecSize = kRounds * kFecRoots * kBlockSize;
+
+  brillo::Blob part_data(kDataSize + kFecSize);
+  unsigned int seed = 1234;
+  for (size_t i = 0; i < kDataSize; i++)
+    part_data[i] = rand_r(&seed) & 0xff;
+  test_utils::WriteFileVector(partition_.target_path, part_data);
+
+  // Compute the expected FEC one round at a time.
+  std::unique_ptr<void, decltype(&free_rs_char)> rs_char(
+      init_rs_char(FEC_PARAMS(kFecRoots)), &free_rs_char);
+  ASSERT_NE(nullptr, rs_char);
+  brillo::Blob expected_fec;
+  for (uint64_t i = 0; i < kRounds; i++) {
+    brillo::Blob rs_blocks(kBlockSize * kRsN, 0);
+    for (size_t j = 0; j < kRsN; j++) {
+      uint64_t offset =
+          fec_ecc_interleave(i * kRsN * kBlockSize + j, kRsN, kRounds);
+      if (offset >= kDataSize)
+        continue;
+      for (size_t k = 0; k < kBlockSize; k++)
+        rs_blocks[k * kRsN + j] = part_data[offset + k];
+    }
+    brillo::Blob fec(kBlockSize * kFecRoots);
+    for (size_t j = 0; j < kBlockSize; j++) {
+      encode_rs_char(rs_char.get(),
+                     rs_blocks.data() + j * kRsN,
+                     fec.data() + j * kFecRoots);
+    }
+    expected_fec.insert(expected_fec.end(), fec.begin(), fec.end());
+  }
+
+  EXPECT_TRUE(VerityWriterAndroid::EncodeFEC(partition_.target_path,
+                                             0,
+                                             kDataSize,
+                                             kDataSize,
+                                             kFecSize,
+                                             kFecRoots,
+                                             kBlockSize,
+                                             false /* verify_mode */));
+  brillo::Blob actual_part;
+  utils::ReadFile(partition_.target_path, &actual_part);
+  EXPECT_EQ(expected_fec,
+            brillo::Blob(actual_part.begin() + kDataSize, actual_part.end()));
+
+  EXPECT_TRUE(VerityWriterAndroid::EncodeFEC(partition_.target_path,
+                                             0,
+                                             kDataSize,
+                                             kDataSize,
+                                             kFecSize,
+                                             kFecRoots,
+                                             kBlockSize,
+                                             true /* verify_mode */));
+  // Corrupt the data read by the last round.
+  actual_part[kDataSize - 1] ^= 0xff;
+  test_utils::WriteFileVector(partition_.target_path, actual_part);
+  EXPECT_FALSE(VerityWriterAndroid::EncodeFEC(partition_.target_path,
+                                              0,
+                                              kDataSize,
+                                              kDataSize,
+                                              kFecSize,
+                                              kFecRoots,
+                                              kBlockSize,
+                                              true /* verify_mode */));
+}
+
+TEST_F(VerityWriterAndroidTest, AccumulatedFECTest) {
+  const uint32_t kBlockSize = 4096;
+  const uint32_t kFecRoots = 2;
+  const size_t kRsN = FEC_RSM - kFecRoots;
+  const uint64_t kDataBlocks = kRsN * 2 + 10;
+  const uint64_t kRounds = 3;
+  const uint64_t kDataSize = kDataBlocks * kBlockSize;
+  const uint64_t kFecSize = kRounds * kFecRoots * kBlockSize;
+  partition_.hash_tree_data_size = 0;
+  partition_.hash_tree_size = 0;
+  partition_.fec_data_offset = 0;
+  partition_.fec_data_size = kDataSize;
+  partition_.fec_offset = kDataSize;
+  partition_.fec_size = kFecSize;
+
+  brillo::Blob part_data(kDataSize + kFecSize);
+  unsigned int seed = 4321;
+  for (size_t i = 0; i < kDataSize; i++)
+    part_data[i] = rand_r(&seed) & 0xff;
+  test_utils::WriteFileVector(partition_.target_path, part_data);
+
+  ASSERT_TRUE(verity_writer_.Init(partition_));
+  // Pass the data backwards in chunks not aligned to the blocks, the FEC
+  // should only be written once all of it was passed.
+  const uint64_t kChunkSize = 10000;
+  uint64_t end = kDataSize;
+  while (end > 0) {
+    uint64_t start = end > kChunkSize ? end - kChunkSize : 0;
+    if (start == 0) {
+      brillo::Blob actual_part;
+      utils::ReadFile(partition_.target_path, &actual_part);
+      EXPECT_EQ(part_data, actual_part);
+    }
+    EXPECT_TRUE(
+        verity_writer_.Update(start, part_data.data() + start, end - start));
+    end = start;
+  }
+  EXPECT_TRUE(verity_writer_.Finalize());
+  EXPECT_TRUE(VerityWriterAndroid::EncodeFEC(partition_.target_path,
+                                             0,
+                                             kDataSize,
+                                             kDataSize,
+                                             kFecSize,
+                                             kFecRoots,
+                                             kBlockSize,
+                                             true /* verify_mode */));
+
+  // The FEC isn't written if some data is missing.
+  ASSERT_TRUE(verity_writer_.Init(partition_));
+  EXPECT_TRUE(verity_writer_.Update(0, part_data.data(), kDataSize - 1));
+  EXPECT_FALSE(verity_writer_.Finalize());
+}
+
 }  // namespace chromeos_update_engine
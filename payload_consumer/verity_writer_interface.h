@@ -34,8 +34,11 @@ class VerityWriterInterface {
   // Update partition data at [offset : offset + size) stored in |buffer|.
   // Data not in |hash_tree_data_extent| or |fec_data_extent| is ignored.
   // Will write verity data to the target partition once all the necessary
-  // blocks has passed.
+  // blocks has passed. Each byte must be passed only once.
   virtual bool Update(uint64_t offset, const uint8_t* buffer, size_t size) = 0;
+  // Called once all the partition data has been passed to Update(). Returns
+  // false if some of the verity data was not written.
+  virtual bool Finalize() = 0;
 
  protected:
   VerityWriterInterface() = default;
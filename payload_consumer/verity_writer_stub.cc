@@ -36,4 +36,8 @@ bool VerityWriterStub::Update(uint64_t offset,
   return true;
 }
 
+bool VerityWriterStub::Finalize() {
+  return true;
+}
+
 }  // namespace chromeos_update_engine
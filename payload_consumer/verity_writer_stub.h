@@ -28,6 +28,7 @@ class VerityWriterStub : public VerityWriterInterface {
 
   bool Init(const InstallPlan::Partition& partition) override;
   bool Update(uint64_t offset, const uint8_t* buffer, size_t size) override;
+  bool Finalize() override;
 
  private:
   DISALLOW_COPY_AND_ASSIGN(VerityWriterStub);
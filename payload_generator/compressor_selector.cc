@@ -0,0 +1,209 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/compressor_selector.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_generator/bzip.h"
+#include "update_engine/payload_generator/xz.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The sample compressed to predict the compressed sizes is made of
+// |kSampleSlices| slices of |kSampleSliceSize| bytes spread over the data.
+const size_t kSampleSlices = 4;
+const size_t kSampleSliceSize = 16 * 1024;
+
+// Smaller data is compressed with all the allowed compressors, since the
+// sample would be a big part of it.
+const size_t kMinSelectionSize = 256 * 1024;
+
+// The byte entropy, in bits, above which the data is considered already
+// compressed and not worth compressing again.
+const double kIncompressibleEntropy = 7.98;
+
+// The compressor predicted to lose is still run when its predicted size is
+// within this ratio of the winner's, since the prediction is not exact.
+const double kSpeculativeMargin = 0.03;
+
+brillo::Blob TakeSample(const brillo::Blob& data) {
+  brillo::Blob sample;
+  sample.reserve(kSampleSlices * kSampleSliceSize);
+  size_t stride = (data.size() - kSampleSliceSize) / (kSampleSlices - 1);
+  for (size_t i = 0; i < kSampleSlices; i++) {
+    auto slice = data.begin() + i * stride;
+    sample.insert(sample.end(), slice, slice + kSampleSliceSize);
+  }
+  return sample;
+}
+
+// Returns the Shannon entropy of the bytes of |data| in bits per byte.
+double ByteEntropy(const brillo::Blob& data) {
+  uint64_t counts[256] = {};
+  for (uint8_t byte : data)
+    counts[byte]++;
+  double entropy = 0;
+  for (uint64_t count : counts) {
+    if (count) {
+      double p = static_cast<double>(count) / data.size();
+      entropy -= p * log2(p);
+    }
+  }
+  return entropy;
+}
+
+}  // namespace
+
+CompressorSelector::CompressorSelector(base::TimeDelta speculative_budget,
+                                       bool audit)
+    : speculative_budget_(speculative_budget), audit_(audit) {}
+
+CompressorSelector::Selection CompressorSelector::Select(
+    const brillo::Blob& data, bool xz_allowed, bool bzip_allowed) {
+  Selection selection;
+  selection.xz = xz_allowed;
+  selection.bzip = bzip_allowed;
+  if (data.size() < kMinSelectionSize || !(xz_allowed && bzip_allowed))
+    return selection;
+
+  // Extrapolate the compressed sizes of the sample. They are also needed when
+  // nothing is compressed, to estimate what skipping the compressors cost.
+  brillo::Blob sample = TakeSample(data);
+  brillo::Blob compressed;
+  double scale = static_cast<double>(data.size()) / sample.size();
+  selection.predicted_xz_size = data.size();
+  if (XzCompress(sample, &compressed) && !compressed.empty())
+    selection.predicted_xz_size =
+        static_cast<uint64_t>(compressed.size() * scale);
+  selection.predicted_bzip_size = data.size();
+  if (BzipCompress(sample, &compressed) && !compressed.empty())
+    selection.predicted_bzip_size =
+        static_cast<uint64_t>(compressed.size() * scale);
+
+  uint64_t best_size =
+      std::min(selection.predicted_xz_size, selection.predicted_bzip_size);
+  if (ByteEntropy(sample) >= kIncompressibleEntropy ||
+      best_size >= data.size()) {
+    selection.xz = selection.bzip = false;
+    selection.skipped_xz = selection.skipped_bzip = true;
+    return selection;
+  }
+
+  bool xz_wins = selection.predicted_xz_size <= selection.predicted_bzip_size;
+  uint64_t loser_size = xz_wins ? selection.predicted_bzip_size
+                                : selection.predicted_xz_size;
+  bool speculate = loser_size <= best_size * (1 + kSpeculativeMargin);
+  if (speculate && speculative_budget_ >= base::TimeDelta()) {
+    base::AutoLock auto_lock(lock_);
+    speculate = speculative_time_ < speculative_budget_;
+  }
+  if (xz_wins) {
+    selection.bzip = selection.speculative_bzip = speculate;
+    selection.skipped_bzip = !speculate;
+  } else {
+    selection.xz = selection.speculative_xz = speculate;
+    selection.skipped_xz = !speculate;
+  }
+  return selection;
+}
+
+void CompressorSelector::RecordResult(const brillo::Blob& data,
+                                      const Selection& selection,
+                                      size_t size,
+                                      base::TimeDelta speculative_time,
+                                      bool speculative_won) {
+  uint64_t cost = 0;
+  if (selection.skipped_xz || selection.skipped_bzip) {
+    uint64_t skipped_size;
+    if (audit_) {
+      skipped_size =
+          CompressedSize(data, selection.skipped_xz, selection.skipped_bzip);
+    } else {
+      // Without a prediction, the skipped compressors are assumed to be no
+      // better than the chosen one.
+      skipped_size = size;
+      if (selection.skipped_xz && selection.predicted_xz_size)
+        skipped_size = std::min(skipped_size, selection.predicted_xz_size);
+      if (selection.skipped_bzip && selection.predicted_bzip_size)
+        skipped_size = std::min(skipped_size, selection.predicted_bzip_size);
+    }
+    if (skipped_size < size)
+      cost = size - skipped_size;
+  }
+
+  base::AutoLock auto_lock(lock_);
+  selections_++;
+  if (selection.skipped_xz)
+    skipped_xz_++;
+  if (selection.skipped_bzip)
+    skipped_bzip_++;
+  skipped_cost_ += cost;
+  if (selection.speculative_xz || selection.speculative_bzip) {
+    speculative_runs_++;
+    if (speculative_won)
+      speculative_wins_++;
+    speculative_time_ += speculative_time;
+  }
+}
+
+void CompressorSelector::LogStats(const string& name) {
+  base::AutoLock auto_lock(lock_);
+  LOG(INFO) << "Compressor selection for " << name << ": skipped xz "
+            << skipped_xz_ << " and bzip2 " << skipped_bzip_ << " times out of "
+            << selections_ << ", costing " << skipped_cost_ << " bytes ("
+            << (audit_ ? "measured" : "estimated") << "). "
+            << speculative_wins_ << " of " << speculative_runs_
+            << " speculative runs won, taking "
+            << speculative_time_.InSecondsF() << " seconds.";
+}
+
+uint64_t CompressorSelector::skipped_xz() {
+  base::AutoLock auto_lock(lock_);
+  return skipped_xz_;
+}
+
+uint64_t CompressorSelector::skipped_bzip() {
+  base::AutoLock auto_lock(lock_);
+  return skipped_bzip_;
+}
+
+uint64_t CompressorSelector::skipped_cost() {
+  base::AutoLock auto_lock(lock_);
+  return skipped_cost_;
+}
+
+size_t CompressorSelector::CompressedSize(const brillo::Blob& data,
+                                          bool xz,
+                                          bool bzip) {
+  size_t size = data.size();
+  brillo::Blob compressed;
+  if (xz && XzCompress(data, &compressed) && !compressed.empty())
+    size = std::min(size, compressed.size());
+  if (bzip && BzipCompress(data, &compressed) && !compressed.empty())
+    size = std::min(size, compressed.size());
+  return size;
+}
+
+}  // namespace chromeos_update_engine
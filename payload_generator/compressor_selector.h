@@ -0,0 +1,129 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_COMPRESSOR_SELECTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_COMPRESSOR_SELECTOR_H_
+
+#include <string>
+
+#include <base/macros.h>
+#include <base/synchronization/lock.h>
+#include <base/time/time.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// Predicts which of the xz and bzip2 compressors are worth running on the data
+// of a full operation, so GenerateBestFullOperation() doesn't run compressors
+// whose output would be thrown away.
+//
+// The prediction compresses a small sample taken across the data with both
+// compressors and extrapolates their sizes. Data with a byte entropy close to 8
+// bits, usually already compressed, is not compressed at all. The compressor
+// predicted to lose is still run when its predicted size is close to the
+// winner's, as long as the time spent on these speculative runs stays within
+// the budget.
+//
+// The budget only covers the speculative runs, not the sampling nor the runs
+// of the predicted winners. It is the sum of the wall-clock durations of the
+// speculative runs of all the threads, so with several threads it runs out
+// sooner than the elapsed time. It is checked before each run, so each thread
+// can go over it by one run.
+//
+// The skipped compressors are counted along with the bytes skipping them cost,
+// estimated from the sample or, in audit mode, measured by running them anyway.
+//
+// All the methods can be called from several threads at the same time.
+class CompressorSelector {
+ public:
+  // The compressors to run on some data.
+  struct Selection {
+    bool xz = false;
+    bool bzip = false;
+
+    // The allowed compressors not run.
+    bool skipped_xz = false;
+    bool skipped_bzip = false;
+
+    // Whether the compressor is run although it is predicted to lose.
+    bool speculative_xz = false;
+    bool speculative_bzip = false;
+
+    // The predicted sizes of the xz and bzip2 blobs, or 0 if not predicted.
+    uint64_t predicted_xz_size = 0;
+    uint64_t predicted_bzip_size = 0;
+  };
+
+  // Creates a selector spending at most |speculative_budget| running the
+  // compressors predicted to lose, as described above, or with no limit if it
+  // is negative. In |audit| mode the skipped compressors are run anyway to
+  // measure the cost of skipping them.
+  CompressorSelector(base::TimeDelta speculative_budget, bool audit);
+  ~CompressorSelector() = default;
+
+  // Returns the compressors worth running on |data| among the allowed ones.
+  Selection Select(const brillo::Blob& data, bool xz_allowed, bool bzip_allowed);
+
+  // Records that the compressors of the |selection| for |data| produced a blob
+  // of |size| bytes, where the speculative compressor took |speculative_time|
+  // and produced the blob if |speculative_won|. In audit mode, this runs the
+  // skipped compressors to measure what skipping them cost.
+  void RecordResult(const brillo::Blob& data,
+                    const Selection& selection,
+                    size_t size,
+                    base::TimeDelta speculative_time,
+                    bool speculative_won);
+
+  // Logs the number of skipped compressors and what skipping them cost, with
+  // |name| identifying the data compressed, such as the partition name.
+  void LogStats(const std::string& name);
+
+  base::TimeDelta speculative_budget() const { return speculative_budget_; }
+  bool audit() const { return audit_; }
+
+  uint64_t skipped_xz();
+  uint64_t skipped_bzip();
+  uint64_t skipped_cost();
+
+ private:
+  // Returns the size of the smallest blob produced by the compressors with
+  // |xz| and |bzip| on |data|, or |data| size if none compresses it.
+  static size_t CompressedSize(const brillo::Blob& data, bool xz, bool bzip);
+
+  const base::TimeDelta speculative_budget_;
+  const bool audit_;
+
+  // Protects all the members below.
+  base::Lock lock_;
+
+  // The time spent running the compressors predicted to lose.
+  base::TimeDelta speculative_time_;
+
+  uint64_t selections_{0};
+  uint64_t skipped_xz_{0};
+  uint64_t skipped_bzip_{0};
+  // The bytes that would have been saved by running the skipped compressors.
+  uint64_t skipped_cost_{0};
+  // The number of speculative runs, and how many of them won.
+  uint64_t speculative_runs_{0};
+  uint64_t speculative_wins_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(CompressorSelector);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_COMPRESSOR_SELECTOR_H_
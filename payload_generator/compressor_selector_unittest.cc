@@ -0,0 +1,128 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/compressor_selector.h"
+
+#include <random>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+
+namespace chromeos_update_engine {
+
+class CompressorSelectorTest : public ::testing::Test {
+ protected:
+  // Returns |size| bytes of random data.
+  brillo::Blob RandomData(size_t size) {
+    std::mt19937 gen(12345);
+    std::uniform_int_distribution<int> dist(0, 255);
+    brillo::Blob data(size);
+    for (uint8_t& byte : data)
+      byte = dist(gen);
+    return data;
+  }
+
+  // Returns |size| bytes of repetitive data that compresses well.
+  brillo::Blob RepetitiveData(size_t size) {
+    brillo::Blob data(size);
+    test_utils::FillWithData(&data);
+    return data;
+  }
+
+  CompressorSelector selector_{base::TimeDelta::FromSeconds(-1), false};
+};
+
+TEST_F(CompressorSelectorTest, SmallDataRunsAllCompressorsTest) {
+  CompressorSelector::Selection selection =
+      selector_.Select(RandomData(4096), true, true);
+  EXPECT_TRUE(selection.xz);
+  EXPECT_TRUE(selection.bzip);
+  EXPECT_FALSE(selection.skipped_xz);
+  EXPECT_FALSE(selection.skipped_bzip);
+}
+
+TEST_F(CompressorSelectorTest, OnlyAllowedCompressorsTest) {
+  CompressorSelector::Selection selection =
+      selector_.Select(RepetitiveData(1024 * 1024), true, false);
+  EXPECT_TRUE(selection.xz);
+  EXPECT_FALSE(selection.bzip);
+}
+
+TEST_F(CompressorSelectorTest, SkipIncompressibleDataTest) {
+  brillo::Blob data = RandomData(1024 * 1024);
+  CompressorSelector::Selection selection = selector_.Select(data, true, true);
+  EXPECT_FALSE(selection.xz);
+  EXPECT_FALSE(selection.bzip);
+  EXPECT_TRUE(selection.skipped_xz);
+  EXPECT_TRUE(selection.skipped_bzip);
+
+  selector_.RecordResult(data, selection, data.size(), base::TimeDelta(), false);
+  EXPECT_EQ(1u, selector_.skipped_xz());
+  EXPECT_EQ(1u, selector_.skipped_bzip());
+  EXPECT_EQ(0u, selector_.skipped_cost());
+}
+
+TEST_F(CompressorSelectorTest, SkipHighEntropyDataEstimatesCostTest) {
+  // Repeating random bytes keeps the byte entropy close to 8 bits, but the
+  // repetitions compress well.
+  brillo::Blob block = RandomData(4096);
+  brillo::Blob data;
+  while (data.size() < 1024 * 1024)
+    data.insert(data.end(), block.begin(), block.end());
+  CompressorSelector::Selection selection = selector_.Select(data, true, true);
+  EXPECT_FALSE(selection.xz);
+  EXPECT_FALSE(selection.bzip);
+  EXPECT_LT(selection.predicted_xz_size, data.size());
+
+  selector_.RecordResult(data, selection, data.size(), base::TimeDelta(), false);
+  EXPECT_GT(selector_.skipped_cost(), 0u);
+}
+
+TEST_F(CompressorSelectorTest, SelectOneCompressorTest) {
+  CompressorSelector::Selection selection =
+      selector_.Select(RepetitiveData(1024 * 1024), true, true);
+  EXPECT_GT(selection.predicted_xz_size, 0u);
+  EXPECT_GT(selection.predicted_bzip_size, 0u);
+  // At least one of them is run, and the other one only speculatively.
+  EXPECT_TRUE(selection.xz || selection.bzip);
+  EXPECT_EQ(selection.skipped_xz, !selection.xz);
+  EXPECT_EQ(selection.skipped_bzip, !selection.bzip);
+  EXPECT_FALSE(selection.xz && selection.bzip &&
+               !selection.speculative_xz && !selection.speculative_bzip);
+}
+
+TEST_F(CompressorSelectorTest, NoSpeculationOverBudgetTest) {
+  CompressorSelector selector(base::TimeDelta(), false);
+  CompressorSelector::Selection selection =
+      selector.Select(RepetitiveData(1024 * 1024), true, true);
+  EXPECT_FALSE(selection.speculative_xz);
+  EXPECT_FALSE(selection.speculative_bzip);
+  EXPECT_NE(selection.xz, selection.bzip);
+}
+
+TEST_F(CompressorSelectorTest, AuditMeasuresSkippedCostTest) {
+  CompressorSelector selector(base::TimeDelta::FromSeconds(-1), true);
+  brillo::Blob data = RepetitiveData(1024 * 1024);
+  CompressorSelector::Selection selection;
+  selection.skipped_xz = true;
+  // Pretend the chosen blob was not compressed at all.
+  selector.RecordResult(data, selection, data.size(), base::TimeDelta(), false);
+  EXPECT_EQ(1u, selector.skipped_xz());
+  EXPECT_GT(selector.skipped_cost(), 0u);
+}
+
+}  // namespace chromeos_update_engine
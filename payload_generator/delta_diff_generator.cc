@@ -29,15 +29,18 @@
 #include <vector>
 
 #include <base/logging.h>
+#include <base/time/time.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/ab_generator.h"
 #include "update_engine/payload_generator/blob_file_writer.h"
+#include "update_engine/payload_generator/compressor_selector.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/full_update_generator.h"
 #include "update_engine/payload_generator/inplace_generator.h"
+#include "update_engine/payload_generator/memory_budget.h"
 #include "update_engine/payload_generator/payload_file.h"
 
 using std::string;
@@ -80,6 +83,9 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
       TEST_AND_RETURN_FALSE(config.source.partitions.size() ==
                             config.target.partitions.size());
     }
+    // The budget is shared by all the partitions, so its statistics cover the
+    // whole payload.
+    MemoryBudget memory_budget(config.memory_budget);
     PartitionConfig empty_part("");
     for (size_t i = 0; i < config.target.partitions.size(); i++) {
       const PartitionConfig& old_part =
@@ -105,10 +111,25 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
         strategy.reset(new FullUpdateGenerator());
       }
 
+      unique_ptr<CompressorSelector> compressor_selector;
+      if (config.select_compressors) {
+        compressor_selector.reset(new CompressorSelector(
+            base::TimeDelta::FromSecondsD(
+                config.speculative_compression_budget),
+            config.audit_compressor_selection));
+      }
+      diff_utils::SetCompressorSelector(compressor_selector.get());
+      diff_utils::SetMemoryBudget(&memory_budget);
+
       vector<AnnotatedOperation> aops;
       // Generate the operations using the strategy we selected above.
-      TEST_AND_RETURN_FALSE(strategy->GenerateOperations(
-          config, old_part, new_part, &blob_file, &aops));
+      bool success = strategy->GenerateOperations(
+          config, old_part, new_part, &blob_file, &aops);
+      diff_utils::SetCompressorSelector(nullptr);
+      diff_utils::SetMemoryBudget(nullptr);
+      TEST_AND_RETURN_FALSE(success);
+      if (compressor_selector)
+        compressor_selector->LogStats(new_part.name);
 
       // Filter the no-operations. OperationsGenerators should not output this
       // kind of operations normally, but this is an extra step to fix that if
@@ -117,6 +138,7 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
 
       TEST_AND_RETURN_FALSE(payload.AddPartition(old_part, new_part, aops));
     }
+    memory_budget.LogStats();
   }
 
   LOG(INFO) << "Writing payload file...";
@@ -17,6 +17,7 @@
 #include "update_engine/payload_generator/delta_diff_utils.h"
 
 #include <endian.h>
+#include <string.h>
 #if defined(__clang__)
 // TODO(*): Remove these pragmas when b/35721782 is fixed.
 #pragma clang diagnostic push
@@ -26,6 +27,7 @@
 #if defined(__clang__)
 #pragma clang diagnostic pop
 #endif
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -33,6 +35,7 @@
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>  // NOLINT(build/c++11)
 #include <numeric>
 #include <utility>
 
@@ -40,6 +43,7 @@
 #include <base/format_macros.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
+#include <base/synchronization/lock.h>
 #include <base/threading/simple_thread.h>
 #include <base/time/time.h>
 #include <brillo/data_encoding.h>
@@ -58,6 +62,8 @@
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/file_similarity_index.h"
+#include "update_engine/payload_generator/rolling_hash_index.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
 #include "update_engine/payload_generator/xz.h"
 
@@ -83,6 +89,65 @@ const uint64_t kMaxPuffdiffDestinationSize = 150 * 1024 * 1024;  // bytes
 
 const int kBrotliCompressionQuality = 11;
 
+// The MFD_CLOEXEC flag of memfd_create(), which older libc headers don't have.
+const unsigned int kMemfdCloexec = 0x0001U;
+
+// The cache of the diff operations used by ReadExtentsToDiff(), if any.
+DiffCache* diff_cache = nullptr;
+
+// The selector of the compressors used by GenerateBestFullOperation(), if any.
+CompressorSelector* compressor_selector = nullptr;
+
+// The memory budget of the tasks of DeltaReadPartition(), if any.
+MemoryBudget* memory_budget = nullptr;
+
+// The threads of the pool generating the operations, set by
+// ScopedIdlePoolThreads. The ones without a task to run, and not lent already,
+// can compress the big inputs of GenerateBestFullOperation() with xz.
+struct PoolThreads {
+  base::Lock lock;
+  size_t num_threads = 0;
+  // The tasks of the pool not done yet.
+  size_t pending_tasks = 0;
+  // The idle threads lent to the xz compressions.
+  size_t lent_threads = 0;
+};
+
+PoolThreads* GetPoolThreads() {
+  static PoolThreads* pool_threads = new PoolThreads();
+  return pool_threads;
+}
+
+// Borrows up to |max_threads| idle threads of the pool, and returns how many.
+size_t BorrowIdlePoolThreads(size_t max_threads) {
+  PoolThreads* pool_threads = GetPoolThreads();
+  base::AutoLock auto_lock(pool_threads->lock);
+  size_t busy_threads =
+      std::min(pool_threads->num_threads, pool_threads->pending_tasks) +
+      pool_threads->lent_threads;
+  if (busy_threads >= pool_threads->num_threads)
+    return 0;
+  size_t threads =
+      std::min(max_threads, pool_threads->num_threads - busy_threads);
+  pool_threads->lent_threads += threads;
+  return threads;
+}
+
+void ReturnIdlePoolThreads(size_t threads) {
+  PoolThreads* pool_threads = GetPoolThreads();
+  base::AutoLock auto_lock(pool_threads->lock);
+  pool_threads->lent_threads -= threads;
+}
+
+// bsdiff builds a suffix array of up to 8 bytes per byte of the old data.
+const uint64_t kSuffixArrayFactor = 8;
+
+// The memory used by the compressors of the full operations, mostly the xz
+// encoder, when compressing on a single thread. Each additional xz thread uses
+// another encoder.
+const uint64_t kCompressorMemory = 100 * 1024 * 1024;  // bytes
+const uint64_t kXzEncoderMemory = 94 * 1024 * 1024;    // bytes
+
 // Process a range of blocks from |range_start| to |range_end| in the extent at
 // position |*idx_p| of |extents|. If |do_remove| is true, this range will be
 // removed, which may cause the extent to be trimmed, split or removed entirely.
@@ -228,35 +293,349 @@ int LevenshteinDistance(const string& a, const string& b) {
   }
   return distances.back();
 }
+
+// Computes in |key| the DiffCache key of the diff operation between |old_data|
+// and |new_data|. The key covers everything ReadExtentsToDiff() uses to pick
+// the diff operation: the data, their deflates, the payload |version| and
+// which diff operations are allowed, plus any other |settings| the operation
+// depends on.
+bool GetDiffCacheKey(const brillo::Blob& old_data,
+                     const brillo::Blob& new_data,
+                     const vector<puffin::BitExtent>& src_deflates,
+                     const vector<puffin::BitExtent>& dst_deflates,
+                     const PayloadVersion& version,
+                     bool bsdiff_allowed,
+                     bool puffdiff_allowed,
+                     const vector<uint64_t>& settings,
+                     brillo::Blob* key) {
+  vector<uint64_t> header = {version.major,
+                             version.minor,
+                             bsdiff_allowed,
+                             puffdiff_allowed,
+                             old_data.size(),
+                             new_data.size(),
+                             src_deflates.size(),
+                             dst_deflates.size(),
+                             settings.size()};
+  header.insert(header.end(), settings.begin(), settings.end());
+  for (const auto* deflates : {&src_deflates, &dst_deflates}) {
+    for (const puffin::BitExtent& deflate : *deflates) {
+      header.push_back(deflate.offset);
+      header.push_back(deflate.length);
+    }
+  }
+  for (uint64_t& value : header)
+    value = htobe64(value);
+
+  HashCalculator hasher;
+  TEST_AND_RETURN_FALSE(
+      hasher.Update(header.data(), header.size() * sizeof(header[0])));
+  TEST_AND_RETURN_FALSE(hasher.Update(old_data.data(), old_data.size()));
+  TEST_AND_RETURN_FALSE(hasher.Update(new_data.data(), new_data.size()));
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+  *key = hasher.raw_hash();
+  return true;
+}
+
+// The cached values are the operation type as a big endian uint32 followed by
+// the operation blob.
+bool LookupDiffCache(const brillo::Blob& key,
+                     InstallOperation::Type* op_type,
+                     brillo::Blob* blob) {
+  brillo::Blob value;
+  if (!diff_cache->Lookup(key, &value) || value.size() < sizeof(uint32_t))
+    return false;
+  uint32_t type;
+  memcpy(&type, value.data(), sizeof(type));
+  type = be32toh(type);
+  if (!InstallOperation::Type_IsValid(type))
+    return false;
+  *op_type = static_cast<InstallOperation::Type>(type);
+  blob->assign(value.begin() + sizeof(type), value.end());
+  return true;
+}
+
+void StoreDiffCache(const brillo::Blob& key,
+                    InstallOperation::Type op_type,
+                    const brillo::Blob& blob) {
+  uint32_t type = htobe32(op_type);
+  brillo::Blob value(reinterpret_cast<const uint8_t*>(&type),
+                     reinterpret_cast<const uint8_t*>(&type) + sizeof(type));
+  value.insert(value.end(), blob.begin(), blob.end());
+  if (!diff_cache->Store(key, value))
+    LOG(WARNING) << "Failed to store the diff operation in the diff cache.";
+}
+
+// Same as diff_utils::GenerateBestFullOperation(), but reusing the operation
+// stored in the diff cache for the same |new_data|, if any. Its key is the one
+// of a diff from empty old data, which ReadExtentsToDiff() never computes,
+// including the settings of the compressor selector since the compressors run
+// depend on them.
+bool GenerateCachedFullOperation(const brillo::Blob& new_data,
+                                 const PayloadVersion& version,
+                                 brillo::Blob* out_blob,
+                                 InstallOperation::Type* out_type) {
+  vector<uint64_t> settings = {compressor_selector != nullptr};
+  if (compressor_selector) {
+    settings.push_back(
+        compressor_selector->speculative_budget().InMicroseconds());
+    settings.push_back(compressor_selector->audit());
+  }
+  brillo::Blob key;
+  if (diff_cache &&
+      GetDiffCacheKey(
+          {}, new_data, {}, {}, version, false, false, settings, &key) &&
+      LookupDiffCache(key, out_type, out_blob)) {
+    return true;
+  }
+  TEST_AND_RETURN_FALSE(diff_utils::GenerateBestFullOperation(
+      new_data, version, out_blob, out_type));
+  if (!key.empty())
+    StoreDiffCache(key, *out_type, *out_blob);
+  return true;
+}
+
+// A file the patches of bsdiff and puffdiff, which only write them to a path,
+// are written to and read back from. It is kept in memory with memfd_create()
+// when the kernel supports it, and each thread reuses its own one for all its
+// diffs, so diffing doesn't create and remove files.
+class ScratchFile {
+ public:
+  ~ScratchFile() {
+    IGNORE_EINTR(close(fd_));
+    if (!temp_path_.empty())
+      unlink(temp_path_.c_str());
+  }
+
+  // Returns the scratch file of the calling thread, truncated to be empty, or
+  // nullptr if it can't be created.
+  static ScratchFile* GetEmpty() {
+    static thread_local std::unique_ptr<ScratchFile> scratch_file;
+    if (!scratch_file) {
+      int fd = syscall(__NR_memfd_create, "update_engine_diff", kMemfdCloexec);
+      if (fd >= 0) {
+        scratch_file.reset(new ScratchFile(
+            fd, base::StringPrintf("/proc/self/fd/%d", fd), ""));
+      } else {
+        // Kernels older than 3.17 don't have memfd_create(), so fall back to a
+        // temporary file, still created only once per thread.
+        string temp_path;
+        if (!utils::MakeTempFile("diff-scratch.XXXXXX", &temp_path, &fd))
+          return nullptr;
+        scratch_file.reset(new ScratchFile(fd, temp_path, temp_path));
+      }
+    }
+    if (HANDLE_EINTR(ftruncate(scratch_file->fd_, 0)) != 0) {
+      PLOG(ERROR) << "Failed to truncate " << scratch_file->path_;
+      return nullptr;
+    }
+    return scratch_file.get();
+  }
+
+  // The path to pass to the diff libraries to write the file.
+  const string& path() const { return path_; }
+
+  // Reads the whole contents of the file into |data|.
+  bool Read(brillo::Blob* data) const {
+    off_t size = utils::FileSize(fd_);
+    TEST_AND_RETURN_FALSE(size >= 0);
+    data->resize(size);
+    ssize_t bytes_read;
+    TEST_AND_RETURN_FALSE(
+        utils::PReadAll(fd_, data->data(), size, 0, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == size);
+    return true;
+  }
+
+ private:
+  ScratchFile(int fd, const string& path, const string& temp_path)
+      : fd_(fd), path_(path), temp_path_(temp_path) {}
+
+  int fd_;
+  string path_;
+  // The path of the temporary file to remove, if not in memory.
+  string temp_path_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScratchFile);
+};
+
+// The part of a file diffed into one operation.
+struct FileChunk {
+  vector<Extent> old_extents;
+  vector<Extent> new_extents;
+  // The name of the operation.
+  string name;
+};
+
+// Splits the file |name| made of the |new_extents| and the |old_extents| of
+// its old version in chunks of |chunk_blocks| blocks, or a single chunk if
+// |chunk_blocks| is -1. The old and new files are split in the same chunks, so
+// a chunk gets no old data past the end of the old file.
+vector<FileChunk> SplitFileInChunks(const vector<Extent>& old_extents,
+                                    const vector<Extent>& new_extents,
+                                    const string& name,
+                                    ssize_t chunk_blocks) {
+  uint64_t total_blocks = utils::BlocksInExtents(new_extents);
+  if (chunk_blocks == -1)
+    chunk_blocks = total_blocks;
+
+  vector<FileChunk> chunks;
+  for (uint64_t block_offset = 0; block_offset < total_blocks;
+       block_offset += chunk_blocks) {
+    FileChunk chunk;
+    chunk.old_extents = ExtentsSublist(old_extents, block_offset, chunk_blocks);
+    chunk.new_extents = ExtentsSublist(new_extents, block_offset, chunk_blocks);
+    NormalizeExtents(&chunk.old_extents);
+    NormalizeExtents(&chunk.new_extents);
+    chunk.name = name;
+    if (static_cast<uint64_t>(chunk_blocks) < total_blocks) {
+      chunk.name = base::StringPrintf(
+          "%s:%" PRIu64, name.c_str(), block_offset / chunk_blocks);
+    }
+    chunks.push_back(std::move(chunk));
+  }
+  return chunks;
+}
+
+// Returns an estimate of the peak memory used to diff the |chunk| of a file:
+// the old and new data, the compressors, the suffix array bsdiff builds over
+// the old data when the chunk is small enough to be diffed, and the blob
+// produced. The new data bigger than an xz block may be compressed by several
+// xz encoders on the idle threads of the pool.
+uint64_t EstimateChunkMemory(const FileChunk& chunk,
+                             const PayloadVersion& version) {
+  uint64_t old_size = utils::BlocksInExtents(chunk.old_extents) * kBlockSize;
+  uint64_t new_size = utils::BlocksInExtents(chunk.new_extents) * kBlockSize;
+  uint64_t xz_threads = std::min<uint64_t>(
+      kMaxXzThreads, utils::DivRoundUp(new_size, kXzBlockSize));
+  uint64_t memory = old_size + 2 * new_size + kCompressorMemory;
+  if (xz_threads > 1)
+    memory += (xz_threads - 1) * kXzEncoderMemory;
+  bool diff_allowed =
+      version.OperationAllowed(InstallOperation::BSDIFF) ||
+      version.OperationAllowed(InstallOperation::SOURCE_BSDIFF) ||
+      version.OperationAllowed(InstallOperation::BROTLI_BSDIFF) ||
+      version.OperationAllowed(InstallOperation::PUFFDIFF);
+  if (old_size && diff_allowed && new_size <= kMaxBsdiffDestinationSize)
+    memory += old_size * kSuffixArrayFactor;
+  return memory;
+}
+
+// The index of the old data of a pseudo-file shared by all its chunks. It is
+// built by the first chunk looking up its source, so the old data is read and
+// checksummed on the threads of the pool instead of before starting them.
+class SharedSourceIndex {
+ public:
+  SharedSourceIndex(const string& part_path, const vector<Extent>& extents)
+      : part_path_(part_path), extents_(extents) {}
+  ~SharedSourceIndex() {
+    if (budget_)
+      budget_->ReleaseShared(reserved_memory_);
+  }
+
+  // Same as RollingHashIndex::FindSourceExtents(), building the index first if
+  // needed. Returns false if the index can't be built.
+  bool FindSourceExtents(const string& part_path,
+                         const vector<Extent>& extents,
+                         vector<Extent>* source_extents) {
+    // The other chunks of the pseudo-file wait for the index, but the chunks
+    // of the other files don't.
+    std::call_once(init_once_, [this] {
+      // The index is kept until all the chunks are done.
+      budget_ = memory_budget;
+      reserved_memory_ = RollingHashIndex::EstimateMemory(extents_);
+      if (budget_)
+        budget_->AcquireShared(reserved_memory_);
+      valid_ = index_.Init(part_path_, extents_);
+    });
+    TEST_AND_RETURN_FALSE(valid_);
+    return index_.FindSourceExtents(part_path, extents, source_extents);
+  }
+
+ private:
+  const string part_path_;
+  const vector<Extent> extents_;
+
+  // Built once by the first chunk, and only read afterwards.
+  std::once_flag init_once_;
+  bool valid_{false};
+  RollingHashIndex index_;
+
+  // The memory reserved for |index_| in the |budget_| it was built with.
+  MemoryBudget* budget_{nullptr};
+  uint64_t reserved_memory_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(SharedSourceIndex);
+};
+
+// Diffs the |chunk| of a file stored in |new_part| from its old version in
+// |old_part| and adds its operation to |aops|, unless it writes nothing.
+bool DeltaReadChunk(vector<AnnotatedOperation>* aops,
+                    const string& old_part,
+                    const string& new_part,
+                    const FileChunk& chunk,
+                    const vector<puffin::BitExtent>& old_deflates,
+                    const vector<puffin::BitExtent>& new_deflates,
+                    const PayloadVersion& version,
+                    BlobFileWriter* blob_file) {
+  brillo::Blob data;
+  InstallOperation operation;
+  TEST_AND_RETURN_FALSE(diff_utils::ReadExtentsToDiff(old_part,
+                                                      new_part,
+                                                      chunk.old_extents,
+                                                      chunk.new_extents,
+                                                      old_deflates,
+                                                      new_deflates,
+                                                      version,
+                                                      &data,
+                                                      &operation));
+
+  // Check if the operation writes nothing.
+  if (operation.dst_extents_size() == 0) {
+    if (operation.type() == InstallOperation::MOVE) {
+      LOG(INFO) << "Empty MOVE operation (" << chunk.name << "), skipping";
+      return true;
+    }
+    LOG(ERROR) << "Empty non-MOVE operation";
+    return false;
+  }
+
+  // Now, insert into the list of operations.
+  AnnotatedOperation aop;
+  aop.name = chunk.name;
+  aop.op = operation;
+
+  // Write the data
+  TEST_AND_RETURN_FALSE(aop.SetOperationBlob(data, blob_file));
+  aops->emplace_back(aop);
+  return true;
+}
+
 }  // namespace
 
 namespace diff_utils {
 
 // This class encapsulates a file delta processing thread work. The
-// processor computes the delta between the source and target files;
+// processor computes the delta between a chunk of the source and target files;
 // and write the compressed delta to the blob.
 class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
  public:
   FileDeltaProcessor(const string& old_part,
                      const string& new_part,
                      const PayloadVersion& version,
-                     const vector<Extent>& old_extents,
-                     const vector<Extent>& new_extents,
+                     FileChunk&& chunk,
                      const vector<puffin::BitExtent>& old_deflates,
                      const vector<puffin::BitExtent>& new_deflates,
-                     const string& name,
-                     ssize_t chunk_blocks,
+                     SharedSourceIndex* source_index,
                      BlobFileWriter* blob_file)
       : old_part_(old_part),
         new_part_(new_part),
         version_(version),
-        old_extents_(old_extents),
-        new_extents_(new_extents),
-        new_extents_blocks_(utils::BlocksInExtents(new_extents)),
+        chunk_(std::move(chunk)),
+        new_extents_blocks_(utils::BlocksInExtents(chunk_.new_extents)),
         old_deflates_(old_deflates),
         new_deflates_(new_deflates),
-        name_(name),
-        chunk_blocks_(chunk_blocks),
+        source_index_(source_index),
         blob_file_(blob_file) {}
 
   bool operator>(const FileDeltaProcessor& other) const {
@@ -278,18 +657,18 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
   const string& new_part_;  // NOLINT(runtime/member_string_references)
   const PayloadVersion& version_;
 
-  // The block ranges of the old/new file within the src/tgt image
-  const vector<Extent> old_extents_;
-  const vector<Extent> new_extents_;
+  // The block ranges of the old/new file chunk within the src/tgt image, and
+  // the name of its operation.
+  FileChunk chunk_;
   const size_t new_extents_blocks_;
   const vector<puffin::BitExtent> old_deflates_;
   const vector<puffin::BitExtent> new_deflates_;
-  const string name_;
-  // Block limit of one aop.
-  const ssize_t chunk_blocks_;
+  // The index of the old data of a pseudo-file used to find the source of the
+  // chunk, or nullptr to use the old data at the same position.
+  SharedSourceIndex* source_index_;
   BlobFileWriter* blob_file_;
 
-  // The list of ops to reach the new file from the old file.
+  // The list of ops to reach the new file chunk from the old file.
   vector<AnnotatedOperation> file_aops_;
 
   bool failed_ = false;
@@ -298,21 +677,38 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
 };
 
 void FileDeltaProcessor::Run() {
+  ScopedIdlePoolThreads::ScopedTask pool_task;
   TEST_AND_RETURN(blob_file_ != nullptr);
   base::TimeTicks start = base::TimeTicks::Now();
 
-  if (!DeltaReadFile(&file_aops_,
-                     old_part_,
-                     new_part_,
-                     old_extents_,
-                     new_extents_,
-                     old_deflates_,
-                     new_deflates_,
-                     name_,
-                     chunk_blocks_,
-                     version_,
-                     blob_file_)) {
-    LOG(ERROR) << "Failed to generate delta for " << name_ << " ("
+  if (source_index_) {
+    // The lookup reads the new data of the chunk.
+    MemoryBudget::ScopedReservation lookup_reservation(
+        memory_budget, new_extents_blocks_ * kBlockSize);
+    vector<Extent> source_extents;
+    if (!source_index_->FindSourceExtents(
+            new_part_, chunk_.new_extents, &source_extents)) {
+      LOG(ERROR) << "Failed to find the source of " << chunk_.name;
+      failed_ = true;
+      return;
+    }
+    if (!source_extents.empty())
+      chunk_.old_extents = std::move(source_extents);
+  }
+
+  // The estimate uses the source found above, if any.
+  MemoryBudget::ScopedReservation reservation(
+      memory_budget, EstimateChunkMemory(chunk_, version_));
+
+  if (!DeltaReadChunk(&file_aops_,
+                      old_part_,
+                      new_part_,
+                      chunk_,
+                      old_deflates_,
+                      new_deflates_,
+                      version_,
+                      blob_file_)) {
+    LOG(ERROR) << "Failed to generate delta for " << chunk_.name << " ("
                << new_extents_blocks_ << " blocks)";
     failed_ = true;
     return;
@@ -321,13 +717,13 @@ void FileDeltaProcessor::Run() {
   if (!version_.InplaceUpdate()) {
     if (!ABGenerator::FragmentOperations(
             version_, &file_aops_, new_part_, blob_file_)) {
-      LOG(ERROR) << "Failed to fragment operations for " << name_;
+      LOG(ERROR) << "Failed to fragment operations for " << chunk_.name;
       failed_ = true;
       return;
     }
   }
 
-  LOG(INFO) << "Encoded file " << name_ << " (" << new_extents_blocks_
+  LOG(INFO) << "Encoded file " << chunk_.name << " (" << new_extents_blocks_
             << " blocks) in " << (base::TimeTicks::Now() - start);
 }
 
@@ -402,19 +798,60 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                                                 &old_zero_blocks));
 
   bool puffdiff_allowed = version.OperationAllowed(InstallOperation::PUFFDIFF);
+  vector<FilesystemInterface::File> old_files;
   map<string, FilesystemInterface::File> old_files_map;
   if (old_part.fs_interface) {
-    vector<FilesystemInterface::File> old_files;
     TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
         old_part, &old_files, puffdiff_allowed));
     for (const FilesystemInterface::File& file : old_files)
       old_files_map[file.name] = file;
   }
+  // The indexes of the old data of the pseudo-files, which isn't organized in
+  // files and may have moved by any number of bytes. The in-place updates
+  // can't read the old blocks freely.
+  list<SharedSourceIndex> source_indexes;
+  bool index_sources = !version.InplaceUpdate();
 
   TEST_AND_RETURN_FALSE(new_part.fs_interface);
   vector<FilesystemInterface::File> new_files;
-  TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
-      new_part, &new_files, puffdiff_allowed));
+  if (new_part.files_preprocessed &&
+      new_part.files_have_deflates == puffdiff_allowed) {
+    new_files = new_part.files;
+  } else {
+    TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
+        new_part, &new_files, puffdiff_allowed));
+  }
+
+  // A new file without an old file of the same name, for example because it
+  // was renamed or moved, uses the old file with the most similar content if
+  // any, or else the one with the most similar name. The sketches of the
+  // contents of the old files and of these new files are computed on all the
+  // threads before generating the operations.
+  FileSimilarityIndex similarity_index;
+  vector<const FilesystemInterface::File*> similar_files(new_files.size());
+  vector<double> similarities(new_files.size());
+  vector<size_t> renamed_files;
+  vector<const vector<Extent>*> renamed_extents;
+  if (!old_files_map.empty()) {
+    for (size_t i = 0; i < new_files.size(); i++) {
+      if (!new_files[i].extents.empty() &&
+          old_files_map.count(new_files[i].name) == 0) {
+        renamed_files.push_back(i);
+        renamed_extents.push_back(&new_files[i].extents);
+      }
+    }
+  }
+  if (!renamed_files.empty()) {
+    TEST_AND_RETURN_FALSE(
+        similarity_index.Init(old_part.path, old_files, GetMaxThreads()));
+    vector<FileSimilarityIndex::Sketch> sketches;
+    TEST_AND_RETURN_FALSE(FileSimilarityIndex::ComputeSketches(
+        new_part.path, renamed_extents, GetMaxThreads(), &sketches));
+    for (size_t i = 0; i < renamed_files.size(); i++) {
+      similar_files[renamed_files[i]] = similarity_index.FindSimilar(
+          sketches[i], &similarities[renamed_files[i]]);
+    }
+  }
 
   list<FileDeltaProcessor> file_delta_processors;
 
@@ -425,7 +862,8 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
   // packing or compression where the blocks store more than one file) are only
   // generated once in the new image, but are also used only once from the old
   // image due to some simplifications (see below).
-  for (const FilesystemInterface::File& new_file : new_files) {
+  for (size_t file_index = 0; file_index < new_files.size(); file_index++) {
+    const FilesystemInterface::File& new_file = new_files[file_index];
     // Ignore the files in the new filesystem without blocks. Symlinks with
     // data blocks (for example, symlinks bigger than 60 bytes in ext2) are
     // handled as normal files. We also ignore blocks that were already
@@ -437,6 +875,15 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     if (new_file_extents.empty())
       continue;
 
+    // The old file with the most similar content found above, if any.
+    const FilesystemInterface::File* similar_file = similar_files[file_index];
+    if (similar_file) {
+      LOG(INFO) << "Using " << similar_file->name << " as source for "
+                << new_file.name << " ("
+                << static_cast<int>(similarities[file_index] * 100)
+                << "% similar content)";
+    }
+
     // We can't visit each dst image inode more than once, as that would
     // duplicate work. Here, we avoid visiting each source image inode
     // more than once. Technically, we could have multiple operations
@@ -446,7 +893,7 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     // time, it will be easy (non-complex) to have many operations read
     // from the same source blocks. At that time, this code can die. -adlr
     FilesystemInterface::File old_file =
-        GetOldFile(old_files_map, new_file.name);
+        similar_file ? *similar_file : GetOldFile(old_files_map, new_file.name);
     vector<Extent> old_file_extents;
     if (version.InplaceUpdate())
       old_file_extents =
@@ -455,16 +902,29 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
       old_file_extents = FilterExtentRanges(old_file.extents, old_zero_blocks);
     old_visited_blocks.AddExtents(old_file_extents);
 
-    file_delta_processors.emplace_back(old_part.path,
-                                       new_part.path,
-                                       version,
-                                       std::move(old_file_extents),
-                                       std::move(new_file_extents),
-                                       old_file.deflates,
-                                       new_file.deflates,
-                                       new_file.name,  // operation name
-                                       hard_chunk_blocks,
-                                       blob_file);
+    // Pseudo-files don't start with a /.
+    SharedSourceIndex* source_index = nullptr;
+    if (index_sources && new_file.name[0] != '/' &&
+        !old_file_extents.empty()) {
+      source_indexes.emplace_back(old_part.path, old_file_extents);
+      source_index = &source_indexes.back();
+    }
+
+    // Each chunk of the file is diffed on its own, so the chunks of a big file
+    // are processed in parallel instead of by a single thread.
+    for (FileChunk& chunk : SplitFileInChunks(old_file_extents,
+                                              new_file_extents,
+                                              new_file.name,  // operation name
+                                              hard_chunk_blocks)) {
+      file_delta_processors.emplace_back(old_part.path,
+                                         new_part.path,
+                                         version,
+                                         std::move(chunk),
+                                         old_file.deflates,
+                                         new_file.deflates,
+                                         source_index,
+                                         blob_file);
+    }
   }
   // Process all the blocks not included in any file. We provided all the unused
   // blocks in the old partition as available data.
@@ -481,35 +941,54 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     LOG(INFO) << "Scanning " << utils::BlocksInExtents(new_unvisited)
               << " unwritten blocks using chunk size of " << soft_chunk_blocks
               << " blocks.";
+    // The chunks find where their data comes from in the unused old blocks.
+    SharedSourceIndex* source_index = nullptr;
+    if (index_sources && !old_unvisited.empty()) {
+      source_indexes.emplace_back(old_part.path, old_unvisited);
+      source_index = &source_indexes.back();
+    }
     // We use the soft_chunk_blocks limit for the <non-file-data> as we don't
     // really know the structure of this data and we should not expect it to
     // have redundancy between partitions.
-    file_delta_processors.emplace_back(
-        old_part.path,
-        new_part.path,
-        version,
-        std::move(old_unvisited),
-        std::move(new_unvisited),
-        vector<puffin::BitExtent>{},  // old_deflates,
-        vector<puffin::BitExtent>{},  // new_deflates
-        "<non-file-data>",            // operation name
-        soft_chunk_blocks,
-        blob_file);
+    for (FileChunk& chunk : SplitFileInChunks(old_unvisited,
+                                              new_unvisited,
+                                              "<non-file-data>",
+                                              soft_chunk_blocks)) {
+      file_delta_processors.emplace_back(
+          old_part.path,
+          new_part.path,
+          version,
+          std::move(chunk),
+          vector<puffin::BitExtent>{},  // old_deflates,
+          vector<puffin::BitExtent>{},  // new_deflates
+          source_index,
+          blob_file);
+    }
   }
 
   size_t max_threads = GetMaxThreads();
 
-  // Sort the files in descending order based on number of new blocks to make
-  // sure we start the largest ones first.
-  if (file_delta_processors.size() > max_threads) {
-    file_delta_processors.sort(std::greater<FileDeltaProcessor>());
+  // Start the chunks in descending order based on number of new blocks to make
+  // sure the largest ones don't start last. The operations are still merged in
+  // the order of the files and of their chunks.
+  vector<FileDeltaProcessor*> sorted_processors;
+  sorted_processors.reserve(file_delta_processors.size());
+  for (auto& processor : file_delta_processors)
+    sorted_processors.push_back(&processor);
+  if (sorted_processors.size() > max_threads) {
+    std::stable_sort(sorted_processors.begin(),
+                     sorted_processors.end(),
+                     [](const FileDeltaProcessor* a,
+                        const FileDeltaProcessor* b) { return *a > *b; });
   }
 
+  ScopedIdlePoolThreads idle_pool_threads(max_threads,
+                                          sorted_processors.size());
   base::DelegateSimpleThreadPool thread_pool("incremental-update-generator",
                                              max_threads);
   thread_pool.Start();
-  for (auto& processor : file_delta_processors) {
-    thread_pool.AddWork(&processor);
+  for (FileDeltaProcessor* processor : sorted_processors) {
+    thread_pool.AddWork(processor);
   }
   thread_pool.JoinAll();
 
@@ -700,59 +1179,16 @@ bool DeltaReadFile(vector<AnnotatedOperation>* aops,
                    ssize_t chunk_blocks,
                    const PayloadVersion& version,
                    BlobFileWriter* blob_file) {
-  brillo::Blob data;
-  InstallOperation operation;
-
-  uint64_t total_blocks = utils::BlocksInExtents(new_extents);
-  if (chunk_blocks == -1)
-    chunk_blocks = total_blocks;
-
-  for (uint64_t block_offset = 0; block_offset < total_blocks;
-       block_offset += chunk_blocks) {
-    // Split the old/new file in the same chunks. Note that this could drop
-    // some information from the old file used for the new chunk. If the old
-    // file is smaller (or even empty when there's no old file) the chunk will
-    // also be empty.
-    vector<Extent> old_extents_chunk =
-        ExtentsSublist(old_extents, block_offset, chunk_blocks);
-    vector<Extent> new_extents_chunk =
-        ExtentsSublist(new_extents, block_offset, chunk_blocks);
-    NormalizeExtents(&old_extents_chunk);
-    NormalizeExtents(&new_extents_chunk);
-
-    TEST_AND_RETURN_FALSE(ReadExtentsToDiff(old_part,
-                                            new_part,
-                                            old_extents_chunk,
-                                            new_extents_chunk,
-                                            old_deflates,
-                                            new_deflates,
-                                            version,
-                                            &data,
-                                            &operation));
-
-    // Check if the operation writes nothing.
-    if (operation.dst_extents_size() == 0) {
-      if (operation.type() == InstallOperation::MOVE) {
-        LOG(INFO) << "Empty MOVE operation (" << name << "), skipping";
-        continue;
-      } else {
-        LOG(ERROR) << "Empty non-MOVE operation";
-        return false;
-      }
-    }
-
-    // Now, insert into the list of operations.
-    AnnotatedOperation aop;
-    aop.name = name;
-    if (static_cast<uint64_t>(chunk_blocks) < total_blocks) {
-      aop.name = base::StringPrintf(
-          "%s:%" PRIu64, name.c_str(), block_offset / chunk_blocks);
-    }
-    aop.op = operation;
-
-    // Write the data
-    TEST_AND_RETURN_FALSE(aop.SetOperationBlob(data, blob_file));
-    aops->emplace_back(aop);
+  for (const FileChunk& chunk :
+       SplitFileInChunks(old_extents, new_extents, name, chunk_blocks)) {
+    TEST_AND_RETURN_FALSE(DeltaReadChunk(aops,
+                                         old_part,
+                                         new_part,
+                                         chunk,
+                                         old_deflates,
+                                         new_deflates,
+                                         version,
+                                         blob_file));
   }
   return true;
 }
@@ -776,21 +1212,39 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
 
   bool out_blob_set = false;
 
-  // Try compressing |new_data| with xz first.
-  if (version.OperationAllowed(InstallOperation::REPLACE_XZ)) {
+  // Only run the compressors likely to produce the smallest blob.
+  bool xz_allowed = version.OperationAllowed(InstallOperation::REPLACE_XZ);
+  bool bzip_allowed = version.OperationAllowed(InstallOperation::REPLACE_BZ);
+  CompressorSelector::Selection selection;
+  selection.xz = xz_allowed;
+  selection.bzip = bzip_allowed;
+  if (compressor_selector)
+    selection = compressor_selector->Select(new_data, xz_allowed, bzip_allowed);
+  base::TimeDelta speculative_time;
+
+  // Try compressing |new_data| with xz first. The inputs split in several xz
+  // blocks are compressed on the idle threads of the pool, if any.
+  if (selection.xz) {
+    base::TimeTicks start = base::TimeTicks::Now();
+    size_t extra_threads = 0;
+    if (new_data.size() > kXzBlockSize)
+      extra_threads = BorrowIdlePoolThreads(kMaxXzThreads - 1);
     brillo::Blob new_data_xz;
-    if (XzCompress(new_data, &new_data_xz) && !new_data_xz.empty()) {
+    bool xz_compressed = XzCompress(new_data, 1 + extra_threads, &new_data_xz);
+    ReturnIdlePoolThreads(extra_threads);
+    if (xz_compressed && !new_data_xz.empty()) {
       *out_type = InstallOperation::REPLACE_XZ;
       *out_blob = std::move(new_data_xz);
       out_blob_set = true;
     }
+    if (selection.speculative_xz)
+      speculative_time = base::TimeTicks::Now() - start;
   }
 
   // Try compressing it with bzip2.
-  if (version.OperationAllowed(InstallOperation::REPLACE_BZ)) {
+  if (selection.bzip) {
+    base::TimeTicks start = base::TimeTicks::Now();
     brillo::Blob new_data_bz;
-    // TODO(deymo): Implement some heuristic to determine if it is worth trying
-    // to compress the blob with bzip2 if we already have a good REPLACE_XZ.
     if (BzipCompress(new_data, &new_data_bz) && !new_data_bz.empty() &&
         (!out_blob_set || out_blob->size() > new_data_bz.size())) {
       // A REPLACE_BZ is better or nothing else was set.
@@ -798,6 +1252,8 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
       *out_blob = std::move(new_data_bz);
       out_blob_set = true;
     }
+    if (selection.speculative_bzip)
+      speculative_time = base::TimeTicks::Now() - start;
   }
 
   // If nothing else worked or it was badly compressed we try a REPLACE.
@@ -808,6 +1264,19 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
     // low.
     *out_blob = new_data;
   }
+
+  if (compressor_selector) {
+    bool speculative_won =
+        (selection.speculative_xz &&
+         *out_type == InstallOperation::REPLACE_XZ) ||
+        (selection.speculative_bzip &&
+         *out_type == InstallOperation::REPLACE_BZ);
+    compressor_selector->RecordResult(new_data,
+                                      selection,
+                                      out_blob->size(),
+                                      speculative_time,
+                                      speculative_won);
+  }
   return true;
 }
 
@@ -865,7 +1334,7 @@ bool ReadExtentsToDiff(const string& old_part,
   // old_data.
   InstallOperation::Type op_type;
   TEST_AND_RETURN_FALSE(
-      GenerateBestFullOperation(new_data, version, &data_blob, &op_type));
+      GenerateCachedFullOperation(new_data, version, &data_blob, &op_type));
   operation.set_type(op_type);
 
   brillo::Blob old_data;
@@ -886,21 +1355,56 @@ bool ReadExtentsToDiff(const string& old_part,
                    operation, data_blob.size(), 0, src_extents.size())) {
       // No point in trying diff if zero blob size diff operation is
       // still worse than replace.
-      if (bsdiff_allowed) {
-        base::FilePath patch;
-        TEST_AND_RETURN_FALSE(base::CreateTemporaryFile(&patch));
-        ScopedPathUnlinker unlinker(patch.value());
+
+      // Find all deflate positions inside the given extents and then put all
+      // deflates together because we have already read all the extents into
+      // one buffer.
+      vector<puffin::BitExtent> src_deflates;
+      vector<puffin::BitExtent> dst_deflates;
+      if (puffdiff_allowed) {
+        TEST_AND_RETURN_FALSE(deflate_utils::FindAndCompactDeflates(
+            src_extents, old_deflates, &src_deflates));
+        TEST_AND_RETURN_FALSE(deflate_utils::FindAndCompactDeflates(
+            dst_extents, new_deflates, &dst_deflates));
+      }
+
+      // The diff operations only depend on the data, so a previous run may
+      // have already computed them.
+      brillo::Blob cache_key;
+      bool cache_hit = false;
+      if (diff_cache &&
+          GetDiffCacheKey(old_data,
+                          new_data,
+                          src_deflates,
+                          dst_deflates,
+                          version,
+                          bsdiff_allowed,
+                          puffdiff_allowed,
+                          {},
+                          &cache_key)) {
+        InstallOperation::Type cached_type;
+        brillo::Blob cached_blob;
+        cache_hit = LookupDiffCache(cache_key, &cached_type, &cached_blob);
+        if (cache_hit) {
+          operation.set_type(cached_type);
+          data_blob = std::move(cached_blob);
+        }
+      }
+
+      if (!cache_hit && bsdiff_allowed) {
+        ScratchFile* patch = ScratchFile::GetEmpty();
+        TEST_AND_RETURN_FALSE(patch);
 
         std::unique_ptr<bsdiff::PatchWriterInterface> bsdiff_patch_writer;
         InstallOperation::Type operation_type = InstallOperation::BSDIFF;
         if (version.OperationAllowed(InstallOperation::BROTLI_BSDIFF)) {
           bsdiff_patch_writer =
-              bsdiff::CreateBSDF2PatchWriter(patch.value(),
+              bsdiff::CreateBSDF2PatchWriter(patch->path(),
                                              bsdiff::CompressorType::kBrotli,
                                              kBrotliCompressionQuality);
           operation_type = InstallOperation::BROTLI_BSDIFF;
         } else {
-          bsdiff_patch_writer = bsdiff::CreateBsdiffPatchWriter(patch.value());
+          bsdiff_patch_writer = bsdiff::CreateBsdiffPatchWriter(patch->path());
           if (version.OperationAllowed(InstallOperation::SOURCE_BSDIFF)) {
             operation_type = InstallOperation::SOURCE_BSDIFF;
           }
@@ -914,7 +1418,7 @@ bool ReadExtentsToDiff(const string& old_part,
                                                   bsdiff_patch_writer.get(),
                                                   nullptr));
 
-        TEST_AND_RETURN_FALSE(utils::ReadFile(patch.value(), &bsdiff_delta));
+        TEST_AND_RETURN_FALSE(patch->Read(&bsdiff_delta));
         CHECK_GT(bsdiff_delta.size(), static_cast<brillo::Blob::size_type>(0));
         if (IsDiffOperationBetter(operation,
                                   data_blob.size(),
@@ -924,18 +1428,7 @@ bool ReadExtentsToDiff(const string& old_part,
           data_blob = std::move(bsdiff_delta);
         }
       }
-      if (puffdiff_allowed) {
-        // Find all deflate positions inside the given extents and then put all
-        // deflates together because we have already read all the extents into
-        // one buffer.
-        vector<puffin::BitExtent> src_deflates;
-        TEST_AND_RETURN_FALSE(deflate_utils::FindAndCompactDeflates(
-            src_extents, old_deflates, &src_deflates));
-
-        vector<puffin::BitExtent> dst_deflates;
-        TEST_AND_RETURN_FALSE(deflate_utils::FindAndCompactDeflates(
-            dst_extents, new_deflates, &dst_deflates));
-
+      if (!cache_hit && puffdiff_allowed) {
         puffin::RemoveEqualBitExtents(
             old_data, new_data, &src_deflates, &dst_deflates);
 
@@ -951,17 +1444,15 @@ bool ReadExtentsToDiff(const string& old_part,
         // Only Puffdiff if both files have at least one deflate left.
         if (!src_deflates.empty() && !dst_deflates.empty()) {
           brillo::Blob puffdiff_delta;
-          string temp_file_path;
-          TEST_AND_RETURN_FALSE(utils::MakeTempFile(
-              "puffdiff-delta.XXXXXX", &temp_file_path, nullptr));
-          ScopedPathUnlinker temp_file_unlinker(temp_file_path);
+          ScratchFile* temp_file = ScratchFile::GetEmpty();
+          TEST_AND_RETURN_FALSE(temp_file);
 
           // Perform PuffDiff operation.
           TEST_AND_RETURN_FALSE(puffin::PuffDiff(old_data,
                                                  new_data,
                                                  src_deflates,
                                                  dst_deflates,
-                                                 temp_file_path,
+                                                 temp_file->path(),
                                                  &puffdiff_delta));
           TEST_AND_RETURN_FALSE(puffdiff_delta.size() > 0);
           if (IsDiffOperationBetter(operation,
@@ -973,6 +1464,8 @@ bool ReadExtentsToDiff(const string& old_part,
           }
         }
       }
+      if (!cache_hit && !cache_key.empty())
+        StoreDiffCache(cache_key, operation.type(), data_blob);
     }
   }
 
@@ -1104,6 +1597,41 @@ size_t GetMaxThreads() {
   return std::max(sysconf(_SC_NPROCESSORS_ONLN), 4L);
 }
 
+ScopedIdlePoolThreads::ScopedIdlePoolThreads(size_t num_threads,
+                                             size_t num_tasks) {
+  PoolThreads* pool_threads = GetPoolThreads();
+  base::AutoLock auto_lock(pool_threads->lock);
+  DCHECK_EQ(pool_threads->num_threads, 0u) << "Only one pool lends threads.";
+  pool_threads->num_threads = num_threads;
+  pool_threads->pending_tasks = num_tasks;
+}
+
+ScopedIdlePoolThreads::~ScopedIdlePoolThreads() {
+  PoolThreads* pool_threads = GetPoolThreads();
+  base::AutoLock auto_lock(pool_threads->lock);
+  pool_threads->num_threads = 0;
+  pool_threads->pending_tasks = 0;
+}
+
+ScopedIdlePoolThreads::ScopedTask::~ScopedTask() {
+  PoolThreads* pool_threads = GetPoolThreads();
+  base::AutoLock auto_lock(pool_threads->lock);
+  if (pool_threads->pending_tasks > 0)
+    pool_threads->pending_tasks--;
+}
+
+void SetDiffCache(DiffCache* cache) {
+  diff_cache = cache;
+}
+
+void SetCompressorSelector(CompressorSelector* selector) {
+  compressor_selector = selector;
+}
+
+void SetMemoryBudget(MemoryBudget* budget) {
+  memory_budget = budget;
+}
+
 }  // namespace diff_utils
 
 }  // namespace chromeos_update_engine
@@ -21,11 +21,15 @@
 #include <string>
 #include <vector>
 
+#include <base/macros.h>
 #include <brillo/secure_blob.h>
 #include <puffin/puffdiff.h>
 
 #include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/compressor_selector.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/memory_budget.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -42,7 +46,8 @@ namespace diff_utils {
 // and soft chunk limits in number of blocks respectively. The soft chunk limit
 // is used to split MOVE and SOURCE_COPY operations and REPLACE_BZ of zeroed
 // blocks, while the hard limit is used to split a file when generating other
-// operations. A value of -1 in |hard_chunk_blocks| means whole files.
+// operations. A value of -1 in |hard_chunk_blocks| means whole files. The
+// chunks of the files are processed in parallel, even within a file.
 bool DeltaReadPartition(std::vector<AnnotatedOperation>* aops,
                         const PartitionConfig& old_part,
                         const PartitionConfig& new_part,
@@ -151,6 +156,44 @@ bool IsExtFilesystem(const std::string& device);
 // Returns the max number of threads to process the files(chunks) in parallel.
 size_t GetMaxThreads();
 
+// Lends the threads of a pool generating operations left without a task to
+// GenerateBestFullOperation(), which compresses the big inputs of the tasks
+// still running with xz on them, so the compressor threads and the pool threads
+// together never exceed the pool size. The pool has |num_threads| threads and
+// runs |num_tasks| tasks, each of them holding a ScopedTask while it runs.
+class ScopedIdlePoolThreads {
+ public:
+  ScopedIdlePoolThreads(size_t num_threads, size_t num_tasks);
+  ~ScopedIdlePoolThreads();
+
+  // Marks a task of the pool as done when destroyed.
+  class ScopedTask {
+   public:
+    ScopedTask() = default;
+    ~ScopedTask();
+
+   private:
+    DISALLOW_COPY_AND_ASSIGN(ScopedTask);
+  };
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(ScopedIdlePoolThreads);
+};
+
+// Sets the |cache| used by ReadExtentsToDiff() to reuse the diff operations
+// computed by previous runs, or disables it if |cache| is nullptr. The |cache|
+// must outlive the payload generation.
+void SetDiffCache(DiffCache* cache);
+
+// Sets the |selector| used by GenerateBestFullOperation() to skip the
+// compressors unlikely to produce the smallest blob, or runs all of them if
+// |selector| is nullptr.
+void SetCompressorSelector(CompressorSelector* selector);
+
+// Sets the |budget| DeltaReadPartition() reserves the memory each of its tasks
+// is estimated to use from, or doesn't limit it if |budget| is nullptr.
+void SetMemoryBudget(MemoryBudget* budget);
+
 // Returns the old file which file name has the shortest levenshtein distance to
 // |new_file_name|.
 FilesystemInterface::File GetOldFile(
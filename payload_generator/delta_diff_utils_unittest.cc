@@ -22,13 +22,16 @@
 #include <vector>
 
 #include <base/files/scoped_file.h>
+#include <base/files/scoped_temp_dir.h>
 #include <base/format_macros.h>
 #include <base/strings/stringprintf.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/compressor_selector.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/fake_filesystem.h"
@@ -194,6 +197,37 @@ TEST_F(DeltaDiffUtilsTest, SkipVerityExtentsTest) {
   }
 }
 
+TEST_F(DeltaDiffUtilsTest, FileChunksMergedInOrderTest) {
+  // A file of 10 blocks split in chunks of 4 blocks, which are processed
+  // separately.
+  static_cast<FakeFilesystem*>(new_part_.fs_interface.get())
+      ->AddFile("file", {ExtentForRange(10, 10)});
+  ASSERT_TRUE(InitializePartitionWithUniqueBlocks(old_part_, block_size_, 1));
+  ASSERT_TRUE(InitializePartitionWithUniqueBlocks(new_part_, block_size_, 2));
+
+  BlobFileWriter blob_file(blob_fd_, &blob_size_);
+  EXPECT_TRUE(diff_utils::DeltaReadPartition(
+      &aops_,
+      old_part_,
+      new_part_,
+      4,
+      -1,
+      PayloadVersion(kChromeOSMajorPayloadVersion, kSourceMinorPayloadVersion),
+      &blob_file));
+
+  // The chunks are merged in order, followed by the data not in any file.
+  ASSERT_GE(aops_.size(), 4u);
+  EXPECT_EQ("file:0", aops_[0].name);
+  EXPECT_EQ("file:1", aops_[1].name);
+  EXPECT_EQ("file:2", aops_[2].name);
+  for (size_t i = 3; i < aops_.size(); i++)
+    EXPECT_EQ("<non-file-data>", aops_[i].name);
+  ASSERT_EQ(1, aops_[0].op.dst_extents_size());
+  EXPECT_EQ(ExtentForRange(10, 4), aops_[0].op.dst_extents(0));
+  ASSERT_EQ(1, aops_[2].op.dst_extents_size());
+  EXPECT_EQ(ExtentForRange(18, 2), aops_[2].op.dst_extents(0));
+}
+
 TEST_F(DeltaDiffUtilsTest, MoveSmallTest) {
   brillo::Blob data_blob(block_size_);
   test_utils::FillWithData(&data_blob);
@@ -352,6 +386,82 @@ TEST_F(DeltaDiffUtilsTest, BsdiffSmallTest) {
   EXPECT_EQ(1U, utils::BlocksInExtents(op.dst_extents()));
 }
 
+TEST_F(DeltaDiffUtilsTest, BsdiffCachedTest) {
+  base::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  DiffCache cache(cache_dir.GetPath(), 1024 * 1024);
+  ASSERT_TRUE(cache.Init());
+  diff_utils::SetDiffCache(&cache);
+
+  brillo::Blob data_blob(kBlockSize);
+  test_utils::FillWithData(&data_blob);
+  vector<Extent> old_extents = {ExtentForRange(1, 1)};
+  vector<Extent> new_extents = {ExtentForRange(2, 1)};
+  EXPECT_TRUE(WriteExtents(old_part_.path, old_extents, kBlockSize, data_blob));
+  data_blob[0]++;
+  EXPECT_TRUE(WriteExtents(new_part_.path, new_extents, kBlockSize, data_blob));
+
+  // The second full and diff operations of the same data come from the cache.
+  brillo::Blob data[2];
+  InstallOperation op[2];
+  for (int i = 0; i < 2; i++) {
+    EXPECT_TRUE(diff_utils::ReadExtentsToDiff(
+        old_part_.path,
+        new_part_.path,
+        old_extents,
+        new_extents,
+        {},  // old_deflates
+        {},  // new_deflates
+        PayloadVersion(kChromeOSMajorPayloadVersion,
+                       kInPlaceMinorPayloadVersion),
+        &data[i],
+        &op[i]));
+  }
+
+  EXPECT_EQ(2u, cache.misses());
+  EXPECT_EQ(2u, cache.hits());
+  EXPECT_EQ(InstallOperation::BSDIFF, op[1].type());
+  EXPECT_EQ(data[0], data[1]);
+  EXPECT_EQ(op[0].SerializeAsString(), op[1].SerializeAsString());
+
+  // Selecting the compressors doesn't use the cached full operation, but still
+  // uses the cached diff operation.
+  CompressorSelector selector(base::TimeDelta(), false);
+  diff_utils::SetCompressorSelector(&selector);
+  brillo::Blob selected_data;
+  InstallOperation selected_op;
+  EXPECT_TRUE(diff_utils::ReadExtentsToDiff(
+      old_part_.path,
+      new_part_.path,
+      old_extents,
+      new_extents,
+      {},  // old_deflates
+      {},  // new_deflates
+      PayloadVersion(kChromeOSMajorPayloadVersion, kInPlaceMinorPayloadVersion),
+      &selected_data,
+      &selected_op));
+  diff_utils::SetCompressorSelector(nullptr);
+  EXPECT_EQ(3u, cache.misses());
+  EXPECT_EQ(3u, cache.hits());
+
+  // A different payload version doesn't use the cached operations.
+  brillo::Blob source_data;
+  InstallOperation source_op;
+  EXPECT_TRUE(diff_utils::ReadExtentsToDiff(
+      old_part_.path,
+      new_part_.path,
+      old_extents,
+      new_extents,
+      {},  // old_deflates
+      {},  // new_deflates
+      PayloadVersion(kChromeOSMajorPayloadVersion, kSourceMinorPayloadVersion),
+      &source_data,
+      &source_op));
+  diff_utils::SetDiffCache(nullptr);
+  EXPECT_EQ(5u, cache.misses());
+  EXPECT_EQ(InstallOperation::SOURCE_BSDIFF, source_op.type());
+}
+
 TEST_F(DeltaDiffUtilsTest, ReplaceSmallTest) {
   // The old file is on a different block than the new one.
   vector<Extent> old_extents = {ExtentForRange(1, 1)};
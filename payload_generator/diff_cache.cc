@@ -0,0 +1,226 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_cache.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <base/files/file_enumerator.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_util.h>
+#include <base/time/time.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The extension of the files storing the cache entries. Any other file in the
+// cache directory is ignored, except the temporary files left by interrupted
+// runs which are removed.
+const char kEntryExtension[] = ".entry";
+
+// The age after which a temporary file is considered left by an interrupted
+// run. Younger ones may still be written by another run sharing the cache.
+const int64_t kStaleTempFileAgeHours = 24;
+
+}  // namespace
+
+const size_t DiffCache::kChecksumSize = 32;
+
+DiffCache::DiffCache(const base::FilePath& dir, uint64_t max_size)
+    : dir_(dir), max_size_(max_size) {}
+
+bool DiffCache::Init() {
+  TEST_AND_RETURN_FALSE(base::CreateDirectory(dir_));
+
+  vector<std::pair<base::Time, base::FilePath>> files;
+  base::Time stale_time =
+      base::Time::Now() - base::TimeDelta::FromHours(kStaleTempFileAgeHours);
+  base::FileEnumerator dir(dir_, false, base::FileEnumerator::FILES);
+  for (base::FilePath name = dir.Next(); !name.empty(); name = dir.Next()) {
+    if (!base::EndsWith(
+            name.value(), kEntryExtension, base::CompareCase::SENSITIVE)) {
+      if (base::StartsWith(name.BaseName().value(),
+                           ".",
+                           base::CompareCase::SENSITIVE) &&
+          dir.GetInfo().GetLastModifiedTime() < stale_time) {
+        base::DeleteFile(name, false);
+      }
+      continue;
+    }
+    files.emplace_back(dir.GetInfo().GetLastModifiedTime(), name);
+  }
+  std::sort(files.begin(), files.end());
+
+  base::AutoLock auto_lock(lock_);
+  for (const auto& time_and_name : files) {
+    int64_t file_size;
+    if (!base::GetFileSize(time_and_name.second, &file_size))
+      continue;
+    AddEntryLocked(time_and_name.second.BaseName().value(), file_size);
+  }
+  LOG(INFO) << "Loaded " << entries_.size() << " entries (" << size_
+            << " bytes) from the diff cache in " << dir_.value();
+  return true;
+}
+
+bool DiffCache::Lookup(const brillo::Blob& key, brillo::Blob* value) {
+  base::FilePath path = GetEntryPath(key);
+  uint64_t generation;
+  {
+    base::AutoLock auto_lock(lock_);
+    auto it = entries_.find(path.BaseName().value());
+    if (it == entries_.end()) {
+      misses_++;
+      return false;
+    }
+    generation = it->second.generation;
+  }
+
+  // The entry may be evicted by another thread while it is read, in which case
+  // the read fails or the file is replaced by a new version of the entry.
+  brillo::Blob data;
+  bool valid = utils::ReadFile(path.value(), &data) &&
+               data.size() >= kChecksumSize;
+  if (valid) {
+    brillo::Blob checksum;
+    valid = HashCalculator::RawHashOfBytes(
+                data.data(), data.size() - kChecksumSize, &checksum) &&
+            std::equal(checksum.begin(),
+                       checksum.end(),
+                       data.end() - kChecksumSize,
+                       data.end());
+  }
+
+  base::AutoLock auto_lock(lock_);
+  auto it = entries_.find(path.BaseName().value());
+  if (!valid) {
+    // Only remove the entry read, not one evicted or stored again by another
+    // thread meanwhile.
+    if (it != entries_.end() && it->second.generation == generation) {
+      LOG(WARNING) << "Removing invalid diff cache entry " << path.value();
+      base::DeleteFile(path, false);
+      RemoveEntryLocked(path.BaseName().value());
+    }
+    misses_++;
+    return false;
+  }
+  if (it != entries_.end())
+    lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+  base::Time now = base::Time::Now();
+  base::TouchFile(path, now, now);
+  hits_++;
+
+  data.resize(data.size() - kChecksumSize);
+  *value = std::move(data);
+  return true;
+}
+
+bool DiffCache::Store(const brillo::Blob& key, const brillo::Blob& value) {
+  brillo::Blob data = value;
+  brillo::Blob checksum;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(value, &checksum));
+  data.insert(data.end(), checksum.begin(), checksum.end());
+  // An entry over the size limit would be evicted right away.
+  if (data.size() > max_size_)
+    return false;
+
+  // Write the entry in a temporary file first so a concurrent Lookup() never
+  // sees a partial entry.
+  base::FilePath temp_path;
+  TEST_AND_RETURN_FALSE(base::CreateTemporaryFileInDir(dir_, &temp_path));
+  base::FilePath path = GetEntryPath(key);
+  if (!utils::WriteFile(temp_path.value().c_str(), data.data(), data.size()) ||
+      !base::ReplaceFile(temp_path, path, nullptr)) {
+    base::DeleteFile(temp_path, false);
+    return false;
+  }
+
+  base::AutoLock auto_lock(lock_);
+  AddEntryLocked(path.BaseName().value(), data.size());
+  stores_++;
+  return true;
+}
+
+void DiffCache::LogStats() {
+  base::AutoLock auto_lock(lock_);
+  uint64_t lookups = hits_ + misses_;
+  LOG(INFO) << "Diff cache: " << hits_ << " hits and " << misses_
+            << " misses (" << (lookups ? hits_ * 100 / lookups : 0)
+            << "% hit rate), " << stores_ << " stores, " << evictions_
+            << " evictions, " << entries_.size() << " entries using " << size_
+            << " bytes.";
+}
+
+uint64_t DiffCache::hits() {
+  base::AutoLock auto_lock(lock_);
+  return hits_;
+}
+
+uint64_t DiffCache::misses() {
+  base::AutoLock auto_lock(lock_);
+  return misses_;
+}
+
+uint64_t DiffCache::evictions() {
+  base::AutoLock auto_lock(lock_);
+  return evictions_;
+}
+
+uint64_t DiffCache::size() {
+  base::AutoLock auto_lock(lock_);
+  return size_;
+}
+
+base::FilePath DiffCache::GetEntryPath(const brillo::Blob& key) const {
+  return dir_.Append(base::HexEncode(key.data(), key.size()) +
+                     kEntryExtension);
+}
+
+void DiffCache::AddEntryLocked(const string& name, uint64_t entry_size) {
+  RemoveEntryLocked(name);
+  lru_.push_front(name);
+  entries_[name] = {lru_.begin(), entry_size, next_generation_++};
+  size_ += entry_size;
+
+  while (size_ > max_size_ && !lru_.empty()) {
+    string victim = lru_.back();
+    base::DeleteFile(dir_.Append(victim), false);
+    RemoveEntryLocked(victim);
+    evictions_++;
+  }
+}
+
+void DiffCache::RemoveEntryLocked(const string& name) {
+  auto it = entries_.find(name);
+  if (it == entries_.end())
+    return;
+  size_ -= it->second.size;
+  lru_.erase(it->second.lru_it);
+  entries_.erase(it);
+}
+
+}  // namespace chromeos_update_engine
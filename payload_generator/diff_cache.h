@@ -0,0 +1,120 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include <base/files/file_path.h>
+#include <base/macros.h>
+#include <base/synchronization/lock.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// A persistent cache of the results of the expensive steps of the payload
+// generation, such as the bsdiff and puffdiff patches, so regenerating a
+// payload from mostly the same images does not compute them again. Each entry
+// is stored in its own file in the cache directory, named after its key. The
+// keys must be derived from everything the value depends on, usually the
+// hashes of the input data and the payload version.
+//
+// When the total size of the entries goes over the size limit, the least
+// recently used ones are removed. The use time of the entries is kept in the
+// modification time of their files so it persists across runs.
+//
+// All the methods can be called from several threads at the same time.
+class DiffCache {
+ public:
+  // Creates a cache storing its entries in |dir|, using at most |max_size|
+  // bytes of disk.
+  DiffCache(const base::FilePath& dir, uint64_t max_size);
+  ~DiffCache() = default;
+
+  // Creates the cache directory if needed, loads the entries already in it and
+  // removes the temporary files left by runs interrupted over a day ago.
+  // Returns whether the cache can be used.
+  bool Init();
+
+  // Looks up the entry with the given |key| and stores its value in |value|.
+  // Returns whether the entry was found and valid.
+  bool Lookup(const brillo::Blob& key, brillo::Blob* value);
+
+  // Stores |value| as the entry with the given |key|, replacing any previous
+  // one, and evicts the least recently used entries if the cache is over its
+  // size limit. Returns whether the entry was stored, which is never the case
+  // for an entry larger than the size limit.
+  bool Store(const brillo::Blob& key, const brillo::Blob& value);
+
+  // Logs the hit rate and the size of the cache.
+  void LogStats();
+
+  uint64_t hits();
+  uint64_t misses();
+  uint64_t evictions();
+  uint64_t size();
+
+ private:
+  // The size of the hash appended to the values to detect corrupt entries.
+  static const size_t kChecksumSize;
+
+  // Returns the path of the file storing the entry with the given |key|.
+  base::FilePath GetEntryPath(const brillo::Blob& key) const;
+
+  // Adds the entry stored in |name| with |entry_size| bytes as the most
+  // recently used one, replacing any previous one, and evicts the least
+  // recently used entries over the size limit. |lock_| must be held.
+  void AddEntryLocked(const std::string& name, uint64_t entry_size);
+
+  // Removes the entry stored in |name| from the index. |lock_| must be held.
+  void RemoveEntryLocked(const std::string& name);
+
+  const base::FilePath dir_;
+  const uint64_t max_size_;
+
+  // Protects all the members below.
+  base::Lock lock_;
+
+  struct Entry {
+    // The position of the entry in |lru_|.
+    std::list<std::string>::iterator lru_it;
+    uint64_t size;
+    // Identifies the version of the entry added to the index, so a Lookup()
+    // failing to read it doesn't remove a newer version stored meanwhile.
+    uint64_t generation;
+  };
+
+  // The names of the entries from the most to the least recently used, and the
+  // entries by name.
+  std::list<std::string> lru_;
+  std::unordered_map<std::string, Entry> entries_;
+  uint64_t size_{0};
+  uint64_t next_generation_{0};
+
+  uint64_t hits_{0};
+  uint64_t misses_{0};
+  uint64_t stores_{0};
+  uint64_t evictions_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(DiffCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
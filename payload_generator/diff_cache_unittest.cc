@@ -0,0 +1,164 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_cache.h"
+
+#include <base/files/file_enumerator.h>
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <base/time/time.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The size of an entry holding a value of |value_size| bytes.
+uint64_t EntrySize(size_t value_size) {
+  return value_size + 32;
+}
+
+}  // namespace
+
+class DiffCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override { ASSERT_TRUE(tempdir_.CreateUniqueTempDir()); }
+
+  base::ScopedTempDir tempdir_;
+  const brillo::Blob key1_{1, 2, 3};
+  const brillo::Blob key2_{4, 5, 6};
+  const brillo::Blob key3_{7, 8, 9};
+  const brillo::Blob value_ = brillo::Blob(100, 'a');
+};
+
+TEST_F(DiffCacheTest, LookupAndStoreTest) {
+  DiffCache cache(tempdir_.GetPath(), 1024 * 1024);
+  ASSERT_TRUE(cache.Init());
+
+  brillo::Blob value;
+  EXPECT_FALSE(cache.Lookup(key1_, &value));
+  EXPECT_TRUE(cache.Store(key1_, value_));
+  EXPECT_TRUE(cache.Lookup(key1_, &value));
+  EXPECT_EQ(value_, value);
+  EXPECT_FALSE(cache.Lookup(key2_, &value));
+
+  // Storing an entry again replaces it.
+  brillo::Blob empty_value;
+  EXPECT_TRUE(cache.Store(key1_, empty_value));
+  EXPECT_TRUE(cache.Lookup(key1_, &value));
+  EXPECT_TRUE(value.empty());
+
+  EXPECT_EQ(2u, cache.hits());
+  EXPECT_EQ(2u, cache.misses());
+  EXPECT_EQ(EntrySize(0), cache.size());
+}
+
+TEST_F(DiffCacheTest, EvictLeastRecentlyUsedTest) {
+  DiffCache cache(tempdir_.GetPath(), EntrySize(value_.size()) * 2);
+  ASSERT_TRUE(cache.Init());
+
+  brillo::Blob value;
+  EXPECT_TRUE(cache.Store(key1_, value_));
+  EXPECT_TRUE(cache.Store(key2_, value_));
+  // Using |key1_| makes |key2_| the least recently used entry.
+  EXPECT_TRUE(cache.Lookup(key1_, &value));
+  EXPECT_TRUE(cache.Store(key3_, value_));
+
+  EXPECT_EQ(1u, cache.evictions());
+  EXPECT_EQ(EntrySize(value_.size()) * 2, cache.size());
+  EXPECT_TRUE(cache.Lookup(key1_, &value));
+  EXPECT_FALSE(cache.Lookup(key2_, &value));
+  EXPECT_TRUE(cache.Lookup(key3_, &value));
+}
+
+TEST_F(DiffCacheTest, PersistAcrossInstancesTest) {
+  {
+    DiffCache cache(tempdir_.GetPath(), 1024 * 1024);
+    ASSERT_TRUE(cache.Init());
+    EXPECT_TRUE(cache.Store(key1_, value_));
+  }
+  DiffCache cache(tempdir_.GetPath(), 1024 * 1024);
+  ASSERT_TRUE(cache.Init());
+  EXPECT_EQ(EntrySize(value_.size()), cache.size());
+  brillo::Blob value;
+  EXPECT_TRUE(cache.Lookup(key1_, &value));
+  EXPECT_EQ(value_, value);
+}
+
+TEST_F(DiffCacheTest, InitEvictsOverSizeLimitTest) {
+  {
+    DiffCache cache(tempdir_.GetPath(), 1024 * 1024);
+    ASSERT_TRUE(cache.Init());
+    EXPECT_TRUE(cache.Store(key1_, value_));
+    EXPECT_TRUE(cache.Store(key2_, value_));
+  }
+  DiffCache cache(tempdir_.GetPath(), EntrySize(value_.size()));
+  ASSERT_TRUE(cache.Init());
+  EXPECT_EQ(1u, cache.evictions());
+  EXPECT_EQ(EntrySize(value_.size()), cache.size());
+}
+
+TEST_F(DiffCacheTest, CorruptEntryTest) {
+  DiffCache cache(tempdir_.GetPath(), 1024 * 1024);
+  ASSERT_TRUE(cache.Init());
+  EXPECT_TRUE(cache.Store(key1_, value_));
+
+  // Flip a byte of the only entry stored.
+  base::FilePath entry_path;
+  base::FileEnumerator dir(
+      tempdir_.GetPath(), false, base::FileEnumerator::FILES);
+  entry_path = dir.Next();
+  ASSERT_FALSE(entry_path.empty());
+  brillo::Blob data;
+  ASSERT_TRUE(utils::ReadFile(entry_path.value(), &data));
+  data[0] ^= 1;
+  ASSERT_TRUE(
+      utils::WriteFile(entry_path.value().c_str(), data.data(), data.size()));
+
+  brillo::Blob value;
+  EXPECT_FALSE(cache.Lookup(key1_, &value));
+  EXPECT_FALSE(base::PathExists(entry_path));
+  EXPECT_EQ(0u, cache.size());
+}
+
+TEST_F(DiffCacheTest, EntryOverSizeLimitNotStoredTest) {
+  DiffCache cache(tempdir_.GetPath(), EntrySize(value_.size()) - 1);
+  ASSERT_TRUE(cache.Init());
+  EXPECT_FALSE(cache.Store(key1_, value_));
+  EXPECT_EQ(0u, cache.evictions());
+  EXPECT_EQ(0u, cache.size());
+  EXPECT_TRUE(base::IsDirectoryEmpty(tempdir_.GetPath()));
+}
+
+TEST_F(DiffCacheTest, InitRemovesStaleTempFilesTest) {
+  base::FilePath recent_path = tempdir_.GetPath().Append(".recent");
+  base::FilePath stale_path = tempdir_.GetPath().Append(".stale");
+  ASSERT_EQ(0, base::WriteFile(recent_path, "", 0));
+  ASSERT_EQ(0, base::WriteFile(stale_path, "", 0));
+  base::Time stale_time = base::Time::Now() - base::TimeDelta::FromDays(2);
+  ASSERT_TRUE(base::TouchFile(stale_path, stale_time, stale_time));
+
+  DiffCache cache(tempdir_.GetPath(), 1024 * 1024);
+  ASSERT_TRUE(cache.Init());
+  // The recent temporary file may still be written by another run.
+  EXPECT_TRUE(base::PathExists(recent_path));
+  EXPECT_FALSE(base::PathExists(stale_path));
+  EXPECT_EQ(0u, cache.size());
+}
+
+}  // namespace chromeos_update_engine
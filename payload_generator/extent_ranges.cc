@@ -17,7 +17,6 @@
 #include "update_engine/payload_generator/extent_ranges.h"
 
 #include <algorithm>
-#include <set>
 #include <utility>
 #include <vector>
 
@@ -27,7 +26,6 @@
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/extent_utils.h"
 
-using std::set;
 using std::vector;
 
 namespace chromeos_update_engine {
@@ -66,168 +64,345 @@ void ExtentRanges::SubtractBlock(uint64_t block) {
 
 namespace {
 
-Extent UnionOverlappingExtents(const Extent& first, const Extent& second) {
-  CHECK_NE(kSparseHole, first.start_block());
-  CHECK_NE(kSparseHole, second.start_block());
-  uint64_t start = std::min(first.start_block(), second.start_block());
-  uint64_t end = std::max(first.start_block() + first.num_blocks(),
-                          second.start_block() + second.num_blocks());
-  return ExtentForRange(start, end - start);
-}
+// The maximum number of ranges in a chunk. A chunk is split in two halves
+// when it gets larger.
+const size_t kMaxChunkSize = 512;
+
+// Adding or subtracting ranges one at a time moves up to a chunk worth of
+// ranges for each of them, while merging them with the existing ones in a
+// single pass moves all of them once. The merge is used when the ranges added
+// or subtracted are more than 1/kMergeRatio of the existing ones.
+const size_t kMergeRatio = kMaxChunkSize / 8;
 
 }  // namespace
 
-void ExtentRanges::AddExtent(Extent extent) {
-  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
-    return;
+template <typename Iterator>
+ExtentRanges::BlockRangeVector ExtentRanges::SortedRanges(Iterator begin,
+                                                          Iterator end) {
+  BlockRangeVector ranges;
+  for (Iterator it = begin; it != end; ++it) {
+    if (it->start_block() == kSparseHole || it->num_blocks() == 0)
+      continue;
+    ranges.push_back({it->start_block(), it->start_block() + it->num_blocks()});
+  }
+  std::sort(ranges.begin(),
+            ranges.end(),
+            [](const BlockRange& a, const BlockRange& b) {
+              return a.start < b.start;
+            });
+  // Merge the ranges overlapping or touching the previous one.
+  size_t size = 0;
+  for (const BlockRange& range : ranges) {
+    if (size > 0 && range.start <= ranges[size - 1].end)
+      ranges[size - 1].end = std::max(ranges[size - 1].end, range.end);
+    else
+      ranges[size++] = range;
+  }
+  ranges.resize(size);
+  return ranges;
+}
 
-  ExtentSet::iterator begin_del = extent_set_.end();
-  ExtentSet::iterator end_del = extent_set_.end();
-  uint64_t del_blocks = 0;
-  for (ExtentSet::iterator it = extent_set_.begin(), e = extent_set_.end();
-       it != e;
-       ++it) {
-    if (ExtentsOverlapOrTouch(*it, extent)) {
-      end_del = it;
-      ++end_del;
-      del_blocks += it->num_blocks();
-      if (begin_del == extent_set_.end())
-        begin_del = it;
-
-      extent = UnionOverlappingExtents(extent, *it);
-    }
+void ExtentRanges::Next(Position* pos) const {
+  if (++pos->index == chunks_[pos->chunk].size()) {
+    pos->chunk++;
+    pos->index = 0;
   }
-  extent_set_.erase(begin_del, end_del);
-  extent_set_.insert(extent);
-  blocks_ -= del_blocks;
-  blocks_ += extent.num_blocks();
 }
 
-namespace {
-// Returns base - subtractee (set subtraction).
-ExtentRanges::ExtentSet SubtractOverlappingExtents(const Extent& base,
-                                                   const Extent& subtractee) {
-  ExtentRanges::ExtentSet ret;
-  if (subtractee.start_block() > base.start_block()) {
-    ret.insert(ExtentForRange(base.start_block(),
-                              subtractee.start_block() - base.start_block()));
+ExtentRanges::Position ExtentRanges::FirstEndingAtOrAfter(
+    uint64_t block) const {
+  auto chunk = std::lower_bound(
+      chunks_.begin(),
+      chunks_.end(),
+      block,
+      [](const BlockRangeVector& other, uint64_t value) {
+        return other.back().end < value;
+      });
+  if (chunk == chunks_.end())
+    return End();
+  auto it = std::lower_bound(chunk->begin(),
+                             chunk->end(),
+                             block,
+                             [](const BlockRange& range, uint64_t value) {
+                               return range.end < value;
+                             });
+  return {static_cast<size_t>(chunk - chunks_.begin()),
+          static_cast<size_t>(it - chunk->begin())};
+}
+
+ExtentRanges::Position ExtentRanges::FirstStartingAfter(uint64_t block) const {
+  auto chunk = std::upper_bound(
+      chunks_.begin(),
+      chunks_.end(),
+      block,
+      [](uint64_t value, const BlockRangeVector& other) {
+        return value < other.back().start;
+      });
+  if (chunk == chunks_.end())
+    return End();
+  auto it = std::upper_bound(chunk->begin(),
+                             chunk->end(),
+                             block,
+                             [](uint64_t value, const BlockRange& range) {
+                               return value < range.start;
+                             });
+  return {static_cast<size_t>(chunk - chunks_.begin()),
+          static_cast<size_t>(it - chunk->begin())};
+}
+
+void ExtentRanges::Insert(const Position& pos, const BlockRange& range) {
+  if (chunks_.empty()) {
+    chunks_.push_back({range});
+    return;
   }
-  uint64_t base_end = base.start_block() + base.num_blocks();
-  uint64_t subtractee_end = subtractee.start_block() + subtractee.num_blocks();
-  if (base_end > subtractee_end) {
-    ret.insert(ExtentForRange(subtractee_end, base_end - subtractee_end));
+  // Insert at the end of the last chunk rather than in a new one.
+  Position insert_pos = pos;
+  if (insert_pos == End())
+    insert_pos = {chunks_.size() - 1, chunks_.back().size()};
+  BlockRangeVector& chunk = chunks_[insert_pos.chunk];
+  chunk.insert(chunk.begin() + insert_pos.index, range);
+  if (chunk.size() > kMaxChunkSize) {
+    BlockRangeVector second_half(chunk.begin() + chunk.size() / 2,
+                                 chunk.end());
+    chunk.resize(chunk.size() / 2);
+    chunks_.insert(chunks_.begin() + insert_pos.chunk + 1,
+                   std::move(second_half));
   }
-  return ret;
 }
-}  // namespace
 
-void ExtentRanges::SubtractExtent(const Extent& extent) {
-  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+void ExtentRanges::Erase(const Position& from, const Position& to) {
+  if (from == to)
+    return;
+  if (from.chunk == to.chunk) {
+    BlockRangeVector& chunk = chunks_[from.chunk];
+    chunk.erase(chunk.begin() + from.index, chunk.begin() + to.index);
+    if (chunk.empty())
+      chunks_.erase(chunks_.begin() + from.chunk);
     return;
+  }
+  // Erase the beginning of the last chunk, the chunks in between and the end
+  // of the first chunk, in this order so the positions remain valid.
+  size_t end_chunk = to.chunk;
+  if (to.chunk < chunks_.size()) {
+    BlockRangeVector& chunk = chunks_[to.chunk];
+    chunk.erase(chunk.begin(), chunk.begin() + to.index);
+    if (chunk.empty())
+      end_chunk++;
+  }
+  chunks_[from.chunk].resize(from.index);
+  size_t begin_chunk = from.index == 0 ? from.chunk : from.chunk + 1;
+  chunks_.erase(chunks_.begin() + begin_chunk, chunks_.begin() + end_chunk);
+}
 
-  ExtentSet::iterator begin_del = extent_set_.end();
-  ExtentSet::iterator end_del = extent_set_.end();
-  uint64_t del_blocks = 0;
-  ExtentSet new_extents;
-  for (ExtentSet::iterator it = extent_set_.begin(), e = extent_set_.end();
-       it != e;
-       ++it) {
-    if (!ExtentsOverlap(*it, extent))
-      continue;
+ExtentRanges::BlockRangeVector ExtentRanges::GetRanges() const {
+  BlockRangeVector ranges;
+  ranges.reserve(NumRanges());
+  for (const BlockRangeVector& chunk : chunks_)
+    ranges.insert(ranges.end(), chunk.begin(), chunk.end());
+  return ranges;
+}
 
-    if (begin_del == extent_set_.end())
-      begin_del = it;
-    end_del = it;
-    ++end_del;
+void ExtentRanges::SetRanges(const BlockRangeVector& ranges) {
+  // Leave room in the chunks for more ranges.
+  const size_t chunk_size = kMaxChunkSize / 2;
+  chunks_.clear();
+  blocks_ = 0;
+  for (size_t i = 0; i < ranges.size(); i += chunk_size) {
+    chunks_.emplace_back(ranges.begin() + i,
+                         ranges.begin() + std::min(i + chunk_size,
+                                                   ranges.size()));
+  }
+  for (const BlockRange& range : ranges)
+    blocks_ += range.end - range.start;
+}
 
-    del_blocks += it->num_blocks();
+size_t ExtentRanges::NumRanges() const {
+  size_t num_ranges = 0;
+  for (const BlockRangeVector& chunk : chunks_)
+    num_ranges += chunk.size();
+  return num_ranges;
+}
+
+void ExtentRanges::AddRange(uint64_t start, uint64_t end) {
+  // The ranges in [first, last) overlap or touch [start, end).
+  Position first = FirstEndingAtOrAfter(start);
+  Position last = FirstStartingAfter(end);
+  if (first == last) {
+    Insert(first, {start, end});
+    blocks_ += end - start;
+    return;
+  }
+  // Extend the first range to cover all of them and erase the others.
+  BlockRange& range = At(first);
+  uint64_t new_start = std::min(start, range.start);
+  uint64_t new_end = end;
+  for (Position pos = first; pos != last; Next(&pos)) {
+    blocks_ -= At(pos).end - At(pos).start;
+    new_end = std::max(new_end, At(pos).end);
+  }
+  range = {new_start, new_end};
+  blocks_ += new_end - new_start;
+  Position second = first;
+  Next(&second);
+  Erase(second, last);
+}
 
-    ExtentSet subtraction = SubtractOverlappingExtents(*it, extent);
-    for (ExtentSet::iterator jt = subtraction.begin(), je = subtraction.end();
-         jt != je;
-         ++jt) {
-      new_extents.insert(*jt);
-      del_blocks -= jt->num_blocks();
+void ExtentRanges::SubtractRange(uint64_t start, uint64_t end) {
+  // The ranges in [first, last) overlap [start, end).
+  Position first = FirstEndingAtOrAfter(start + 1);
+  Position last = FirstStartingAfter(end - 1);
+  if (first == last)
+    return;
+  Position pos = first;
+  Position prev = first;
+  for (; pos != last; Next(&pos)) {
+    blocks_ -= At(pos).end - At(pos).start;
+    prev = pos;
+  }
+  // Keep the parts of the first and last ranges outside [start, end), in
+  // place.
+  Position erase_from = first;
+  Position erase_to = last;
+  BlockRange first_range = At(first);
+  BlockRange last_range = At(prev);
+  if (first_range.start < start) {
+    At(first).end = start;
+    blocks_ += start - first_range.start;
+    Next(&erase_from);
+  }
+  if (last_range.end > end) {
+    BlockRange right = {end, last_range.end};
+    blocks_ += right.end - right.start;
+    if (erase_from != erase_to) {
+      At(prev) = right;
+      erase_to = prev;
+    } else {
+      // The first range is split in two.
+      Insert(erase_from, right);
+      return;
     }
   }
-  extent_set_.erase(begin_del, end_del);
-  extent_set_.insert(new_extents.begin(), new_extents.end());
-  blocks_ -= del_blocks;
+  Erase(erase_from, erase_to);
 }
 
-void ExtentRanges::AddRanges(const ExtentRanges& ranges) {
-  for (ExtentSet::const_iterator it = ranges.extent_set_.begin(),
-                                 e = ranges.extent_set_.end();
-       it != e;
-       ++it) {
-    AddExtent(*it);
+void ExtentRanges::AddSortedRanges(const BlockRangeVector& ranges) {
+  if (ranges.size() * kMergeRatio <= NumRanges()) {
+    for (const BlockRange& range : ranges)
+      AddRange(range.start, range.end);
+    return;
   }
+  BlockRangeVector current = GetRanges();
+  BlockRangeVector result;
+  result.reserve(current.size() + ranges.size());
+  auto it = current.begin();
+  auto jt = ranges.begin();
+  while (it != current.end() || jt != ranges.end()) {
+    // Take the range starting first and merge it with the previous one if
+    // they overlap or touch.
+    const BlockRange& range =
+        (jt == ranges.end() || (it != current.end() && it->start < jt->start))
+            ? *it++
+            : *jt++;
+    if (!result.empty() && range.start <= result.back().end)
+      result.back().end = std::max(result.back().end, range.end);
+    else
+      result.push_back(range);
+  }
+  SetRanges(result);
 }
 
-void ExtentRanges::SubtractRanges(const ExtentRanges& ranges) {
-  for (ExtentSet::const_iterator it = ranges.extent_set_.begin(),
-                                 e = ranges.extent_set_.end();
-       it != e;
-       ++it) {
-    SubtractExtent(*it);
+void ExtentRanges::SubtractSortedRanges(const BlockRangeVector& ranges) {
+  if (ranges.size() * kMergeRatio <= NumRanges()) {
+    for (const BlockRange& range : ranges)
+      SubtractRange(range.start, range.end);
+    return;
+  }
+  BlockRangeVector result;
+  auto jt = ranges.begin();
+  for (const BlockRangeVector& chunk : chunks_) {
+    for (BlockRange range : chunk) {
+      // Skip the subtracted ranges before this one, and cut this one with the
+      // ones overlapping it.
+      while (jt != ranges.end() && jt->end <= range.start)
+        ++jt;
+      for (auto kt = jt; kt != ranges.end() && kt->start < range.end; ++kt) {
+        if (kt->start > range.start)
+          result.push_back({range.start, kt->start});
+        range.start = std::max(range.start, kt->end);
+        if (range.start >= range.end)
+          break;
+      }
+      if (range.start < range.end)
+        result.push_back(range);
+    }
   }
+  SetRanges(result);
+}
+
+void ExtentRanges::AddExtent(Extent extent) {
+  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+    return;
+  AddRange(extent.start_block(), extent.start_block() + extent.num_blocks());
+}
+
+void ExtentRanges::SubtractExtent(const Extent& extent) {
+  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+    return;
+  SubtractRange(extent.start_block(),
+                extent.start_block() + extent.num_blocks());
+}
+
+void ExtentRanges::AddRanges(const ExtentRanges& ranges) {
+  AddSortedRanges(ranges.GetRanges());
+}
+
+void ExtentRanges::SubtractRanges(const ExtentRanges& ranges) {
+  SubtractSortedRanges(ranges.GetRanges());
 }
 
 void ExtentRanges::AddExtents(const vector<Extent>& extents) {
-  for (vector<Extent>::const_iterator it = extents.begin(), e = extents.end();
-       it != e;
-       ++it) {
-    AddExtent(*it);
-  }
+  AddSortedRanges(SortedRanges(extents.begin(), extents.end()));
 }
 
 void ExtentRanges::SubtractExtents(const vector<Extent>& extents) {
-  for (vector<Extent>::const_iterator it = extents.begin(), e = extents.end();
-       it != e;
-       ++it) {
-    SubtractExtent(*it);
-  }
+  SubtractSortedRanges(SortedRanges(extents.begin(), extents.end()));
 }
 
 void ExtentRanges::AddRepeatedExtents(
     const ::google::protobuf::RepeatedPtrField<Extent>& exts) {
-  for (int i = 0, e = exts.size(); i != e; ++i) {
-    AddExtent(exts.Get(i));
-  }
+  AddSortedRanges(SortedRanges(exts.begin(), exts.end()));
 }
 
 void ExtentRanges::SubtractRepeatedExtents(
     const ::google::protobuf::RepeatedPtrField<Extent>& exts) {
-  for (int i = 0, e = exts.size(); i != e; ++i) {
-    SubtractExtent(exts.Get(i));
-  }
+  SubtractSortedRanges(SortedRanges(exts.begin(), exts.end()));
 }
 
 bool ExtentRanges::ContainsBlock(uint64_t block) const {
-  auto lower = extent_set_.lower_bound(ExtentForRange(block, 1));
-  // The block could be on the extent before the one in |lower|.
-  if (lower != extent_set_.begin())
-    lower--;
-  // Any extent starting at block+1 or later is not interesting, so this is the
-  // upper limit.
-  auto upper = extent_set_.lower_bound(ExtentForRange(block + 1, 0));
-  for (auto iter = lower; iter != upper; ++iter) {
-    if (iter->start_block() <= block &&
-        block < iter->start_block() + iter->num_blocks()) {
-      return true;
-    }
-  }
-  return false;
+  // The first range ending after |block| is the only one which could contain
+  // it.
+  Position pos = FirstEndingAtOrAfter(block + 1);
+  return pos != End() && At(pos).start <= block;
 }
 
 void ExtentRanges::Dump() const {
   LOG(INFO) << "ExtentRanges Dump. blocks: " << blocks_;
-  for (ExtentSet::const_iterator it = extent_set_.begin(),
-                                 e = extent_set_.end();
-       it != e;
-       ++it) {
-    LOG(INFO) << "{" << it->start_block() << ", " << it->num_blocks() << "}";
+  for (const BlockRangeVector& chunk : chunks_) {
+    for (const BlockRange& range : chunk) {
+      LOG(INFO) << "{" << range.start << ", " << range.end - range.start
+                << "}";
+    }
+  }
+}
+
+ExtentRanges::ExtentSet ExtentRanges::extent_set() const {
+  ExtentSet extents;
+  extents.reserve(NumRanges());
+  for (const BlockRangeVector& chunk : chunks_) {
+    for (const BlockRange& range : chunk)
+      extents.push_back(ExtentForRange(range.start, range.end - range.start));
   }
+  return extents;
 }
 
 Extent ExtentForRange(uint64_t start_block, uint64_t num_blocks) {
@@ -251,23 +426,18 @@ vector<Extent> ExtentRanges::GetExtentsForBlockCount(uint64_t count) const {
     return out;
   uint64_t out_blocks = 0;
   CHECK(count <= blocks_);
-  for (ExtentSet::const_iterator it = extent_set_.begin(),
-                                 e = extent_set_.end();
-       it != e;
-       ++it) {
+  for (Position pos = {0, 0}; pos != End(); Next(&pos)) {
+    const BlockRange& range = At(pos);
     const uint64_t blocks_needed = count - out_blocks;
-    const Extent& extent = *it;
-    out.push_back(extent);
-    out_blocks += extent.num_blocks();
-    if (extent.num_blocks() < blocks_needed)
-      continue;
-    if (extent.num_blocks() == blocks_needed)
+    const uint64_t num_blocks = range.end - range.start;
+    if (num_blocks >= blocks_needed) {
+      // This is the last extent needed, possibly cut to the blocks needed.
+      out.push_back(ExtentForRange(range.start, blocks_needed));
+      out_blocks += blocks_needed;
       break;
-    // If we get here, we just added the last extent needed, but it's too big
-    out_blocks -= extent.num_blocks();
-    out_blocks += blocks_needed;
-    out.back().set_num_blocks(blocks_needed);
-    break;
+    }
+    out.push_back(ExtentForRange(range.start, num_blocks));
+    out_blocks += num_blocks;
   }
   CHECK(out_blocks == utils::BlocksInExtents(out));
   return out;
@@ -276,49 +446,29 @@ vector<Extent> ExtentRanges::GetExtentsForBlockCount(uint64_t count) const {
 vector<Extent> FilterExtentRanges(const vector<Extent>& extents,
                                   const ExtentRanges& ranges) {
   vector<Extent> result;
-  const ExtentRanges::ExtentSet& extent_set = ranges.extent_set();
-  for (Extent extent : extents) {
-    // The extents are sorted by the start_block. We want to iterate all the
-    // Extents in the ExtentSet possibly overlapping the current |extent|. This
-    // is achieved by looking from the extent whose start_block is *lower* than
-    // the extent.start_block() up to the greatest extent whose start_block is
-    // lower than extent.start_block() + extent.num_blocks().
-    auto lower = extent_set.lower_bound(extent);
-    // We need to decrement the lower_bound to look at the extent that could
-    // overlap the beginning of the current |extent|.
-    if (lower != extent_set.begin())
-      lower--;
-    auto upper = extent_set.lower_bound(
-        ExtentForRange(extent.start_block() + extent.num_blocks(), 0));
-    for (auto iter = lower; iter != upper; ++iter) {
-      if (!ExtentRanges::ExtentsOverlap(extent, *iter))
-        continue;
-      if (iter->start_block() <= extent.start_block()) {
-        // We need to cut blocks from the beginning of the |extent|.
-        uint64_t cut_blocks =
-            iter->start_block() + iter->num_blocks() - extent.start_block();
-        if (cut_blocks >= extent.num_blocks()) {
-          extent.set_num_blocks(0);
-          break;
-        }
-        extent = ExtentForRange(extent.start_block() + cut_blocks,
-                                extent.num_blocks() - cut_blocks);
-      } else {
-        // We need to cut blocks on the middle of the extent, possible up to the
-        // end of it.
-        result.push_back(ExtentForRange(
-            extent.start_block(), iter->start_block() - extent.start_block()));
-        uint64_t new_start = iter->start_block() + iter->num_blocks();
-        uint64_t old_end = extent.start_block() + extent.num_blocks();
-        if (new_start >= old_end) {
-          extent.set_num_blocks(0);
-          break;
-        }
-        extent = ExtentForRange(new_start, old_end - new_start);
-      }
-    }
-    if (extent.num_blocks() > 0)
+  for (const Extent& extent : extents) {
+    if (extent.num_blocks() == 0)
+      continue;
+    // Sparse holes are never in an ExtentRanges.
+    if (extent.start_block() == kSparseHole) {
       result.push_back(extent);
+      continue;
+    }
+    uint64_t start = extent.start_block();
+    uint64_t end = start + extent.num_blocks();
+    // Iterate over the ranges overlapping the current |extent|, starting from
+    // the first one ending after its first block, and keep the blocks between
+    // them.
+    for (ExtentRanges::Position pos = ranges.FirstEndingAtOrAfter(start + 1);
+         pos != ranges.End() && ranges.At(pos).start < end && start < end;
+         ranges.Next(&pos)) {
+      const ExtentRanges::BlockRange& range = ranges.At(pos);
+      if (range.start > start)
+        result.push_back(ExtentForRange(start, range.start - start));
+      start = range.end;
+    }
+    if (start < end)
+      result.push_back(ExtentForRange(start, end - start));
   }
   return result;
 }
@@ -47,7 +47,7 @@ Extent ExtentForBytes(uint64_t block_size,
 
 class ExtentRanges {
  public:
-  typedef std::set<Extent, ExtentLess> ExtentSet;
+  typedef std::vector<Extent> ExtentSet;
 
   ExtentRanges() : blocks_(0) {}
   void AddBlock(uint64_t block);
@@ -73,7 +73,10 @@ class ExtentRanges {
   void Dump() const;
 
   uint64_t blocks() const { return blocks_; }
-  const ExtentSet& extent_set() const { return extent_set_; }
+
+  // Returns the extents in this ExtentRanges sorted by start block. The
+  // extents don't overlap or touch each other.
+  ExtentSet extent_set() const;
 
   // Returns an ordered vector of extents for |count| blocks,
   // using extents in extent_set_. The returned extents are not
@@ -82,7 +85,73 @@ class ExtentRanges {
   std::vector<Extent> GetExtentsForBlockCount(uint64_t count) const;
 
  private:
-  ExtentSet extent_set_;
+  friend std::vector<Extent> FilterExtentRanges(
+      const std::vector<Extent>& extents, const ExtentRanges& ranges);
+
+  // The blocks [start, end). Unlike an Extent, this is a plain struct so a
+  // vector of them can be moved around cheaply.
+  struct BlockRange {
+    uint64_t start;
+    uint64_t end;
+  };
+  typedef std::vector<BlockRange> BlockRangeVector;
+
+  // The position of a range in |chunks_|. The end position is
+  // {chunks_.size(), 0}.
+  struct Position {
+    size_t chunk;
+    size_t index;
+
+    bool operator==(const Position& other) const {
+      return chunk == other.chunk && index == other.index;
+    }
+    bool operator!=(const Position& other) const { return !(*this == other); }
+  };
+
+  // Returns the non-sparse and non-empty extents in [begin, end) as sorted
+  // ranges not overlapping or touching each other.
+  template <typename Iterator>
+  static BlockRangeVector SortedRanges(Iterator begin, Iterator end);
+
+  Position End() const { return {chunks_.size(), 0}; }
+  BlockRange& At(const Position& pos) { return chunks_[pos.chunk][pos.index]; }
+  const BlockRange& At(const Position& pos) const {
+    return chunks_[pos.chunk][pos.index];
+  }
+  // Moves |pos| to the next range.
+  void Next(Position* pos) const;
+
+  // Returns the position of the first range ending at or after |block|, or
+  // starting after |block|.
+  Position FirstEndingAtOrAfter(uint64_t block) const;
+  Position FirstStartingAfter(uint64_t block) const;
+
+  // Inserts |range| before |pos|, splitting the chunk if it gets too large.
+  void Insert(const Position& pos, const BlockRange& range);
+  // Erases the ranges in [from, to) and the chunks left empty.
+  void Erase(const Position& from, const Position& to);
+
+  // Returns all the ranges in a single vector, or replaces them with
+  // |ranges|.
+  BlockRangeVector GetRanges() const;
+  void SetRanges(const BlockRangeVector& ranges);
+  size_t NumRanges() const;
+
+  // Adds or subtracts the blocks [start, end).
+  void AddRange(uint64_t start, uint64_t end);
+  void SubtractRange(uint64_t start, uint64_t end);
+
+  // Adds or subtracts all the sorted |ranges|, merging them with the existing
+  // ones in a single pass when there are many of them.
+  void AddSortedRanges(const BlockRangeVector& ranges);
+  void SubtractSortedRanges(const BlockRangeVector& ranges);
+
+  // The blocks in this ExtentRanges, as ranges sorted by start block and not
+  // overlapping or touching each other. The ranges are split in chunks of
+  // bounded size, so adding or removing one only moves the ranges after it
+  // in its chunk while the chunks keep the ranges contiguous in memory. No
+  // chunk is empty.
+  std::vector<BlockRangeVector> chunks_;
   uint64_t blocks_;
 };
 
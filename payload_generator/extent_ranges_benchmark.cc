@@ -0,0 +1,199 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Benchmark of the ExtentRanges operations the delta generator runs for every
+// file of the images, compared with the std::set based implementation used
+// before.
+
+#include <algorithm>
+#include <random>
+#include <set>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The previous ExtentRanges implementation, reduced to the operations
+// benchmarked.
+class SetExtentRanges {
+ public:
+  void AddExtent(Extent extent) {
+    if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+      return;
+    auto begin_del = extent_set_.end();
+    auto end_del = extent_set_.end();
+    for (auto it = extent_set_.begin(); it != extent_set_.end(); ++it) {
+      if (ExtentRanges::ExtentsOverlapOrTouch(*it, extent)) {
+        end_del = it;
+        ++end_del;
+        if (begin_del == extent_set_.end())
+          begin_del = it;
+        uint64_t start = std::min(extent.start_block(), it->start_block());
+        uint64_t end = std::max(extent.start_block() + extent.num_blocks(),
+                                it->start_block() + it->num_blocks());
+        extent = ExtentForRange(start, end - start);
+      }
+    }
+    extent_set_.erase(begin_del, end_del);
+    extent_set_.insert(extent);
+  }
+
+  void AddExtents(const vector<Extent>& extents) {
+    for (const Extent& extent : extents)
+      AddExtent(extent);
+  }
+
+  bool ContainsBlock(uint64_t block) const {
+    auto lower = extent_set_.lower_bound(ExtentForRange(block, 1));
+    if (lower != extent_set_.begin())
+      lower--;
+    auto upper = extent_set_.lower_bound(ExtentForRange(block + 1, 0));
+    for (auto iter = lower; iter != upper; ++iter) {
+      if (iter->start_block() <= block &&
+          block < iter->start_block() + iter->num_blocks()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  vector<Extent> Filter(const vector<Extent>& extents) const {
+    vector<Extent> result;
+    for (Extent extent : extents) {
+      auto lower = extent_set_.lower_bound(extent);
+      if (lower != extent_set_.begin())
+        lower--;
+      auto upper = extent_set_.lower_bound(
+          ExtentForRange(extent.start_block() + extent.num_blocks(), 0));
+      for (auto iter = lower; iter != upper; ++iter) {
+        if (!ExtentRanges::ExtentsOverlap(extent, *iter))
+          continue;
+        uint64_t end = extent.start_block() + extent.num_blocks();
+        if (iter->start_block() > extent.start_block()) {
+          result.push_back(ExtentForRange(
+              extent.start_block(),
+              iter->start_block() - extent.start_block()));
+        }
+        uint64_t new_start = iter->start_block() + iter->num_blocks();
+        if (new_start >= end) {
+          extent.set_num_blocks(0);
+          break;
+        }
+        extent = ExtentForRange(new_start, end - new_start);
+      }
+      if (extent.num_blocks() > 0)
+        result.push_back(extent);
+    }
+    return result;
+  }
+
+ private:
+  std::set<Extent, ExtentLess> extent_set_;
+};
+
+// Returns |num_extents| extents of 1 to 8 blocks with small gaps between them,
+// in a random order like the extents of the files in a filesystem.
+vector<Extent> SyntheticExtents(size_t num_extents) {
+  std::mt19937 gen(num_extents);
+  std::uniform_int_distribution<uint64_t> length_dist(1, 8);
+  std::uniform_int_distribution<uint64_t> gap_dist(0, 2);
+  vector<Extent> extents;
+  uint64_t block = 0;
+  for (size_t i = 0; i < num_extents; i++) {
+    block += gap_dist(gen);
+    extents.push_back(ExtentForRange(block, length_dist(gen)));
+    block += extents.back().num_blocks();
+  }
+  std::shuffle(extents.begin(), extents.end(), gen);
+  return extents;
+}
+
+// Filters the extents of each file with the blocks already visited and adds
+// the remaining ones, like DeltaReadPartition() does.
+template <typename Ranges>
+void FilterAndAdd(Ranges* ranges, const vector<Extent>& extents);
+
+template <>
+void FilterAndAdd(ExtentRanges* ranges, const vector<Extent>& extents) {
+  for (const Extent& extent : extents)
+    ranges->AddExtents(FilterExtentRanges({extent}, *ranges));
+}
+
+template <>
+void FilterAndAdd(SetExtentRanges* ranges, const vector<Extent>& extents) {
+  for (const Extent& extent : extents)
+    ranges->AddExtents(ranges->Filter({extent}));
+}
+
+template <typename Ranges>
+void BM_FilterAndAdd(benchmark::State& state) {
+  vector<Extent> extents = SyntheticExtents(state.range(0));
+  for (auto _ : state) {
+    Ranges ranges;
+    FilterAndAdd(&ranges, extents);
+    benchmark::DoNotOptimize(ranges);
+  }
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+
+template <typename Ranges>
+void BM_ContainsBlock(benchmark::State& state) {
+  vector<Extent> extents = SyntheticExtents(state.range(0));
+  Ranges ranges;
+  ranges.AddExtents(extents);
+  uint64_t num_blocks = 0;
+  for (const Extent& extent : extents) {
+    num_blocks =
+        std::max(num_blocks, extent.start_block() + extent.num_blocks());
+  }
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<uint64_t> block_dist(0, num_blocks - 1);
+  for (auto _ : state)
+    benchmark::DoNotOptimize(ranges.ContainsBlock(block_dist(gen)));
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_BulkAddExtents(benchmark::State& state) {
+  vector<Extent> extents = SyntheticExtents(state.range(0));
+  for (auto _ : state) {
+    ExtentRanges ranges;
+    ranges.AddExtents(extents);
+    benchmark::DoNotOptimize(ranges);
+  }
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+
+// The std::set implementation is quadratic, so it is only run on the smaller
+// workloads.
+BENCHMARK_TEMPLATE(BM_FilterAndAdd, ExtentRanges)->Range(1 << 10, 1 << 20);
+BENCHMARK_TEMPLATE(BM_FilterAndAdd, SetExtentRanges)->Range(1 << 10, 1 << 14);
+BENCHMARK_TEMPLATE(BM_ContainsBlock, ExtentRanges)->Range(1 << 10, 1 << 20);
+BENCHMARK_TEMPLATE(BM_ContainsBlock, SetExtentRanges)->Range(1 << 10, 1 << 14);
+BENCHMARK(BM_BulkAddExtents)->Range(1 << 10, 1 << 20);
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+BENCHMARK_MAIN();
@@ -16,11 +16,13 @@
 
 #include "update_engine/payload_generator/extent_ranges.h"
 
+#include <random>
 #include <vector>
 
 #include <gtest/gtest.h>
 
 #include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/extent_utils.h"
 
@@ -314,4 +316,55 @@ TEST(ExtentRangesTest, FilterExtentRangesOvelapping) {
                 ranges));
 }
 
+TEST(ExtentRangesTest, BulkAddAndSubtractTest) {
+  // Compare the result of adding and subtracting random extents, one at a time
+  // and in batches, with a set of blocks.
+  // There are enough ranges to fill several chunks of ranges internally.
+  const uint64_t kNumBlocks = 20000;
+  const uint64_t kMaxLength = 5;
+  std::mt19937 gen(1234);
+  std::uniform_int_distribution<uint64_t> start_dist(0, kNumBlocks - 1);
+  std::uniform_int_distribution<uint64_t> length_dist(0, kMaxLength);
+  ExtentRanges ranges;
+  vector<bool> expected_blocks(kNumBlocks + kMaxLength, false);
+  for (size_t round = 0; round < 400; round++) {
+    bool add = round % 3 != 2;
+    vector<Extent> extents(round % 40);
+    for (Extent& extent : extents) {
+      extent = ExtentForRange(start_dist(gen), length_dist(gen));
+      for (uint64_t i = 0; i < extent.num_blocks(); i++)
+        expected_blocks[extent.start_block() + i] = add;
+    }
+    if (round % 5 == 0) {
+      // Sparse holes are ignored.
+      extents.push_back(ExtentForRange(kSparseHole, 10));
+    }
+    if (add) {
+      ranges.AddExtents(extents);
+    } else {
+      ExtentRanges other;
+      other.AddExtents(extents);
+      ranges.SubtractRanges(other);
+    }
+
+    vector<Extent> expected_extents;
+    for (uint64_t block = 0; block < expected_blocks.size(); block++) {
+      EXPECT_EQ(expected_blocks[block], ranges.ContainsBlock(block));
+      if (!expected_blocks[block])
+        continue;
+      if (!expected_extents.empty() &&
+          expected_extents.back().start_block() +
+                  expected_extents.back().num_blocks() ==
+              block) {
+        expected_extents.back().set_num_blocks(
+            expected_extents.back().num_blocks() + 1);
+      } else {
+        expected_extents.push_back(ExtentForRange(block, 1));
+      }
+    }
+    EXPECT_EQ(expected_extents, ranges.extent_set());
+    EXPECT_EQ(utils::BlocksInExtents(expected_extents), ranges.blocks());
+  }
+}
+
 }  // namespace chromeos_update_engine
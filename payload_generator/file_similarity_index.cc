@@ -0,0 +1,289 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/file_similarity_index.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <limits>
+#include <list>
+
+#include <base/logging.h>
+#include <base/threading/simple_thread.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// A chunk ends where the bits of the rolling hash selected by this mask are
+// all zero, giving chunks of 4 KiB on average, but never shorter than
+// |kMinChunkSize| nor longer than |kMaxChunkSize|. The low bits of the gear
+// hash only depend on the last few bytes, so as in FastCDC the mask selects
+// the high bits, which depend on the last 64 bytes.
+const uint64_t kChunkBoundaryMask = ((1ULL << 12) - 1) << 52;
+const size_t kMinChunkSize = 1024;
+const size_t kMaxChunkSize = 16 * 1024;
+
+// The size of the reads of the file data.
+const size_t kReadSize = 1024 * 1024;
+
+// The minimum estimated fraction of chunks a new file must share with an old
+// file to use it as the source of its diff.
+const double kMinSimilarity = 0.1;
+
+const uint64_t kEmptySketchValue = std::numeric_limits<uint64_t>::max();
+
+uint64_t SplitMix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// The random values added by the rolling hash for each byte value.
+const uint64_t* GearTable() {
+  static const std::array<uint64_t, 256> table = [] {
+    std::array<uint64_t, 256> values;
+    for (size_t i = 0; i < values.size(); i++)
+      values[i] = SplitMix64(i);
+    return values;
+  }();
+  return table.data();
+}
+
+// The seeds of the hash functions of each position of the sketch.
+const uint64_t* SketchSeeds() {
+  static const std::array<uint64_t, FileSimilarityIndex::kSketchSize> seeds =
+      [] {
+        std::array<uint64_t, FileSimilarityIndex::kSketchSize> values;
+        for (size_t i = 0; i < values.size(); i++)
+          values[i] = SplitMix64(0x5eed0000 + i);
+        return values;
+      }();
+  return seeds.data();
+}
+
+// Cuts the data passed to Update() in chunks and adds the hash of each one to
+// the sketch.
+class Sketcher {
+ public:
+  explicit Sketcher(FileSimilarityIndex::Sketch* sketch)
+      : sketch_(sketch),
+        gear_(GearTable()),
+        seeds_(SketchSeeds()) {
+    sketch_->fill(kEmptySketchValue);
+  }
+
+  void Update(const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      uint8_t byte = data[i];
+      rolling_hash_ = (rolling_hash_ << 1) + gear_[byte];
+      // FNV-1a hash of the content of the chunk.
+      chunk_hash_ = (chunk_hash_ ^ byte) * 0x100000001b3ULL;
+      nonzero_ |= byte;
+      chunk_size_++;
+      if ((chunk_size_ >= kMinChunkSize &&
+           (rolling_hash_ & kChunkBoundaryMask) == 0) ||
+          chunk_size_ >= kMaxChunkSize) {
+        EndChunk();
+      }
+    }
+  }
+
+  void Finish() {
+    if (chunk_size_)
+      EndChunk();
+  }
+
+ private:
+  void EndChunk() {
+    // Chunks of zeros are shared by many unrelated files, so they're not
+    // counted.
+    if (nonzero_) {
+      for (size_t i = 0; i < FileSimilarityIndex::kSketchSize; i++) {
+        uint64_t value = SplitMix64(chunk_hash_ ^ seeds_[i]);
+        (*sketch_)[i] = std::min((*sketch_)[i], value);
+      }
+    }
+    rolling_hash_ = 0;
+    chunk_hash_ = 0xcbf29ce484222325ULL;
+    nonzero_ = 0;
+    chunk_size_ = 0;
+  }
+
+  FileSimilarityIndex::Sketch* sketch_;
+  const uint64_t* gear_;
+  const uint64_t* seeds_;
+
+  uint64_t rolling_hash_{0};
+  uint64_t chunk_hash_{0xcbf29ce484222325ULL};
+  uint8_t nonzero_{0};
+  size_t chunk_size_{0};
+};
+
+// Computes the sketch of some data of a partition on a thread of a pool.
+class SketchTask : public base::DelegateSimpleThread::Delegate {
+ public:
+  SketchTask(const string& part_path,
+             const vector<Extent>* extents,
+             FileSimilarityIndex::Sketch* sketch)
+      : part_path_(part_path), extents_(extents), sketch_(sketch) {}
+
+  void Run() override {
+    success_ =
+        FileSimilarityIndex::ComputeSketch(part_path_, *extents_, sketch_);
+  }
+
+  bool success() const { return success_; }
+
+ private:
+  const string& part_path_;
+  const vector<Extent>* extents_;
+  FileSimilarityIndex::Sketch* sketch_;
+  bool success_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(SketchTask);
+};
+
+bool IsEmptySketch(const FileSimilarityIndex::Sketch& sketch) {
+  return std::all_of(sketch.begin(), sketch.end(), [](uint64_t value) {
+    return value == kEmptySketchValue;
+  });
+}
+
+}  // namespace
+
+const size_t FileSimilarityIndex::kSketchSize;
+
+bool FileSimilarityIndex::ComputeSketch(const string& part_path,
+                                        const vector<Extent>& extents,
+                                        Sketch* sketch) {
+  int fd = HANDLE_EINTR(open(part_path.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+
+  Sketcher sketcher(sketch);
+  brillo::Blob buffer(kReadSize);
+  for (const Extent& extent : extents) {
+    uint64_t offset = extent.start_block() * kBlockSize;
+    uint64_t end = offset + extent.num_blocks() * kBlockSize;
+    while (offset < end) {
+      size_t size = std::min(static_cast<uint64_t>(kReadSize), end - offset);
+      ssize_t bytes_read;
+      TEST_AND_RETURN_FALSE(
+          utils::PReadAll(fd, buffer.data(), size, offset, &bytes_read));
+      TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size));
+      sketcher.Update(buffer.data(), size);
+      offset += size;
+    }
+  }
+  sketcher.Finish();
+  return true;
+}
+
+bool FileSimilarityIndex::ComputeSketches(
+    const string& part_path,
+    const vector<const vector<Extent>*>& extents_list,
+    size_t num_threads,
+    vector<Sketch>* sketches) {
+  sketches->resize(extents_list.size());
+  std::list<SketchTask> tasks;
+  for (size_t i = 0; i < extents_list.size(); i++)
+    tasks.emplace_back(part_path, extents_list[i], &(*sketches)[i]);
+
+  base::DelegateSimpleThreadPool thread_pool(
+      "file-similarity-index",
+      std::max<size_t>(1, std::min(num_threads, tasks.size())));
+  thread_pool.Start();
+  for (SketchTask& task : tasks)
+    thread_pool.AddWork(&task);
+  thread_pool.JoinAll();
+
+  for (const SketchTask& task : tasks)
+    TEST_AND_RETURN_FALSE(task.success());
+  return true;
+}
+
+bool FileSimilarityIndex::Init(const string& part_path,
+                               const vector<FilesystemInterface::File>& files,
+                               size_t num_threads) {
+  vector<const FilesystemInterface::File*> indexed_files;
+  vector<const vector<Extent>*> extents_list;
+  for (const FilesystemInterface::File& file : files) {
+    // Pseudo-files don't start with a /.
+    if (file.name.empty() || file.name[0] != '/' || file.extents.empty())
+      continue;
+    indexed_files.push_back(&file);
+    extents_list.push_back(&file.extents);
+  }
+  vector<Sketch> sketches;
+  TEST_AND_RETURN_FALSE(
+      ComputeSketches(part_path, extents_list, num_threads, &sketches));
+
+  for (size_t i = 0; i < indexed_files.size(); i++) {
+    const Sketch& sketch = sketches[i];
+    if (IsEmptySketch(sketch))
+      continue;
+    for (size_t j = 0; j < kSketchSize; j++)
+      buckets_[{j, sketch[j]}].push_back(files_.size());
+    files_.push_back(*indexed_files[i]);
+  }
+  LOG(INFO) << "Indexed the content of " << files_.size() << " files.";
+  return true;
+}
+
+const FilesystemInterface::File* FileSimilarityIndex::FindSimilar(
+    const string& part_path,
+    const vector<Extent>& extents,
+    double* similarity) const {
+  Sketch sketch;
+  if (!ComputeSketch(part_path, extents, &sketch))
+    return nullptr;
+  return FindSimilar(sketch, similarity);
+}
+
+const FilesystemInterface::File* FileSimilarityIndex::FindSimilar(
+    const Sketch& sketch, double* similarity) const {
+  if (IsEmptySketch(sketch))
+    return nullptr;
+
+  // The number of equal sketch values of each indexed file.
+  vector<size_t> matches(files_.size());
+  for (size_t i = 0; i < kSketchSize; i++) {
+    auto bucket = buckets_.find({i, sketch[i]});
+    if (bucket == buckets_.end())
+      continue;
+    for (size_t index : bucket->second)
+      matches[index]++;
+  }
+  auto best = std::max_element(matches.begin(), matches.end());
+  if (best == matches.end())
+    return nullptr;
+  *similarity = static_cast<double>(*best) / kSketchSize;
+  if (*similarity < kMinSimilarity)
+    return nullptr;
+  return &files_[best - matches.begin()];
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,103 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_SIMILARITY_INDEX_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_SIMILARITY_INDEX_H_
+
+#include <array>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Finds the old file whose content is the most similar to a new file, to use
+// it as the source of the diff when the new file has no old file with the same
+// name, for example when it was renamed or moved.
+//
+// The content of each file is cut in chunks of about 4 KiB at positions chosen
+// by a rolling hash of the data, so the same data gives the same chunks even
+// when it's shifted by insertions or deletions. The sketch of a file is the
+// MinHash of the set of its chunks, and the fraction of equal values in the
+// sketches of two files estimates the fraction of chunks they share. The
+// sketches of several files are computed in parallel.
+class FileSimilarityIndex {
+ public:
+  // The number of MinHash values in the sketch of a file.
+  static const size_t kSketchSize = 64;
+  using Sketch = std::array<uint64_t, kSketchSize>;
+
+  FileSimilarityIndex() = default;
+  ~FileSimilarityIndex() = default;
+
+  // Computes the sketch of the data in the blocks |extents| of the partition
+  // |part_path|. Returns false if the data can't be read. A file with no
+  // chunks gets a sketch of empty values, similar to nothing.
+  static bool ComputeSketch(const std::string& part_path,
+                            const std::vector<Extent>& extents,
+                            Sketch* sketch);
+
+  // Computes in |sketches| the sketch of the data in each of the blocks
+  // |extents_list| of the partition |part_path|, on up to |num_threads|
+  // threads. Returns false if any of the data can't be read.
+  static bool ComputeSketches(
+      const std::string& part_path,
+      const std::vector<const std::vector<Extent>*>& extents_list,
+      size_t num_threads,
+      std::vector<Sketch>* sketches);
+
+  // Indexes the regular |files| of the partition |part_path|, whose data is
+  // read to compute their sketches on up to |num_threads| threads.
+  // Pseudo-files are skipped.
+  bool Init(const std::string& part_path,
+            const std::vector<FilesystemInterface::File>& files,
+            size_t num_threads);
+
+  // Returns the indexed file most similar to the data with the given |sketch|
+  // and sets |similarity| to the estimated fraction of chunks they share.
+  // Returns nullptr if no file shares enough of it.
+  const FilesystemInterface::File* FindSimilar(const Sketch& sketch,
+                                               double* similarity) const;
+
+  // Same as above for the data in the blocks |extents| of the partition
+  // |part_path|. Returns nullptr if the data can't be read.
+  const FilesystemInterface::File* FindSimilar(
+      const std::string& part_path,
+      const std::vector<Extent>& extents,
+      double* similarity) const;
+
+  size_t size() const { return files_.size(); }
+
+ private:
+  // The indexed files.
+  std::vector<FilesystemInterface::File> files_;
+
+  // Maps each sketch position and value to the indexes in |files_| of the
+  // files with that value at that position.
+  std::map<std::pair<size_t, uint64_t>, std::vector<size_t>> buckets_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileSimilarityIndex);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_SIMILARITY_INDEX_H_
@@ -0,0 +1,138 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/file_similarity_index.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+brillo::Blob RandomData(size_t size, uint32_t seed) {
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<int> dist(0, 255);
+  brillo::Blob data(size);
+  for (uint8_t& byte : data)
+    byte = dist(gen);
+  return data;
+}
+
+FilesystemInterface::File MakeFile(const string& name,
+                                   uint64_t start_block,
+                                   uint64_t num_blocks) {
+  FilesystemInterface::File file;
+  file.name = name;
+  file.extents = {ExtentForRange(start_block, num_blocks)};
+  return file;
+}
+
+}  // namespace
+
+class FileSimilarityIndexTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // The old partition has two unrelated files of 16 blocks.
+    old_data_ = RandomData(32 * kBlockSize, 1);
+    ASSERT_TRUE(test_utils::WriteFileVector(old_part_.path(), old_data_));
+    old_files_ = {MakeFile("/system/app/a.apk", 0, 16),
+                  MakeFile("/system/app/b.apk", 16, 16),
+                  MakeFile("<free-space>", 0, 32)};
+    ASSERT_TRUE(index_.Init(old_part_.path(), old_files_, 2));
+  }
+
+  test_utils::ScopedTempFile old_part_{"FileSimilarityIndexTest-old.XXXXXX"};
+  test_utils::ScopedTempFile new_part_{"FileSimilarityIndexTest-new.XXXXXX"};
+  brillo::Blob old_data_;
+  vector<FilesystemInterface::File> old_files_;
+  FileSimilarityIndex index_;
+};
+
+TEST_F(FileSimilarityIndexTest, SkipsPseudoFilesTest) {
+  EXPECT_EQ(2u, index_.size());
+}
+
+TEST_F(FileSimilarityIndexTest, FindShiftedContentTest) {
+  // The data of the second file with a few bytes inserted at the start.
+  brillo::Blob new_data = {1, 2, 3};
+  new_data.insert(new_data.end(),
+                  old_data_.begin() + 16 * kBlockSize,
+                  old_data_.begin() + 32 * kBlockSize - 3);
+  ASSERT_TRUE(test_utils::WriteFileVector(new_part_.path(), new_data));
+
+  double similarity = 0;
+  const FilesystemInterface::File* file = index_.FindSimilar(
+      new_part_.path(), {ExtentForRange(0, 16)}, &similarity);
+  ASSERT_NE(nullptr, file);
+  EXPECT_EQ("/system/app/b.apk", file->name);
+  EXPECT_GT(similarity, 0.5);
+}
+
+TEST_F(FileSimilarityIndexTest, UnrelatedContentTest) {
+  ASSERT_TRUE(test_utils::WriteFileVector(new_part_.path(),
+                                          RandomData(16 * kBlockSize, 2)));
+  double similarity;
+  EXPECT_EQ(nullptr,
+            index_.FindSimilar(
+                new_part_.path(), {ExtentForRange(0, 16)}, &similarity));
+}
+
+TEST_F(FileSimilarityIndexTest, ZerosAreNotSimilarTest) {
+  ASSERT_TRUE(test_utils::WriteFileVector(new_part_.path(),
+                                          brillo::Blob(16 * kBlockSize)));
+  double similarity;
+  EXPECT_EQ(nullptr,
+            index_.FindSimilar(
+                new_part_.path(), {ExtentForRange(0, 16)}, &similarity));
+}
+
+TEST_F(FileSimilarityIndexTest, ComputeSketchesTest) {
+  vector<Extent> extents[3] = {{ExtentForRange(0, 16)},
+                               {ExtentForRange(16, 16)},
+                               {ExtentForRange(4, 8), ExtentForRange(20, 2)}};
+  vector<FileSimilarityIndex::Sketch> sketches;
+  EXPECT_TRUE(FileSimilarityIndex::ComputeSketches(
+      old_part_.path(), {&extents[0], &extents[1], &extents[2]}, 2, &sketches));
+  ASSERT_EQ(3u, sketches.size());
+  // The sketches are the same as when computed one by one.
+  for (size_t i = 0; i < sketches.size(); i++) {
+    FileSimilarityIndex::Sketch sketch;
+    EXPECT_TRUE(FileSimilarityIndex::ComputeSketch(
+        old_part_.path(), extents[i], &sketch));
+    EXPECT_EQ(sketch, sketches[i]);
+  }
+
+  double similarity = 0;
+  const FilesystemInterface::File* file =
+      index_.FindSimilar(sketches[1], &similarity);
+  ASSERT_NE(nullptr, file);
+  EXPECT_EQ("/system/app/b.apk", file->name);
+  EXPECT_EQ(1.0, similarity);
+}
+
+}  // namespace chromeos_update_engine
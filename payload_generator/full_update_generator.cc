@@ -85,6 +85,7 @@ class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
 };
 
 void ChunkProcessor::Run() {
+  diff_utils::ScopedIdlePoolThreads::ScopedTask pool_task;
   if (!ProcessChunk()) {
     LOG(ERROR) << "Error processing region at " << offset_ << " of size "
                << size_;
@@ -180,6 +181,8 @@ bool FullUpdateGenerator::GenerateOperations(
   }
 
   // Thread pool used for worker threads.
+  diff_utils::ScopedIdlePoolThreads idle_pool_threads(max_threads,
+                                                      chunk_processors.size());
   base::DelegateSimpleThreadPool thread_pool("full-update-generator",
                                              max_threads);
   thread_pool.Start();
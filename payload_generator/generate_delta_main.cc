@@ -14,12 +14,15 @@
 // limitations under the License.
 //
 
+#include <memory>
 #include <string>
 #include <vector>
 
 #include <base/files/file_path.h>
 #include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
 #include <base/logging.h>
+#include <base/macros.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
 #include <brillo/flag_helper.h>
@@ -37,6 +40,9 @@
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/diff_cache.h"
+#include "update_engine/payload_generator/memory_budget.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/payload_generator/payload_signer.h"
 #include "update_engine/payload_generator/xz.h"
@@ -281,6 +287,29 @@ int ExtractProperties(const string& payload_path, const string& props_file) {
   return true;
 }
 
+// Uses a DiffCache for the payloads generated during its lifetime, and logs its
+// stats once they are done.
+class ScopedDiffCacheSetter {
+ public:
+  explicit ScopedDiffCacheSetter(DiffCache* diff_cache)
+      : diff_cache_(diff_cache) {
+    if (diff_cache_)
+      diff_utils::SetDiffCache(diff_cache_);
+  }
+
+  ~ScopedDiffCacheSetter() {
+    if (diff_cache_) {
+      diff_utils::SetDiffCache(nullptr);
+      diff_cache_->LogStats();
+    }
+  }
+
+ private:
+  DiffCache* diff_cache_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedDiffCacheSetter);
+};
+
 int Main(int argc, char** argv) {
   DEFINE_string(old_image, "", "Path to the old rootfs");
   DEFINE_string(new_image, "", "Path to the new rootfs");
@@ -291,7 +320,10 @@ int Main(int argc, char** argv) {
                 "Path to the old partitions. To pass multiple partitions, use "
                 "a single argument with a colon between paths, e.g. "
                 "/path/to/part:/path/to/part2::/path/to/last_part . Path can "
-                "be empty, but it has to match the order of partition_names.");
+                "be empty, but it has to match the order of partition_names. "
+                "To generate one payload from each of several sources, "
+                "separate their partitions with a comma, and pass as many "
+                "--out_file and --old_mapfiles separated by commas.");
   DEFINE_string(new_partitions,
                 "",
                 "Path to the new partitions. To pass multiple partitions, use "
@@ -319,7 +351,10 @@ int Main(int argc, char** argv) {
                 "",
                 "Path to input delta payload file used to hash/sign payloads "
                 "and apply delta over old_image (for debugging)");
-  DEFINE_string(out_file, "", "Path to output delta payload file");
+  DEFINE_string(out_file,
+                "",
+                "Path to output delta payload file, or several paths "
+                "separated by commas, see --old_partitions.");
   DEFINE_string(out_hash_file, "", "Path to output hash file");
   DEFINE_string(
       out_metadata_hash_file, "", "Path to output metadata hash file");
@@ -421,6 +456,36 @@ int Main(int argc, char** argv) {
                 "",
                 "An info file specifying dynamic partition metadata. "
                 "Only allowed in major version 2 or newer.");
+  DEFINE_bool(select_compressors,
+              false,
+              "Only run the compressors predicted to produce the smallest "
+              "full operations, instead of all of them.");
+  DEFINE_double(speculative_compression_budget,
+                -1,
+                "The time in seconds each partition can spend running the "
+                "compressors predicted to lose with --select_compressors, or "
+                "-1 for no limit. It adds up the durations of these runs on "
+                "all the threads, and doesn't cover the other compressions.");
+  DEFINE_bool(audit_compressor_selection,
+              false,
+              "Also run the compressors skipped by --select_compressors to "
+              "log how many bytes skipping them cost.");
+  DEFINE_int64(memory_budget,
+               -1,
+               "The memory in bytes the threads generating the delta "
+               "operations are estimated to use at once, or -1 for three "
+               "quarters of the physical memory or of the memory limit of "
+               "the cgroup, or 0 for no limit.");
+  DEFINE_string(diff_cache_dir,
+                "",
+                "A directory where the diff operations are cached to be "
+                "reused by the next payloads generated from the same data. "
+                "The payloads generated from several --old_partitions sets "
+                "share a temporary cache if not set.");
+  DEFINE_uint64(diff_cache_max_size,
+                8ULL * 1024 * 1024 * 1024,
+                "The maximum size in bytes of the diff cache. The least "
+                "recently used operations are removed above this size.");
 
   brillo::FlagHelper::Init(
       argc,
@@ -473,13 +538,46 @@ int Main(int argc, char** argv) {
   // A payload generation was requested. Convert the flags to a
   // PayloadGenerationConfig.
   PayloadGenerationConfig payload_config;
-  vector<string> partition_names, old_partitions, new_partitions;
-  vector<string> old_mapfiles, new_mapfiles;
-
-  if (!FLAGS_old_mapfiles.empty()) {
-    old_mapfiles = base::SplitString(
-        FLAGS_old_mapfiles, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+  vector<string> partition_names, new_partitions;
+  vector<string> new_mapfiles;
+
+  // Several sets of old partitions separated by commas generate one payload
+  // from each of them to the same new partitions, sharing the work done on
+  // the new partitions.
+  vector<string> old_partition_sets = {FLAGS_old_partitions};
+  vector<string> old_mapfile_sets = {FLAGS_old_mapfiles};
+  vector<string> out_files = {FLAGS_out_file};
+  if (FLAGS_old_partitions.find(',') != string::npos) {
+    old_partition_sets = base::SplitString(FLAGS_old_partitions,
+                                           ",",
+                                           base::TRIM_WHITESPACE,
+                                           base::SPLIT_WANT_ALL);
+    out_files = base::SplitString(
+        FLAGS_out_file, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+    LOG_IF(FATAL, out_files.size() != old_partition_sets.size())
+        << "Pass one --out_file per set of --old_partitions.";
+    if (FLAGS_old_mapfiles.empty()) {
+      old_mapfile_sets.assign(old_partition_sets.size(), "");
+    } else {
+      old_mapfile_sets = base::SplitString(
+          FLAGS_old_mapfiles, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+      LOG_IF(FATAL, old_mapfile_sets.size() != old_partition_sets.size())
+          << "Pass one set of --old_mapfiles per set of --old_partitions.";
+    }
+    LOG_IF(FATAL, !FLAGS_in_file.empty())
+        << "Only one set of --old_partitions can be passed with --in_file.";
+    LOG_IF(FATAL, !FLAGS_out_metadata_size_file.empty())
+        << "Only one set of --old_partitions can be passed with "
+        << "--out_metadata_size_file.";
+    LOG_IF(FATAL,
+           !FLAGS_old_channel.empty() || !FLAGS_old_board.empty() ||
+               !FLAGS_old_version.empty() || !FLAGS_old_key.empty() ||
+               !FLAGS_old_build_channel.empty() ||
+               !FLAGS_old_build_version.empty())
+        << "The old image info can't be passed with several sets of "
+        << "--old_partitions.";
   }
+
   if (!FLAGS_new_mapfiles.empty()) {
     new_mapfiles = base::SplitString(
         FLAGS_new_mapfiles, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
@@ -531,30 +629,6 @@ int Main(int argc, char** argv) {
       payload_config.target.partitions.back().mapfile_path = new_mapfiles[i];
   }
 
-  if (payload_config.is_delta) {
-    if (!FLAGS_old_partitions.empty()) {
-      old_partitions = base::SplitString(FLAGS_old_partitions,
-                                         ":",
-                                         base::TRIM_WHITESPACE,
-                                         base::SPLIT_WANT_ALL);
-      CHECK(old_partitions.size() == new_partitions.size());
-    } else {
-      old_partitions = {FLAGS_old_image, FLAGS_old_kernel};
-      LOG(WARNING) << "--old_partitions is empty, using deprecated --old_image "
-                   << "and --old_kernel flags.";
-    }
-    for (size_t i = 0; i < partition_names.size(); i++) {
-      payload_config.source.partitions.emplace_back(partition_names[i]);
-      payload_config.source.partitions.back().path = old_partitions[i];
-      if (i < old_mapfiles.size())
-        payload_config.source.partitions.back().mapfile_path = old_mapfiles[i];
-    }
-  }
-
-  if (!FLAGS_in_file.empty()) {
-    return ApplyPayload(FLAGS_in_file, payload_config) ? 0 : 1;
-  }
-
   if (!FLAGS_new_postinstall_config_file.empty()) {
     LOG_IF(FATAL, FLAGS_major_version == kChromeOSMajorPayloadVersion)
         << "Postinstall config is only allowed in major version 2 or newer.";
@@ -567,13 +641,6 @@ int Main(int argc, char** argv) {
   payload_config.hard_chunk_size = FLAGS_chunk_size;
   payload_config.block_size = kBlockSize;
 
-  // The partition size is never passed to the delta_generator, so we
-  // need to detect those from the provided files.
-  if (payload_config.is_delta) {
-    CHECK(payload_config.source.LoadImageSize());
-  }
-  CHECK(payload_config.target.LoadImageSize());
-
   if (!FLAGS_dynamic_partition_info_file.empty()) {
     LOG_IF(FATAL, FLAGS_major_version == kChromeOSMajorPayloadVersion)
         << "Dynamic partition info is only allowed in major version 2 or "
@@ -581,11 +648,8 @@ int Main(int argc, char** argv) {
     brillo::KeyValueStore store;
     CHECK(store.Load(base::FilePath(FLAGS_dynamic_partition_info_file)));
     CHECK(payload_config.target.LoadDynamicPartitionMetadata(store));
-    CHECK(payload_config.target.ValidateDynamicPartitionMetadata());
   }
 
-  CHECK(!FLAGS_out_file.empty());
-
   // Ignore failures. These are optional arguments.
   ParseImageInfo(FLAGS_new_channel,
                  FLAGS_new_board,
@@ -595,76 +659,172 @@ int Main(int argc, char** argv) {
                  FLAGS_new_build_version,
                  &payload_config.target.image_info);
 
-  // Ignore failures. These are optional arguments.
-  ParseImageInfo(FLAGS_old_channel,
-                 FLAGS_old_board,
-                 FLAGS_old_version,
-                 FLAGS_old_key,
-                 FLAGS_old_build_channel,
-                 FLAGS_old_build_version,
-                 &payload_config.source.image_info);
-
   payload_config.rootfs_partition_size = FLAGS_rootfs_partition_size;
+  payload_config.version.major = FLAGS_major_version;
+  LOG(INFO) << "Using provided major_version=" << FLAGS_major_version;
+  payload_config.max_timestamp = FLAGS_max_timestamp;
+  payload_config.select_compressors = FLAGS_select_compressors;
+  payload_config.speculative_compression_budget =
+      FLAGS_speculative_compression_budget;
+  payload_config.audit_compressor_selection = FLAGS_audit_compressor_selection;
+  if (FLAGS_memory_budget < 0) {
+    payload_config.memory_budget = GetUsableMemory() / 4 * 3;
+  } else {
+    payload_config.memory_budget = FLAGS_memory_budget;
+  }
 
-  if (payload_config.is_delta) {
-    // Avoid opening the filesystem interface for full payloads.
-    for (PartitionConfig& part : payload_config.target.partitions)
-      CHECK(part.OpenFilesystem());
-    for (PartitionConfig& part : payload_config.source.partitions)
-      CHECK(part.OpenFilesystem());
+  // The diff cache also keeps the full operations of the new partitions, so
+  // the payloads generated from several sources share them. Without a
+  // --diff_cache_dir they share a temporary cache, removed once all the
+  // payloads are generated.
+  base::ScopedTempDir diff_cache_temp_dir;
+  base::FilePath diff_cache_dir(FLAGS_diff_cache_dir);
+  if (diff_cache_dir.empty() && old_partition_sets.size() > 1) {
+    if (diff_cache_temp_dir.CreateUniqueTempDir())
+      diff_cache_dir = diff_cache_temp_dir.GetPath();
+    else
+      LOG(WARNING) << "Unable to create a temporary diff cache directory.";
+  }
+  std::unique_ptr<DiffCache> diff_cache;
+  if (!diff_cache_dir.empty() && payload_config.is_delta) {
+    diff_cache.reset(new DiffCache(diff_cache_dir, FLAGS_diff_cache_max_size));
+    if (!diff_cache->Init()) {
+      LOG(WARNING) << "Not using the diff cache in " << diff_cache_dir.value();
+      diff_cache.reset();
+    }
   }
+  ScopedDiffCacheSetter diff_cache_setter(diff_cache.get());
 
-  payload_config.version.major = FLAGS_major_version;
-  LOG(INFO) << "Using provided major_version=" << FLAGS_major_version;
+  for (size_t source = 0; source < old_partition_sets.size(); source++) {
+    payload_config.source = ImageConfig();
+    if (payload_config.is_delta) {
+      vector<string> old_partitions, old_mapfiles;
+      if (!old_partition_sets[source].empty()) {
+        old_partitions = base::SplitString(old_partition_sets[source],
+                                           ":",
+                                           base::TRIM_WHITESPACE,
+                                           base::SPLIT_WANT_ALL);
+        CHECK(old_partitions.size() == new_partitions.size());
+      } else {
+        old_partitions = {FLAGS_old_image, FLAGS_old_kernel};
+        LOG(WARNING) << "--old_partitions is empty, using deprecated "
+                     << "--old_image and --old_kernel flags.";
+      }
+      if (!old_mapfile_sets[source].empty()) {
+        old_mapfiles = base::SplitString(old_mapfile_sets[source],
+                                         ":",
+                                         base::TRIM_WHITESPACE,
+                                         base::SPLIT_WANT_ALL);
+      }
+      for (size_t i = 0; i < partition_names.size(); i++) {
+        payload_config.source.partitions.emplace_back(partition_names[i]);
+        payload_config.source.partitions.back().path = old_partitions[i];
+        if (i < old_mapfiles.size())
+          payload_config.source.partitions.back().mapfile_path =
+              old_mapfiles[i];
+      }
+    }
+
+    if (!FLAGS_in_file.empty()) {
+      return ApplyPayload(FLAGS_in_file, payload_config) ? 0 : 1;
+    }
+
+    // The partition size is never passed to the delta_generator, so we
+    // need to detect those from the provided files.
+    if (payload_config.is_delta) {
+      CHECK(payload_config.source.LoadImageSize());
+    }
+    if (source == 0) {
+      CHECK(payload_config.target.LoadImageSize());
+      if (payload_config.target.dynamic_partition_metadata)
+        CHECK(payload_config.target.ValidateDynamicPartitionMetadata());
+    }
+
+    CHECK(!out_files[source].empty());
+
+    // Ignore failures. These are optional arguments.
+    ParseImageInfo(FLAGS_old_channel,
+                   FLAGS_old_board,
+                   FLAGS_old_version,
+                   FLAGS_old_key,
+                   FLAGS_old_build_channel,
+                   FLAGS_old_build_version,
+                   &payload_config.source.image_info);
 
-  if (FLAGS_minor_version == -1) {
-    // Autodetect minor_version by looking at the update_engine.conf in the old
-    // image.
     if (payload_config.is_delta) {
-      payload_config.version.minor = kInPlaceMinorPayloadVersion;
-      brillo::KeyValueStore store;
-      uint32_t minor_version;
-      for (const PartitionConfig& part : payload_config.source.partitions) {
-        if (part.fs_interface && part.fs_interface->LoadSettings(&store) &&
-            utils::GetMinorVersion(store, &minor_version)) {
-          payload_config.version.minor = minor_version;
-          break;
+      // Avoid opening the filesystem interface for full payloads.
+      if (source == 0) {
+        for (PartitionConfig& part : payload_config.target.partitions)
+          CHECK(part.OpenFilesystem());
+      }
+      for (PartitionConfig& part : payload_config.source.partitions)
+        CHECK(part.OpenFilesystem());
+    }
+
+    if (FLAGS_minor_version == -1) {
+      // Autodetect minor_version by looking at the update_engine.conf in the
+      // old image.
+      if (payload_config.is_delta) {
+        payload_config.version.minor = kInPlaceMinorPayloadVersion;
+        brillo::KeyValueStore store;
+        uint32_t minor_version;
+        for (const PartitionConfig& part : payload_config.source.partitions) {
+          if (part.fs_interface && part.fs_interface->LoadSettings(&store) &&
+              utils::GetMinorVersion(store, &minor_version)) {
+            payload_config.version.minor = minor_version;
+            break;
+          }
         }
+      } else {
+        payload_config.version.minor = kFullPayloadMinorVersion;
       }
+      LOG(INFO) << "Auto-detected minor_version="
+                << payload_config.version.minor;
     } else {
-      payload_config.version.minor = kFullPayloadMinorVersion;
+      payload_config.version.minor = FLAGS_minor_version;
+      LOG(INFO) << "Using provided minor_version=" << FLAGS_minor_version;
     }
-    LOG(INFO) << "Auto-detected minor_version=" << payload_config.version.minor;
-  } else {
-    payload_config.version.minor = FLAGS_minor_version;
-    LOG(INFO) << "Using provided minor_version=" << FLAGS_minor_version;
-  }
 
-  payload_config.max_timestamp = FLAGS_max_timestamp;
+    // The minor version may change between sources.
+    if (payload_config.version.minor >= kVerityMinorPayloadVersion) {
+      CHECK(payload_config.target.LoadVerityConfig());
+    } else {
+      for (PartitionConfig& part : payload_config.target.partitions)
+        part.verity = VerityConfig();
+    }
 
-  if (payload_config.version.minor >= kVerityMinorPayloadVersion)
-    CHECK(payload_config.target.LoadVerityConfig());
+    LOG(INFO) << "Generating " << (payload_config.is_delta ? "delta" : "full")
+              << " update to " << out_files[source];
 
-  LOG(INFO) << "Generating " << (payload_config.is_delta ? "delta" : "full")
-            << " update";
+    // From this point, all the options have been parsed.
+    if (!payload_config.Validate()) {
+      LOG(ERROR) << "Invalid options passed. See errors above.";
+      return 1;
+    }
 
-  // From this point, all the options have been parsed.
-  if (!payload_config.Validate()) {
-    LOG(ERROR) << "Invalid options passed. See errors above.";
-    return 1;
-  }
+    // Look at the files of the new partitions only once for all the sources.
+    if (payload_config.is_delta && old_partition_sets.size() > 1) {
+      bool puffdiff_allowed =
+          payload_config.version.OperationAllowed(InstallOperation::PUFFDIFF);
+      for (PartitionConfig& part : payload_config.target.partitions)
+        CHECK(part.PreprocessFiles(puffdiff_allowed));
+    }
 
-  uint64_t metadata_size;
-  if (!GenerateUpdatePayloadFile(
-          payload_config, FLAGS_out_file, FLAGS_private_key, &metadata_size)) {
-    return 1;
-  }
-  if (!FLAGS_out_metadata_size_file.empty()) {
-    string metadata_size_string = std::to_string(metadata_size);
-    CHECK(utils::WriteFile(FLAGS_out_metadata_size_file.c_str(),
-                           metadata_size_string.data(),
-                           metadata_size_string.size()));
+    uint64_t metadata_size;
+    if (!GenerateUpdatePayloadFile(payload_config,
+                                   out_files[source],
+                                   FLAGS_private_key,
+                                   &metadata_size)) {
+      return 1;
+    }
+    if (!FLAGS_out_metadata_size_file.empty()) {
+      string metadata_size_string = std::to_string(metadata_size);
+      CHECK(utils::WriteFile(FLAGS_out_metadata_size_file.c_str(),
+                             metadata_size_string.data(),
+                             metadata_size_string.size()));
+    }
   }
+
   return 0;
 }
 
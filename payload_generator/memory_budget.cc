@@ -0,0 +1,208 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/memory_budget.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+#include <base/sys_info.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Returns the peak resident memory of the process in bytes, or 0 if unknown.
+uint64_t GetPeakResidentMemory() {
+  string status;
+  if (!utils::ReadFile("/proc/self/status", &status))
+    return 0;
+  for (const string& line : base::SplitString(
+           status, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    if (!base::StartsWith(line, "VmHWM:", base::CompareCase::SENSITIVE))
+      continue;
+    // The line looks like "VmHWM:    123456 kB".
+    std::vector<string> fields = base::SplitString(
+        line, " \t", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    uint64_t kib;
+    if (fields.size() == 3 && base::StringToUint64(fields[1], &kib))
+      return kib * 1024;
+  }
+  return 0;
+}
+
+// Reads the memory limit in the file |name| of the cgroup at |path| in the
+// hierarchy mounted at |root|. In a cgroup namespace the cgroup of the process
+// is the root of the hierarchy, so the file is also looked up there. Returns 0
+// if there is no limit.
+uint64_t ReadCgroupLimit(const base::FilePath& root,
+                         const string& path,
+                         const string& name) {
+  string relative_path;
+  base::TrimString(path, "/", &relative_path);
+  std::vector<base::FilePath> dirs;
+  if (!relative_path.empty())
+    dirs.push_back(root.Append(relative_path));
+  dirs.push_back(root);
+  for (const base::FilePath& dir : dirs) {
+    string limit;
+    if (!utils::ReadFile(dir.Append(name).value(), &limit))
+      continue;
+    uint64_t bytes;
+    // cgroup v2 uses "max" when there is no limit.
+    if (base::StringToUint64(
+            base::TrimWhitespaceASCII(limit, base::TRIM_ALL), &bytes)) {
+      return bytes;
+    }
+    return 0;
+  }
+  return 0;
+}
+
+}  // namespace
+
+uint64_t GetUsableMemory() {
+  uint64_t memory = base::SysInfo::AmountOfPhysicalMemory();
+  string proc_cgroup;
+  if (utils::ReadFile("/proc/self/cgroup", &proc_cgroup)) {
+    uint64_t limit =
+        GetCgroupMemoryLimit(base::FilePath("/sys/fs/cgroup"), proc_cgroup);
+    if (limit && limit < memory) {
+      LOG(INFO) << "Using the memory limit of the cgroup, " << limit
+                << " bytes.";
+      memory = limit;
+    }
+  }
+  return memory;
+}
+
+uint64_t GetCgroupMemoryLimit(const base::FilePath& cgroup_root,
+                              const string& proc_cgroup) {
+  // Each line looks like "<hierarchy id>:<controllers>:<path>", with the
+  // cgroup v2 hierarchy as "0::<path>".
+  for (const string& line : base::SplitString(proc_cgroup,
+                                              "\n",
+                                              base::TRIM_WHITESPACE,
+                                              base::SPLIT_WANT_NONEMPTY)) {
+    std::vector<string> fields = base::SplitString(
+        line, ":", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
+    if (fields.size() != 3)
+      continue;
+    uint64_t limit = 0;
+    if (fields[0] == "0" && fields[1].empty()) {
+      limit = ReadCgroupLimit(cgroup_root, fields[2], "memory.max");
+    } else {
+      std::vector<string> controllers = base::SplitString(
+          fields[1], ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+      if (std::find(controllers.begin(), controllers.end(), "memory") !=
+          controllers.end()) {
+        limit = ReadCgroupLimit(
+            cgroup_root.Append("memory"), fields[2], "memory.limit_in_bytes");
+      }
+    }
+    if (limit)
+      return limit;
+  }
+  return 0;
+}
+
+MemoryBudget::ScopedReservation::ScopedReservation(MemoryBudget* budget,
+                                                   uint64_t size)
+    : budget_(budget), size_(size) {
+  if (budget_)
+    budget_->Acquire(size_);
+}
+
+MemoryBudget::ScopedReservation::~ScopedReservation() {
+  if (budget_)
+    budget_->Release(size_);
+}
+
+MemoryBudget::MemoryBudget(uint64_t budget) : budget_(budget) {}
+
+void MemoryBudget::Acquire(uint64_t size) {
+  base::AutoLock auto_lock(lock_);
+  if (budget_ && reserved_ > shared_reserved_ && reserved_ + size > budget_) {
+    waits_++;
+    base::TimeTicks start = base::TimeTicks::Now();
+    while (reserved_ > shared_reserved_ && reserved_ + size > budget_)
+      released_.Wait();
+    wait_time_ += base::TimeTicks::Now() - start;
+  }
+  reserved_ += size;
+  reservations_++;
+  peak_reserved_ = std::max(peak_reserved_, reserved_);
+  largest_reservation_ = std::max(largest_reservation_, size);
+}
+
+void MemoryBudget::Release(uint64_t size) {
+  base::AutoLock auto_lock(lock_);
+  DCHECK_LE(size, reserved_);
+  reserved_ -= size;
+  released_.Broadcast();
+}
+
+void MemoryBudget::AcquireShared(uint64_t size) {
+  base::AutoLock auto_lock(lock_);
+  reserved_ += size;
+  shared_reserved_ += size;
+  reservations_++;
+  peak_reserved_ = std::max(peak_reserved_, reserved_);
+  largest_reservation_ = std::max(largest_reservation_, size);
+}
+
+void MemoryBudget::ReleaseShared(uint64_t size) {
+  base::AutoLock auto_lock(lock_);
+  DCHECK_LE(size, shared_reserved_);
+  reserved_ -= size;
+  shared_reserved_ -= size;
+  released_.Broadcast();
+}
+
+void MemoryBudget::LogStats() {
+  base::AutoLock auto_lock(lock_);
+  LOG(INFO) << "Memory budget of " << budget_ << " bytes: peak reserved "
+            << peak_reserved_ << " bytes, largest of " << reservations_
+            << " reservations " << largest_reservation_ << " bytes, " << waits_
+            << " waited for memory for " << wait_time_.InSecondsF()
+            << " seconds. Peak resident memory " << GetPeakResidentMemory()
+            << " bytes.";
+}
+
+uint64_t MemoryBudget::reserved() {
+  base::AutoLock auto_lock(lock_);
+  return reserved_;
+}
+
+uint64_t MemoryBudget::peak_reserved() {
+  base::AutoLock auto_lock(lock_);
+  return peak_reserved_;
+}
+
+uint64_t MemoryBudget::waits() {
+  base::AutoLock auto_lock(lock_);
+  return waits_;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,115 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_MEMORY_BUDGET_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_MEMORY_BUDGET_H_
+
+#include <string>
+
+#include <base/files/file_path.h>
+#include <base/macros.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+#include <base/time/time.h>
+
+namespace chromeos_update_engine {
+
+// Limits the memory used by the threads generating the operations at the same
+// time. Each task reserves the memory it's estimated to use at its peak before
+// running, and waits while that would take the reservations over the budget.
+// A task estimated to need more than the whole budget runs alone.
+//
+// All the methods can be called from several threads at the same time.
+class MemoryBudget {
+ public:
+  // Reserves memory in the |budget| for as long as it's in scope. A null
+  // |budget| reserves nothing.
+  class ScopedReservation {
+   public:
+    ScopedReservation(MemoryBudget* budget, uint64_t size);
+    ~ScopedReservation();
+
+   private:
+    MemoryBudget* budget_;
+    uint64_t size_;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedReservation);
+  };
+
+  // Creates a budget of |budget| bytes, or with no limit if it is 0, in which
+  // case it only records the statistics.
+  explicit MemoryBudget(uint64_t budget);
+  ~MemoryBudget() = default;
+
+  // Blocks until |size| more bytes fit in the budget, or nothing else is
+  // reserved, and reserves them.
+  void Acquire(uint64_t size);
+
+  // Releases |size| bytes reserved with Acquire().
+  void Release(uint64_t size);
+
+  // Reserves |size| bytes used by data shared by the tasks, such as an index
+  // of the old data, for as long as it is kept. This never waits, and while
+  // only shared data is reserved a task over the budget still runs alone.
+  void AcquireShared(uint64_t size);
+
+  // Releases |size| bytes reserved with AcquireShared().
+  void ReleaseShared(uint64_t size);
+
+  // Logs the peak of the reservations, the time tasks waited for memory and
+  // the peak resident memory of the process.
+  void LogStats();
+
+  uint64_t reserved();
+  uint64_t peak_reserved();
+  uint64_t waits();
+
+ private:
+  const uint64_t budget_;
+
+  // Protects all the members below.
+  base::Lock lock_;
+  // Signaled when memory is released.
+  base::ConditionVariable released_{&lock_};
+
+  uint64_t reserved_{0};
+  // The part of |reserved_| reserved with AcquireShared().
+  uint64_t shared_reserved_{0};
+  uint64_t peak_reserved_{0};
+  // The biggest single reservation.
+  uint64_t largest_reservation_{0};
+  uint64_t reservations_{0};
+  // The number of reservations that had to wait, and how long they waited.
+  uint64_t waits_{0};
+  base::TimeDelta wait_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryBudget);
+};
+
+// Returns the memory the process can use: the physical memory, or the memory
+// limit of its cgroup if lower.
+uint64_t GetUsableMemory();
+
+// Returns the memory limit of the cgroup listed in |proc_cgroup|, the contents
+// of /proc/<pid>/cgroup, with the cgroup filesystem mounted at |cgroup_root|.
+// Both the cgroup v2 memory.max and the cgroup v1 memory.limit_in_bytes are
+// used. Returns 0 if there is no limit or it can't be read.
+uint64_t GetCgroupMemoryLimit(const base::FilePath& cgroup_root,
+                              const std::string& proc_cgroup);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_MEMORY_BUDGET_H_
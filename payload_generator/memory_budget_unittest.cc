@@ -0,0 +1,152 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/memory_budget.h"
+
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <base/threading/platform_thread.h>
+#include <base/threading/simple_thread.h>
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Reserves memory from another thread.
+class ReservingDelegate : public base::DelegateSimpleThread::Delegate {
+ public:
+  ReservingDelegate(MemoryBudget* budget, uint64_t size)
+      : budget_(budget), size_(size) {}
+
+  void Run() override { budget_->Acquire(size_); }
+
+ private:
+  MemoryBudget* budget_;
+  uint64_t size_;
+};
+
+}  // namespace
+
+class MemoryBudgetTest : public ::testing::Test {};
+
+TEST_F(MemoryBudgetTest, UnlimitedBudgetTest) {
+  MemoryBudget budget(0);
+  budget.Acquire(1000);
+  budget.Acquire(1000);
+  EXPECT_EQ(2000u, budget.reserved());
+  EXPECT_EQ(0u, budget.waits());
+  budget.Release(2000);
+  EXPECT_EQ(0u, budget.reserved());
+  EXPECT_EQ(2000u, budget.peak_reserved());
+}
+
+TEST_F(MemoryBudgetTest, ScopedReservationTest) {
+  MemoryBudget budget(100);
+  {
+    MemoryBudget::ScopedReservation reservation(&budget, 60);
+    EXPECT_EQ(60u, budget.reserved());
+  }
+  EXPECT_EQ(0u, budget.reserved());
+  // A null budget reserves nothing.
+  MemoryBudget::ScopedReservation reservation(nullptr, 60);
+}
+
+TEST_F(MemoryBudgetTest, OversizedReservationRunsAloneTest) {
+  MemoryBudget budget(100);
+  budget.Acquire(200);
+  EXPECT_EQ(200u, budget.reserved());
+  EXPECT_EQ(0u, budget.waits());
+  budget.Release(200);
+}
+
+TEST_F(MemoryBudgetTest, WaitForReleaseTest) {
+  MemoryBudget budget(100);
+  budget.Acquire(60);
+
+  ReservingDelegate delegate(&budget, 60);
+  base::DelegateSimpleThread thread(&delegate, "reserving-thread");
+  thread.Start();
+  while (budget.waits() == 0)
+    base::PlatformThread::YieldCurrentThread();
+  // The second reservation doesn't fit until the first one is released.
+  EXPECT_EQ(60u, budget.reserved());
+
+  budget.Release(60);
+  thread.Join();
+  EXPECT_EQ(60u, budget.reserved());
+  EXPECT_EQ(60u, budget.peak_reserved());
+  budget.Release(60);
+}
+
+TEST_F(MemoryBudgetTest, SharedReservationTest) {
+  MemoryBudget budget(100);
+  budget.AcquireShared(80);
+  // A task over the budget with only shared data reserved runs alone.
+  budget.Acquire(60);
+  EXPECT_EQ(140u, budget.reserved());
+  EXPECT_EQ(0u, budget.waits());
+
+  ReservingDelegate delegate(&budget, 10);
+  base::DelegateSimpleThread thread(&delegate, "reserving-thread");
+  thread.Start();
+  while (budget.waits() == 0)
+    base::PlatformThread::YieldCurrentThread();
+  // The next task waits for the first one, not for the shared data.
+  budget.Release(60);
+  thread.Join();
+  EXPECT_EQ(90u, budget.reserved());
+  budget.Release(10);
+  budget.ReleaseShared(80);
+  EXPECT_EQ(0u, budget.reserved());
+  EXPECT_EQ(140u, budget.peak_reserved());
+}
+
+TEST_F(MemoryBudgetTest, CgroupV2MemoryLimitTest) {
+  base::ScopedTempDir cgroup_root;
+  ASSERT_TRUE(cgroup_root.CreateUniqueTempDir());
+  base::FilePath cgroup_dir = cgroup_root.GetPath().Append("user.slice/job");
+  ASSERT_TRUE(base::CreateDirectory(cgroup_dir));
+  const char kProcCgroup[] = "0::/user.slice/job\n";
+
+  ASSERT_EQ(4, base::WriteFile(cgroup_dir.Append("memory.max"), "max\n", 4));
+  EXPECT_EQ(0u, GetCgroupMemoryLimit(cgroup_root.GetPath(), kProcCgroup));
+  ASSERT_EQ(11,
+            base::WriteFile(
+                cgroup_dir.Append("memory.max"), "1073741824\n", 11));
+  EXPECT_EQ(1073741824u,
+            GetCgroupMemoryLimit(cgroup_root.GetPath(), kProcCgroup));
+}
+
+TEST_F(MemoryBudgetTest, CgroupV1MemoryLimitTest) {
+  base::ScopedTempDir cgroup_root;
+  ASSERT_TRUE(cgroup_root.CreateUniqueTempDir());
+  // In a cgroup namespace, the cgroup of the process is the root one.
+  base::FilePath memory_dir = cgroup_root.GetPath().Append("memory");
+  ASSERT_TRUE(base::CreateDirectory(memory_dir));
+  ASSERT_EQ(9,
+            base::WriteFile(
+                memory_dir.Append("memory.limit_in_bytes"), "536870912", 9));
+  EXPECT_EQ(536870912u,
+            GetCgroupMemoryLimit(cgroup_root.GetPath(),
+                                 "5:cpu,cpuacct:/docker/abc\n"
+                                 "4:memory:/docker/abc\n"));
+  // No memory controller.
+  EXPECT_EQ(0u,
+            GetCgroupMemoryLimit(cgroup_root.GetPath(), "5:cpu:/docker/abc\n"));
+}
+
+}  // namespace chromeos_update_engine
@@ -17,6 +17,10 @@
 #include "update_engine/payload_generator/payload_file.h"
 
 #include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <map>
@@ -28,6 +32,7 @@
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/file_writer.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_hash_tree.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/payload_signer.h"
@@ -50,6 +55,9 @@ struct DeltaObject {
   off_t size;
 };
 
+// The most bytes copied by one copy_file_range() call.
+const uint64_t kMaxCopyLength = 1 << 30;
+
 // Writes the uint64_t passed in in host-endian to the file as big-endian.
 // Returns true on success.
 bool WriteUint64AsBigEndian(FileWriter* writer, const uint64_t value) {
@@ -112,12 +120,10 @@ bool PayloadFile::WritePayload(const string& payload_file,
                                const string& data_blobs_path,
                                const string& private_key_path,
                                uint64_t* metadata_size_out) {
-  // Reorder the data blobs with the manifest_.
-  string ordered_blobs_path;
-  TEST_AND_RETURN_FALSE(utils::MakeTempFile(
-      "CrAU_temp_data.ordered.XXXXXX", &ordered_blobs_path, nullptr));
-  ScopedPathUnlinker ordered_blobs_unlinker(ordered_blobs_path);
-  TEST_AND_RETURN_FALSE(ReorderDataBlobs(data_blobs_path, ordered_blobs_path));
+  // Order the data blobs with the manifest_. They are copied to the payload
+  // from where they are in |data_blobs_path|.
+  vector<BlobRange> blob_ranges;
+  TEST_AND_RETURN_FALSE(OrderDataBlobs(data_blobs_path, &blob_ranges));
 
   // Check that install op blobs are in order.
   uint64_t next_blob_offset = 0;
@@ -263,19 +269,8 @@ bool PayloadFile::WritePayload(const string& payload_file,
 
   // Append the data blobs
   LOG(INFO) << "Writing final delta file data blobs...";
-  int blobs_fd = open(ordered_blobs_path.c_str(), O_RDONLY, 0);
-  ScopedFdCloser blobs_fd_closer(&blobs_fd);
-  TEST_AND_RETURN_FALSE(blobs_fd >= 0);
-  for (;;) {
-    vector<char> buf(1024 * 1024);
-    ssize_t rc = read(blobs_fd, buf.data(), buf.size());
-    if (0 == rc) {
-      // EOF
-      break;
-    }
-    TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
-    TEST_AND_RETURN_FALSE_ERRNO(writer.Write(buf.data(), rc));
-  }
+  TEST_AND_RETURN_FALSE(
+      CopyDataBlobs(data_blobs_path, blob_ranges, writer.fd()));
 
   // Write payload signature blob.
   if (!private_key_path.empty()) {
@@ -297,22 +292,15 @@ bool PayloadFile::WritePayload(const string& payload_file,
   return true;
 }
 
-bool PayloadFile::ReorderDataBlobs(const string& data_blobs_path,
-                                   const string& new_data_blobs_path) {
+bool PayloadFile::OrderDataBlobs(const string& data_blobs_path,
+                                 vector<BlobRange>* blob_ranges) {
   int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
   TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
   ScopedFdCloser in_fd_closer(&in_fd);
 
-  DirectFileWriter writer;
-  int rc = writer.Open(
-      new_data_blobs_path.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0644);
-  if (rc != 0) {
-    PLOG(ERROR) << "Error creating " << new_data_blobs_path;
-    return false;
-  }
-  ScopedFileWriterCloser writer_closer(&writer);
+  blob_ranges->clear();
   uint64_t out_file_size = 0;
-
+  PayloadHashTreeBuilder hash_tree_builder(kPayloadHashTreeChunkSize);
   for (auto& part : part_vec_) {
     for (AnnotatedOperation& aop : part.aops) {
       if (!aop.op.has_data_offset())
@@ -324,12 +312,72 @@ bool PayloadFile::ReorderDataBlobs(const string& data_blobs_path,
 
       // Add the hash of the data blobs for this operation
       TEST_AND_RETURN_FALSE(AddOperationHash(&aop.op, buf));
+      TEST_AND_RETURN_FALSE(hash_tree_builder.Update(buf.data(), buf.size()));
 
+      blob_ranges->push_back({aop.op.data_offset(), aop.op.data_length()});
       aop.op.set_data_offset(out_file_size);
-      TEST_AND_RETURN_FALSE_ERRNO(writer.Write(buf.data(), buf.size()));
       out_file_size += buf.size();
     }
   }
+
+  // The hash tree can only be trusted when the manifest is signed, which
+  // requires the metadata signature of the major version 2.
+  manifest_.clear_payload_hash_tree();
+  if (major_version_ == kBrilloMajorPayloadVersion) {
+    TEST_AND_RETURN_FALSE(
+        hash_tree_builder.Finalize(manifest_.mutable_payload_hash_tree()));
+  }
+  return true;
+}
+
+bool PayloadFile::CopyDataBlobs(const string& data_blobs_path,
+                                const vector<BlobRange>& blob_ranges,
+                                int out_fd) {
+  int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
+  ScopedFdCloser in_fd_closer(&in_fd);
+
+  // copy_file_range() copies the data within the kernel, or even shares it on
+  // filesystems that support it. Fall back to reading and writing it if the
+  // kernel, the filesystems or the sandbox don't allow it.
+  bool copy_file_range_supported = true;
+  vector<char> buf;
+  for (const BlobRange& range : blob_ranges) {
+    uint64_t offset = range.offset;
+    uint64_t end = range.offset + range.length;
+    while (offset < end) {
+      ssize_t rc = -1;
+#ifdef __NR_copy_file_range
+      if (copy_file_range_supported) {
+        off64_t in_offset = offset;
+        size_t length = std::min(end - offset, kMaxCopyLength);
+        rc = HANDLE_EINTR(syscall(__NR_copy_file_range,
+                                  in_fd,
+                                  &in_offset,
+                                  out_fd,
+                                  nullptr,
+                                  length,
+                                  0));
+        // ENOTSUP may differ from EOPNOTSUPP, and EPERM is returned by some
+        // seccomp policies and filesystems.
+        if (rc < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                       errno == EOPNOTSUPP || errno == ENOTSUP ||
+                       errno == EPERM)) {
+          copy_file_range_supported = false;
+        } else {
+          TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
+        }
+      }
+#endif  // __NR_copy_file_range
+      if (rc < 0) {
+        buf.resize(std::min(end - offset, static_cast<uint64_t>(1024 * 1024)));
+        rc = pread(in_fd, buf.data(), buf.size(), offset);
+        TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
+        TEST_AND_RETURN_FALSE(utils::WriteAll(out_fd, buf.data(), rc));
+      }
+      offset += rc;
+    }
+  }
   return true;
 }
 
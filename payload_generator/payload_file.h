@@ -46,8 +46,8 @@ class PayloadFile {
                     const std::vector<AnnotatedOperation>& aops);
 
   // Write the payload to the |payload_file| file. The operations reference
-  // blobs in the |data_blobs_path| file and the blobs will be reordered in the
-  // payload file to match the order of the operations. The size of the metadata
+  // blobs in the |data_blobs_path| file and the blobs will be copied in the
+  // payload file in the order of the operations. The size of the metadata
   // section of the payload is stored in |metadata_size_out|.
   bool WritePayload(const std::string& payload_file,
                     const std::string& data_blobs_path,
@@ -55,7 +55,14 @@ class PayloadFile {
                     uint64_t* metadata_size_out);
 
  private:
-  FRIEND_TEST(PayloadFileTest, ReorderBlobsTest);
+  FRIEND_TEST(PayloadFileTest, OrderBlobsTest);
+  FRIEND_TEST(PayloadFileTest, CopyBlobsTest);
+
+  // The location of a data blob in the data blobs file.
+  struct BlobRange {
+    uint64_t offset;
+    uint64_t length;
+  };
 
   // Computes a SHA256 hash of the given buf and sets the hash value in the
   // operation so that update_engine could verify. This hash should be set
@@ -66,14 +73,23 @@ class PayloadFile {
   static bool AddOperationHash(InstallOperation* op, const brillo::Blob& buf);
 
   // Install operations in the manifest may reference data blobs, which
-  // are in data_blobs_path. This function creates a new data blobs file
-  // with the data blobs in the same order as the referencing install
-  // operations in the manifest. E.g. if manifest[0] has a data blob
-  // "X" at offset 1, manifest[1] has a data blob "Y" at offset 0,
-  // and data_blobs_path's file contains "YX", new_data_blobs_path
-  // will set to be a file that contains "XY".
-  bool ReorderDataBlobs(const std::string& data_blobs_path,
-                        const std::string& new_data_blobs_path);
+  // are in data_blobs_path. This function sets the offsets of the data blobs
+  // to place them in the payload in the same order as the referencing install
+  // operations in the manifest, and their hashes. The ranges of the blobs in
+  // data_blobs_path are stored in |blob_ranges| in that order. E.g. if
+  // manifest[0] has a data blob "X" at offset 1, manifest[1] has a data blob
+  // "Y" at offset 0, and data_blobs_path's file contains "YX", the offsets
+  // become 0 and 1 and |blob_ranges| is {1, 1}, {0, 1}. The hash tree of the
+  // ordered data blobs is also set in the manifest.
+  bool OrderDataBlobs(const std::string& data_blobs_path,
+                      std::vector<BlobRange>* blob_ranges);
+
+  // Copies the |blob_ranges| of data_blobs_path in order to the current
+  // position of |out_fd|, without going through a copy of the reordered data
+  // blobs.
+  static bool CopyDataBlobs(const std::string& data_blobs_path,
+                            const std::vector<BlobRange>& blob_ranges,
+                            int out_fd);
 
   // Print in stderr the Payload usage report.
   void ReportPayloadUsage(uint64_t metadata_size) const;
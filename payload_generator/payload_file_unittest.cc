@@ -16,13 +16,17 @@
 
 #include "update_engine/payload_generator/payload_file.h"
 
+#include <fcntl.h>
+
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <gtest/gtest.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/test_utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 
 using std::string;
@@ -35,8 +39,8 @@ class PayloadFileTest : public ::testing::Test {
   PayloadFile payload_;
 };
 
-TEST_F(PayloadFileTest, ReorderBlobsTest) {
-  test_utils::ScopedTempFile orig_blobs("ReorderBlobsTest.orig.XXXXXX");
+TEST_F(PayloadFileTest, OrderBlobsTest) {
+  test_utils::ScopedTempFile orig_blobs("OrderBlobsTest.orig.XXXXXX");
 
   // The operations have three blob and one gap (the whitespace):
   // Rootfs operation 1: [8, 3] bcd
@@ -45,8 +49,6 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   string orig_data = "kernel abcd";
   EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), orig_data));
 
-  test_utils::ScopedTempFile new_blobs("ReorderBlobsTest.new.XXXXXX");
-
   payload_.part_vec_.resize(2);
 
   vector<AnnotatedOperation> aops;
@@ -64,24 +66,58 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   aop.op.set_data_length(6);
   payload_.part_vec_[1].aops = {aop};
 
-  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs.path(), new_blobs.path()));
+  payload_.major_version_ = kBrilloMajorPayloadVersion;
+  vector<PayloadFile::BlobRange> blob_ranges;
+  EXPECT_TRUE(payload_.OrderDataBlobs(orig_blobs.path(), &blob_ranges));
 
   const vector<AnnotatedOperation>& part0_aops = payload_.part_vec_[0].aops;
   const vector<AnnotatedOperation>& part1_aops = payload_.part_vec_[1].aops;
-  string new_data;
-  EXPECT_TRUE(utils::ReadFile(new_blobs.path(), &new_data));
   // Kernel blobs should appear at the end.
-  EXPECT_EQ("bcdakernel", new_data);
+  ASSERT_EQ(3U, blob_ranges.size());
+  EXPECT_EQ(8U, blob_ranges[0].offset);
+  EXPECT_EQ(3U, blob_ranges[0].length);
+  EXPECT_EQ(7U, blob_ranges[1].offset);
+  EXPECT_EQ(1U, blob_ranges[1].length);
+  EXPECT_EQ(0U, blob_ranges[2].offset);
+  EXPECT_EQ(6U, blob_ranges[2].length);
 
   EXPECT_EQ(2U, part0_aops.size());
   EXPECT_EQ(0U, part0_aops[0].op.data_offset());
   EXPECT_EQ(3U, part0_aops[0].op.data_length());
   EXPECT_EQ(3U, part0_aops[1].op.data_offset());
   EXPECT_EQ(1U, part0_aops[1].op.data_length());
+  EXPECT_TRUE(part0_aops[1].op.has_data_sha256_hash());
 
   EXPECT_EQ(1U, part1_aops.size());
   EXPECT_EQ(4U, part1_aops[0].op.data_offset());
   EXPECT_EQ(6U, part1_aops[0].op.data_length());
+
+  // The hash tree covers the ordered blobs.
+  const PayloadHashTree& tree = payload_.manifest_.payload_hash_tree();
+  EXPECT_EQ(10U, tree.data_size());
+  ASSERT_EQ(1, tree.chunk_hashes_size());
+  brillo::Blob hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfBytes("bcdakernel", 10, &hash));
+  EXPECT_EQ(string(hash.begin(), hash.end()), tree.chunk_hashes(0));
+}
+
+TEST_F(PayloadFileTest, CopyBlobsTest) {
+  test_utils::ScopedTempFile orig_blobs("CopyBlobsTest.orig.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), "kernel abcd"));
+
+  test_utils::ScopedTempFile new_blobs("CopyBlobsTest.new.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(new_blobs.path(), "header"));
+  int fd = open(new_blobs.path().c_str(), O_WRONLY);
+  ASSERT_GE(fd, 0);
+  ScopedFdCloser fd_closer(&fd);
+  ASSERT_EQ(6, lseek(fd, 0, SEEK_END));
+
+  EXPECT_TRUE(PayloadFile::CopyDataBlobs(
+      orig_blobs.path(), {{8, 3}, {7, 1}, {0, 6}}, fd));
+
+  string new_data;
+  EXPECT_TRUE(utils::ReadFile(new_blobs.path(), &new_data));
+  EXPECT_EQ("headerbcdakernel", new_data);
 }
 
 }  // namespace chromeos_update_engine
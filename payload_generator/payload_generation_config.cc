@@ -27,6 +27,7 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_generator/boot_img_filesystem.h"
+#include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/ext2_filesystem.h"
@@ -62,6 +63,7 @@ bool PartitionConfig::OpenFilesystem() {
   if (path.empty())
     return true;
   fs_interface.reset();
+  files_preprocessed = false;
   if (diff_utils::IsExtFilesystem(path)) {
     fs_interface = Ext2Filesystem::CreateFromFile(path);
     // TODO(deymo): The delta generator algorithm doesn't support a block size
@@ -93,6 +95,19 @@ bool PartitionConfig::OpenFilesystem() {
   return true;
 }
 
+bool PartitionConfig::PreprocessFiles(bool extract_deflates) {
+  if (files_preprocessed && files_have_deflates == extract_deflates)
+    return true;
+  TEST_AND_RETURN_FALSE(fs_interface);
+  files.clear();
+  files_preprocessed = false;
+  TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
+      *this, &files, extract_deflates));
+  files_preprocessed = true;
+  files_have_deflates = extract_deflates;
+  return true;
+}
+
 bool ImageConfig::ValidateIsEmpty() const {
   TEST_AND_RETURN_FALSE(ImageInfoIsEmpty());
   return partitions.empty();
@@ -91,6 +91,12 @@ struct PartitionConfig {
   // |fs_interface|. Returns whether opening the filesystem worked.
   bool OpenFilesystem();
 
+  // Stores in |files| the files of |fs_interface| preprocessed by
+  // deflate_utils::PreprocessPartitionFiles(), unless they are already there
+  // with the same |extract_deflates|. This lets the payloads generated from
+  // several sources to this partition look at its files only once.
+  bool PreprocessFiles(bool extract_deflates);
+
   // The path to the partition file. This can be a regular file or a block
   // device such as a loop device.
   std::string path;
@@ -112,6 +118,12 @@ struct PartitionConfig {
   // files.
   std::unique_ptr<FilesystemInterface> fs_interface;
 
+  // The files preprocessed by PreprocessFiles(), if |files_preprocessed|, and
+  // whether their deflates were extracted.
+  std::vector<FilesystemInterface::File> files;
+  bool files_preprocessed = false;
+  bool files_have_deflates = false;
+
   std::string name;
 
   PostInstallConfig postinstall;
@@ -231,6 +243,24 @@ struct PayloadGenerationConfig {
 
   // The maximum timestamp of the OS allowed to apply this payload.
   int64_t max_timestamp = 0;
+
+  // Whether to only run the compressors predicted to produce the smallest
+  // blob for the full operations. See CompressorSelector.
+  bool select_compressors = false;
+
+  // The time in seconds each partition can spend running the compressors
+  // predicted to lose, or a negative value for no limit. It is the sum of the
+  // durations of these runs over all the threads, and doesn't include the
+  // other compressions.
+  double speculative_compression_budget = -1;
+
+  // Whether to also run the skipped compressors to measure what skipping them
+  // cost.
+  bool audit_compressor_selection = false;
+
+  // The memory in bytes the threads generating the delta operations are
+  // estimated to use at once, or 0 for no limit. See MemoryBudget.
+  uint64_t memory_budget = 0;
 };
 
 }  // namespace chromeos_update_engine
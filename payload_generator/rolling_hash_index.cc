@@ -0,0 +1,234 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/rolling_hash_index.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <map>
+#include <utility>
+
+#include <base/logging.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The number of low bits of the checksums in the lookup filter.
+const uint32_t kFilterBits = 20;
+
+// Blocks repeated more than this many times, like padding, are only indexed
+// this many times.
+const size_t kMaxBlocksPerChecksum = 16;
+
+// The most voted offsets used as the source, and the votes each of them needs.
+const size_t kMaxSourceRegions = 4;
+const uint64_t kMinVotes = 2;
+
+// The old data before and after the matching blocks of a region also used as
+// the source, for the data around them which changed.
+const uint64_t kSourceMargin = 64 * 1024;  // bytes
+
+// The size of the reads of the indexed data.
+const size_t kReadSize = 1024 * 1024;
+
+// The memory used by each indexed block: its node and bucket in the hash map
+// with the allocation of its positions.
+const uint64_t kMemoryPerBlock = 96;
+
+// The two sums of the rsync checksum of a window of |kBlockSize| bytes: |a| is
+// the sum of the bytes and |b| the sum of the bytes weighted by their distance
+// to the end of the window, both modulo 2^16.
+struct Checksum {
+  uint32_t a = 0;
+  uint32_t b = 0;
+
+  explicit Checksum(const uint8_t* data) {
+    for (size_t i = 0; i < kBlockSize; i++) {
+      a += data[i];
+      b += (kBlockSize - i) * data[i];
+    }
+  }
+
+  // Moves the window one byte, removing |out| and adding |in|.
+  void Roll(uint8_t out, uint8_t in) {
+    a += in - out;
+    b += a - kBlockSize * out;
+  }
+
+  uint32_t value() const { return (b << 16) | (a & 0xffff); }
+};
+
+// The new data matching the indexed data at the same offset.
+struct Region {
+  uint64_t votes = 0;
+  // The offsets in the new data of the first and last matching windows.
+  uint64_t first = 0;
+  uint64_t last = 0;
+};
+
+}  // namespace
+
+uint64_t RollingHashIndex::EstimateMemory(const vector<Extent>& extents) {
+  return utils::BlocksInExtents(extents) * kMemoryPerBlock +
+         extents.size() * sizeof(Extent) + (1 << kFilterBits) / 8 + kReadSize;
+}
+
+bool RollingHashIndex::Init(const string& part_path,
+                            const vector<Extent>& extents) {
+  extents_ = extents;
+  num_blocks_ = 0;
+  blocks_.clear();
+  filter_.assign(1 << kFilterBits, false);
+
+  int fd = HANDLE_EINTR(open(part_path.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+
+  brillo::Blob buffer(kReadSize);
+  for (const Extent& extent : extents_) {
+    uint64_t offset = extent.start_block() * kBlockSize;
+    uint64_t end = offset + extent.num_blocks() * kBlockSize;
+    while (offset < end) {
+      size_t size = std::min(static_cast<uint64_t>(kReadSize), end - offset);
+      ssize_t bytes_read;
+      TEST_AND_RETURN_FALSE(
+          utils::PReadAll(fd, buffer.data(), size, offset, &bytes_read));
+      TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size));
+      for (size_t i = 0; i < size; i += kBlockSize, num_blocks_++) {
+        const uint8_t* block = buffer.data() + i;
+        // Zeroed blocks are handled by DeltaMovedAndZeroBlocks().
+        if (std::all_of(
+                block, block + kBlockSize, [](uint8_t x) { return x == 0; }))
+          continue;
+        uint32_t checksum = Checksum(block).value();
+        vector<uint64_t>& positions = blocks_[checksum];
+        if (positions.size() < kMaxBlocksPerChecksum)
+          positions.push_back(num_blocks_);
+        filter_[checksum & ((1 << kFilterBits) - 1)] = true;
+      }
+      offset += size;
+    }
+  }
+  return true;
+}
+
+bool RollingHashIndex::FindSourceExtents(const string& part_path,
+                                         const vector<Extent>& extents,
+                                         vector<Extent>* source_extents) const {
+  source_extents->clear();
+  if (blocks_.empty())
+    return true;
+
+  brillo::Blob data;
+  uint64_t size = utils::BlocksInExtents(extents) * kBlockSize;
+  TEST_AND_RETURN_FALSE(
+      utils::ReadExtents(part_path, extents, &data, size, kBlockSize));
+  if (size < kBlockSize)
+    return true;
+
+  // The regions keyed by the offset of the new data in the indexed data.
+  std::map<int64_t, Region> regions;
+  uint64_t pos = 0;
+  Checksum checksum(data.data());
+  while (true) {
+    uint32_t value = checksum.value();
+    auto positions = filter_[value & ((1 << kFilterBits) - 1)]
+                         ? blocks_.find(value)
+                         : blocks_.end();
+    if (positions != blocks_.end()) {
+      for (uint64_t block : positions->second) {
+        int64_t delta = static_cast<int64_t>(block * kBlockSize) -
+                        static_cast<int64_t>(pos);
+        Region& region = regions[delta];
+        if (region.votes++ == 0)
+          region.first = pos;
+        region.last = pos;
+      }
+      // Like rsync, continue after the matching window.
+      pos += kBlockSize;
+      if (pos + kBlockSize > size)
+        break;
+      checksum = Checksum(data.data() + pos);
+      continue;
+    }
+    if (pos + kBlockSize >= size)
+      break;
+    checksum.Roll(data[pos], data[pos + kBlockSize]);
+    pos++;
+  }
+
+  // Use the indexed data around the most voted regions.
+  vector<std::pair<int64_t, Region>> sorted_regions(regions.begin(),
+                                                    regions.end());
+  std::stable_sort(sorted_regions.begin(),
+                   sorted_regions.end(),
+                   [](const std::pair<int64_t, Region>& a,
+                      const std::pair<int64_t, Region>& b) {
+                     return a.second.votes > b.second.votes;
+                   });
+  int64_t indexed_size = num_blocks_ * kBlockSize;
+  // The ranges of indexed blocks to use, as [start, end) pairs.
+  vector<std::pair<uint64_t, uint64_t>> ranges;
+  for (const auto& delta_region : sorted_regions) {
+    const Region& region = delta_region.second;
+    if (ranges.size() == kMaxSourceRegions || region.votes < kMinVotes)
+      break;
+    int64_t start = delta_region.first + static_cast<int64_t>(region.first) -
+                    static_cast<int64_t>(kSourceMargin);
+    int64_t end = delta_region.first + static_cast<int64_t>(region.last) +
+                  static_cast<int64_t>(kBlockSize + kSourceMargin);
+    start = std::max(start, static_cast<int64_t>(0));
+    end = std::min(end, indexed_size);
+    if (start >= end)
+      continue;
+    ranges.emplace_back(start / kBlockSize,
+                        (end + kBlockSize - 1) / kBlockSize);
+  }
+  if (ranges.empty())
+    return true;
+
+  // Merge the overlapping ranges.
+  std::sort(ranges.begin(), ranges.end());
+  vector<std::pair<uint64_t, uint64_t>> merged_ranges = {ranges[0]};
+  for (const auto& range : ranges) {
+    if (range.first <= merged_ranges.back().second) {
+      merged_ranges.back().second =
+          std::max(merged_ranges.back().second, range.second);
+    } else {
+      merged_ranges.push_back(range);
+    }
+  }
+  for (const auto& range : merged_ranges) {
+    vector<Extent> range_extents =
+        ExtentsSublist(extents_, range.first, range.second - range.first);
+    source_extents->insert(
+        source_extents->end(), range_extents.begin(), range_extents.end());
+  }
+  NormalizeExtents(source_extents);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,78 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_ROLLING_HASH_INDEX_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_ROLLING_HASH_INDEX_H_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Finds where the data of a new chunk of raw data, such as the blocks not in
+// any file or a raw partition, comes from in the old partition, even when it
+// moved by a number of bytes that isn't a multiple of the block size.
+//
+// Like rsync, the old data is indexed by a weak checksum of each of its
+// blocks, and the checksum of the window of one block at every byte offset of
+// the new data is rolled and looked up in the index. Each match votes for the
+// offset between the old and the new data, and the old data around the most
+// voted offsets is used as the source of the diff, instead of diffing against
+// the whole old data or the old data at the same position.
+class RollingHashIndex {
+ public:
+  RollingHashIndex() = default;
+  ~RollingHashIndex() = default;
+
+  // Returns an upper bound of the memory used to index the blocks |extents|,
+  // including while Init() reads them.
+  static uint64_t EstimateMemory(const std::vector<Extent>& extents);
+
+  // Indexes the data in the blocks |extents| of the partition |part_path|.
+  bool Init(const std::string& part_path, const std::vector<Extent>& extents);
+
+  // Looks up the data in the blocks |extents| of the partition |part_path| and
+  // stores in |source_extents| the indexed blocks around the regions matching
+  // it, in the order of the indexed data, or nothing if no region matches.
+  // Returns false if the data can't be read.
+  bool FindSourceExtents(const std::string& part_path,
+                         const std::vector<Extent>& extents,
+                         std::vector<Extent>* source_extents) const;
+
+ private:
+  // The indexed blocks.
+  std::vector<Extent> extents_;
+  uint64_t num_blocks_{0};
+
+  // Maps the checksum of a block to the positions of the blocks with that
+  // checksum in |extents_|.
+  std::unordered_map<uint32_t, std::vector<uint64_t>> blocks_;
+
+  // A bit for each value of the low bits of the indexed checksums, to skip
+  // most of the lookups of checksums not indexed.
+  std::vector<bool> filter_;
+
+  DISALLOW_COPY_AND_ASSIGN(RollingHashIndex);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_ROLLING_HASH_INDEX_H_
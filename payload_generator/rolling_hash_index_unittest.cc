@@ -0,0 +1,89 @@
+//
+// Copyright (C) 2019 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/rolling_hash_index.h"
+
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class RollingHashIndexTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<int> dist(0, 255);
+    old_data_.resize(256 * kBlockSize);
+    for (uint8_t& byte : old_data_)
+      byte = dist(gen);
+    ASSERT_TRUE(test_utils::WriteFileVector(old_part_.path(), old_data_));
+  }
+
+  test_utils::ScopedTempFile old_part_{"RollingHashIndexTest-old.XXXXXX"};
+  test_utils::ScopedTempFile new_part_{"RollingHashIndexTest-new.XXXXXX"};
+  brillo::Blob old_data_;
+  RollingHashIndex index_;
+};
+
+TEST_F(RollingHashIndexTest, FindShiftedDataTest) {
+  ASSERT_TRUE(index_.Init(old_part_.path(), {ExtentForRange(0, 256)}));
+  // 32 blocks of the old data starting 1000 bytes after block 100.
+  auto begin = old_data_.begin() + 100 * kBlockSize + 1000;
+  brillo::Blob new_data(begin, begin + 32 * kBlockSize);
+  ASSERT_TRUE(test_utils::WriteFileVector(new_part_.path(), new_data));
+
+  vector<Extent> source_extents;
+  EXPECT_TRUE(index_.FindSourceExtents(
+      new_part_.path(), {ExtentForRange(0, 32)}, &source_extents));
+  // The blocks of the matching data and the 64 KiB around them.
+  EXPECT_EQ(vector<Extent>{ExtentForRange(85, 63)}, source_extents);
+}
+
+TEST_F(RollingHashIndexTest, SourceInIndexedExtentsTest) {
+  // The indexed data starts with the blocks 200 to 255.
+  ASSERT_TRUE(index_.Init(old_part_.path(),
+                          {ExtentForRange(200, 56), ExtentForRange(0, 200)}));
+  auto begin = old_data_.begin() + 10 * kBlockSize + 1;
+  brillo::Blob new_data(begin, begin + 8 * kBlockSize);
+  ASSERT_TRUE(test_utils::WriteFileVector(new_part_.path(), new_data));
+
+  vector<Extent> source_extents;
+  EXPECT_TRUE(index_.FindSourceExtents(
+      new_part_.path(), {ExtentForRange(0, 8)}, &source_extents));
+  EXPECT_EQ((vector<Extent>{ExtentForRange(251, 5), ExtentForRange(0, 34)}),
+            source_extents);
+}
+
+TEST_F(RollingHashIndexTest, NoMatchTest) {
+  ASSERT_TRUE(index_.Init(old_part_.path(), {ExtentForRange(0, 256)}));
+  brillo::Blob new_data(8 * kBlockSize, 0x5a);
+  ASSERT_TRUE(test_utils::WriteFileVector(new_part_.path(), new_data));
+
+  vector<Extent> source_extents;
+  EXPECT_TRUE(index_.FindSourceExtents(
+      new_part_.path(), {ExtentForRange(0, 8)}, &source_extents));
+  EXPECT_TRUE(source_extents.empty());
+}
+
+}  // namespace chromeos_update_engine
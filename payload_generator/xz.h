@@ -21,12 +21,26 @@
 
 namespace chromeos_update_engine {
 
+// The size of the xz blocks XzCompress() splits the bigger inputs in, so they
+// are compressed on several threads. Three times the dictionary size as xz -T
+// does, so the split barely affects the compression ratio.
+const size_t kXzBlockSize = 24 * 1024 * 1024;
+
+// The maximum number of threads compressing the blocks of a single input.
+const size_t kMaxXzThreads = 4;
+
 // Initialize the xz compression unit. Call once before any call to
 // XzCompress().
 void XzCompressInit();
 
 // Compresses the input buffer |in| into |out| with xz. The compressed stream
-// will be the equivalent of running xz -9 --check=none
+// will be the equivalent of running xz -9 --check=none. Inputs bigger than
+// kXzBlockSize are compressed as independent blocks of the same stream, on up
+// to |max_threads| threads including the calling one. The stream doesn't
+// depend on the number of threads.
+bool XzCompress(const brillo::Blob& in, size_t max_threads, brillo::Blob* out);
+
+// Same as above, on the calling thread only.
 bool XzCompress(const brillo::Blob& in, brillo::Blob* out);
 
 }  // namespace chromeos_update_engine
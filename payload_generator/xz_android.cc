@@ -20,31 +20,46 @@
 #include <endian.h>
 
 #include <algorithm>
+#include <list>
+#include <vector>
 
 #include <7zCrc.h>
 #include <Xz.h>
 #include <XzEnc.h>
 #include <base/logging.h>
+#include <base/threading/simple_thread.h>
+
+#include "update_engine/common/utils.h"
+
+using std::list;
+using std::vector;
 
 namespace {
 
 bool xz_initialized = false;
 
-// An ISeqInStream implementation that reads all the data from the passed Blob.
+// The sizes of the xz stream header and footer.
+const size_t kXzStreamHeaderSize = 12;
+const size_t kXzStreamFooterSize = 12;
+
+// An ISeqInStream implementation that reads all the data from the passed
+// buffer.
 struct BlobReaderStream : public ISeqInStream {
-  explicit BlobReaderStream(const brillo::Blob& data) : data_(data) {
+  BlobReaderStream(const uint8_t* data, size_t size)
+      : data_(data), size_(size) {
     Read = &BlobReaderStream::ReadStatic;
   }
 
   static SRes ReadStatic(const ISeqInStream* p, void* buf, size_t* size) {
     auto* self = static_cast<BlobReaderStream*>(const_cast<ISeqInStream*>(p));
-    *size = std::min(*size, self->data_.size() - self->pos_);
-    memcpy(buf, self->data_.data() + self->pos_, *size);
+    *size = std::min(*size, self->size_ - self->pos_);
+    memcpy(buf, self->data_ + self->pos_, *size);
     self->pos_ += *size;
     return SZ_OK;
   }
 
-  const brillo::Blob& data_;
+  const uint8_t* data_;
+  size_t size_;
 
   // The current reader position.
   size_t pos_ = 0;
@@ -100,26 +115,12 @@ int GetFilterID(const brillo::Blob& data) {
   return 0;
 }
 
-}  // namespace
-
-namespace chromeos_update_engine {
-
-void XzCompressInit() {
-  if (xz_initialized)
-    return;
-  xz_initialized = true;
-  // Although we don't include a CRC32 for the stream, the xz file header has
-  // a CRC32 of the header itself, which required the CRC table to be
-  // initialized.
-  CrcGenerateTable();
-}
-
-bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
-  CHECK(xz_initialized) << "Initialize XzCompress first";
-  out->clear();
-  if (in.empty())
-    return true;
-
+// Compresses the |size| bytes at |data| into |out| as a whole xz stream using
+// the BCJ filter |filter_id|.
+bool XzCompressBuffer(const uint8_t* data,
+                      size_t size,
+                      int filter_id,
+                      brillo::Blob* out) {
   // Xz compression properties.
   CXzProps props;
   XzProps_Init(&props);
@@ -136,16 +137,195 @@ bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
   lzma2Props.lzmaProps.level = 6;
   lzma2Props.lzmaProps.numThreads = 1;
   // The input size data is used to reduce the dictionary size if possible.
-  lzma2Props.lzmaProps.reduceSize = in.size();
+  lzma2Props.lzmaProps.reduceSize = size;
   Lzma2EncProps_Normalize(&lzma2Props);
   props.lzma2Props = lzma2Props;
 
-  props.filterProps.id = GetFilterID(in);
+  props.filterProps.id = filter_id;
 
   BlobWriterStream out_writer(out);
-  BlobReaderStream in_reader(in);
+  BlobReaderStream in_reader(data, size);
   SRes res = Xz_Encode(&out_writer, &in_reader, &props, nullptr /* progress */);
   return res == SZ_OK;
 }
 
+// Compresses one block of the input on a worker thread.
+class XzBlockCompressor : public base::DelegateSimpleThread::Delegate {
+ public:
+  XzBlockCompressor(const uint8_t* data, size_t size, int filter_id)
+      : data_(data), size_(size), filter_id_(filter_id) {}
+  ~XzBlockCompressor() override = default;
+
+  // DelegateSimpleThread::Delegate override.
+  void Run() override {
+    success_ = XzCompressBuffer(data_, size_, filter_id_, &stream_);
+  }
+
+  bool success() const { return success_; }
+  const brillo::Blob& stream() const { return stream_; }
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+  int filter_id_;
+
+  // The whole xz stream with the compressed block.
+  brillo::Blob stream_;
+  bool success_ = false;
+};
+
+uint32_t ReadLE32(const uint8_t* data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16) |
+         (static_cast<uint32_t>(data[3]) << 24);
+}
+
+void AppendLE32(uint32_t value, brillo::Blob* out) {
+  for (int i = 0; i < 4; i++)
+    out->push_back((value >> (8 * i)) & 0xff);
+}
+
+// Reads the variable length integer at |*pos| in |data|, up to |end|, and
+// moves |*pos| past it.
+bool ReadMultibyteInteger(const uint8_t* data,
+                          size_t end,
+                          size_t* pos,
+                          uint64_t* value) {
+  *value = 0;
+  for (size_t i = 0; i < 9 && *pos < end; i++) {
+    uint8_t byte = data[(*pos)++];
+    *value |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+void AppendMultibyteInteger(uint64_t value, brillo::Blob* out) {
+  while (value >= 0x80) {
+    out->push_back((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out->push_back(value);
+}
+
+// Joins the xz |streams| in a single xz stream in |out|, with the blocks of all
+// the |streams| in order. The streams must have the same stream flags. Unlike
+// concatenating the streams, the result is supported by xz-embedded.
+bool JoinXzStreams(const vector<const brillo::Blob*>& streams,
+                   brillo::Blob* out) {
+  // The records of the index: the unpadded and uncompressed size of each block.
+  vector<uint64_t> records;
+  for (const brillo::Blob* stream : streams) {
+    const uint8_t* data = stream->data();
+    size_t size = stream->size();
+    TEST_AND_RETURN_FALSE(size >= kXzStreamHeaderSize + kXzStreamFooterSize);
+    // The stream flags follow the 6 bytes of magic of the header.
+    TEST_AND_RETURN_FALSE(memcmp(data + 6, streams[0]->data() + 6, 2) == 0);
+    size_t index_size =
+        (static_cast<size_t>(ReadLE32(data + size - 8)) + 1) * 4;
+    TEST_AND_RETURN_FALSE(index_size <=
+                          size - kXzStreamHeaderSize - kXzStreamFooterSize);
+    size_t index_start = size - kXzStreamFooterSize - index_size;
+    size_t index_end = index_start + index_size - 4;  // Without the CRC32.
+
+    size_t pos = index_start;
+    uint64_t num_records;
+    TEST_AND_RETURN_FALSE(data[pos++] == 0);  // Index indicator.
+    TEST_AND_RETURN_FALSE(
+        ReadMultibyteInteger(data, index_end, &pos, &num_records));
+    for (uint64_t i = 0; i < num_records * 2; i++) {
+      uint64_t value;
+      TEST_AND_RETURN_FALSE(ReadMultibyteInteger(data, index_end, &pos, &value));
+      records.push_back(value);
+    }
+
+    if (out->empty())
+      out->insert(out->end(), data, data + kXzStreamHeaderSize);
+    // The blocks, with their padding.
+    out->insert(out->end(), data + kXzStreamHeaderSize, data + index_start);
+  }
+
+  size_t index_start = out->size();
+  out->push_back(0);  // Index indicator.
+  AppendMultibyteInteger(records.size() / 2, out);
+  for (uint64_t value : records)
+    AppendMultibyteInteger(value, out);
+  while ((out->size() - index_start) % 4)
+    out->push_back(0);
+  AppendLE32(CrcCalc(out->data() + index_start, out->size() - index_start),
+             out);
+  uint32_t backward_size = (out->size() - index_start) / 4 - 1;
+
+  size_t footer_start = out->size();
+  out->resize(footer_start + 4);  // CRC32 of the backward size and flags.
+  AppendLE32(backward_size, out);
+  out->insert(out->end(), streams[0]->data() + 6, streams[0]->data() + 8);
+  uint32_t footer_crc = CrcCalc(out->data() + footer_start + 4, 6);
+  for (int i = 0; i < 4; i++)
+    (*out)[footer_start + i] = (footer_crc >> (8 * i)) & 0xff;
+  out->push_back('Y');
+  out->push_back('Z');
+  return true;
+}
+
+}  // namespace
+
+namespace chromeos_update_engine {
+
+void XzCompressInit() {
+  if (xz_initialized)
+    return;
+  xz_initialized = true;
+  // Although we don't include a CRC32 for the stream, the xz file header has
+  // a CRC32 of the header itself, which required the CRC table to be
+  // initialized.
+  CrcGenerateTable();
+}
+
+bool XzCompress(const brillo::Blob& in,
+                size_t max_threads,
+                brillo::Blob* out) {
+  CHECK(xz_initialized) << "Initialize XzCompress first";
+  out->clear();
+  if (in.empty())
+    return true;
+
+  int filter_id = GetFilterID(in);
+  size_t num_blocks = (in.size() + kXzBlockSize - 1) / kXzBlockSize;
+  if (num_blocks <= 1)
+    return XzCompressBuffer(in.data(), in.size(), filter_id, out);
+
+  // The LZMA SDK is built single-threaded, so each block is compressed as its
+  // own stream and the streams are joined afterwards.
+  list<XzBlockCompressor> compressors;
+  for (size_t offset = 0; offset < in.size(); offset += kXzBlockSize) {
+    compressors.emplace_back(in.data() + offset,
+                             std::min(kXzBlockSize, in.size() - offset),
+                             filter_id);
+  }
+  size_t num_threads =
+      std::max<size_t>(1, std::min({max_threads, kMaxXzThreads, num_blocks}));
+  if (num_threads == 1) {
+    for (XzBlockCompressor& compressor : compressors)
+      compressor.Run();
+  } else {
+    base::DelegateSimpleThreadPool thread_pool("xz-compressor", num_threads);
+    thread_pool.Start();
+    for (XzBlockCompressor& compressor : compressors)
+      thread_pool.AddWork(&compressor);
+    thread_pool.JoinAll();
+  }
+
+  vector<const brillo::Blob*> streams;
+  for (const XzBlockCompressor& compressor : compressors) {
+    TEST_AND_RETURN_FALSE(compressor.success());
+    streams.push_back(&compressor.stream());
+  }
+  return JoinXzStreams(streams, out);
+}
+
+bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
+  return XzCompress(in, 1, out);
+}
+
 }  // namespace chromeos_update_engine
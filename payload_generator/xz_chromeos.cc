@@ -16,6 +16,8 @@
 
 #include "update_engine/payload_generator/xz.h"
 
+#include <algorithm>
+
 #include <base/logging.h>
 #include <lzma.h>
 
@@ -23,7 +25,9 @@ namespace chromeos_update_engine {
 
 void XzCompressInit() {}
 
-bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
+bool XzCompress(const brillo::Blob& in,
+                size_t max_threads,
+                brillo::Blob* out) {
   out->clear();
   if (in.empty())
     return true;
@@ -34,14 +38,41 @@ bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
 
   const uint32_t kLzmaPreset = 6;
   size_t out_pos = 0;
-  int rc = lzma_easy_buffer_encode(kLzmaPreset,
-                                   LZMA_CHECK_NONE,  // We do not need CRC.
-                                   nullptr,
-                                   in.data(),
-                                   in.size(),
-                                   out->data(),
-                                   &out_pos,
-                                   out->size());
+  int rc;
+  if (in.size() <= kXzBlockSize) {
+    rc = lzma_easy_buffer_encode(kLzmaPreset,
+                                 LZMA_CHECK_NONE,  // We do not need CRC.
+                                 nullptr,
+                                 in.data(),
+                                 in.size(),
+                                 out->data(),
+                                 &out_pos,
+                                 out->size());
+  } else {
+    // Bigger inputs are compressed as several blocks on up to |max_threads|
+    // threads. The blocks are the same with a single thread.
+    lzma_mt mt_options = {};
+    mt_options.block_size = kXzBlockSize;
+    mt_options.preset = kLzmaPreset;
+    mt_options.check = LZMA_CHECK_NONE;
+    mt_options.threads = static_cast<uint32_t>(
+        std::max<size_t>(1, std::min(max_threads, kMaxXzThreads)));
+    lzma_stream stream = LZMA_STREAM_INIT;
+    rc = lzma_stream_encoder_mt(&stream, &mt_options);
+    if (rc == LZMA_OK) {
+      stream.next_in = in.data();
+      stream.avail_in = in.size();
+      stream.next_out = out->data();
+      stream.avail_out = out->size();
+      do {
+        rc = lzma_code(&stream, LZMA_FINISH);
+      } while (rc == LZMA_OK);
+      if (rc == LZMA_STREAM_END)
+        rc = LZMA_OK;
+      out_pos = stream.total_out;
+      lzma_end(&stream);
+    }
+  }
   if (rc != LZMA_OK) {
     LOG(ERROR) << "Failed to compress data to LZMA stream with return code: "
                << rc;
@@ -51,4 +82,8 @@ bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
   return true;
 }
 
+bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
+  return XzCompress(in, 1, out);
+}
+
 }  // namespace chromeos_update_engine
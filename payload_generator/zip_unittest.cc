@@ -162,6 +162,32 @@ TYPED_TEST(ZipTest, EmptyInputsTest) {
   EXPECT_EQ(0U, out.size());
 }
 
+TYPED_TEST(ZipTest, CompressBigInputTest) {
+  // Data that compresses well, in more than two xz blocks.
+  brillo::Blob in(kXzBlockSize * 2 + 1000);
+  for (size_t i = 0; i < in.size(); i++)
+    in[i] = kRandomString[(i / 7) % sizeof(kRandomString)];
+  brillo::Blob out;
+  EXPECT_TRUE(this->ZipCompress(in, &out));
+  EXPECT_LT(out.size(), in.size());
+  brillo::Blob decompressed;
+  EXPECT_TRUE(this->ZipDecompress(out, &decompressed));
+  EXPECT_EQ(in, decompressed);
+}
+
+// The xz stream of a big input is the same whatever the number of threads
+// compressing it.
+TEST(XzCompressTest, SameStreamOnSeveralThreadsTest) {
+  brillo::Blob in(kXzBlockSize * 2 + 1000);
+  for (size_t i = 0; i < in.size(); i++)
+    in[i] = kRandomString[(i / 7) % sizeof(kRandomString)];
+  brillo::Blob out;
+  EXPECT_TRUE(XzCompress(in, &out));
+  brillo::Blob threaded_out;
+  EXPECT_TRUE(XzCompress(in, kMaxXzThreads, &threaded_out));
+  EXPECT_EQ(out, threaded_out);
+}
+
 TYPED_TEST(ZipTest, CompressELFTest) {
   string path = test_utils::GetBuildArtifactsPath("delta_generator");
   brillo::Blob in;
@@ -103,9 +103,9 @@ bool RealSystemState::Initialize() {
     LOG(ERROR) << "Failed to get a non-volatile directory.";
     return false;
   }
-  Prefs* prefs;
-  prefs_.reset(prefs = new Prefs());
-  if (!prefs->Init(non_volatile_path.Append(kPrefsSubDirectory))) {
+  JournaledPrefs* journaled_prefs;
+  prefs_.reset(journaled_prefs = new JournaledPrefs());
+  if (!journaled_prefs->Init(non_volatile_path.Append(kPrefsSubDirectory))) {
     LOG(ERROR) << "Failed to initialize preferences.";
     return false;
   }
@@ -117,6 +117,7 @@ bool RealSystemState::Initialize() {
     powerwash_safe_path = non_volatile_path.Append("powerwash-safe");
     LOG(WARNING) << "No powerwash-safe directory, using non-volatile one.";
   }
+  Prefs* prefs;
   powerwash_safe_prefs_.reset(prefs = new Prefs());
   if (!prefs->Init(
           powerwash_safe_path.Append(kPowerwashSafePrefsSubDirectory))) {
@@ -149,6 +150,9 @@ bool RealSystemState::Initialize() {
       new CertificateChecker(prefs_.get(), &openssl_wrapper_));
   certificate_checker_->Init();
 
+  connection_pool_.reset(new LibcurlConnectionPool());
+  connection_pool_->Init();
+
   update_attempter_.reset(
       new UpdateAttempter(this, certificate_checker_.get()));
 
@@ -36,6 +36,7 @@
 #include "update_engine/common/prefs.h"
 #include "update_engine/connection_manager_interface.h"
 #include "update_engine/daemon_state_interface.h"
+#include "update_engine/libcurl_connection_pool.h"
 #include "update_engine/metrics_reporter_interface.h"
 #include "update_engine/metrics_reporter_omaha.h"
 #include "update_engine/p2p_manager.h"
@@ -177,6 +178,10 @@ class RealSystemState : public SystemState, public DaemonStateInterface {
   OpenSSLWrapper openssl_wrapper_;
   std::unique_ptr<CertificateChecker> certificate_checker_;
 
+  // The connections shared by the HTTP transfers. It must outlive their
+  // fetchers.
+  std::unique_ptr<LibcurlConnectionPool> connection_pool_;
+
   // Pointer to the update attempter object.
   std::unique_ptr<UpdateAttempter> update_attempter_;
 
@@ -87,6 +87,9 @@ bool ParseRequest(int fd, HttpRequest* request) {
       perror("read");
       exit(RC_ERR_READ);
     }
+    // The client closed the connection.
+    if (r == 0)
+      return false;
     headers.append(buf, r);
   } while (!base::EndsWith(headers, EOL EOL, base::CompareCase::SENSITIVE));
 
@@ -521,11 +524,10 @@ class UrlTerms {
   vector<string> terms;
 };
 
-void HandleConnection(int fd) {
-  HttpRequest request;
-  ParseRequest(fd, &request);
-
-  string& url = request.url;
+// Handles the |request| received on the connection |fd|. Returns whether the
+// connection is kept open for another request.
+bool HandleRequest(int fd, const HttpRequest& request) {
+  const string& url = request.url;
   LOG(INFO) << "pid(" << getpid() << "): handling url " << url;
   if (url == "/quitquitquit") {
     HandleQuit(fd);
@@ -533,6 +535,12 @@ void HandleConnection(int fd) {
                  url, "/download/", base::CompareCase::SENSITIVE)) {
     const UrlTerms terms(url, 2);
     HandleGet(fd, request, terms.GetSizeT(1));
+  } else if (base::StartsWith(
+                 url, "/keep-alive/", base::CompareCase::SENSITIVE)) {
+    // Like /download/, but the connection is kept open afterwards.
+    const UrlTerms terms(url, 2);
+    HandleGet(fd, request, terms.GetSizeT(1));
+    return true;
   } else if (base::StartsWith(url, "/flaky/", base::CompareCase::SENSITIVE)) {
     const UrlTerms terms(url, 5);
     HandleGet(fd,
@@ -556,7 +564,13 @@ void HandleConnection(int fd) {
   } else {
     HandleDefault(fd, request);
   }
+  return false;
+}
 
+void HandleConnection(int fd) {
+  HttpRequest request;
+  while (ParseRequest(fd, &request) && HandleRequest(fd, request))
+    request = HttpRequest();
   close(fd);
 }
 
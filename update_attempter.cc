@@ -142,6 +142,8 @@ void UpdateAttempter::Init() {
 
   if (cert_checker_)
     cert_checker_->SetObserver(this);
+  // The LibcurlConnectionPool might not be initialized in unittests.
+  connection_pool_ = LibcurlConnectionPool::Get();
 
   // In case of update_engine restart without a reboot we need to restore the
   // reboot needed state.
@@ -173,6 +175,19 @@ void UpdateAttempter::CertificateChecked(ServerToCheck server_to_check,
       server_to_check, result);
 }
 
+void UpdateAttempter::ReportConnectionSetupMetrics() {
+  if (!connection_pool_)
+    return;
+  LibcurlConnectionPool::Stats stats = connection_pool_->TakeStats();
+  if (stats.new_connections + stats.reused_connections == 0)
+    return;
+  TimeDelta average_setup_time;
+  if (stats.new_connections > 0)
+    average_setup_time = stats.setup_time / stats.new_connections;
+  system_state_->metrics_reporter()->ReportConnectionSetupMetrics(
+      stats.new_connections, stats.reused_connections, average_setup_time);
+}
+
 bool UpdateAttempter::CheckAndReportDailyMetrics() {
   int64_t stored_value;
   Time now = system_state_->clock()->GetWallclockTime();
@@ -1013,6 +1028,7 @@ void UpdateAttempter::ProcessingDone(const ActionProcessor* processor,
   }
 
   attempt_error_code_ = utils::GetBaseErrorCode(code);
+  ReportConnectionSetupMetrics();
 
   if (code == ErrorCode::kSuccess) {
     // For install operation, we do not mark update complete since we do not
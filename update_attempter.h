@@ -37,6 +37,7 @@
 #include "update_engine/common/action_processor.h"
 #include "update_engine/common/cpu_limiter.h"
 #include "update_engine/common/proxy_resolver.h"
+#include "update_engine/libcurl_connection_pool.h"
 #include "update_engine/omaha_request_params.h"
 #include "update_engine/omaha_response_handler_action.h"
 #include "update_engine/payload_consumer/download_action.h"
@@ -282,6 +283,10 @@ class UpdateAttempter : public ActionProcessorDelegate,
   void CertificateChecked(ServerToCheck server_to_check,
                           CertificateCheckResult result) override;
 
+  // Reports the metrics of the connections set up by the transfers since the
+  // last report, if any.
+  void ReportConnectionSetupMetrics();
+
   // Checks if it's more than 24 hours since daily metrics were last
   // reported and, if so, reports daily metrics. Returns |true| if
   // metrics were reported, |false| otherwise.
@@ -428,6 +433,9 @@ class UpdateAttempter : public ActionProcessorDelegate,
   // Pointer to the certificate checker instance to use.
   CertificateChecker* cert_checker_;
 
+  // Pointer to the connection pool shared by the transfers, if any.
+  LibcurlConnectionPool* connection_pool_{nullptr};
+
   // The list of services observing changes in the updater.
   std::set<ServiceObserverInterface*> service_observers_;
 
@@ -34,6 +34,7 @@
 #include "update_engine/common/constants.h"
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/file_fetcher.h"
+#include "update_engine/common/hash_calculator_pool.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/daemon_state_interface.h"
 #include "update_engine/metrics_reporter_interface.h"
@@ -53,6 +54,7 @@
 #ifndef _UE_SIDELOAD
 // Do not include support for external HTTP(s) urls when building
 // update_engine_sideload.
+#include "update_engine/libcurl_connection_pool.h"
 #include "update_engine/libcurl_http_fetcher.h"
 #endif
 
@@ -95,6 +97,24 @@ bool GetHeaderAsBool(const string& header, bool default_value) {
   return default_value;
 }
 
+#ifndef _UE_SIDELOAD
+// Creates a fetcher for the parallel download of the payload, with the same
+// extra headers as the main one.
+HttpFetcher* CreateDownloadFetcher(ProxyResolver* proxy_resolver,
+                                   HardwareInterface* hardware,
+                                   const string& authorization,
+                                   const string& user_agent) {
+  LibcurlHttpFetcher* fetcher =
+      new LibcurlHttpFetcher(proxy_resolver, hardware);
+  fetcher->set_server_to_check(ServerToCheck::kDownload);
+  if (!authorization.empty())
+    fetcher->SetHeader("Authorization", authorization);
+  if (!user_agent.empty())
+    fetcher->SetHeader("User-Agent", user_agent);
+  return fetcher;
+}
+#endif  // _UE_SIDELOAD
+
 }  // namespace
 
 UpdateAttempterAndroid::UpdateAttempterAndroid(
@@ -260,6 +280,7 @@ bool UpdateAttempterAndroid::ApplyPayload(
   install_plan_.Dump();
 
   HttpFetcher* fetcher = nullptr;
+  download_fetcher_factory_.Reset();
   if (FileFetcher::SupportedUrl(payload_url)) {
     DLOG(INFO) << "Using FileFetcher for file URL.";
     fetcher = new FileFetcher();
@@ -271,6 +292,48 @@ bool UpdateAttempterAndroid::ApplyPayload(
         new LibcurlHttpFetcher(&proxy_resolver_, hardware_);
     libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
     fetcher = libcurl_fetcher;
+
+    uint64_t connections = 1;
+    if (!headers[kPayloadPropertyDownloadConnections].empty() &&
+        !base::StringToUint64(headers[kPayloadPropertyDownloadConnections],
+                              &connections)) {
+      LOG(WARNING) << "Invalid download connections: "
+                   << headers[kPayloadPropertyDownloadConnections];
+      connections = 1;
+    }
+    if (connections > static_cast<uint64_t>(kDownloadMaxParallelConnections)) {
+      LOG(WARNING) << "Limiting the " << connections
+                   << " download connections requested to "
+                   << kDownloadMaxParallelConnections << ".";
+      connections = kDownloadMaxParallelConnections;
+    }
+    uint64_t buffer_size = kDownloadParallelBufferBytes;
+    if (!headers[kPayloadPropertyDownloadBufferSize].empty() &&
+        !base::StringToUint64(headers[kPayloadPropertyDownloadBufferSize],
+                              &buffer_size)) {
+      LOG(WARNING) << "Invalid download buffer size: "
+                   << headers[kPayloadPropertyDownloadBufferSize];
+      buffer_size = kDownloadParallelBufferBytes;
+    }
+    if (buffer_size > static_cast<uint64_t>(kDownloadMaxParallelBufferBytes)) {
+      LOG(WARNING) << "Limiting the download buffer size of " << buffer_size
+                   << " bytes requested to " << kDownloadMaxParallelBufferBytes
+                   << " bytes.";
+      buffer_size = kDownloadMaxParallelBufferBytes;
+    }
+    if (connections > 1) {
+      LOG(INFO) << "Downloading over up to " << connections
+                << " connections, buffering up to " << buffer_size
+                << " bytes.";
+      download_fetcher_factory_ =
+          Bind(&CreateDownloadFetcher,
+               &proxy_resolver_,
+               hardware_,
+               headers[kPayloadPropertyAuthorization],
+               headers[kPayloadPropertyUserAgent]);
+      download_connections_ = connections;
+      download_buffer_size_ = buffer_size;
+    }
 #endif  // _UE_SIDELOAD
   }
   // Setup extra headers.
@@ -415,6 +478,8 @@ bool UpdateAttempterAndroid::VerifyPayloadApplicable(
   }
 
   BootControlInterface::Slot current_slot = boot_control_->GetCurrentSlot();
+  // Hashes the source blocks while the next ones are read.
+  HashCalculatorPool hash_pool(1);
   for (const PartitionUpdate& partition : manifest.partitions()) {
     if (!partition.has_old_partition_info())
       continue;
@@ -437,7 +502,8 @@ bool UpdateAttempterAndroid::VerifyPayloadApplicable(
       if (!fd_utils::ReadAndHashExtents(fd,
                                         operation.src_extents(),
                                         manifest.block_size(),
-                                        &source_hash)) {
+                                        &source_hash,
+                                        &hash_pool)) {
         return LogAndSetError(
             error, FROM_HERE, "Failed to hash " + partition_path);
       }
@@ -650,6 +716,11 @@ void UpdateAttempterAndroid::BuildUpdateActions(HttpFetcher* fetcher) {
                                        true /* interactive */);
   download_action->set_delegate(this);
   download_action->set_base_offset(base_offset_);
+  if (!download_fetcher_factory_.is_null()) {
+    download_action->SetParallelDownload(download_fetcher_factory_,
+                                         download_connections_,
+                                         download_buffer_size_);
+  }
   auto filesystem_verifier_action =
       std::make_unique<FilesystemVerifierAction>();
   auto postinstall_runner_action =
@@ -732,6 +803,21 @@ void UpdateAttempterAndroid::CollectAndReportUpdateMetricsOnUpdateFinished(
       metrics::DownloadErrorCode::kUnset,
       metrics::ConnectionType::kUnset);
 
+#ifndef _UE_SIDELOAD
+  // The connections set up by all the transfers of this attempt.
+  LibcurlConnectionPool* connection_pool = LibcurlConnectionPool::Get();
+  if (connection_pool) {
+    LibcurlConnectionPool::Stats stats = connection_pool->TakeStats();
+    if (stats.new_connections + stats.reused_connections > 0) {
+      TimeDelta average_setup_time;
+      if (stats.new_connections > 0)
+        average_setup_time = stats.setup_time / stats.new_connections;
+      metrics_reporter_->ReportConnectionSetupMetrics(
+          stats.new_connections, stats.reused_connections, average_setup_time);
+    }
+  }
+#endif  // _UE_SIDELOAD
+
   if (error_code == ErrorCode::kSuccess) {
     int64_t reboot_count =
         metrics_utils::GetPersistedValue(kPrefsNumReboots, prefs_);
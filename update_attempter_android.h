@@ -30,6 +30,7 @@
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/clock.h"
 #include "update_engine/common/hardware_interface.h"
+#include "update_engine/common/multi_range_http_fetcher.h"
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/daemon_state_interface.h"
 #include "update_engine/metrics_reporter_interface.h"
@@ -185,6 +186,12 @@ class UpdateAttempterAndroid
   // The offset in the payload file where the CrAU part starts.
   int64_t base_offset_{0};
 
+  // The fetchers used to download the payload over several connections, or
+  // null to download it over a single one.
+  MultiRangeHttpFetcher::FetcherFactory download_fetcher_factory_;
+  size_t download_connections_{1};
+  size_t download_buffer_size_{0};
+
   // Helper class to select the network to use during the update.
   std::unique_ptr<NetworkSelectorInterface> network_selector_;
 
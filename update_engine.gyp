@@ -36,6 +36,7 @@
       # here when these USE flags are not defined. You can set the default value
       # for the USE flag in the ebuild.
       'USE_hwid_override%': '0',
+      'USE_io_uring%': '0',
     },
     'cflags': [
       '-g',
@@ -60,6 +61,7 @@
       'USE_DBUS=<(USE_dbus)',
       'USE_FEC=0',
       'USE_HWID_OVERRIDE=<(USE_hwid_override)',
+      'USE_IO_URING=<(USE_io_uring)',
       'USE_CHROME_KIOSK_APP=<(USE_chrome_kiosk_app)',
       'USE_CHROME_NETWORK_PROXY=<(USE_chrome_network_proxy)',
       'USE_MTD=<(USE_mtd)',
@@ -159,6 +161,7 @@
         'common/cpu_limiter.cc',
         'common/error_code_utils.cc',
         'common/hash_calculator.cc',
+        'common/hash_calculator_pool.cc',
         'common/http_common.cc',
         'common/http_fetcher.cc',
         'common/hwid_override.cc',
@@ -169,6 +172,8 @@
         'common/subprocess.cc',
         'common/terminator.cc',
         'common/utils.cc',
+        'payload_consumer/apply_pipeline.cc',
+        'payload_consumer/block_cache_file_descriptor.cc',
         'payload_consumer/bzip_extent_writer.cc',
         'payload_consumer/cached_file_descriptor.cc',
         'payload_consumer/delta_performer.cc',
@@ -182,6 +187,8 @@
         'payload_consumer/install_plan.cc',
         'payload_consumer/mount_history.cc',
         'payload_consumer/payload_constants.cc',
+        'payload_consumer/payload_data_buffer.cc',
+        'payload_consumer/payload_hash_tree.cc',
         'payload_consumer/payload_metadata.cc',
         'payload_consumer/payload_verifier.cc',
         'payload_consumer/postinstall_runner_action.cc',
@@ -199,6 +206,11 @@
             ],
           },
         }],
+        ['USE_io_uring == 1', {
+          'sources': [
+            'payload_consumer/io_uring_file_descriptor.cc',
+          ],
+        }],
       ],
     },
     # The main daemon static_library with all the code used to check for updates
@@ -265,6 +277,7 @@
         'dbus_service.cc',
         'hardware_chromeos.cc',
         'image_properties_chromeos.cc',
+        'libcurl_connection_pool.cc',
         'libcurl_http_fetcher.cc',
         'metrics_reporter_omaha.cc',
         'metrics_utils.cc',
@@ -411,23 +424,28 @@
         'payload_generator/block_mapping.cc',
         'payload_generator/boot_img_filesystem.cc',
         'payload_generator/bzip.cc',
+        'payload_generator/compressor_selector.cc',
         'payload_generator/cycle_breaker.cc',
         'payload_generator/deflate_utils.cc',
         'payload_generator/delta_diff_generator.cc',
         'payload_generator/delta_diff_utils.cc',
+        'payload_generator/diff_cache.cc',
         'payload_generator/ext2_filesystem.cc',
         'payload_generator/extent_ranges.cc',
         'payload_generator/extent_utils.cc',
+        'payload_generator/file_similarity_index.cc',
         'payload_generator/full_update_generator.cc',
         'payload_generator/graph_types.cc',
         'payload_generator/graph_utils.cc',
         'payload_generator/inplace_generator.cc',
         'payload_generator/mapfile_filesystem.cc',
+        'payload_generator/memory_budget.cc',
         'payload_generator/payload_file.cc',
         'payload_generator/payload_generation_config_chromeos.cc',
         'payload_generator/payload_generation_config.cc',
         'payload_generator/payload_signer.cc',
         'payload_generator/raw_filesystem.cc',
+        'payload_generator/rolling_hash_index.cc',
         'payload_generator/squashfs_filesystem.cc',
         'payload_generator/tarjan.cc',
         'payload_generator/topological_sort.cc',
@@ -551,6 +569,7 @@
             'common/action_unittest.cc',
             'common/cpu_limiter_unittest.cc',
             'common/hash_calculator_unittest.cc',
+            'common/hash_calculator_pool_unittest.cc',
             'common/http_fetcher_unittest.cc',
             'common/hwid_override_unittest.cc',
             'common/prefs_unittest.cc',
@@ -569,6 +588,8 @@
             'omaha_response_handler_action_unittest.cc',
             'omaha_utils_unittest.cc',
             'p2p_manager_unittest.cc',
+            'payload_consumer/apply_pipeline_unittest.cc',
+            'payload_consumer/block_cache_file_descriptor_unittest.cc',
             'payload_consumer/bzip_extent_writer_unittest.cc',
             'payload_consumer/cached_file_descriptor_unittest.cc',
             'payload_consumer/delta_performer_integration_test.cc',
@@ -579,25 +600,32 @@
             'payload_consumer/file_descriptor_utils_unittest.cc',
             'payload_consumer/file_writer_unittest.cc',
             'payload_consumer/filesystem_verifier_action_unittest.cc',
+            'payload_consumer/payload_data_buffer_unittest.cc',
+            'payload_consumer/payload_hash_tree_unittest.cc',
             'payload_consumer/postinstall_runner_action_unittest.cc',
             'payload_consumer/xz_extent_writer_unittest.cc',
             'payload_generator/ab_generator_unittest.cc',
             'payload_generator/blob_file_writer_unittest.cc',
             'payload_generator/block_mapping_unittest.cc',
             'payload_generator/boot_img_filesystem_unittest.cc',
+            'payload_generator/compressor_selector_unittest.cc',
             'payload_generator/cycle_breaker_unittest.cc',
             'payload_generator/deflate_utils_unittest.cc',
             'payload_generator/delta_diff_utils_unittest.cc',
+            'payload_generator/diff_cache_unittest.cc',
             'payload_generator/ext2_filesystem_unittest.cc',
             'payload_generator/extent_ranges_unittest.cc',
             'payload_generator/extent_utils_unittest.cc',
+            'payload_generator/file_similarity_index_unittest.cc',
             'payload_generator/full_update_generator_unittest.cc',
             'payload_generator/graph_utils_unittest.cc',
             'payload_generator/inplace_generator_unittest.cc',
             'payload_generator/mapfile_filesystem_unittest.cc',
+            'payload_generator/memory_budget_unittest.cc',
             'payload_generator/payload_file_unittest.cc',
             'payload_generator/payload_generation_config_unittest.cc',
             'payload_generator/payload_signer_unittest.cc',
+            'payload_generator/rolling_hash_index_unittest.cc',
             'payload_generator/squashfs_filesystem_unittest.cc',
             'payload_generator/tarjan_unittest.cc',
             'payload_generator/topological_sort_unittest.cc',
@@ -623,6 +651,13 @@
             'update_manager/variable_unittest.cc',
             'update_manager/weekly_time_unittest.cc',
           ],
+          'conditions': [
+            ['USE_io_uring == 1', {
+              'sources': [
+                'payload_consumer/io_uring_file_descriptor_unittest.cc',
+              ],
+            }],
+          ],
         },
       ],
     }],